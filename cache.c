@@ -0,0 +1,2284 @@
+/*
+ * cache.c
+ * 
+ * Implementation of cache.h
+ * 
+ * See the header for further information.
+ */
+
+#include "cache.h"
+#include "incl.h"
+#include "ir.h"
+#include "source.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Constants
+ * =========
+ */
+
+/*
+ * The signature at the start of a cache file, and the length of the
+ * whole cache file header.
+ */
+#define CACHE_SIGNATURE "NoirTkC2"
+#define CACHE_HEADLEN (24)
+
+/*
+ * The suffix added to the cache file path for the temporary file that
+ * a new cache file is written to.
+ */
+#define CACHE_TMPSUFFIX ".tmp"
+
+/*
+ * The number of filtered input bytes covered by each block hash.  Must
+ * be a multiple of eight.
+ */
+#define CACHE_HASHBLOCK (4096)
+
+/*
+ * The number of bytes read at a time from the input and the cache file.
+ */
+#define CACHE_READSIZE (65536)
+
+/*
+ * The odd multiplier used by the hash function.
+ */
+#define CACHE_MUL (UINT64_C(0x9e3779b97f4a7c15))
+
+/*
+ * The maximum number of bytes in a varint, which is enough for 64 bits.
+ */
+#define CACHE_MAXVARINT (10)
+
+/*
+ * The number of distinct pitches, which is the largest possible pitch
+ * set.
+ */
+#define CACHE_MAXPSET (NMF_MAXPITCH - NMF_MINPITCH + 1)
+
+/*
+ * The number of distinct articulation keys.
+ */
+#define CACHE_MAXART (62)
+
+/*
+ * The record kinds of the EOF record and of resume marks.
+ */
+#define CACHE_K_EOF (0)
+#define CACHE_K_MARK (1)
+
+/*
+ * Type declarations
+ * =================
+ */
+
+/*
+ * A decoded cache record.
+ */
+typedef struct {
+  
+  /*
+   * The kind byte of the record.
+   */
+  int kind;
+  
+  /*
+   * The line number of the record.
+   */
+  int32_t line;
+  
+  /*
+   * The duration, integer parameter, or articulation number, for
+   * records that have one.
+   */
+  int32_t v;
+  
+  /*
+   * The offset of the next entity, for marks.
+   */
+  int64_t offs;
+  
+  /*
+   * The library path and its length, for include records.  The path is
+   * not nul-terminated when it points into loaded records.
+   */
+  const char *pPath;
+  int32_t plen;
+  
+  /*
+   * The pitch set, for pitch set records.
+   */
+  NVM_PITCHSET ps;
+  
+} CACHE_REC;
+
+/*
+ * A position within a sequence of records.
+ * 
+ * Since line numbers are relative to the previous record and mark
+ * offsets are relative to the previous mark, these are needed to decode
+ * the next record.
+ */
+typedef struct {
+  
+  /*
+   * Pointer to the next record.
+   */
+  const unsigned char *p;
+  
+  /*
+   * The line number of the previous record and the offset in the
+   * previous mark, or one and zero at the start of the sequence.
+   */
+  int32_t line;
+  int64_t mark;
+  
+} CACHE_POS;
+
+/*
+ * A growable array of block hashes.
+ */
+typedef struct {
+  
+  /*
+   * The dynamically allocated array, its number of hashes, and its
+   * capacity.
+   */
+  uint64_t *pHash;
+  int64_t count;
+  int64_t cap;
+  
+} CACHE_HASHES;
+
+/*
+ * The state of the input filter between one block and the next.
+ */
+typedef struct {
+  
+  /*
+   * Flag indicating whether the first byte is still to come.
+   */
+  int first;
+  
+  /*
+   * The previous byte passed through the line break filter, or -1 if
+   * none yet or the previous byte completed a line break pair.
+   */
+  int prev;
+  
+} CACHE_FILT;
+
+/*
+ * A resume mark in the loaded cache file.
+ */
+typedef struct {
+  
+  /*
+   * The position of the mark record.
+   */
+  CACHE_POS pos;
+  
+  /*
+   * The offset and line of the entity after the mark.
+   */
+  int64_t offs;
+  int32_t line;
+  
+} CACHE_MARK;
+
+/*
+ * A growable array of resume marks.
+ */
+typedef struct {
+  
+  /*
+   * The dynamically allocated array, its number of marks, and its
+   * capacity.
+   */
+  CACHE_MARK *pMark;
+  int32_t count;
+  int32_t cap;
+  
+} CACHE_MARKS;
+
+/*
+ * Static data
+ * ===========
+ */
+
+/*
+ * Flag indicating whether cache_open() has been called yet.
+ */
+static int m_cache_opened = 0;
+
+/*
+ * The result of cache_open().
+ */
+static int m_cache_mode = CACHE_MISS;
+
+/*
+ * Flag set while recording entities for a new cache file.
+ */
+static int m_cache_rec = 0;
+
+/*
+ * Flag set once the EOF record has been recorded.
+ */
+static int m_cache_done = 0;
+
+/*
+ * Flag set once cache_replay() has been called.
+ */
+static int m_cache_replayed = 0;
+
+/*
+ * The path to the cache file.
+ */
+static const char *m_cache_pPath = NULL;
+
+/*
+ * The read buffer, with room at the start for a partial block carried
+ * over from the previous read.
+ */
+static unsigned char m_cache_block[CACHE_HASHBLOCK + CACHE_READSIZE];
+
+/*
+ * The filtered length, hash, and block hashes of the input.
+ */
+static int64_t m_cache_len = 0;
+static uint64_t m_cache_key = 0;
+static CACHE_HASHES m_cache_hashes;
+
+/*
+ * The loaded cache file.
+ * 
+ * m_cache_oldLen is the filtered length of the input that the cache
+ * file was written for, m_cache_oldHashes holds its block hashes, and
+ * the m_cache_oldSize bytes at m_cache_pOld hold its records, which
+ * have all been validated.  m_cache_oldLine is the line of the EOF
+ * record, and m_cache_marks holds all the resume marks.
+ */
+static int64_t m_cache_oldLen = 0;
+static CACHE_HASHES m_cache_oldHashes;
+static unsigned char *m_cache_pOld = NULL;
+static size_t m_cache_oldSize = 0;
+static int32_t m_cache_oldLine = 0;
+static CACHE_MARKS m_cache_marks;
+
+/*
+ * The record buffer for recording.
+ * 
+ * m_cache_bufLen is the number of bytes in the buffer and
+ * m_cache_bufCap is its allocated capacity.  m_cache_line is the line
+ * of the last record and m_cache_mark is the offset in the last mark,
+ * which are one and zero before the first record.  m_cache_markNext is
+ * the offset from which the next mark is due.
+ */
+static unsigned char *m_cache_pBuf = NULL;
+static size_t m_cache_bufLen = 0;
+static size_t m_cache_bufCap = 0;
+static int32_t m_cache_line = 1;
+static int64_t m_cache_mark = 0;
+static int64_t m_cache_markNext = 0;
+
+/*
+ * The state of an edit.
+ * 
+ * The first m_cache_keep bytes of the loaded records are the entities
+ * before the edit, m_cache_keepPos is the position just after them,
+ * and m_cache_resume is the offset in the mark that follows them.
+ * 
+ * m_cache_delta is the change in the filtered input length.  The input
+ * from m_cache_tail to the end is unchanged, apart from having moved by
+ * m_cache_delta, or m_cache_tail is -1 if there is no such input.
+ * 
+ * m_cache_markCur is the index of the next loaded mark where replaying
+ * might resume.  Once cache_sync() finds such a mark, m_cache_synced is
+ * set.
+ */
+static size_t m_cache_keep = 0;
+static CACHE_POS m_cache_keepPos;
+static int64_t m_cache_resume = 0;
+static int64_t m_cache_delta = 0;
+static int64_t m_cache_tail = -1;
+static int32_t m_cache_markCur = 0;
+static int m_cache_synced = 0;
+
+/*
+ * Local functions
+ * ===============
+ */
+
+/* Prototypes */
+static uint64_t cache_word(const unsigned char *p);
+static void cache_putWord(unsigned char *p, uint64_t v);
+static uint64_t cache_mix(uint64_t h, uint64_t w);
+static uint64_t cache_block(const unsigned char *p, size_t n);
+static uint64_t cache_key(const CACHE_HASHES *ph, int64_t len);
+static void cache_addHash(CACHE_HASHES *ph, uint64_t h);
+static void cache_addMark(const CACHE_POS *pc, const CACHE_REC *pr);
+static size_t cache_filter(CACHE_FILT *pf, unsigned char *p, size_t n);
+static int cache_scan(
+    FILE         * pIn,
+    int64_t        skip,
+    CACHE_HASHES * ph,
+    int64_t      * pLen);
+static int cache_load(void);
+static int cache_tailAt(FILE *pIn);
+static int cache_edit(FILE *pIn);
+
+static void cache_grow(size_t n);
+static void cache_putU(uint64_t v);
+static void cache_putS(int64_t v);
+static void cache_putRec(const CACHE_REC *pr);
+
+static int cache_getU(
+    const unsigned char ** pp,
+    const unsigned char  * pEnd,
+          uint64_t       * pv);
+static int cache_getS(
+    const unsigned char ** pp,
+    const unsigned char  * pEnd,
+          int64_t        * pv);
+static int cache_record(
+          CACHE_POS     * pc,
+    const unsigned char * pEnd,
+          int64_t         len,
+          CACHE_REC     * pr);
+static int cache_run(const CACHE_REC *pr, int64_t *ppos, int *per);
+
+/*
+ * Decode an unsigned 64-bit little-endian integer.
+ * 
+ * Parameters:
+ * 
+ *   p - pointer to the eight bytes to decode
+ * 
+ * Return:
+ * 
+ *   the decoded integer
+ */
+static uint64_t cache_word(const unsigned char *p) {
+  
+  /* Check parameter */
+  if (p == NULL) {
+    abort();
+  }
+  
+  /* Assemble the bytes */
+  return ((uint64_t) p[0]) |
+          (((uint64_t) p[1]) << 8) |
+          (((uint64_t) p[2]) << 16) |
+          (((uint64_t) p[3]) << 24) |
+          (((uint64_t) p[4]) << 32) |
+          (((uint64_t) p[5]) << 40) |
+          (((uint64_t) p[6]) << 48) |
+          (((uint64_t) p[7]) << 56);
+}
+
+/*
+ * Encode an unsigned 64-bit little-endian integer.
+ * 
+ * Parameters:
+ * 
+ *   p - pointer to the eight bytes to receive the encoding
+ * 
+ *   v - the integer to encode
+ */
+static void cache_putWord(unsigned char *p, uint64_t v) {
+  
+  int i = 0;
+  
+  /* Check parameter */
+  if (p == NULL) {
+    abort();
+  }
+  
+  /* Store the bytes */
+  for(i = 0; i < 8; i++) {
+    p[i] = (unsigned char) ((v >> (i * 8)) & 0xff);
+  }
+}
+
+/*
+ * Mix a 64-bit word into a hash state.
+ * 
+ * Parameters:
+ * 
+ *   h - the hash state
+ * 
+ *   w - the word to mix in
+ * 
+ * Return:
+ * 
+ *   the new hash state
+ */
+static uint64_t cache_mix(uint64_t h, uint64_t w) {
+  h = (h ^ w) * CACHE_MUL;
+  return h ^ (h >> 32);
+}
+
+/*
+ * Hash a block of bytes.
+ * 
+ * The hash mixes in each little-endian word of eight bytes, then the
+ * final partial word padded with zero bytes, then the length.  It only
+ * depends on the bytes and not on where the block is, so that blocks
+ * can be compared after the input around them has moved.
+ * 
+ * Parameters:
+ * 
+ *   p - the bytes to hash
+ * 
+ *   n - the number of bytes
+ * 
+ * Return:
+ * 
+ *   the hash
+ */
+static uint64_t cache_block(const unsigned char *p, size_t n) {
+  
+  unsigned char pad[8];
+  uint64_t h = 0;
+  size_t i = 0;
+  
+  /* Check parameter */
+  if (p == NULL) {
+    abort();
+  }
+  
+  /* Mix in the whole words */
+  for(i = 0; i + 8 <= n; i += 8) {
+    h = cache_mix(h, cache_word(&(p[i])));
+  }
+  
+  /* Mix in the partial word, if any */
+  if (i < n) {
+    memset(pad, 0, 8);
+    memcpy(pad, &(p[i]), n - i);
+    h = cache_mix(h, cache_word(pad));
+  }
+  
+  /* Mix in the length */
+  return cache_mix(h, (uint64_t) n);
+}
+
+/*
+ * Compute the input hash from the block hashes and the length.
+ * 
+ * Parameters:
+ * 
+ *   ph - the block hashes
+ * 
+ *   len - the filtered input length
+ * 
+ * Return:
+ * 
+ *   the input hash
+ */
+static uint64_t cache_key(const CACHE_HASHES *ph, int64_t len) {
+  
+  uint64_t h = 0;
+  int64_t i = 0;
+  
+  /* Check parameter */
+  if (ph == NULL) {
+    abort();
+  }
+  
+  /* Mix in the block hashes, then the length */
+  for(i = 0; i < ph->count; i++) {
+    h = cache_mix(h, (ph->pHash)[i]);
+  }
+  return cache_mix(h, (uint64_t) len);
+}
+
+/*
+ * Append a hash to a growable array of block hashes.
+ * 
+ * Parameters:
+ * 
+ *   ph - the array
+ * 
+ *   h - the hash to append
+ */
+static void cache_addHash(CACHE_HASHES *ph, uint64_t h) {
+  
+  /* Check parameter */
+  if (ph == NULL) {
+    abort();
+  }
+  
+  /* Grow the array if necessary */
+  if (ph->count >= ph->cap) {
+    if (ph->cap < 1) {
+      ph->cap = 256;
+    } else if (ph->cap <= INT32_MAX) {
+      ph->cap *= 2;
+    } else {
+      abort();
+    }
+    
+    ph->pHash = (uint64_t *) realloc(
+                  ph->pHash, ((size_t) ph->cap) * sizeof(uint64_t));
+    if (ph->pHash == NULL) {
+      abort();
+    }
+  }
+  
+  /* Append the hash */
+  (ph->pHash)[ph->count] = h;
+  (ph->count)++;
+}
+
+/*
+ * Append a resume mark to m_cache_marks.
+ * 
+ * Parameters:
+ * 
+ *   pc - the position of the mark record
+ * 
+ *   pr - the decoded mark record
+ */
+static void cache_addMark(const CACHE_POS *pc, const CACHE_REC *pr) {
+  
+  CACHE_MARK *pm = NULL;
+  
+  /* Check parameters */
+  if ((pc == NULL) || (pr == NULL)) {
+    abort();
+  }
+  
+  /* Grow the array if necessary */
+  if (m_cache_marks.count >= m_cache_marks.cap) {
+    if (m_cache_marks.cap < 1) {
+      m_cache_marks.cap = 256;
+    } else if (m_cache_marks.cap <= INT32_MAX / 2) {
+      m_cache_marks.cap *= 2;
+    } else {
+      abort();
+    }
+    
+    m_cache_marks.pMark = (CACHE_MARK *) realloc(
+                            m_cache_marks.pMark,
+                            ((size_t) m_cache_marks.cap) *
+                              sizeof(CACHE_MARK));
+    if (m_cache_marks.pMark == NULL) {
+      abort();
+    }
+  }
+  
+  /* Append the mark */
+  pm = &((m_cache_marks.pMark)[m_cache_marks.count]);
+  memcpy(&(pm->pos), pc, sizeof(CACHE_POS));
+  pm->offs = pr->offs;
+  pm->line = pr->line;
+  (m_cache_marks.count)++;
+}
+
+/*
+ * Filter raw input bytes in place.
+ * 
+ * This is the same filter that the token module applies, so that
+ * offsets and hashes refer to the same bytes that the token module
+ * sees.  A UTF-8 BOM at the start of input is removed, and line breaks
+ * are converted to LF.  Unlike the token module, errors are not
+ * detected, since they make compilation fail anyway.
+ * 
+ * Parameters:
+ * 
+ *   pf - the filter state
+ * 
+ *   p - the bytes to filter
+ * 
+ *   n - the number of bytes
+ * 
+ * Return:
+ * 
+ *   the number of filtered bytes at the start of p
+ */
+static size_t cache_filter(CACHE_FILT *pf, unsigned char *p, size_t n) {
+  
+  size_t i = 0;
+  size_t j = 0;
+  int c = 0;
+  
+  /* Check parameters */
+  if ((pf == NULL) || (p == NULL)) {
+    abort();
+  }
+  
+  /* Skip a UTF-8 BOM at the very start */
+  if (pf->first && (n > 0)) {
+    pf->first = 0;
+    if ((n >= 3) && (p[0] == 0xef) && (p[1] == 0xbb) && (p[2] == 0xbf)) {
+      i = 3;
+    }
+  }
+  
+  if ((pf->prev != ASCII_CR) &&
+      (memchr(&(p[i]), ASCII_CR, n - i) == NULL)) {
+    /* No CR, so there is nothing to convert and no pair to complete;
+     * only the BOM might need to be removed */
+    if (i > 0) {
+      memmove(p, &(p[i]), n - i);
+    }
+    j = n - i;
+    if (j > 0) {
+      pf->prev = p[j - 1];
+    }
+    
+  } else {
+    /* Filter the bytes */
+    for(j = 0; i < n; i++) {
+      c = p[i];
+      
+      /* Drop the second byte of a CR LF or LF CR pair */
+      if (((c == ASCII_LF) && (pf->prev == ASCII_CR)) ||
+          ((c == ASCII_CR) && (pf->prev == ASCII_LF))) {
+        pf->prev = -1;
+        continue;
+      }
+      pf->prev = c;
+      
+      /* Convert CR to LF */
+      if (c == ASCII_CR) {
+        c = ASCII_LF;
+      }
+      p[j] = (unsigned char) c;
+      j++;
+    }
+  }
+  
+  /* Return filtered length */
+  return j;
+}
+
+/*
+ * Hash blocks of the filtered input.
+ * 
+ * The input is read from its current position to the end, and the
+ * position is then restored.  The first skip bytes of filtered input
+ * are skipped, and then a hash of each block of CACHE_HASHBLOCK bytes
+ * is appended to the array, the last block possibly being shorter.
+ * 
+ * Parameters:
+ * 
+ *   pIn - the input file
+ * 
+ *   skip - the number of filtered bytes to skip
+ * 
+ *   ph - the array to append block hashes to
+ * 
+ *   pLen - pointer to variable to receive the filtered length of the
+ *   whole input
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if the input is not seekable or could
+ *   not be read
+ */
+static int cache_scan(
+    FILE         * pIn,
+    int64_t        skip,
+    CACHE_HASHES * ph,
+    int64_t      * pLen) {
+  
+  int status = 1;
+  int seek = 0;
+  fpos_t pos;
+  CACHE_FILT filt;
+  size_t fill = 0;
+  size_t count = 0;
+  size_t i = 0;
+  int64_t len = 0;
+  int done = 0;
+  int err = ERR_OK;
+  
+  /* Initialize structures */
+  memset(&pos, 0, sizeof(fpos_t));
+  filt.first = 1;
+  filt.prev = -1;
+  
+  /* Check parameters */
+  if ((pIn == NULL) || (skip < 0) || (ph == NULL) || (pLen == NULL)) {
+    abort();
+  }
+  
+  /* Get the current position, which fails if input is not seekable */
+  if (fgetpos(pIn, &pos) == 0) {
+    seek = 1;
+  } else {
+    status = 0;
+  }
+  
+  /* Read the input through the source module, so that compressed
+   * input is decompressed, and filter it; fill is the number of bytes
+   * of a partial block left over at the start of the buffer */
+  if (status) {
+    source_open(pIn);
+    while (!done) {
+      count = source_read(&(m_cache_block[fill]), CACHE_READSIZE, &err);
+      if (count < CACHE_READSIZE) {
+        done = 1;
+        if (err != ERR_OK) {
+          status = 0;
+          break;
+        }
+      }
+      
+      count = cache_filter(&filt, &(m_cache_block[fill]), count);
+      len += (int64_t) count;
+      fill += count;
+      
+      /* Drop bytes that are still to be skipped */
+      if (skip > 0) {
+        i = fill;
+        if ((int64_t) i > skip) {
+          i = (size_t) skip;
+        }
+        memmove(m_cache_block, &(m_cache_block[i]), fill - i);
+        fill -= i;
+        skip -= (int64_t) i;
+      }
+      
+      /* Hash the complete blocks */
+      for(i = 0; i + CACHE_HASHBLOCK <= fill; i += CACHE_HASHBLOCK) {
+        cache_addHash(
+          ph, cache_block(&(m_cache_block[i]), CACHE_HASHBLOCK));
+      }
+      if (i > 0) {
+        memmove(m_cache_block, &(m_cache_block[i]), fill - i);
+        fill -= i;
+      }
+    }
+    source_close();
+  }
+  
+  /* Hash the final partial block */
+  if (status && (fill > 0)) {
+    cache_addHash(ph, cache_block(m_cache_block, fill));
+  }
+  
+  /* Restore the position, even if reading failed */
+  if (seek) {
+    if (fsetpos(pIn, &pos) != 0) {
+      status = 0;
+    }
+  }
+  
+  /* Store the length */
+  if (status) {
+    *pLen = len;
+  }
+  
+  /* Return status */
+  return status;
+}
+
+/*
+ * Load the cache file.
+ * 
+ * The block hashes are loaded into m_cache_oldHashes and the records
+ * into m_cache_pOld.  The block hashes must match the input hash in
+ * the header, and the records must all be valid, with the EOF record
+ * last.
+ * 
+ * Return:
+ * 
+ *   non-zero if the cache file was loaded, zero if it does not exist or
+ *   is damaged
+ */
+static int cache_load(void) {
+  
+  int status = 1;
+  FILE *pf = NULL;
+  unsigned char head[CACHE_HEADLEN];
+  unsigned char *pData = NULL;
+  size_t dataLen = 0;
+  size_t dataCap = 0;
+  size_t count = 0;
+  int64_t n = 0;
+  int64_t i = 0;
+  CACHE_POS pos;
+  CACHE_POS prev;
+  CACHE_REC rec;
+  
+  /* Initialize structures */
+  memset(head, 0, sizeof(head));
+  memset(&pos, 0, sizeof(CACHE_POS));
+  memset(&prev, 0, sizeof(CACHE_POS));
+  memset(&rec, 0, sizeof(CACHE_REC));
+  
+  /* Open the cache file */
+  pf = fopen(m_cache_pPath, "rb");
+  if (pf == NULL) {
+    status = 0;
+  }
+  
+  /* Read and check the header */
+  if (status) {
+    if (fread(head, 1, CACHE_HEADLEN, pf) != CACHE_HEADLEN) {
+      status = 0;
+    }
+  }
+  if (status) {
+    if ((memcmp(head, CACHE_SIGNATURE, 8) != 0) ||
+        (cache_word(&(head[8])) > (uint64_t) (INT64_MAX / 2))) {
+      status = 0;
+    }
+  }
+  if (status) {
+    m_cache_oldLen = (int64_t) cache_word(&(head[8]));
+  }
+  
+  /* Read the rest of the file */
+  if (status) {
+    while (!feof(pf)) {
+      if (dataCap - dataLen < CACHE_READSIZE) {
+        if (dataCap < 1) {
+          dataCap = CACHE_READSIZE;
+        } else if (dataCap <= SIZE_MAX / 2) {
+          dataCap *= 2;
+        } else {
+          abort();
+        }
+        pData = (unsigned char *) realloc(pData, dataCap);
+        if (pData == NULL) {
+          abort();
+        }
+      }
+      
+      count = fread(&(pData[dataLen]), 1, CACHE_READSIZE, pf);
+      if (ferror(pf)) {
+        status = 0;
+        break;
+      }
+      dataLen += count;
+    }
+  }
+  
+  /* Close the cache file */
+  if (pf != NULL) {
+    fclose(pf);
+    pf = NULL;
+  }
+  
+  /* Split off the block hashes and check them against the header */
+  if (status) {
+    n = (m_cache_oldLen + CACHE_HASHBLOCK - 1) / CACHE_HASHBLOCK;
+    if ((uint64_t) n > (uint64_t) (dataLen / 8)) {
+      status = 0;
+    }
+  }
+  if (status) {
+    for(i = 0; i < n; i++) {
+      cache_addHash(&m_cache_oldHashes, cache_word(&(pData[i * 8])));
+    }
+    if (cache_key(&m_cache_oldHashes, m_cache_oldLen) !=
+          cache_word(&(head[16]))) {
+      status = 0;
+    }
+  }
+  
+  /* Keep the records and validate all of them, so that replay never
+   * has to stop part-way because of a damaged file, collecting the
+   * marks along the way */
+  if (status) {
+    m_cache_oldSize = dataLen - ((size_t) n) * 8;
+    memmove(pData, &(pData[n * 8]), m_cache_oldSize);
+    m_cache_pOld = pData;
+    pData = NULL;
+    
+    pos.p = m_cache_pOld;
+    pos.line = 1;
+    pos.mark = 0;
+    do {
+      memcpy(&prev, &pos, sizeof(CACHE_POS));
+      if (!cache_record(&pos, m_cache_pOld + m_cache_oldSize,
+                        m_cache_oldLen, &rec)) {
+        status = 0;
+        break;
+      }
+      if (rec.kind == CACHE_K_MARK) {
+        cache_addMark(&prev, &rec);
+      }
+    } while (rec.kind != CACHE_K_EOF);
+  }
+  if (status) {
+    if (pos.p != m_cache_pOld + m_cache_oldSize) {
+      status = 0;
+    }
+  }
+  if (status) {
+    m_cache_oldLine = rec.line;
+  }
+  
+  /* Discard everything if the cache file was not loaded */
+  if (pData != NULL) {
+    free(pData);
+    pData = NULL;
+  }
+  if (!status) {
+    m_cache_oldHashes.count = 0;
+    m_cache_marks.count = 0;
+    if (m_cache_pOld != NULL) {
+      free(m_cache_pOld);
+      m_cache_pOld = NULL;
+    }
+    m_cache_oldSize = 0;
+  }
+  
+  /* Return status */
+  return status;
+}
+
+/*
+ * Find the unchanged input at the end.
+ * 
+ * The input is hashed again in blocks that line up with the blocks of
+ * the loaded cache file after moving them by m_cache_delta.  Matching
+ * blocks are counted back from the end, and m_cache_tail is set to the
+ * new offset of the first of them, or -1 if none match.
+ * 
+ * Parameters:
+ * 
+ *   pIn - the input file
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if the input could not be read
+ */
+static int cache_tailAt(FILE *pIn) {
+  
+  int status = 1;
+  CACHE_HASHES moved;
+  int64_t first = 0;
+  int64_t skip = 0;
+  int64_t len = 0;
+  int64_t n = 0;
+  
+  /* Initialize structure */
+  memset(&moved, 0, sizeof(CACHE_HASHES));
+  
+  /* Check parameter */
+  if (pIn == NULL) {
+    abort();
+  }
+  
+  /* Find the first loaded block that is still within the input after
+   * moving, and the new offset it moved to */
+  if (m_cache_delta < 0) {
+    first = ((-m_cache_delta) + CACHE_HASHBLOCK - 1) / CACHE_HASHBLOCK;
+  }
+  skip = first * CACHE_HASHBLOCK + m_cache_delta;
+  
+  /* Hash the input in moved blocks; the last moved block ends at the
+   * end of input just as the last loaded block does, so the two arrays
+   * line up at their ends */
+  if (!cache_scan(pIn, skip, &moved, &len)) {
+    status = 0;
+  }
+  
+  /* Count the matching blocks from the end */
+  m_cache_tail = -1;
+  if (status) {
+    while ((n < moved.count) && (n < m_cache_oldHashes.count - first) &&
+            ((moved.pHash)[moved.count - 1 - n] ==
+              (m_cache_oldHashes.pHash)[
+                m_cache_oldHashes.count - 1 - n])) {
+      n++;
+    }
+    if (n > 0) {
+      m_cache_tail = (m_cache_oldHashes.count - n) * CACHE_HASHBLOCK +
+                      m_cache_delta;
+    }
+  }
+  
+  /* Release the moved hashes */
+  free(moved.pHash);
+  moved.pHash = NULL;
+  
+  /* Return status */
+  return status;
+}
+
+/*
+ * Prepare to reuse a loaded cache file for an edited input.
+ * 
+ * The unchanged input at the start is found by comparing block hashes,
+ * and the entities before the last mark within it are kept.  The
+ * unchanged input at the end is found with cache_tailAt().
+ * 
+ * Parameters:
+ * 
+ *   pIn - the input file
+ * 
+ * Return:
+ * 
+ *   non-zero if the cache file can be partly reused, zero if not
+ */
+static int cache_edit(FILE *pIn) {
+  
+  int status = 1;
+  int64_t n = 0;
+  int64_t head = 0;
+  const CACHE_MARK *pm = NULL;
+  
+  /* Check parameter */
+  if (pIn == NULL) {
+    abort();
+  }
+  
+  /* Count the matching blocks from the start; only the last block can
+   * be partial, and its hash includes its length */
+  while ((n < m_cache_hashes.count) && (n < m_cache_oldHashes.count) &&
+          ((m_cache_hashes.pHash)[n] == (m_cache_oldHashes.pHash)[n])) {
+    n++;
+  }
+  head = n * CACHE_HASHBLOCK;
+  
+  /* Keep the entities before the last mark that comes before the first
+   * changed byte; everything up to and including the byte at the mark
+   * is then unchanged, so the lexer ends their tokens at the same places
+   * as before, and it can start again at the mark */
+  m_cache_keepPos.p = m_cache_pOld;
+  m_cache_keepPos.line = 1;
+  m_cache_keepPos.mark = 0;
+  while ((m_cache_markCur < m_cache_marks.count) &&
+          ((m_cache_marks.pMark)[m_cache_markCur].offs < head)) {
+    m_cache_markCur++;
+  }
+  if (m_cache_markCur > 0) {
+    pm = &((m_cache_marks.pMark)[m_cache_markCur - 1]);
+    memcpy(&m_cache_keepPos, &(pm->pos), sizeof(CACHE_POS));
+    m_cache_resume = pm->offs;
+    m_cache_markCur--;
+  }
+  m_cache_keep = (size_t) (m_cache_keepPos.p - m_cache_pOld);
+  
+  /* Find the unchanged input at the end */
+  m_cache_delta = m_cache_len - m_cache_oldLen;
+  if (!cache_tailAt(pIn)) {
+    status = 0;
+  }
+  
+  /* Only worthwhile if something can be reused */
+  if (status) {
+    if ((m_cache_keep < 1) && (m_cache_tail < 0)) {
+      status = 0;
+    }
+  }
+  
+  /* Return status */
+  return status;
+}
+
+/*
+ * Make sure the record buffer has room for at least n more bytes.
+ * 
+ * Parameters:
+ * 
+ *   n - the number of bytes that must be available
+ */
+static void cache_grow(size_t n) {
+  
+  size_t newcap = 0;
+  
+  /* Only grow if necessary */
+  if (n > m_cache_bufCap - m_cache_bufLen) {
+    
+    /* Double the capacity until it is enough */
+    newcap = m_cache_bufCap;
+    if (newcap < CACHE_READSIZE) {
+      newcap = CACHE_READSIZE;
+    }
+    while (n > newcap - m_cache_bufLen) {
+      if (newcap > SIZE_MAX / 2) {
+        abort();
+      }
+      newcap *= 2;
+    }
+    
+    /* Reallocate */
+    m_cache_pBuf = (unsigned char *) realloc(m_cache_pBuf, newcap);
+    if (m_cache_pBuf == NULL) {
+      abort();
+    }
+    m_cache_bufCap = newcap;
+  }
+}
+
+/*
+ * Append an unsigned varint to the record buffer.
+ * 
+ * Parameters:
+ * 
+ *   v - the value
+ */
+static void cache_putU(uint64_t v) {
+  
+  cache_grow(CACHE_MAXVARINT);
+  
+  while (v >= 0x80) {
+    m_cache_pBuf[m_cache_bufLen] = (unsigned char) ((v & 0x7f) | 0x80);
+    m_cache_bufLen++;
+    v >>= 7;
+  }
+  m_cache_pBuf[m_cache_bufLen] = (unsigned char) v;
+  m_cache_bufLen++;
+}
+
+/*
+ * Append a signed varint to the record buffer.
+ * 
+ * Parameters:
+ * 
+ *   v - the value
+ */
+static void cache_putS(int64_t v) {
+  if (v < 0) {
+    cache_putU((((uint64_t) (-(v + 1))) << 1) | 1);
+  } else {
+    cache_putU(((uint64_t) v) << 1);
+  }
+}
+
+/*
+ * Append a record to the record buffer.
+ * 
+ * A fault occurs if recording is not on, if the EOF has already been
+ * recorded, if the record is out of order with the previous record, or
+ * if its kind or value is invalid.
+ * 
+ * Parameters:
+ * 
+ *   pr - the record
+ */
+static void cache_putRec(const CACHE_REC *pr) {
+  
+  NVM_PITCHSET pset;
+  int32_t pa[CACHE_MAXPSET];
+  int32_t count = 0;
+  int32_t i = 0;
+  
+  /* Check state */
+  if ((!m_cache_rec) || m_cache_done) {
+    abort();
+  }
+  
+  /* Check parameter */
+  if (pr == NULL) {
+    abort();
+  }
+  if (pr->line < m_cache_line) {
+    abort();
+  }
+  
+  /* Append the kind and the line */
+  cache_grow(1);
+  m_cache_pBuf[m_cache_bufLen] = (unsigned char) pr->kind;
+  m_cache_bufLen++;
+  
+  cache_putU((uint64_t) (pr->line - m_cache_line));
+  m_cache_line = pr->line;
+  
+  /* Append the payload according to the kind */
+  switch (pr->kind) {
+    case ASCII_LPAREN:
+      /* Get the pitches in ascending order */
+      memcpy(&pset, &(pr->ps), sizeof(NVM_PITCHSET));
+      while (!nvm_pitchset_isEmpty(&pset)) {
+        pa[count] = nvm_pitchset_least(&pset);
+        nvm_pitchset_drop(&pset, pa[count]);
+        count++;
+      }
+    
+      cache_putU((uint64_t) count);
+      for(i = 0; i < count; i++) {
+        if (i < 1) {
+          cache_putS((int64_t) pa[i]);
+        } else {
+          cache_putU((uint64_t) (pa[i] - pa[i - 1]));
+        }
+      }
+      break;
+    
+    case ASCII_LSQUARE:
+      if (pr->v < 0) {
+        abort();
+      }
+      cache_putU((uint64_t) pr->v);
+      break;
+    
+    case ASCII_BSLASH:
+    case ASCII_CARET:
+    case ASCII_AMP:
+    case ASCII_PLUS:
+    case ASCII_GRACC:
+    case ASCII_GT:
+      cache_putS((int64_t) pr->v);
+      break;
+    
+    case ASCII_STAR:
+    case ASCII_EXCLAIM:
+      if ((pr->v < 0) || (pr->v >= CACHE_MAXART)) {
+        abort();
+      }
+      cache_putU((uint64_t) pr->v);
+      break;
+    
+    case ASCII_SLASH:
+    case ASCII_DOLLAR:
+    case ASCII_ATSIGN:
+    case ASCII_LCURLY:
+    case ASCII_COLON:
+    case ASCII_RCURLY:
+    case ASCII_EQUALS:
+    case ASCII_TILDE:
+    case ASCII_HYPHEN:
+    case ASCII_LT:
+      break;
+    
+    case ASCII_PERCENT:
+      if ((pr->pPath == NULL) ||
+          (pr->plen < 1) || (pr->plen > INCL_MAXPATH)) {
+        abort();
+      }
+      cache_putU((uint64_t) pr->plen);
+      cache_grow((size_t) pr->plen);
+      memcpy(&(m_cache_pBuf[m_cache_bufLen]), pr->pPath,
+              (size_t) pr->plen);
+      m_cache_bufLen += (size_t) pr->plen;
+      break;
+    
+    case CACHE_K_MARK:
+      if (pr->offs < m_cache_mark) {
+        abort();
+      }
+      cache_putU((uint64_t) (pr->offs - m_cache_mark));
+      m_cache_mark = pr->offs;
+      m_cache_markNext =
+        ((pr->offs / CACHE_HASHBLOCK) + 1) * CACHE_HASHBLOCK;
+      break;
+    
+    case CACHE_K_EOF:
+      m_cache_done = 1;
+      break;
+    
+    default:
+      abort();
+  }
+}
+
+/*
+ * Read an unsigned varint.
+ * 
+ * pp points to the read pointer, which is advanced past the varint on
+ * success.  pEnd is the end of the data.
+ * 
+ * Parameters:
+ * 
+ *   pp - pointer to the read pointer
+ * 
+ *   pEnd - the end of the data
+ * 
+ *   pv - pointer to variable to receive the value
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if the varint is truncated or too long
+ */
+static int cache_getU(
+    const unsigned char ** pp,
+    const unsigned char  * pEnd,
+          uint64_t       * pv) {
+  
+  int status = 1;
+  const unsigned char *p = NULL;
+  uint64_t v = 0;
+  int shift = 0;
+  int c = 0;
+  
+  /* Check parameters */
+  if ((pp == NULL) || (pEnd == NULL) || (pv == NULL)) {
+    abort();
+  }
+  p = *pp;
+  
+  /* Read groups of seven bits */
+  while (status) {
+    if ((p >= pEnd) || (shift >= CACHE_MAXVARINT * 7)) {
+      status = 0;
+      break;
+    }
+    
+    c = *p;
+    p++;
+    
+    if ((shift == (CACHE_MAXVARINT - 1) * 7) && ((c & 0x7f) > 1)) {
+      status = 0;
+      break;
+    }
+    
+    v |= ((uint64_t) (c & 0x7f)) << shift;
+    shift += 7;
+    
+    if (!(c & 0x80)) {
+      break;
+    }
+  }
+  
+  /* Store results */
+  if (status) {
+    *pp = p;
+    *pv = v;
+  }
+  
+  /* Return status */
+  return status;
+}
+
+/*
+ * Read a signed varint.
+ * 
+ * Parameters:
+ * 
+ *   pp - pointer to the read pointer
+ * 
+ *   pEnd - the end of the data
+ * 
+ *   pv - pointer to variable to receive the value
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if the varint is truncated or too long
+ */
+static int cache_getS(
+    const unsigned char ** pp,
+    const unsigned char  * pEnd,
+          int64_t        * pv) {
+  
+  int status = 1;
+  uint64_t u = 0;
+  
+  /* Check parameter */
+  if (pv == NULL) {
+    abort();
+  }
+  
+  /* Read the zig-zag value and decode it */
+  if (!cache_getU(pp, pEnd, &u)) {
+    status = 0;
+  }
+  if (status) {
+    if (u & 1) {
+      *pv = -((int64_t) (u >> 1)) - 1;
+    } else {
+      *pv = (int64_t) (u >> 1);
+    }
+  }
+  
+  /* Return status */
+  return status;
+}
+
+/*
+ * Read and validate a record.
+ * 
+ * pc is the position of the record, which is advanced past it on
+ * success.  pEnd is the end of the records, and len is the filtered
+ * length of the input that they were recorded for, which the offset in
+ * a mark may not go beyond.
+ * 
+ * Parameters:
+ * 
+ *   pc - the position
+ * 
+ *   pEnd - the end of the records
+ * 
+ *   len - the filtered input length
+ * 
+ *   pr - the record structure to fill in
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if the record is invalid
+ */
+static int cache_record(
+          CACHE_POS     * pc,
+    const unsigned char * pEnd,
+          int64_t         len,
+          CACHE_REC     * pr) {
+  
+  int status = 1;
+  const unsigned char *p = NULL;
+  uint64_t u = 0;
+  uint64_t count = 0;
+  uint64_t i = 0;
+  int64_t s = 0;
+  
+  /* Check parameters */
+  if ((pc == NULL) || (pEnd == NULL) || (pr == NULL)) {
+    abort();
+  }
+  p = pc->p;
+  
+  /* Reset record */
+  memset(pr, 0, sizeof(CACHE_REC));
+  nvm_pitchset_clear(&(pr->ps));
+  
+  /* Read the kind byte */
+  if (p < pEnd) {
+    pr->kind = *p;
+    p++;
+  } else {
+    status = 0;
+  }
+  
+  /* Read the line */
+  if (status) {
+    if (!cache_getU(&p, pEnd, &u)) {
+      status = 0;
+    }
+  }
+  if (status) {
+    if (u <= (uint64_t) (INT32_MAX - pc->line)) {
+      pr->line = pc->line + (int32_t) u;
+    } else {
+      status = 0;
+    }
+  }
+  
+  /* Read the payload according to the kind */
+  if (status) {
+    switch (pr->kind) {
+      
+      case ASCII_LPAREN:
+        /* Pitch set -- count, then first pitch, then ascending
+         * differences */
+        if (!cache_getU(&p, pEnd, &count)) {
+          status = 0;
+        }
+        if (status && (count > CACHE_MAXPSET)) {
+          status = 0;
+        }
+        for(i = 0; status && (i < count); i++) {
+          if (i < 1) {
+            if (!cache_getS(&p, pEnd, &s)) {
+              status = 0;
+            }
+          } else {
+            if (!cache_getU(&p, pEnd, &u)) {
+              status = 0;
+            }
+            if (status && ((u < 1) || (u > CACHE_MAXPSET))) {
+              status = 0;
+            }
+            if (status) {
+              s += (int64_t) u;
+            }
+          }
+        
+          if (status) {
+            if ((s < NMF_MINPITCH) || (s > NMF_MAXPITCH)) {
+              status = 0;
+            }
+          }
+          if (status) {
+            nvm_pitchset_add(&(pr->ps), (int32_t) s);
+          }
+        }
+        break;
+      
+      case ASCII_LSQUARE:
+        /* Duration */
+        if (!cache_getU(&p, pEnd, &u)) {
+          status = 0;
+        }
+        if (status && (u > INT32_MAX)) {
+          status = 0;
+        }
+        if (status) {
+          pr->v = (int32_t) u;
+        }
+        break;
+      
+      case ASCII_BSLASH:
+      case ASCII_CARET:
+      case ASCII_AMP:
+      case ASCII_PLUS:
+      case ASCII_GRACC:
+      case ASCII_GT:
+        /* Operation with an integer parameter */
+        if (!cache_getS(&p, pEnd, &s)) {
+          status = 0;
+        }
+        if (status && ((s < INT32_MIN) || (s > INT32_MAX))) {
+          status = 0;
+        }
+        if (status) {
+          pr->v = (int32_t) s;
+        }
+        break;
+      
+      case ASCII_STAR:
+      case ASCII_EXCLAIM:
+        /* Operation with a key parameter */
+        if (!cache_getU(&p, pEnd, &u)) {
+          status = 0;
+        }
+        if (status && (u >= CACHE_MAXART)) {
+          status = 0;
+        }
+        if (status) {
+          pr->v = (int32_t) u;
+        }
+        break;
+      
+      case ASCII_SLASH:
+      case ASCII_DOLLAR:
+      case ASCII_ATSIGN:
+      case ASCII_LCURLY:
+      case ASCII_COLON:
+      case ASCII_RCURLY:
+      case ASCII_EQUALS:
+      case ASCII_TILDE:
+      case ASCII_HYPHEN:
+      case ASCII_LT:
+        /* No payload */
+        break;
+      
+      case ASCII_PERCENT:
+        /* Include operation -- path length, then path */
+        if (!cache_getU(&p, pEnd, &u)) {
+          status = 0;
+        }
+        if (status && ((u < 1) || (u > INCL_MAXPATH) ||
+                        (u > (uint64_t) (pEnd - p)))) {
+          status = 0;
+        }
+        for(i = 0; status && (i < u); i++) {
+          if ((p[i] < 0x21) || (p[i] > 0x7e) || (p[i] == ASCII_SEMICOL)) {
+            status = 0;
+          }
+        }
+        if (status) {
+          pr->pPath = (const char *) p;
+          pr->plen = (int32_t) u;
+          p += u;
+        }
+        break;
+      
+      case CACHE_K_MARK:
+        /* Resume mark */
+        if (!cache_getU(&p, pEnd, &u)) {
+          status = 0;
+        }
+        if (status && (u > (uint64_t) (len - pc->mark))) {
+          status = 0;
+        }
+        if (status) {
+          pr->offs = pc->mark + (int64_t) u;
+        }
+        break;
+      
+      case CACHE_K_EOF:
+        /* No payload */
+        break;
+      
+      default:
+        /* Unknown kind */
+        status = 0;
+    }
+  }
+  
+  /* Update the position on success */
+  if (status) {
+    pc->p = p;
+    pc->line = pr->line;
+    if (pr->kind == CACHE_K_MARK) {
+      pc->mark = pr->offs;
+    }
+  }
+  
+  /* Return status */
+  return status;
+}
+
+/*
+ * Emit the instruction for a record.
+ * 
+ * The line number of the record is the position of the instruction.
+ * Since instructions run in batches, an error may be returned for an
+ * instruction that was emitted earlier; see ir_emit().
+ * 
+ * Parameters:
+ * 
+ *   pr - the record
+ * 
+ *   ppos - pointer to variable to receive the line number in case of
+ *   error
+ * 
+ *   per - pointer to variable to receive error code
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if error
+ */
+static int cache_run(const CACHE_REC *pr, int64_t *ppos, int *per) {
+  
+  int status = 1;
+  NVM_INSTR ins;
+  char path[INCL_MAXPATH + 1];
+  
+  /* Initialize structures */
+  memset(&ins, 0, sizeof(NVM_INSTR));
+  nvm_pitchset_clear(&(ins.ps));
+  
+  /* Check parameters */
+  if ((pr == NULL) || (ppos == NULL) || (per == NULL)) {
+    abort();
+  }
+  
+  /* Get the opcode for the kind */
+  switch (pr->kind) {
+    case ASCII_LPAREN:
+      ins.op = NVM_OP_PSET;
+      memcpy(&(ins.ps), &(pr->ps), sizeof(NVM_PITCHSET));
+      break;
+    
+    case ASCII_LSQUARE:
+      ins.op = NVM_OP_DUR;
+      break;
+    
+    case ASCII_SLASH:
+      ins.op = NVM_OP_REPEAT;
+      break;
+    
+    case ASCII_DOLLAR:
+      ins.op = NVM_OP_SECTION;
+      break;
+    
+    case ASCII_ATSIGN:
+      ins.op = NVM_OP_RETURN;
+      break;
+    
+    case ASCII_LCURLY:
+      ins.op = NVM_OP_PUSHLOC;
+      break;
+    
+    case ASCII_COLON:
+      ins.op = NVM_OP_RETLOC;
+      break;
+    
+    case ASCII_RCURLY:
+      ins.op = NVM_OP_POPLOC;
+      break;
+    
+    case ASCII_EQUALS:
+      ins.op = NVM_OP_POPTRANS;
+      break;
+    
+    case ASCII_TILDE:
+      ins.op = NVM_OP_POPART;
+      break;
+    
+    case ASCII_HYPHEN:
+      ins.op = NVM_OP_POPLAYER;
+      break;
+    
+    case ASCII_BSLASH:
+      ins.op = NVM_OP_MULTIPLE;
+      break;
+    
+    case ASCII_CARET:
+      ins.op = NVM_OP_PUSHTRANS;
+      break;
+    
+    case ASCII_AMP:
+      ins.op = NVM_OP_SETBASE;
+      break;
+    
+    case ASCII_PLUS:
+      ins.op = NVM_OP_PUSHLAYER;
+      break;
+    
+    case ASCII_GRACC:
+      ins.op = NVM_OP_CUE;
+      break;
+    
+    case ASCII_STAR:
+      ins.op = NVM_OP_IMMART;
+      break;
+    
+    case ASCII_EXCLAIM:
+      ins.op = NVM_OP_PUSHART;
+      break;
+    
+    case ASCII_LT:
+      ins.op = NVM_OP_BEGIN;
+      break;
+    
+    case ASCII_GT:
+      ins.op = NVM_OP_END;
+      break;
+    
+    case ASCII_PERCENT:
+      /* Includes are run by the incl module */
+      ins.op = -1;
+      break;
+    
+    case CACHE_K_MARK:
+      /* Marks are not entities */
+      ins.op = -1;
+      break;
+    
+    case CACHE_K_EOF:
+      ins.op = NVM_OP_EOF;
+      break;
+    
+    default:
+      /* Records were validated when loaded */
+      abort();
+  }
+  
+  /* Emit the instruction, or include the library */
+  if (ins.op >= 0) {
+    ins.v = pr->v;
+    ins.pos = pr->line;
+    if (!ir_emit(&ins, ppos, per)) {
+      status = 0;
+    }
+    
+  } else if (pr->kind == ASCII_PERCENT) {
+    memcpy(path, pr->pPath, (size_t) pr->plen);
+    path[pr->plen] = 0;
+    if (!incl_run(path, pr->line, ppos, per)) {
+      status = 0;
+    }
+  }
+  
+  /* Return status */
+  return status;
+}
+
+/*
+ * Public function implementations
+ * ===============================
+ * 
+ * See the header for specifications.
+ */
+
+/*
+ * cache_open function.
+ */
+int cache_open(const char *pPath, FILE *pIn) {
+  
+  /* Check state and update it */
+  if (m_cache_opened) {
+    abort();
+  } else {
+    m_cache_opened = 1;
+  }
+  
+  /* Check parameters */
+  if ((pPath == NULL) || (pIn == NULL)) {
+    abort();
+  }
+  m_cache_pPath = pPath;
+  
+  /* Hash the input, then load the cache file and check whether it
+   * matches the input or an earlier version of it; record unless it
+   * matches */
+  if (cache_scan(pIn, 0, &m_cache_hashes, &m_cache_len)) {
+    m_cache_key = cache_key(&m_cache_hashes, m_cache_len);
+    
+    if (cache_load()) {
+      if ((m_cache_oldLen == m_cache_len) &&
+          (cache_key(&m_cache_oldHashes, m_cache_oldLen) ==
+            m_cache_key) &&
+          (memcmp(m_cache_oldHashes.pHash, m_cache_hashes.pHash,
+            ((size_t) m_cache_hashes.count) * sizeof(uint64_t)) == 0)) {
+        m_cache_mode = CACHE_HIT;
+        
+      } else if (cache_edit(pIn)) {
+        m_cache_mode = CACHE_EDIT;
+      }
+    }
+    
+    if (m_cache_mode != CACHE_HIT) {
+      m_cache_rec = 1;
+    }
+  }
+  
+  /* Return the mode */
+  return m_cache_mode;
+}
+
+/*
+ * cache_digest function.
+ */
+int cache_digest(FILE *pIn, int64_t *pLen, uint64_t *pKey) {
+  
+  int status = 1;
+  CACHE_HASHES h;
+  
+  /* Initialize structure */
+  memset(&h, 0, sizeof(CACHE_HASHES));
+  
+  /* Check parameters */
+  if ((pIn == NULL) || (pLen == NULL) || (pKey == NULL)) {
+    abort();
+  }
+  
+  /* Hash the input */
+  if (cache_scan(pIn, 0, &h, pLen)) {
+    *pKey = cache_key(&h, *pLen);
+  } else {
+    status = 0;
+  }
+  
+  /* Release the block hashes */
+  free(h.pHash);
+  h.pHash = NULL;
+  
+  /* Return status */
+  return status;
+}
+
+/*
+ * cache_recording function.
+ */
+int cache_recording(void) {
+  return m_cache_rec;
+}
+
+/*
+ * cache_putPitch function.
+ */
+void cache_putPitch(int32_t line, const NVM_PITCHSET *ps) {
+  
+  CACHE_REC rec;
+  
+  /* Check parameter */
+  if (ps == NULL) {
+    abort();
+  }
+  
+  /* Append the record */
+  memset(&rec, 0, sizeof(CACHE_REC));
+  rec.kind = ASCII_LPAREN;
+  rec.line = line;
+  memcpy(&(rec.ps), ps, sizeof(NVM_PITCHSET));
+  cache_putRec(&rec);
+}
+
+/*
+ * cache_putDur function.
+ */
+void cache_putDur(int32_t line, int32_t q) {
+  
+  CACHE_REC rec;
+  
+  /* Append the record */
+  memset(&rec, 0, sizeof(CACHE_REC));
+  rec.kind = ASCII_LSQUARE;
+  rec.line = line;
+  rec.v = q;
+  cache_putRec(&rec);
+}
+
+/*
+ * cache_putOp function.
+ */
+void cache_putOp(int32_t line, int c, int32_t v) {
+  
+  CACHE_REC rec;
+  
+  /* Check parameter */
+  if ((c == CACHE_K_EOF) || (c == CACHE_K_MARK) ||
+      (c == ASCII_LPAREN) || (c == ASCII_LSQUARE)) {
+    abort();
+  }
+  
+  /* Append the record */
+  memset(&rec, 0, sizeof(CACHE_REC));
+  rec.kind = c;
+  rec.line = line;
+  rec.v = v;
+  cache_putRec(&rec);
+}
+
+/*
+ * cache_putInclude function.
+ */
+void cache_putInclude(int32_t line, const char *pPath) {
+  
+  CACHE_REC rec;
+  
+  /* Check parameter */
+  if (pPath == NULL) {
+    abort();
+  }
+  
+  /* Append the record */
+  memset(&rec, 0, sizeof(CACHE_REC));
+  rec.kind = ASCII_PERCENT;
+  rec.line = line;
+  rec.pPath = pPath;
+  rec.plen = (int32_t) strlen(pPath);
+  cache_putRec(&rec);
+}
+
+/*
+ * cache_putEOF function.
+ */
+void cache_putEOF(int32_t line) {
+  
+  CACHE_REC rec;
+  
+  /* Append the record */
+  memset(&rec, 0, sizeof(CACHE_REC));
+  rec.kind = CACHE_K_EOF;
+  rec.line = line;
+  cache_putRec(&rec);
+}
+
+/*
+ * cache_wantMark function.
+ */
+int cache_wantMark(int64_t offs) {
+  
+  /* Check state */
+  if (!m_cache_rec) {
+    abort();
+  }
+  
+  /* Due from the start of the next block after the last mark */
+  return (offs >= m_cache_markNext);
+}
+
+/*
+ * cache_putMark function.
+ */
+void cache_putMark(int64_t offs, int32_t line) {
+  
+  CACHE_REC rec;
+  
+  /* Append the record */
+  memset(&rec, 0, sizeof(CACHE_REC));
+  rec.kind = CACHE_K_MARK;
+  rec.line = line;
+  rec.offs = offs;
+  cache_putRec(&rec);
+}
+
+/*
+ * cache_resume function.
+ */
+int64_t cache_resume(void) {
+  
+  int64_t result = 0;
+  
+  if (m_cache_mode == CACHE_EDIT) {
+    result = m_cache_resume;
+  }
+  
+  return result;
+}
+
+/*
+ * cache_sync function.
+ */
+int cache_sync(int64_t offs) {
+  
+  int result = 0;
+  const CACHE_MARK *pm = NULL;
+  
+  /* Only when editing, within the unchanged input at the end, and until
+   * a mark to resume replaying at has been found */
+  if ((m_cache_mode == CACHE_EDIT) && (!m_cache_synced) &&
+      (m_cache_tail >= 0) && (offs >= m_cache_tail)) {
+    
+    /* Skip marks before the offset */
+    while (m_cache_markCur < m_cache_marks.count) {
+      pm = &((m_cache_marks.pMark)[m_cache_markCur]);
+      if (pm->offs + m_cache_delta >= offs) {
+        break;
+      }
+      m_cache_markCur++;
+    }
+    
+    /* Check whether the next mark is at the offset */
+    if (m_cache_markCur < m_cache_marks.count) {
+      pm = &((m_cache_marks.pMark)[m_cache_markCur]);
+      if (pm->offs + m_cache_delta == offs) {
+        result = 1;
+        m_cache_synced = 1;
+      }
+    }
+  }
+  
+  return result;
+}
+
+/*
+ * cache_splice function.
+ */
+int cache_splice(int32_t line, int32_t *pln, int *per) {
+  
+  int status = 1;
+  int raw = 0;
+  int64_t shift = 0;
+  int64_t v = 0;
+  int64_t fail = 0;
+  size_t n = 0;
+  const CACHE_MARK *pm = NULL;
+  const unsigned char *pEnd = NULL;
+  CACHE_POS pos;
+  CACHE_REC rec;
+  
+  /* Initialize structures */
+  memset(&pos, 0, sizeof(CACHE_POS));
+  memset(&rec, 0, sizeof(CACHE_REC));
+  
+  /* Check state */
+  if ((!m_cache_synced) || (!m_cache_rec) || m_cache_done) {
+    abort();
+  }
+  
+  /* Check parameters */
+  if ((pln == NULL) || (per == NULL)) {
+    abort();
+  }
+  
+  /* Lines move by the same amount throughout the unchanged input */
+  pm = &((m_cache_marks.pMark)[m_cache_markCur]);
+  shift = ((int64_t) line) - ((int64_t) pm->line);
+  
+  /* Record the mark at its new place */
+  memcpy(&pos, &(pm->pos), sizeof(CACHE_POS));
+  pEnd = m_cache_pOld + m_cache_oldSize;
+  if (!cache_record(&pos, pEnd, m_cache_oldLen, &rec)) {
+    abort();
+  }
+  rec.offs += m_cache_delta;
+  rec.line = line;
+  cache_putRec(&rec);
+  
+  /* Since records are relative to the one before and marks to the mark
+   * before, the rest of the loaded records can be copied as they are,
+   * unless their line numbers need to be limited the same way
+   * token_line() limits them */
+  if (((int64_t) m_cache_oldLine) + shift <= INT32_MAX) {
+    raw = 1;
+    n = (size_t) (pEnd - pos.p);
+    cache_grow(n);
+    memcpy(&(m_cache_pBuf[m_cache_bufLen]), pos.p, n);
+    m_cache_bufLen += n;
+    m_cache_line = (int32_t) (((int64_t) m_cache_oldLine) + shift);
+    m_cache_mark = (m_cache_marks.pMark)[m_cache_marks.count - 1].offs +
+                    m_cache_delta;
+    m_cache_done = 1;
+  }
+  
+  /* Run the rest of the loaded records, recording them too if they
+   * were not copied */
+  while (status && (rec.kind != CACHE_K_EOF)) {
+    if (!cache_record(&pos, pEnd, m_cache_oldLen, &rec)) {
+      abort();
+    }
+    
+    if (rec.kind == CACHE_K_MARK) {
+      rec.offs += m_cache_delta;
+    }
+    v = ((int64_t) rec.line) + shift;
+    if (v > INT32_MAX) {
+      v = INT32_MAX;
+    }
+    rec.line = (int32_t) v;
+    
+    if (!raw) {
+      cache_putRec(&rec);
+    }
+    if (!cache_run(&rec, &fail, per)) {
+      status = 0;
+      *pln = (int32_t) fail;
+    }
+  }
+  
+  /* Run the instructions that are still pending */
+  if (status) {
+    if (!ir_flush(&fail, per)) {
+      status = 0;
+      *pln = (int32_t) fail;
+    }
+  }
+  
+  /* Return status */
+  return status;
+}
+
+/*
+ * cache_write function.
+ */
+int cache_write(void) {
+  
+  int status = 1;
+  unsigned char head[CACHE_HEADLEN];
+  unsigned char word[8];
+  char *pTmp = NULL;
+  size_t plen = 0;
+  FILE *pf = NULL;
+  int64_t i = 0;
+  
+  /* Initialize structures */
+  memset(head, 0, sizeof(head));
+  memset(word, 0, sizeof(word));
+  
+  /* Check state */
+  if ((!m_cache_rec) || (!m_cache_done)) {
+    abort();
+  }
+  
+  /* Build the header */
+  memcpy(head, CACHE_SIGNATURE, 8);
+  cache_putWord(&(head[8]), (uint64_t) m_cache_len);
+  cache_putWord(&(head[16]), m_cache_key);
+  
+  /* Build the temporary file path */
+  plen = strlen(m_cache_pPath);
+  pTmp = (char *) malloc(plen + sizeof(CACHE_TMPSUFFIX));
+  if (pTmp == NULL) {
+    abort();
+  }
+  memcpy(pTmp, m_cache_pPath, plen);
+  memcpy(&(pTmp[plen]), CACHE_TMPSUFFIX, sizeof(CACHE_TMPSUFFIX));
+  
+  /* Write the header, block hashes, and records to the temporary
+   * file */
+  pf = fopen(pTmp, "wb");
+  if (pf == NULL) {
+    status = 0;
+  }
+  if (status) {
+    if (fwrite(head, 1, CACHE_HEADLEN, pf) != CACHE_HEADLEN) {
+      status = 0;
+    }
+  }
+  for(i = 0; status && (i < m_cache_hashes.count); i++) {
+    cache_putWord(word, (m_cache_hashes.pHash)[i]);
+    if (fwrite(word, 1, 8, pf) != 8) {
+      status = 0;
+    }
+  }
+  if (status) {
+    if (fwrite(m_cache_pBuf, 1, m_cache_bufLen, pf) != m_cache_bufLen) {
+      status = 0;
+    }
+  }
+  if (pf != NULL) {
+    if (fclose(pf) != 0) {
+      status = 0;
+    }
+    pf = NULL;
+  }
+  
+  /* Replace the cache file with it; some platforms do not allow
+   * renaming over an existing file, so remove it first if that
+   * fails */
+  if (status) {
+    if (rename(pTmp, m_cache_pPath) != 0) {
+      remove(m_cache_pPath);
+      if (rename(pTmp, m_cache_pPath) != 0) {
+        status = 0;
+      }
+    }
+  }
+  
+  /* Clean up the temporary file on failure */
+  if (!status) {
+    remove(pTmp);
+  }
+  
+  /* Release the path */
+  free(pTmp);
+  pTmp = NULL;
+  
+  /* Return status */
+  return status;
+}
+
+/*
+ * cache_replay function.
+ */
+int cache_replay(int32_t *pln, int *per) {
+  
+  int status = 1;
+  CACHE_POS pos;
+  const unsigned char *pEnd = NULL;
+  CACHE_REC rec;
+  int64_t fail = 0;
+  
+  /* Initialize structures */
+  memset(&pos, 0, sizeof(CACHE_POS));
+  memset(&rec, 0, sizeof(CACHE_REC));
+  
+  /* Check state and update it */
+  if (((m_cache_mode != CACHE_HIT) && (m_cache_mode != CACHE_EDIT)) ||
+      m_cache_replayed) {
+    abort();
+  } else {
+    m_cache_replayed = 1;
+  }
+  
+  /* Check parameters */
+  if ((pln == NULL) || (per == NULL)) {
+    abort();
+  }
+  
+  /* Replay everything for a hit, or only the kept entities for an
+   * edit, which are also copied to the record buffer */
+  pos.p = m_cache_pOld;
+  pos.line = 1;
+  pos.mark = 0;
+  if (m_cache_mode == CACHE_HIT) {
+    pEnd = m_cache_pOld + m_cache_oldSize;
+    
+  } else {
+    pEnd = m_cache_pOld + m_cache_keep;
+    
+    cache_grow(m_cache_keep);
+    memcpy(&(m_cache_pBuf[m_cache_bufLen]), m_cache_pOld, m_cache_keep);
+    m_cache_bufLen += m_cache_keep;
+    m_cache_line = m_cache_keepPos.line;
+    m_cache_mark = m_cache_keepPos.mark;
+    m_cache_markNext = m_cache_resume;
+  }
+  
+  /* Run through the records, and then run the instructions that are
+   * still pending */
+  while (pos.p < pEnd) {
+    if (!cache_record(&pos, pEnd, m_cache_oldLen, &rec)) {
+      abort();
+    }
+    if (!cache_run(&rec, &fail, per)) {
+      status = 0;
+      *pln = (int32_t) fail;
+      break;
+    }
+  }
+  if (status) {
+    if (!ir_flush(&fail, per)) {
+      status = 0;
+      *pln = (int32_t) fail;
+    }
+  }
+  
+  /* Return status */
+  return status;
+}
@@ -0,0 +1,397 @@
+#ifndef CACHE_H_INCLUDED
+#define CACHE_H_INCLUDED
+
+/*
+ * cache.h
+ * 
+ * Token cache module of the Noir compiler.
+ * 
+ * A token cache file holds the entities of a Noir notation file after
+ * they have been tokenized and decoded, as a compact binary stream.
+ * When the cache file matches the input, the entities are replayed
+ * straight into the ir module as instructions, skipping the token and
+ * entity modules completely.
+ * 
+ * The cache is keyed by the length and a 64-bit content hash of the
+ * filtered input, which is the input decompressed if necessary, with
+ * the UTF-8 BOM removed and line breaks converted to LF, the same as
+ * the token module sees it.
+ * The hash is not cryptographic; it only guards against using a cache
+ * file with an input that has been changed.
+ * 
+ * When the input has been edited since the cache file was written, the
+ * cache file still describes the input before the edit.  The cache
+ * also records a hash of each block of the filtered input, and a resume
+ * mark with the offset of the next entity about once per block, so the
+ * unchanged parts of the input can be found again.  Entities before the
+ * last mark that lies wholly before the edit are replayed from the
+ * cache, and tokenizing starts at that mark.  Once tokenizing reaches
+ * an entity that starts at the same place within the unchanged text
+ * after the edit as a mark in the cache, everything from there to the
+ * end is replayed from the cache.  The amount of input that is
+ * tokenized is therefore proportional to the size of the edit rather
+ * than the size of the input, for a single contiguous edit.
+ * 
+ * Cache file format
+ * -----------------
+ * 
+ * All integers in the header and block hashes are unsigned 64-bit
+ * little endian.  The file begins with a 24-byte header:
+ * 
+ *   (1) The eight ASCII characters "NoirTkC2"
+ *   (2) Filtered input length in bytes
+ *   (3) Filtered input hash
+ * 
+ * The header is followed by one hash for each block of 4096 bytes of
+ * filtered input, the last block possibly being shorter.  The input
+ * hash in the header is a hash of the block hashes and the length.
+ * 
+ * The block hashes are followed by a sequence of records, the last of
+ * which is the EOF record, which must be followed by nothing.  Each
+ * record is a kind byte, followed by the line number of the record
+ * minus the line number of the previous record (or minus one for the
+ * first record), followed by a payload that depends on the kind.  The
+ * line number of an entity record is the line of the last token of the
+ * entity, which is the line that an error would be reported on.  The
+ * line number of a mark is the line of the first token of the entity
+ * after it.
+ * 
+ * The kind byte and its payload are:
+ * 
+ *   ( - pitch set: count, then the first pitch, then the difference
+ *   between each further pitch and the one before it, in ascending
+ *   order; a rest has a count of zero
+ * 
+ *   [ - duration: the duration in quanta
+ * 
+ *   \ ^ & + ` > - operation with an integer parameter: the parameter
+ * 
+ *   * ! - operation with a key parameter: the articulation number
+ * 
+ *   / $ @ { : } = ~ - < - operation without a parameter: no payload
+ * 
+ *   % - include operation: the number of characters in the library
+ *   path, then the characters, which are printing US-ASCII other than
+ *   the semicolon
+ * 
+ *   soh - resume mark: the offset of the first token of the next entity
+ *   in the filtered input, minus the offset in the previous mark, or
+ *   minus zero for the first mark
+ * 
+ *   nul - EOF record: no payload
+ * 
+ * The line differences, counts, durations, pitch differences,
+ * articulation numbers, and offsets are unsigned varints: seven bits
+ * per byte, least significant group first, with the high bit set on
+ * all bytes except the last.  The first pitch and integer parameters
+ * are signed varints, which are zig-zag encoded (0, -1, 1, -2, ... maps
+ * to 0, 1, 2, 3, ...) into unsigned varints.
+ * 
+ * Include operations are recorded with the path of the library rather
+ * than its content, so replaying one includes the library as it is
+ * now.  See incl.h.
+ * 
+ * Requires the incl, ir, source, and nvm modules, as well as the event
+ * module because the nvm module requires it.
+ */
+
+#include "noirdef.h"
+#include "nvm.h"
+#include <stdio.h>
+
+/*
+ * The results of cache_open().
+ * 
+ * CACHE_MISS means there is no usable cache file.  CACHE_HIT means the
+ * cache file matches the input.  CACHE_EDIT means the cache file is for
+ * an earlier version of the input that can be partly reused.
+ */
+#define CACHE_MISS (0)
+#define CACHE_HIT  (1)
+#define CACHE_EDIT (2)
+
+/*
+ * Check a cache file against the input file.
+ * 
+ * This function may only be called once, before anything else is done
+ * with the input file.
+ * 
+ * pPath is the path to the cache file and pIn is the input file, which
+ * must be open for reading.  The input is read from its current
+ * position to the end and hashed, and the position is then restored.
+ * This requires the input to be seekable.  If it is not, the cache is
+ * disabled and CACHE_MISS is returned.
+ * 
+ * If the cache file matches the input, it is loaded and CACHE_HIT is
+ * returned.  Use cache_replay() instead of the token and entity modules
+ * in that case.
+ * 
+ * Otherwise, recording is turned on, so that the entity module records
+ * each entity with the cache_put functions, and cache_write() can then
+ * write a new cache file.  If the cache file is for an earlier version
+ * of the input, CACHE_EDIT is returned.  In that case, call
+ * cache_replay() to replay the entities before the edit, then seek the
+ * token module to cache_resume() before running the entity module,
+ * which then uses cache_sync() and cache_splice() to replay the
+ * entities after the edit.  Otherwise, CACHE_MISS is returned.  A cache
+ * file that does not match, or that is damaged, is simply replaced.
+ * 
+ * Parameters:
+ * 
+ *   pPath - the path to the cache file
+ * 
+ *   pIn - the input file
+ * 
+ * Return:
+ * 
+ *   CACHE_MISS, CACHE_HIT, or CACHE_EDIT
+ */
+int cache_open(const char *pPath, FILE *pIn);
+
+/*
+ * Compute the length and hash of the filtered input, the same way the
+ * cache file is keyed, for other files that have to be matched to the
+ * input.
+ * 
+ * The input is read from its current position to the end, and the
+ * position is then restored.  This may not be called while
+ * cache_open() is running.
+ * 
+ * Parameters:
+ * 
+ *   pIn - the input file
+ * 
+ *   pLen - pointer to variable to receive the filtered input length
+ * 
+ *   pKey - pointer to variable to receive the input hash
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if the input is not seekable or could
+ *   not be read
+ */
+int cache_digest(FILE *pIn, int64_t *pLen, uint64_t *pKey);
+
+/*
+ * Check whether recording is on.
+ * 
+ * Recording is only on after cache_open() returned CACHE_EDIT, or
+ * returned CACHE_MISS for a seekable input.
+ * 
+ * Return:
+ * 
+ *   non-zero if recording, zero if not
+ */
+int cache_recording(void);
+
+/*
+ * Record a pitch set entity.
+ * 
+ * Recording must be on or a fault occurs.
+ * 
+ * Parameters:
+ * 
+ *   line - the line number of the entity
+ * 
+ *   ps - the pitch set, which is empty for a rest
+ */
+void cache_putPitch(int32_t line, const NVM_PITCHSET *ps);
+
+/*
+ * Record a duration entity.
+ * 
+ * Recording must be on or a fault occurs.
+ * 
+ * Parameters:
+ * 
+ *   line - the line number of the entity
+ * 
+ *   q - the duration in quanta, zero or greater
+ */
+void cache_putDur(int32_t line, int32_t q);
+
+/*
+ * Record an operation.
+ * 
+ * Recording must be on or a fault occurs.
+ * 
+ * c is the first character of the operation token, which identifies
+ * the operation.  v is the integer parameter or articulation number
+ * for operations that have one, and it is ignored for the others.
+ * 
+ * Parameters:
+ * 
+ *   line - the line number of the operation
+ * 
+ *   c - the operation character
+ * 
+ *   v - the parameter of the operation
+ */
+void cache_putOp(int32_t line, int c, int32_t v);
+
+/*
+ * Record an include operation.
+ * 
+ * Recording must be on or a fault occurs.
+ * 
+ * Parameters:
+ * 
+ *   line - the line number of the operation
+ * 
+ *   pPath - the path to the library, as given to incl_run()
+ */
+void cache_putInclude(int32_t line, const char *pPath);
+
+/*
+ * Record the EOF.
+ * 
+ * Recording must be on or a fault occurs.
+ * 
+ * Parameters:
+ * 
+ *   line - the line number of the EOF
+ */
+void cache_putEOF(int32_t line);
+
+/*
+ * Check whether a resume mark is due before the next entity.
+ * 
+ * Recording must be on or a fault occurs.  A mark is due before the
+ * first entity that starts in each block of the filtered input.
+ * 
+ * Parameters:
+ * 
+ *   offs - the offset of the first token of the next entity
+ * 
+ * Return:
+ * 
+ *   non-zero if cache_putMark() should be called, zero if not
+ */
+int cache_wantMark(int64_t offs);
+
+/*
+ * Record a resume mark before the next entity.
+ * 
+ * Recording must be on or a fault occurs.  Marks must be recorded in
+ * input order.
+ * 
+ * The lexer must be at the start of a token at offs, so that tokenizing
+ * can be started again there.
+ * 
+ * Parameters:
+ * 
+ *   offs - the offset of the first token of the next entity
+ * 
+ *   line - the line number of that token
+ */
+void cache_putMark(int64_t offs, int32_t line);
+
+/*
+ * Get the offset to start tokenizing at.
+ * 
+ * For CACHE_EDIT, this is the offset of the mark just after the last
+ * entity that cache_replay() replays, or zero if there is none.
+ * Otherwise, it is zero.
+ * 
+ * Return:
+ * 
+ *   the filtered input offset to seek the token module to
+ */
+int64_t cache_resume(void);
+
+/*
+ * Check whether the rest of the input can be replayed from the cache.
+ * 
+ * offs is the offset of the first token of the next entity that the
+ * entity module is about to interpret.  Offsets must not decrease from
+ * one call to the next.  The return value is non-zero if the input from
+ * offs to the end is unchanged since the cache file was written, and
+ * the cache file has a mark at the same place within it.
+ * Call cache_splice() in that case instead of interpreting the entity.
+ * 
+ * This always returns zero unless cache_open() returned CACHE_EDIT.
+ * 
+ * Parameters:
+ * 
+ *   offs - the offset of the next entity
+ * 
+ * Return:
+ * 
+ *   non-zero if the rest of the input can be replayed, zero if not
+ */
+int cache_sync(int64_t offs);
+
+/*
+ * Replay the rest of the input from the cache.
+ * 
+ * This may only be called once, after cache_sync() returned non-zero,
+ * or a fault occurs.
+ * 
+ * The records from the mark that cache_sync() found to the EOF are
+ * recorded with their offsets and lines adjusted for the edit, and the
+ * entities are replayed through the ir module, including the EOF.
+ * Errors are reported the same way as cache_replay() reports them.
+ * 
+ * Parameters:
+ * 
+ *   line - the line number of the first token of the next entity
+ * 
+ *   pln - pointer to variable to receive the line number in case of
+ *   error
+ * 
+ *   per - pointer to variable to receive the error number in case of
+ *   error
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if error
+ */
+int cache_splice(int32_t line, int32_t *pln, int *per);
+
+/*
+ * Write the recorded entities to the cache file.
+ * 
+ * Recording must be on and the EOF must have been recorded, or a fault
+ * occurs.
+ * 
+ * The cache file is written to a temporary file next to it, which then
+ * replaces it, so that a failed write never leaves a damaged cache
+ * file behind.  Failing to write the cache file is not an error for the
+ * compilation, since the cache is only an optimization.
+ * 
+ * Return:
+ * 
+ *   non-zero if the cache file was written, zero if not
+ */
+int cache_write(void);
+
+/*
+ * Replay entities from the loaded cache file through the ir module.
+ * 
+ * cache_open() must have returned CACHE_HIT or CACHE_EDIT, and this
+ * function may only be called once, or a fault occurs.
+ * 
+ * For CACHE_HIT, all the entities are replayed, including the EOF.
+ * This emits the same instructions as entity_run() would have emitted
+ * for the input.  For CACHE_EDIT, only the entities before the edit are
+ * replayed, and they are also recorded.  The instructions have all been
+ * run when this function returns.
+ * 
+ * If an error occurs, the line number of the entity and the error
+ * number are returned the same way entity_run() returns them.
+ * 
+ * Parameters:
+ * 
+ *   pln - pointer to variable to receive the line number in case of
+ *   error
+ * 
+ *   per - pointer to variable to receive the error number in case of
+ *   error
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if error
+ */
+int cache_replay(int32_t *pln, int *per);
+
+#endif
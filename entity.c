@@ -7,12 +7,26 @@
  */
 
 #include "entity.h"
+#include "cache.h"
+#include "incl.h"
+#include "ir.h"
 #include "nvm.h"
+#include "sidx.h"
 #include "token.h"
 
 #include <stdlib.h>
 #include <string.h>
 
+/*
+ * Constants
+ * =========
+ */
+
+/*
+ * The number of tokens read from the tokenizer at a time.
+ */
+#define ENTITY_BATCH (256)
+
 /*
  * Static data
  * ===========
@@ -23,25 +37,109 @@
  */
 static int m_entity_ran = 0;
 
+/*
+ * Flag indicating whether entities are being recorded in the token
+ * cache.
+ */
+static int m_entity_rec = 0;
+
+/*
+ * The current batch of tokens.
+ * 
+ * m_entity_batchLen is the number of tokens in the batch and
+ * m_entity_batchPos is the index of the next token to return.
+ */
+static TOKEN m_entity_batch[ENTITY_BATCH];
+static int32_t m_entity_batchLen = 0;
+static int32_t m_entity_batchPos = 0;
+
+/*
+ * Flag indicating whether an instruction failed when it was run, and
+ * the input offset of that instruction.
+ * 
+ * Instructions run some time after they are emitted, so the line to
+ * report for an error in one is not the line of the current token.
+ */
+static int m_entity_failed = 0;
+static int64_t m_entity_failPos = 0;
+
 /*
  * Local functions
  * ===============
  */
 
 /* Prototypes */
-static int entity_validAtomicOp(const char *pstr);
-static int entity_intOp(const char *pstr, int32_t *pv);
-static int32_t entity_keyOp(const char *pstr);
+static const TOKEN *entity_next(void);
+static int entity_first(const TOKEN *ptk);
+
+static int entity_validAtomicOp(const TOKEN *ptk);
+static int entity_value(const TOKEN *ptk, int32_t *pv, int *per);
+static int entity_path(const TOKEN *ptk, char *pPath, int *per);
 
-static int entity_onepitch(
-          NVM_PITCHSET * ps,
-    const char         * pstr,
+static int entity_emit(
+          int            op,
+          int32_t        v,
+    const NVM_PITCHSET * ps,
+    const TOKEN        * ptk,
           int          * per);
-static int32_t entity_onedur(const char *pstr, int *per);
+static int32_t entity_line(const TOKEN *ptk);
+
+static int entity_pitch(const TOKEN **pptk, int *per);
+static int entity_dur(const TOKEN **pptk, int *per);
+static int entity_op(const TOKEN *ptk, int *per);
+
+/*
+ * Get the next token.
+ * 
+ * Tokens are read from the tokenizer in batches.  The returned pointer
+ * is only valid until the next call.  After the EOF token or a token
+ * with an error status has been returned, this function must not be
+ * called again.
+ * 
+ * Return:
+ * 
+ *   the next token
+ */
+static const TOKEN *entity_next(void) {
+  
+  /* Read another batch if the current one is used up */
+  if (m_entity_batchPos >= m_entity_batchLen) {
+    m_entity_batchLen = token_readBatch(m_entity_batch, ENTITY_BATCH);
+    m_entity_batchPos = 0;
+  }
+  
+  /* Return the next token */
+  return &(m_entity_batch[m_entity_batchPos++]);
+}
 
-static int entity_pitch(TOKEN *ptk, int *per);
-static int entity_dur(TOKEN *ptk, int *per);
-static int entity_op(const char *pstr, int *per);
+/*
+ * Get the first character of a token.
+ * 
+ * Parameters:
+ * 
+ *   ptk - the token
+ * 
+ * Return:
+ * 
+ *   the first character, or zero if the token is empty
+ */
+static int entity_first(const TOKEN *ptk) {
+  
+  int c = 0;
+  
+  /* Check parameter */
+  if (ptk == NULL) {
+    abort();
+  }
+  
+  /* Get first character if there is one */
+  if (ptk->len > 0) {
+    c = token_text(ptk)[0];
+  }
+  
+  /* Return character */
+  return c;
+}
 
 /*
  * Verify that the given token is a valid atomic operation.
@@ -50,23 +148,23 @@ static int entity_op(const char *pstr, int *per);
  * 
  * Parameters:
  * 
- *   pstr - the token to validate
+ *   ptk - the token to validate
  * 
  * Return:
  * 
  *   non-zero if valid, zero if not
  */
-static int entity_validAtomicOp(const char *pstr) {
+static int entity_validAtomicOp(const TOKEN *ptk) {
   
   int status = 1;
   
   /* Check parameter */
-  if (pstr == NULL) {
+  if (ptk == NULL) {
     abort();
   }
   
   /* Validate length */
-  if (strlen(pstr) != 1) {
+  if (ptk->len != 1) {
     status = 0;
   }
   
@@ -75,126 +173,42 @@ static int entity_validAtomicOp(const char *pstr) {
 }
 
 /*
- * Get the signed integer parameter from the given integer parameter
- * operation token.
+ * Get the decoded value of a pitch, duration, or operation token.
  * 
- * pstr is the token, and pv points to the variable to receive the
- * integer parameter if successful.
+ * The token module decodes each token in the same pass that lexes it,
+ * so the semitones of a pitch, the quanta of a duration, the integer
+ * parameter of a parameter operation, and the articulation number of a
+ * key operation are all ready in the token structure.  If the token
+ * could not be decoded, the error that decoding found is reported
+ * instead.
  * 
  * Parameters:
  * 
- *   pstr - the token
+ *   ptk - the token
  * 
- *   pv - pointer to variable to receive integer parameter
+ *   pv - pointer to variable to receive the value
+ * 
+ *   per - pointer to variable to receive error code
  * 
  * Return:
  * 
- *   non-zero if successful, zero if invalid token
+ *   non-zero if successful, zero if error
  */
-static int entity_intOp(const char *pstr, int32_t *pv) {
+static int entity_value(const TOKEN *ptk, int32_t *pv, int *per) {
   
   int status = 1;
-  size_t slen = 0;
-  int negflag = 0;
-  int c = 0;
-  int32_t result = 0;
   
   /* Check parameters */
-  if ((pstr == NULL) || (pv == NULL)) {
+  if ((ptk == NULL) || (pv == NULL) || (per == NULL)) {
     abort();
   }
   
-  /* Get token length */
-  slen = strlen(pstr);
-  
-  /* There must be at least three characters */
-  if (slen < 3) {
+  /* Get the value or the decoding error */
+  if (ptk->vstatus == ERR_OK) {
+    *pv = ptk->value;
+  } else {
     status = 0;
-  }
-  
-  /* Last character must be a semicolon */
-  if (status) {
-    if (pstr[slen - 1] != ASCII_SEMICOL) {
-      status = 0;
-    }
-  }
-  
-  /* If the second character is a sign, there must be at least four
-   * characters */
-  if (status) {
-    if ((pstr[1] == ASCII_PLUS) || (pstr[1] == ASCII_HYPHEN)) {
-      if (slen < 4) {
-        status = 0;
-      }
-    }
-  }
-  
-  /* Advance pointer to first character of parameter */
-  if (status) {
-    pstr++;
-  }
-  
-  /* If first character is sign, update negflag and advance */
-  if (status) {
-    if (*pstr == ASCII_PLUS) {
-      negflag = 0;
-      pstr++;
-    } else if (*pstr == ASCII_HYPHEN) {
-      negflag = 1;
-      pstr++;
-    }
-  }
-  
-  /* Parse the numeric value */
-  if (status) {
-    for( ; *pstr != ASCII_SEMICOL; pstr++) {
-      
-      /* Get current character */
-      c = *pstr;
-      
-      /* Character must be decimal digit */
-      if ((c < ASCII_ZERO) || (c > ASCII_NINE)) {
-        status = 0;
-      }
-      
-      /* Convert character to numeric value */
-      if (status) {
-        c = c - ASCII_ZERO;
-      }
-      
-      /* Multiply result by ten, watching for overflow */
-      if (status) {
-        if (result <= INT32_MAX / 10) {
-          result *= 10;
-        } else {
-          status = 0; /* overflow */
-        }
-      }
-      
-      /* Add current digit in, watching for overflow */
-      if (status) {
-        if (result <= INT32_MAX - c) {
-          result += (int32_t) c;
-        } else {
-          status = 0; /* overflow */
-        }
-      }
-      
-      /* Leave loop if error */
-      if (!status) {
-        break;
-      }
-    }
-  }
-  
-  /* Flip sign if negflag is on */
-  if (status && negflag) {
-    result = -(result);
-  }
-  
-  /* Store result if successful */
-  if (status) {
-    *pv = result;
+    *per = ptk->vstatus;
   }
   
   /* Return status */
@@ -202,80 +216,75 @@ static int entity_intOp(const char *pstr, int32_t *pv) {
 }
 
 /*
- * Get the articulation key from the given key operation token.
+ * Get the library path of an include operation token.
  * 
- * pstr is the token, which will be validated to have a length exactly
- * two.
+ * The path is everything between the operation character and the
+ * final semicolon, which must be at least one character.  The token
+ * decoder treats the path as an integer parameter, so the decoded
+ * value of the token is ignored.
  * 
  * Parameters:
  * 
- *   pstr - the token
+ *   ptk - the token
+ * 
+ *   pPath - the buffer to receive the nul-terminated path, which must
+ *   have room for INCL_MAXPATH + 1 characters
+ * 
+ *   per - pointer to variable to receive error code
  * 
  * Return:
  * 
- *   the numeric articulation key, or -1 if invalid token
+ *   non-zero if successful, zero if error
  */
-static int32_t entity_keyOp(const char *pstr) {
+static int entity_path(const TOKEN *ptk, char *pPath, int *per) {
   
   int status = 1;
-  int32_t result = 0;
-  int c = 0;
+  const char *pc = NULL;
   
-  /* Check parameter */
-  if (pstr == NULL) {
+  /* Check parameters */
+  if ((ptk == NULL) || (pPath == NULL) || (per == NULL)) {
     abort();
   }
   
-  /* Token must have exactly two characters */
-  if (strlen(pstr) != 2) {
+  /* Token must be the operation character, the path, and the
+   * semicolon */
+  pc = token_text(ptk);
+  if ((ptk->len < 3) || (ptk->len - 2 > INCL_MAXPATH) ||
+      (pc[ptk->len - 1] != ASCII_SEMICOL)) {
     status = 0;
+    *per = ERR_BADOP;
   }
   
-  /* Decode articulation key */
+  /* Copy the path */
   if (status) {
-    c = pstr[1];
-    if ((c >= ASCII_ZERO) && (c <= ASCII_NINE)) {
-      /* 0 through 9 */
-      result = (int32_t) (c - ASCII_ZERO);
-      
-    } else if ((c >= ASCII_A_UPPER) && (c <= ASCII_Z_UPPER)) {
-      /* A through Z */
-      result = (int32_t) ((c - ASCII_A_UPPER) + 10);
-      
-    } else if ((c >= ASCII_A_LOWER) && (c <= ASCII_Z_LOWER)) {
-      /* a through z */
-      result = (int32_t) ((c - ASCII_A_LOWER) + 36);
-      
-    } else {
-      /* Invalid articulation key */
-      status = 0;
-    }
+    memcpy(pPath, &(pc[1]), (size_t) (ptk->len - 2));
+    pPath[ptk->len - 2] = 0;
   }
   
-  /* If failure, set result to -1 */
-  if (!status) {
-    result = -1;
-  }
-  
-  /* Return result */
-  return result;
+  /* Return status */
+  return status;
 }
 
 /*
- * Decode a single pitch and add it to the given pitch set.
- * 
- * ps is the pitch set to add the pitch to.
+ * Emit an instruction for an entity.
  * 
- * pstr points to the token to decode.  It may NOT be a pitch set
- * parenthesis or a rest.
+ * op is the opcode, v is the parameter, and ps is the pitch set, which
+ * is only used for NVM_OP_PSET and may be NULL otherwise.  ptk is the
+ * last token of the entity, which gives the position of the
+ * instruction.
  * 
- * per points to a variable to receive an error code in case of error.
+ * If an instruction fails when the pending batch is run, its position
+ * is remembered for entity_line().
  * 
  * Parameters:
  * 
- *   ps - the pitch set to modify
+ *   op - the opcode
  * 
- *   pstr - the pitch token to decode
+ *   v - the parameter
+ * 
+ *   ps - the pitch set, or NULL
+ * 
+ *   ptk - the last token of the entity
  * 
  *   per - pointer to variable to receive error code
  * 
@@ -283,189 +292,34 @@ static int32_t entity_keyOp(const char *pstr) {
  * 
  *   non-zero if successful, zero if error
  */
-static int entity_onepitch(
-          NVM_PITCHSET * ps,
-    const char         * pstr,
+static int entity_emit(
+          int            op,
+          int32_t        v,
+    const NVM_PITCHSET * ps,
+    const TOKEN        * ptk,
           int          * per) {
   
-  int c = 0;
-  int32_t pitch = 0;
   int status = 1;
+  NVM_INSTR ins;
   
   /* Check parameters */
-  if ((ps == NULL) || (pstr == NULL) || (per == NULL)) {
+  if ((ptk == NULL) || (per == NULL) ||
+      ((op == NVM_OP_PSET) && (ps == NULL))) {
     abort();
   }
   
-  /* Get the first character */
-  c = pstr[0];
-  
-  /* Get the starting pitch based on the first character */
-  switch (c) {
-    case ASCII_C_UPPER:
-      pitch = -12;
-      break;
-    
-    case ASCII_D_UPPER:
-      pitch = -10;
-      break;
-    
-    case ASCII_E_UPPER:
-      pitch = -8;
-      break;
-    
-    case ASCII_F_UPPER:
-      pitch = -7;
-      break;
-    
-    case ASCII_G_UPPER:
-      pitch = -5;
-      break;
-    
-    case ASCII_A_UPPER:
-      pitch = -3;
-      break;
-    
-    case ASCII_B_UPPER:
-      pitch = -1;
-      break;
-    
-    case ASCII_C_LOWER:
-      pitch = 0;
-      break;
-    
-    case ASCII_D_LOWER:
-      pitch = 2;
-      break;
-    
-    case ASCII_E_LOWER:
-      pitch = 4;
-      break;
-    
-    case ASCII_F_LOWER:
-      pitch = 5;
-      break;
-    
-    case ASCII_G_LOWER:
-      pitch = 7;
-      break;
-    
-    case ASCII_A_LOWER:
-      pitch = 9;
-      break;
-    
-    case ASCII_B_LOWER:
-      pitch = 11;
-      break;
-    
-    default:
-      status = 0;
-      *per = ERR_BADPITCH;
-  }
-  
-  /* Any remaining characters adjust the pitch */
-  if (status) {
-    for(pstr++; *pstr != 0; pstr++) {
-      
-      /* Get current character */
-      c = *pstr;
-      
-      /* If uppercase letter, change to lowercase */
-      if ((c >= ASCII_A_UPPER) && (c <= ASCII_Z_UPPER)) {
-        c = c + (ASCII_A_LOWER - ASCII_A_UPPER);
-      }
-      
-      /* Interpret modifier */
-      switch (c) {
-        
-        case ASCII_X_LOWER:
-          /* Double-sharp */
-          if (pitch <= INT32_MAX - 2) {
-            pitch += 2;
-          } else {
-            status = 0;
-            *per = ERR_PITCHR;
-          }
-          break;
-        
-        case ASCII_S_LOWER:
-          /* Sharp */
-          if (pitch <= INT32_MAX - 1) {
-            pitch++;
-          } else {
-            status = 0;
-            *per = ERR_PITCHR;
-          }
-          break;
-        
-        case ASCII_N_LOWER:
-          /* Natural -- do nothing */
-          break;
-        
-        case ASCII_H_LOWER:
-          /* Flat */
-          if (pitch >= INT32_MIN + 1) {
-            pitch--;
-          } else {
-            status = 0;
-            *per = ERR_PITCHR;
-          }
-          break;
-        
-        case ASCII_T_LOWER:
-          /* Double-flat */
-          if (pitch >= INT32_MIN + 2) {
-            pitch -= 2;
-          } else {
-            status = 0;
-            *per = ERR_PITCHR;
-          }
-          break;
-        
-        case ASCII_APOS:
-          /* Up one octave */
-          if (pitch <= INT32_MAX - 12) {
-            pitch += 12;
-          } else {
-            status = 0;
-            *per = ERR_PITCHR;
-          }
-          break;
-        
-        case ASCII_COMMA:
-          /* Down one ocatve */
-          if (pitch >= INT32_MIN + 12) {
-            pitch -= 12;
-          } else {
-            status = 0;
-            *per = ERR_PITCHR;
-          }
-          break;
-        
-        default:
-          /* Unrecognized modifier */
-          status = 0;
-          *per = ERR_BADPITCH;
-      }
-      
-      /* Leave loop if error */
-      if (!status) {
-        break;
-      }
-    }
-  }
-  
-  /* Make sure resulting pitch is in range */
-  if (status) {
-    if ((pitch < NMF_MINPITCH) || (pitch > NMF_MAXPITCH)) {
-      status = 0;
-      *per = ERR_PITCHR;
-    }
+  /* Build the instruction */
+  ins.op = op;
+  ins.v = v;
+  ins.pos = ptk->offset;
+  if (op == NVM_OP_PSET) {
+    memcpy(&(ins.ps), ps, sizeof(NVM_PITCHSET));
   }
   
-  /* Add pitch to set */
-  if (status) {
-    nvm_pitchset_add(ps, pitch);
+  /* Emit it */
+  if (!ir_emit(&ins, &m_entity_failPos, per)) {
+    status = 0;
+    m_entity_failed = 1;
   }
   
   /* Return status */
@@ -473,164 +327,53 @@ static int entity_onepitch(
 }
 
 /*
- * Decode a single duration token into a quanta count.
+ * Get the line number to report for an error.
  * 
- * pstr points to the token to decode.  It may NOT be a rhythm group
- * bracket.
- * 
- * The return value is the number of quanta represented by the token, or
- * zero if a grace note, or -1 if an error.
- * 
- * per points to a variable to receive an error code in case of error.
+ * If an instruction failed when it was run, this is the line of that
+ * instruction.  Otherwise, it is the line of the given token, which is
+ * the token where the error was found.
  * 
  * Parameters:
  * 
- *   pstr - the duration token to decode
- * 
- *   per - pointer to variable to receive error code
+ *   ptk - the current token
  * 
  * Return:
  * 
- *   the number of quanta, or zero for grace note, or -1 for error
+ *   the line number of the error
  */
-static int32_t entity_onedur(const char *pstr, int *per) {
+static int32_t entity_line(const TOKEN *ptk) {
   
-  size_t slen = 0;
-  int status = 1;
-  int32_t result = 0;
+  int32_t line = 0;
   
-  /* Check parameters */
-  if ((pstr == NULL) || (per == NULL)) {
+  /* Check parameter */
+  if (ptk == NULL) {
     abort();
   }
   
-  /* Get string length, excluding terminating nul */
-  slen = strlen(pstr);
-  
-  /* String length must be either one or two */
-  if ((slen < 1) || (slen > 2)) {
-    status = 0;
-    *per = ERR_BADDUR;
-  }
-  
-  /* First character must be decimal integer */
-  if (status) {
-    if ((pstr[0] < ASCII_ZERO) || (pstr[0] > ASCII_NINE)) {
-      status = 0;
-      *per = ERR_BADDUR;
-    }
-  }
-  
-  /* Get numeric value of first character */
-  if (status) {
-    result = (pstr[0] - ASCII_ZERO);
-  }
-  
-  /* Look up appropriate quanta value */
-  if (status) {
-    switch (result) {
-      
-      case 0:
-        /* Grace note, make sure no suffix */
-        if (slen > 1) {
-          status = 0;
-          *per = ERR_BADDUR;
-        }
-        break;
-      
-      case 1:
-        /* 64th note */
-        result = 6;
-        break;
-      
-      case 2:
-        /* 32nd note */
-        result = 12;
-        break;
-      
-      case 3:
-        /* 16th note */
-        result = 24;
-        break;
-      
-      case 4:
-        /* 8th note */
-        result = 48;
-        break;
-      
-      case 5:
-        /* Quarter note */
-        result = 96;
-        break;
-      
-      case 6:
-        /* Half note */
-        result = 192;
-        break;
-      
-      case 7:
-        /* Whole note */
-        result = 384;
-        break;
-      
-      case 8:
-        /* Eighth triplet */
-        result = 32;
-        break;
-      
-      case 9:
-        /* Quarter triplet */
-        result = 64;
-        break;
-      
-      default:
-        /* Shouldn't happen */
-        abort();
-    }
-  }
-    
-  /* If suffix, interpret it */
-  if (status && (slen > 1)) {
-    if (pstr[1] == ASCII_APOS) {
-      /* Apostrophe -- double duration */
-      result *= 2;
-      
-    } else if (pstr[1] == ASCII_PERIOD) {
-      /* Period -- add half a value */
-      result = result + (result / 2);
-      
-    } else if (pstr[1] == ASCII_COMMA) {
-      /* Comma -- halve the duration */
-      result /= 2;
-      
-    } else {
-      /* Unknown suffix */
-      status = 0;
-      *per = ERR_BADDUR;
-    }
-  }
-  
-  /* If error, set result to -1 */
-  if (!status) {
-    result = -1;
+  /* Get the line of the failed instruction or of the token */
+  if (m_entity_failed) {
+    line = token_lineOf(m_entity_failPos);
+  } else {
+    line = token_line(ptk);
   }
   
-  /* Return result */
-  return result;
+  /* Return line number */
+  return line;
 }
 
 /*
  * Interpret a pitch token, possibly reading further tokens in the case
  * of a pitch set.
  * 
- * ptk points to the token structure containing the pitch token that was
- * read.  Additional tokens might be read with this token structure.
+ * pptk points to a pointer to the pitch token that was read.  Additional
+ * tokens might be read, in which case the pointer is updated to the
+ * last token that was read.
  * 
  * per points to a variable to receive an error code in case of error.
  * 
  * Parameters:
  * 
- *   ptk - pointer to pitch token
+ *   pptk - pointer to pointer to pitch token
  * 
  *   per - pointer to variable to receive error code
  * 
@@ -638,27 +381,33 @@ static int32_t entity_onedur(const char *pstr, int *per) {
  * 
  *   non-zero if successful, zero if error
  */
-static int entity_pitch(TOKEN *ptk, int *per) {
+static int entity_pitch(const TOKEN **pptk, int *per) {
   
   NVM_PITCHSET pset;
+  const TOKEN *ptk = NULL;
   int c = 0;
   int status = 1;
   int32_t depth = 0;
+  int32_t v = 0;
   
   /* Initialize structure */
   nvm_pitchset_clear(&pset);
   
   /* Check parameters */
-  if ((ptk == NULL) || (per == NULL)) {
+  if ((pptk == NULL) || (per == NULL)) {
+    abort();
+  }
+  ptk = *pptk;
+  if (ptk == NULL) {
     abort();
   }
   
   /* Check whether we have a single pitch, a rest, or a pitch set */
-  c = (ptk->str)[0];
+  c = entity_first(ptk);
   
   if ((c == ASCII_R_UPPER) || (c == ASCII_R_LOWER)) {
     /* We have a rest, so report the empty pitch set */
-    if (!nvm_pset(&pset, per)) {
+    if (!entity_emit(NVM_OP_PSET, 0, &pset, ptk, per)) {
       status = 0;
     }
     
@@ -670,14 +419,16 @@ static int entity_pitch(TOKEN *ptk, int *per) {
     while (depth > 0) {
       
       /* Read another token */
-      if (!token_read(ptk)) {
+      ptk = entity_next();
+      *pptk = ptk;
+      if (ptk->status != ERR_OK) {
         status = 0;
         *per = ptk->status;
       }
       
       /* Interpret the token */
       if (status) {
-        c = (ptk->str)[0];
+        c = entity_first(ptk);
         
         if (c == ASCII_LPAREN) {
           /* Left parenthesis -- increase nesting depth, watching for
@@ -703,10 +454,12 @@ static int entity_pitch(TOKEN *ptk, int *per) {
         } else if (((c >= ASCII_A_LOWER) && (c <= ASCII_G_LOWER)) ||
                     ((c >= ASCII_A_UPPER) && (c <= ASCII_G_UPPER))) {
           /* Individual pitch token -- add it to the set */
-          if (!entity_onepitch(&pset, ptk->str, per)) {
+          if (entity_value(ptk, &v, per)) {
+            nvm_pitchset_add(&pset, v);
+          } else {
             status = 0;
           }
-        
+          
         } else {
           /* Non-pitch token in pitch group */
           status = 0;
@@ -722,34 +475,41 @@ static int entity_pitch(TOKEN *ptk, int *per) {
     
     /* Report the full pitch set */
     if (status) {
-      if (!nvm_pset(&pset, per)) {
+      if (!entity_emit(NVM_OP_PSET, 0, &pset, ptk, per)) {
         status = 0;
       }
     }
-  
+    
   } else if (c == ASCII_RPAREN) {
     /* This shouldn't happen */
     abort();
-  
+    
   } else if (((c >= ASCII_A_LOWER) && (c <= ASCII_G_LOWER)) ||
               ((c >= ASCII_A_UPPER) && (c <= ASCII_G_UPPER))) {
     /* We have a single pitch -- add it to pitch set */
-    if (!entity_onepitch(&pset, ptk->str, per)) {
+    if (entity_value(ptk, &v, per)) {
+      nvm_pitchset_add(&pset, v);
+    } else {
       status = 0;
     }
     
     /* Report the single pitch */
     if (status) {
-      if (!nvm_pset(&pset, per)) {
+      if (!entity_emit(NVM_OP_PSET, 0, &pset, ptk, per)) {
         status = 0;
       }
     }
-  
+    
   } else {
     /* This shouldn't happen */
     abort();
   }
   
+  /* Record the pitch set in the token cache */
+  if (status && m_entity_rec) {
+    cache_putPitch(token_line(*pptk), &pset);
+  }
+  
   /* Return status */
   return status;
 }
@@ -758,14 +518,15 @@ static int entity_pitch(TOKEN *ptk, int *per) {
  * Interpret a duration token, possibly reading further tokens in the
  * case of a rhythm group.
  * 
- * ptk points to the token structure containing the duration token that
- * was read.  Additional tokens might be read with this token structure.
+ * pptk points to a pointer to the duration token that was read.
+ * Additional tokens might be read, in which case the pointer is updated
+ * to the last token that was read.
  * 
  * per points to a variable to receive an error code in case of error.
  * 
  * Parameters:
  * 
- *   ptk - pointer to duration token
+ *   pptk - pointer to pointer to duration token
  * 
  *   per - pointer to variable to receive error code
  * 
@@ -773,8 +534,9 @@ static int entity_pitch(TOKEN *ptk, int *per) {
  * 
  *   non-zero if successful, zero if error
  */
-static int entity_dur(TOKEN *ptk, int *per) {
+static int entity_dur(const TOKEN **pptk, int *per) {
   
+  const TOKEN *ptk = NULL;
   int32_t dur = 0;
   int32_t d = 0;
   int c = 0;
@@ -782,12 +544,16 @@ static int entity_dur(TOKEN *ptk, int *per) {
   int32_t depth = 0;
   
   /* Check parameters */
-  if ((ptk == NULL) || (per == NULL)) {
+  if ((pptk == NULL) || (per == NULL)) {
+    abort();
+  }
+  ptk = *pptk;
+  if (ptk == NULL) {
     abort();
   }
   
   /* Check whether we have a single duration or a rhythm group */
-  c = (ptk->str)[0];
+  c = entity_first(ptk);
   
   if (c == ASCII_LSQUARE) {
     /* We have a rhythm group -- set the nesting depth to one */
@@ -797,14 +563,16 @@ static int entity_dur(TOKEN *ptk, int *per) {
     while (depth > 0) {
       
       /* Read another token */
-      if (!token_read(ptk)) {
+      ptk = entity_next();
+      *pptk = ptk;
+      if (ptk->status != ERR_OK) {
         status = 0;
         *per = ptk->status;
       }
       
       /* Interpret the token */
       if (status) {
-        c = (ptk->str)[0];
+        c = entity_first(ptk);
         
         if (c == ASCII_LSQUARE) {
           /* Left square bracket -- increase nesting depth, watching for
@@ -825,9 +593,8 @@ static int entity_dur(TOKEN *ptk, int *per) {
           }
           
         } else if ((c >= ASCII_ZERO) && (c <= ASCII_NINE)) {
-          /* Individual duration token -- decode it first */
-          d = entity_onedur(ptk->str, per);
-          if (d < 0) {
+          /* Individual duration token -- get its quanta first */
+          if (!entity_value(ptk, &d, per)) {
             status = 0;
           }
           
@@ -846,7 +613,7 @@ static int entity_dur(TOKEN *ptk, int *per) {
               *per = ERR_LONGDUR;
             }
           }
-        
+          
         } else {
           /* Non-duration token in rhythm group */
           status = 0;
@@ -862,34 +629,38 @@ static int entity_dur(TOKEN *ptk, int *per) {
     
     /* Report the full duration */
     if (status) {
-      if (!nvm_dur(dur, per)) {
+      if (!entity_emit(NVM_OP_DUR, dur, NULL, ptk, per)) {
         status = 0;
       }
     }
-  
+    
   } else if (c == ASCII_RSQUARE) {
     /* This shouldn't happen */
     abort();
-  
+    
   } else if ((c >= ASCII_ZERO) && (c <= ASCII_NINE)) {
-    /* We have a single duration -- decode it */
-    dur = entity_onedur(ptk->str, per);
-    if (dur < 0) {
+    /* We have a single duration -- get its quanta */
+    if (!entity_value(ptk, &dur, per)) {
       status = 0;
     }
     
     /* Report the single duration */
     if (status) {
-      if (!nvm_dur(dur, per)) {
+      if (!entity_emit(NVM_OP_DUR, dur, NULL, ptk, per)) {
         status = 0;
       }
     }
-  
+    
   } else {
     /* This shouldn't happen */
     abort();
   }
   
+  /* Record the duration in the token cache */
+  if (status && m_entity_rec) {
+    cache_putDur(token_line(*pptk), dur);
+  }
+  
   /* Return status */
   return status;
 }
@@ -897,13 +668,13 @@ static int entity_dur(TOKEN *ptk, int *per) {
 /*
  * Interpret an operation token.
  * 
- * pstr points to the operation token to interpret.
+ * ptk is the operation token to interpret.
  * 
  * per points to a variable to receive an error code in case of error.
  * 
  * Parameters:
  * 
- *   pstr - the operation token
+ *   ptk - the operation token
  * 
  *   per - variable to receive an error code in case of error
  * 
@@ -911,36 +682,40 @@ static int entity_dur(TOKEN *ptk, int *per) {
  * 
  *   non-zero if successful, zero if error
  */
-static int entity_op(const char *pstr, int *per) {
+static int entity_op(const TOKEN *ptk, int *per) {
   
   int status = 1;
   int c = 0;
   int32_t v = 0;
+  char path[INCL_MAXPATH + 1];
+  
+  /* Initialize buffer */
+  memset(path, 0, sizeof(path));
   
   /* Check parameters */
-  if ((pstr == NULL) || (per == NULL)) {
+  if ((ptk == NULL) || (per == NULL)) {
     abort();
   }
   
   /* Token must have at least one character */
-  if (pstr[0] == 0) {
+  if (ptk->len < 1) {
     status = 0;
     *per = ERR_BADOP;
   }
   
   /* Get first character */
   if (status) {
-    c = pstr[0];
+    c = entity_first(ptk);
   }
   
   /* Handle specific operator */
   if (status) {
     switch (c) {
-    
+      
       case ASCII_SLASH:
         /* Repeater operation */
-        if (entity_validAtomicOp(pstr)) {
-          if (!nvm_op_repeat(per)) {
+        if (entity_validAtomicOp(ptk)) {
+          if (!entity_emit(NVM_OP_REPEAT, 0, NULL, ptk, per)) {
             status = 0;
           }
         
@@ -949,14 +724,16 @@ static int entity_op(const char *pstr, int *per) {
           *per = ERR_BADOP;
         }
         break;
-    
+      
       case ASCII_DOLLAR:
-        /* Section begin operation */
-        if (entity_validAtomicOp(pstr)) {
-          if (!nvm_op_section(per)) {
+        /* Section begin operation, which the section index records */
+        if (entity_validAtomicOp(ptk)) {
+          if (!entity_emit(NVM_OP_SECTION, 0, NULL, ptk, per)) {
             status = 0;
+          } else {
+            sidx_mark(ptk->offset);
           }
-          
+        
         } else {
           status = 0;
           *per = ERR_BADOP;
@@ -965,24 +742,24 @@ static int entity_op(const char *pstr, int *per) {
       
       case ASCII_ATSIGN:
         /* Return operation */
-        if (entity_validAtomicOp(pstr)) {
-          if (!nvm_op_return(per)) {
+        if (entity_validAtomicOp(ptk)) {
+          if (!entity_emit(NVM_OP_RETURN, 0, NULL, ptk, per)) {
             status = 0;
           }
-          
+        
         } else {
           status = 0;
           *per = ERR_BADOP;
         }
         break;
-    
+      
       case ASCII_LCURLY:
         /* Push location operation */
-        if (entity_validAtomicOp(pstr)) {
-          if (!nvm_op_pushloc(per)) {
+        if (entity_validAtomicOp(ptk)) {
+          if (!entity_emit(NVM_OP_PUSHLOC, 0, NULL, ptk, per)) {
             status = 0;
           }
-          
+        
         } else {
           status = 0;
           *per = ERR_BADOP;
@@ -991,11 +768,11 @@ static int entity_op(const char *pstr, int *per) {
       
       case ASCII_COLON:
         /* Return to location operation */
-        if (entity_validAtomicOp(pstr)) {
-          if (!nvm_op_retloc(per)) {
+        if (entity_validAtomicOp(ptk)) {
+          if (!entity_emit(NVM_OP_RETLOC, 0, NULL, ptk, per)) {
             status = 0;
           }
-          
+        
         } else {
           status = 0;
           *per = ERR_BADOP;
@@ -1004,11 +781,11 @@ static int entity_op(const char *pstr, int *per) {
       
       case ASCII_RCURLY:
         /* Pop location operation */
-        if (entity_validAtomicOp(pstr)) {
-          if (!nvm_op_poploc(per)) {
+        if (entity_validAtomicOp(ptk)) {
+          if (!entity_emit(NVM_OP_POPLOC, 0, NULL, ptk, per)) {
             status = 0;
           }
-          
+        
         } else {
           status = 0;
           *per = ERR_BADOP;
@@ -1017,11 +794,11 @@ static int entity_op(const char *pstr, int *per) {
       
       case ASCII_EQUALS:
         /* Pop transposition operation */
-        if (entity_validAtomicOp(pstr)) {
-          if (!nvm_op_poptrans(per)) {
+        if (entity_validAtomicOp(ptk)) {
+          if (!entity_emit(NVM_OP_POPTRANS, 0, NULL, ptk, per)) {
             status = 0;
           }
-          
+        
         } else {
           status = 0;
           *per = ERR_BADOP;
@@ -1030,11 +807,11 @@ static int entity_op(const char *pstr, int *per) {
       
       case ASCII_TILDE:
         /* Pop articulation operation */
-        if (entity_validAtomicOp(pstr)) {
-          if (!nvm_op_popart(per)) {
+        if (entity_validAtomicOp(ptk)) {
+          if (!entity_emit(NVM_OP_POPART, 0, NULL, ptk, per)) {
             status = 0;
           }
-          
+        
         } else {
           status = 0;
           *per = ERR_BADOP;
@@ -1043,11 +820,24 @@ static int entity_op(const char *pstr, int *per) {
       
       case ASCII_HYPHEN:
         /* Pop layer operation */
-        if (entity_validAtomicOp(pstr)) {
-          if (!nvm_op_poplayer(per)) {
+        if (entity_validAtomicOp(ptk)) {
+          if (!entity_emit(NVM_OP_POPLAYER, 0, NULL, ptk, per)) {
             status = 0;
           }
-          
+        
+        } else {
+          status = 0;
+          *per = ERR_BADOP;
+        }
+        break;
+      
+      case ASCII_LT:
+        /* Repeat block begin operation */
+        if (entity_validAtomicOp(ptk)) {
+          if (!entity_emit(NVM_OP_BEGIN, 0, NULL, ptk, per)) {
+            status = 0;
+          }
+        
         } else {
           status = 0;
           *per = ERR_BADOP;
@@ -1056,94 +846,110 @@ static int entity_op(const char *pstr, int *per) {
       
       case ASCII_BSLASH:
         /* Multiple repeater operation */
-        if (entity_intOp(pstr, &v)) {
-          if (!nvm_op_multiple(v, per)) {
+        if (entity_value(ptk, &v, per)) {
+          if (!entity_emit(NVM_OP_MULTIPLE, v, NULL, ptk, per)) {
             status = 0;
           }
-          
+        
         } else {
           status = 0;
-          *per = ERR_BADOP;
         }
         break;
-    
+      
+      case ASCII_GT:
+        /* Repeat block end operation */
+        if (entity_value(ptk, &v, per)) {
+          if (!entity_emit(NVM_OP_END, v, NULL, ptk, per)) {
+            status = 0;
+          }
+        
+        } else {
+          status = 0;
+        }
+        break;
+      
       case ASCII_CARET:
         /* Push transposition operation */
-        if (entity_intOp(pstr, &v)) {
-          if (!nvm_op_pushtrans(v, per)) {
+        if (entity_value(ptk, &v, per)) {
+          if (!entity_emit(NVM_OP_PUSHTRANS, v, NULL, ptk, per)) {
             status = 0;
           }
-          
+        
         } else {
           status = 0;
-          *per = ERR_BADOP;
         }
         break;
       
       case ASCII_AMP:
         /* Set base layer operation */
-        if (entity_intOp(pstr, &v)) {
-          if (!nvm_op_setbase(v, per)) {
+        if (entity_value(ptk, &v, per)) {
+          if (!entity_emit(NVM_OP_SETBASE, v, NULL, ptk, per)) {
             status = 0;
           }
-          
+        
         } else {
           status = 0;
-          *per = ERR_BADOP;
         }
         break;
       
       case ASCII_PLUS:
         /* Push layer operation */
-        if (entity_intOp(pstr, &v)) {
-          if (!nvm_op_pushlayer(v, per)) {
+        if (entity_value(ptk, &v, per)) {
+          if (!entity_emit(NVM_OP_PUSHLAYER, v, NULL, ptk, per)) {
             status = 0;
           }
-          
+        
         } else {
           status = 0;
-          *per = ERR_BADOP;
         }
         break;
       
       case ASCII_GRACC:
         /* Cue operation */
-        if (entity_intOp(pstr, &v)) {
-          if (!nvm_op_cue(v, per)) {
+        if (entity_value(ptk, &v, per)) {
+          if (!entity_emit(NVM_OP_CUE, v, NULL, ptk, per)) {
             status = 0;
           }
-          
+        
+        } else {
+          status = 0;
+        }
+        break;
+      
+      case ASCII_PERCENT:
+        /* Include operation */
+        if (entity_path(ptk, path, per)) {
+          if (!incl_run(path, ptk->offset, &m_entity_failPos, per)) {
+            status = 0;
+            m_entity_failed = 1;
+          }
+        
         } else {
           status = 0;
-          *per = ERR_BADOP;
         }
         break;
       
       case ASCII_STAR:
         /* Immediate articulation operation */
-        v = entity_keyOp(pstr);
-        if (v >= 0) {
-          if (!nvm_op_immart((int) v, per)) {
+        if (entity_value(ptk, &v, per)) {
+          if (!entity_emit(NVM_OP_IMMART, v, NULL, ptk, per)) {
             status = 0;
           }
         
         } else {
           status = 0;
-          *per = ERR_BADOP;
         }
         break;
       
       case ASCII_EXCLAIM:
         /* Push articulation operation */
-        v = entity_keyOp(pstr);
-        if (v >= 0) {
-          if (!nvm_op_pushart((int) v, per)) {
+        if (entity_value(ptk, &v, per)) {
+          if (!entity_emit(NVM_OP_PUSHART, v, NULL, ptk, per)) {
             status = 0;
           }
         
         } else {
           status = 0;
-          *per = ERR_BADOP;
         }
         break;
       
@@ -1154,6 +960,15 @@ static int entity_op(const char *pstr, int *per) {
     }
   }
   
+  /* Record the operation in the token cache */
+  if (status && m_entity_rec) {
+    if (c == ASCII_PERCENT) {
+      cache_putInclude(token_line(ptk), path);
+    } else {
+      cache_putOp(token_line(ptk), c, v);
+    }
+  }
+  
   /* Return status */
   return status;
 }
@@ -1169,14 +984,12 @@ static int entity_op(const char *pstr, int *per) {
  * entity_run function.
  */
 int entity_run(int32_t *pln, int *per) {
-
-  TOKEN tk;
-  int retval = 0;
+  
+  const TOKEN *ptk = NULL;
   int status = 1;
+  int spliced = 0;
   int c = 0;
-  
-  /* Initialize structure */
-  memset(&tk, 0, sizeof(TOKEN));
+  int er = ERR_OK;
   
   /* Check state and update it */
   if (m_entity_ran) {
@@ -1190,18 +1003,42 @@ int entity_run(int32_t *pln, int *per) {
     abort();
   }
   
+  /* Check whether to record entities in the token cache */
+  m_entity_rec = cache_recording();
+  
   /* Go through all tokens except EOF */
-  for(retval = token_read(&tk);
-      retval && ((tk.str)[0] != 0);
-      retval = token_read(&tk)) {
+  for(ptk = entity_next();
+      (ptk->status == ERR_OK) && (ptk->len > 0);
+      ptk = entity_next()) {
+    
+    /* When recording, check whether the rest of the input can be
+     * replayed from the token cache, and otherwise record a resume mark
+     * before the entity if one is due */
+    if (m_entity_rec) {
+      if (cache_sync(ptk->offset)) {
+        spliced = 1;
+        if (!ir_flush(&m_entity_failPos, per)) {
+          status = 0;
+          m_entity_failed = 1;
+          *pln = entity_line(ptk);
+        } else if (!cache_splice(token_line(ptk), pln, per)) {
+          status = 0;
+        }
+        break;
+      }
+      
+      if (cache_wantMark(ptk->offset)) {
+        cache_putMark(ptk->offset, token_line(ptk));
+      }
+    }
     
     /* Get first character of token */
-    c = (tk.str)[0];
+    c = entity_first(ptk);
     
     /* We can't have closing groups on top level */
     if (status && ((c == ASCII_RPAREN) || (c == ASCII_RSQUARE))) {
       status = 0;
-      *pln = tk.line;
+      *pln = token_line(ptk);
       *per = ERR_RIGHT;
     }
     
@@ -1214,25 +1051,25 @@ int entity_run(int32_t *pln, int *per) {
           ((c >= ASCII_A_UPPER) && (c <= ASCII_G_UPPER))) {
         
         /* Interpret pitch entity */
-        if (!entity_pitch(&tk, per)) {
+        if (!entity_pitch(&ptk, per)) {
           status = 0;
-          *pln = tk.line;
+          *pln = entity_line(ptk);
         }
         
       } else if ((c == ASCII_LSQUARE) ||
                   ((c >= ASCII_ZERO) && (c <= ASCII_NINE))) {
         
         /* Interpret duration entity */
-        if (!entity_dur(&tk, per)) {
+        if (!entity_dur(&ptk, per)) {
           status = 0;
-          *pln = tk.line;
+          *pln = entity_line(ptk);
         }
         
       } else {
         /* Interpret operator */
-        if (!entity_op(tk.str, per)) {
+        if (!entity_op(ptk, per)) {
           status = 0;
-          *pln = tk.line;
+          *pln = entity_line(ptk);
         }
       }
     }
@@ -1244,20 +1081,38 @@ int entity_run(int32_t *pln, int *per) {
   }
   
   /* If token reading failed, record error */
-  if (status && (!retval)) {
+  if (status && (!spliced) && (ptk->status != ERR_OK)) {
     status = 0;
-    *pln = tk.line;
-    *per = tk.status;
+    *pln = token_line(ptk);
+    *per = ptk->status;
   }
   
-  /* If we got here successfully, report EOF */
-  if (status) {
-    if (!nvm_eof(per)) {
+  /* If we got here successfully, report EOF, unless the token cache
+   * already did */
+  if (status && (!spliced)) {
+    if (!entity_emit(NVM_OP_EOF, 0, NULL, ptk, per)) {
       status = 0;
-      *pln = tk.line;
+      *pln = entity_line(ptk);
     }
   }
   
+  /* Run the instructions that are still pending, unless one of them
+   * already failed; an error in one of them came before anything that
+   * was found after it was emitted, so it is reported instead */
+  if (!m_entity_failed) {
+    if (!ir_flush(&m_entity_failPos, &er)) {
+      status = 0;
+      m_entity_failed = 1;
+      *pln = entity_line(ptk);
+      *per = er;
+    }
+  }
+  
+  /* Record the EOF in the token cache */
+  if (status && (!spliced) && m_entity_rec) {
+    cache_putEOF(token_line(ptk));
+  }
+  
   /* Return status */
   return status;
 }
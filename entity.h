@@ -7,10 +7,13 @@
  * Entity handling module of the Noir compiler.
  * 
  * This module bridges the tokens read from the token module to a series
- * of calls into the nvm module.
+ * of instructions for the ir module, which runs them through the nvm
+ * module.  Include operations are handed to the incl module, which
+ * emits the instructions of the library, and section operations are
+ * recorded in the section index with sidx_mark().
  * 
- * Requires the token and nvm modules, as well as the event module
- * because the nvm module requires it.
+ * Requires the token, cache, incl, ir, nvm, and sidx modules, as well
+ * as the event module because the nvm module requires it.
  */
 
 #include "noirdef.h"
@@ -19,10 +22,17 @@
  * Fully interpret the input file.
  * 
  * The token module must already be initialized.  This function will
- * read all tokens from the token module, interpret them, and make all
- * appropriate calls to the nvm module so that the Noir notation is run
- * through the virtual machine.  The nvm module will notify the event
- * module of all relevant events.
+ * read all tokens from the token module, interpret them, and emit all
+ * appropriate instructions to the ir module so that the Noir notation
+ * is run through the virtual machine.  All the instructions have been
+ * run when this function returns.  The nvm module will notify the
+ * event module of all relevant events.
+ * 
+ * If cache_recording() indicates that the token cache is recording,
+ * each entity is also recorded in the cache as it is run, so that the
+ * client can write the cache file afterwards.  When the cache is for an
+ * earlier version of the input, the rest of the input is replayed from
+ * the cache as soon as cache_sync() finds a place to resume.
  * 
  * The event_finish() function is NOT called during this process.  The
  * honors are left to the client to call that function.
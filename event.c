@@ -22,6 +22,16 @@
 #define EVENT_STATE_INIT  (1) /* Initialized */
 #define EVENT_STATE_FINAL (2) /* Finish function has been called */
 
+/*
+ * The maximum number of events in an NMF file, which the counting sink
+ * of check mode enforces the same way libnmf does.
+ */
+#ifdef NMF_MAXNOTES
+#define EVENT_MAXNOTES (NMF_MAXNOTES)
+#else
+#define EVENT_MAXNOTES (1048576L)
+#endif
+
 /*
  * Static data
  * ===========
@@ -35,11 +45,117 @@
 static int m_event_state = EVENT_STATE_NONE;
 
 /*
- * Pointer to the NMF data object.
+ * An output, which is either the main output or a variant.
+ */
+typedef struct {
+  
+  /*
+   * Pointer to the NMF data object of the output.
+   * 
+   * Only valid if m_event_state is EVENT_STATE_INIT.
+   */
+  NMF_DATA *pd;
+  
+  /*
+   * The file that event_finish() writes a variant to.  NULL for the
+   * main output, which is written to the file given to event_finish().
+   */
+  FILE *pf;
+  
+  /*
+   * The semitones added to each pitch and the quanta added to each
+   * time offset.
+   */
+  int32_t pitch;
+  int32_t t;
+  
+  /*
+   * The articulation each articulation is remapped to.
+   */
+  uint16_t amap[NMF_MAXART + 1];
+  
+  /*
+   * The zero-indexed layer that each zero-indexed layer is remapped to,
+   * with NOIR_MAXLAYER elements, or NULL if no layers are remapped.
+   */
+  uint16_t *pLayer;
+  
+} EVENT_OUT;
+
+/*
+ * The outputs.
+ * 
+ * The first m_event_outs elements are used.  The first element is the
+ * main output, and the rest are the variants in the order they were
+ * added.
+ */
+static EVENT_OUT m_event_out[EVENT_MAXVAR + 1];
+static int m_event_outs = 1;
+
+/*
+ * Set once the emission parameters have been set for the main output.
+ * The main output starts out with parameters that change nothing.
+ */
+static int m_event_param = 0;
+
+/*
+ * Set if the module is in check mode, in which events go to a counting
+ * sink instead of the outputs.
+ */
+static int m_event_check = 0;
+
+/*
+ * The sections.
+ * 
+ * m_event_sects is the number of sections, counting the first.  The
+ * first m_event_sects - 1 elements of m_event_pStart are the time
+ * offsets where the sections after the first begin, before any
+ * emission parameters are applied.  m_event_startCap is the number of
+ * elements allocated.
+ */
+static int32_t m_event_sects = 1;
+static int32_t *m_event_pStart = NULL;
+static int32_t m_event_startCap = 0;
+
+/*
+ * The selection.
+ * 
+ * If m_event_sel is set, only the events in sections m_event_selS0 up
+ * to and including m_event_selS1 that begin at time offsets from
+ * m_event_selT0 up to but excluding m_event_selT1 are written.  These
+ * are time offsets before any emission parameters are applied.
+ * m_event_stray is set once an event that is not selected has been
+ * added, so that event_finish() knows it has to filter the outputs.
+ */
+static int m_event_sel = 0;
+static int32_t m_event_selS0 = 0;
+static int32_t m_event_selS1 = 0;
+static int32_t m_event_selT0 = 0;
+static int32_t m_event_selT1 = 0;
+static int m_event_stray = 0;
+
+/*
+ * The budgets.
+ * 
+ * If m_event_budget is set, no more than m_event_maxEv events may be
+ * added, and the outputs may hold no more than m_event_maxBytes bytes
+ * of events.  Either is unlimited if it is zero.
+ */
+static int m_event_budget = 0;
+static int64_t m_event_maxEv = 0;
+static int64_t m_event_maxBytes = 0;
+
+/*
+ * The counting sink.
  * 
- * Only valid if m_event_state is EVENT_STATE_INIT.
+ * m_event_count is the number of events.  m_event_graceRun is the
+ * number of grace notes at the end of the events, and m_event_graceMax
+ * is the largest grace note offset among those added since the last
+ * flip, which is all that event_flip() looks at.
  */
-static NMF_DATA *m_event_pd = NULL;
+static int32_t m_event_count = 0;
+static int32_t m_event_graceRun = 0;
+static int32_t m_event_graceMax = 0;
 
 /*
  * Local functions
@@ -48,6 +164,22 @@ static NMF_DATA *m_event_pd = NULL;
 
 /* Prototypes */
 static void event_init(void);
+static void event_setOut(EVENT_OUT *po, const EVENT_PARAM *pp);
+static int event_sink(int32_t dur, int *per);
+static int event_addSect(int32_t offset);
+static int event_room(int64_t n, int *per);
+static int event_batch(
+          int32_t   t,
+          int32_t   dur,
+          int32_t   count,
+    const int32_t * pPitch,
+          int32_t   n,
+          int32_t   art0,
+          int32_t   art,
+          int32_t   sect,
+          int32_t   layer,
+          int     * per);
+static NMF_DATA *event_filter(const EVENT_OUT *po);
 
 /*
  * Initialize the module, if necessary.
@@ -58,6 +190,8 @@ static void event_init(void);
  */
 static void event_init(void) {
   
+  int i = 0;
+  
   /* Only proceed if not already initialized */
   if (m_event_state != EVENT_STATE_INIT) {
     
@@ -66,14 +200,492 @@ static void event_init(void) {
       abort();
     }
     
-    /* Allocate a new data object */
-    m_event_pd = nmf_alloc();
+    /* Give the main output parameters that change nothing if they were
+     * not set */
+    if (!m_event_param) {
+      for(i = 0; i <= NMF_MAXART; i++) {
+        m_event_out[0].amap[i] = (uint16_t) i;
+      }
+      m_event_param = 1;
+    }
+    
+    /* Allocate a new data object for each output, unless events go to
+     * the counting sink */
+    if (!m_event_check) {
+      for(i = 0; i < m_event_outs; i++) {
+        m_event_out[i].pd = nmf_alloc();
+      }
+    }
     
     /* Update state */
     m_event_state = EVENT_STATE_INIT;
   }
 }
 
+/*
+ * Set the emission parameters of an output.
+ * 
+ * A fault occurs if the parameters are invalid.  The layer table is
+ * only allocated if a layer is remapped.
+ * 
+ * Parameters:
+ * 
+ *   po - the output
+ * 
+ *   pp - the emission parameters
+ */
+static void event_setOut(EVENT_OUT *po, const EVENT_PARAM *pp) {
+  
+  int32_t i = 0;
+  int32_t from = 0;
+  
+  /* Check parameters */
+  if ((po == NULL) || (pp == NULL)) {
+    abort();
+  }
+  if ((pp->pitch < -(NMF_MAXPITCH - NMF_MINPITCH)) ||
+      (pp->pitch > NMF_MAXPITCH - NMF_MINPITCH) ||
+      (pp->t < 0) ||
+      (pp->lmap_count < 0) || (pp->lmap_count > EVENT_MAXLMAP)) {
+    abort();
+  }
+  for(i = 0; i <= NMF_MAXART; i++) {
+    if ((pp->amap[i] < 0) || (pp->amap[i] > NMF_MAXART)) {
+      abort();
+    }
+  }
+  
+  /* Copy the offsets and the articulation table */
+  po->pitch = pp->pitch;
+  po->t = pp->t;
+  for(i = 0; i <= NMF_MAXART; i++) {
+    po->amap[i] = (uint16_t) pp->amap[i];
+  }
+  
+  /* Build the layer table if any layers are remapped */
+  if (po->pLayer != NULL) {
+    free(po->pLayer);
+    po->pLayer = NULL;
+  }
+  if (pp->lmap_count > 0) {
+    po->pLayer = (uint16_t *) calloc(
+                    (size_t) NOIR_MAXLAYER, sizeof(uint16_t));
+    if (po->pLayer == NULL) {
+      abort();
+    }
+    for(i = 0; i < NOIR_MAXLAYER; i++) {
+      (po->pLayer)[i] = (uint16_t) i;
+    }
+    
+    for(i = 0; i < pp->lmap_count; i++) {
+      from = (pp->lmap_from)[i];
+      if ((from < 1) || (from > NOIR_MAXLAYER) ||
+          ((pp->lmap_to)[i] < 1) || ((pp->lmap_to)[i] > NOIR_MAXLAYER)) {
+        abort();
+      }
+      if ((po->pLayer)[from - 1] != (uint16_t) (from - 1)) {
+        abort();  /* layer remapped twice */
+      }
+      (po->pLayer)[from - 1] = (uint16_t) ((pp->lmap_to)[i] - 1);
+    }
+  }
+}
+
+/*
+ * Add an event to the counting sink of check mode.
+ * 
+ * Parameters:
+ * 
+ *   dur - the duration of the event, which is negative for a grace note
+ * 
+ *   per - pointer to variable to receive error code
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if too many events
+ */
+static int event_sink(int32_t dur, int *per) {
+  
+  int status = 1;
+  
+  /* Check state and parameter */
+  if (!m_event_check) {
+    abort();
+  }
+  if (per == NULL) {
+    abort();
+  }
+  
+  /* Count the event if there is room */
+  if (m_event_count < EVENT_MAXNOTES) {
+    m_event_count++;
+  } else {
+    status = 0;
+    *per = ERR_MANYNOTES;
+  }
+  
+  /* Keep track of the grace notes at the end */
+  if (status) {
+    if (dur < 0) {
+      m_event_graceRun++;
+      if (-dur > m_event_graceMax) {
+        m_event_graceMax = -dur;
+      }
+    } else {
+      m_event_graceRun = 0;
+    }
+  }
+  
+  /* Return status */
+  return status;
+}
+
+/*
+ * Check that the budgets allow more events to be added.
+ * 
+ * Parameters:
+ * 
+ *   n - the number of events to add
+ * 
+ *   per - pointer to variable to receive error code
+ * 
+ * Return:
+ * 
+ *   non-zero if there is room, zero if a budget would be exceeded
+ */
+static int event_room(int64_t n, int *per) {
+  
+  int status = 1;
+  int64_t total = 0;
+  
+  /* Check parameters */
+  if ((n < 0) || (per == NULL)) {
+    abort();
+  }
+  
+  /* Compare the total to the budgets; the sink of check mode holds no
+   * events */
+  total = ((int64_t) event_count()) + n;
+  if ((m_event_maxEv > 0) && (total > m_event_maxEv)) {
+    status = 0;
+    *per = ERR_EVBUDGET;
+    
+  } else if ((m_event_maxBytes > 0) && (!m_event_check) &&
+              (total > m_event_maxBytes /
+                (((int64_t) m_event_outs) * ((int64_t) sizeof(NMF_NOTE))))) {
+    status = 0;
+    *per = ERR_MEMBUDGET;
+  }
+  
+  /* Return status */
+  return status;
+}
+
+/*
+ * Add a run of repeated chords to every output.
+ * 
+ * This is the shared implementation of event_run() and event_chord(),
+ * which see.  dur may only be negative, for grace notes, if count is
+ * one.  Everything is checked before anything is added.  The checks
+ * are in the order that adding the notes one at a time with
+ * event_note() would make them, as far as that goes: the lowest pitch
+ * and the time offset in each output, then the highest pitch in each
+ * output, and then the room for all of the notes.
+ * 
+ * Parameters:
+ * 
+ *   t - the time offset of the first chord
+ * 
+ *   dur - the duration of each note
+ * 
+ *   count - the number of chords
+ * 
+ *   pPitch - the pitches of the chord in ascending order
+ * 
+ *   n - the number of pitches in the chord
+ * 
+ *   art0 - the articulation of the first chord
+ * 
+ *   art - the articulation of the other chords
+ * 
+ *   sect - the section the notes belong to
+ * 
+ *   layer - the layer within that section the notes belong to
+ * 
+ *   per - pointer to variable to receive error code
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if error
+ */
+static int event_batch(
+          int32_t   t,
+          int32_t   dur,
+          int32_t   count,
+    const int32_t * pPitch,
+          int32_t   n,
+          int32_t   art0,
+          int32_t   art,
+          int32_t   sect,
+          int32_t   layer,
+          int     * per) {
+  
+  int status = 1;
+  int i = 0;
+  int32_t j = 0;
+  int32_t k = 0;
+  int32_t p = 0;
+  int64_t total = 0;
+  int64_t tlast = 0;
+  const EVENT_OUT *po = NULL;
+  NMF_NOTE nt;
+  
+  /* Initialize structure */
+  memset(&nt, 0, sizeof(NMF_NOTE));
+  
+  /* Make sure module initialized */
+  event_init();
+  
+  /* Check parameters */
+  if ((t < 0) || (dur == 0) || (dur < -(INT32_MAX)) ||
+      (count < 1) || ((dur < 0) && (count > 1)) || (n < 0)) {
+    abort();
+  }
+  if ((n > 0) && (pPitch == NULL)) {
+    abort();
+  }
+  for(j = 0; j < n; j++) {
+    if ((pPitch[j] < NMF_MINPITCH) || (pPitch[j] > NMF_MAXPITCH)) {
+      abort();
+    }
+    if ((j > 0) && (pPitch[j] <= pPitch[j - 1])) {
+      abort();
+    }
+  }
+  if ((art0 < 0) || (art0 > NMF_MAXART) ||
+      (art < 0) || (art > NMF_MAXART)) {
+    abort();
+  }
+  if ((sect < 0) || (sect >= NMF_MAXSECT)) {
+    abort();
+  }
+  if ((layer < 1) || (layer > NOIR_MAXLAYER)) {
+    abort();
+  }
+  if (per == NULL) {
+    abort();
+  }
+  
+  /* Only proceed if there is something to add */
+  if (n < 1) {
+    return status;
+  }
+  total = ((int64_t) n) * ((int64_t) count);
+  if (dur > 0) {
+    tlast = ((int64_t) t) + ((int64_t) dur) * ((int64_t) (count - 1));
+  } else {
+    tlast = t;
+  }
+  
+  /* Check that the lowest pitch and the last time offset are in range
+   * for every output, and then the highest pitch, before adding
+   * anything */
+  for(i = 0; i < m_event_outs; i++) {
+    po = &(m_event_out[i]);
+    p = pPitch[0] + po->pitch;
+    if ((p < NMF_MINPITCH) || (p > NMF_MAXPITCH)) {
+      status = 0;
+      *per = ERR_TRANSRNG;
+      break;
+    }
+    if (tlast > (int64_t) (INT32_MAX - po->t)) {
+      status = 0;
+      *per = ERR_LONGPIECE;
+      break;
+    }
+  }
+  for(i = 0; status && (i < m_event_outs); i++) {
+    p = pPitch[n - 1] + m_event_out[i].pitch;
+    if ((p < NMF_MINPITCH) || (p > NMF_MAXPITCH)) {
+      status = 0;
+      *per = ERR_TRANSRNG;
+    }
+  }
+  
+  /* Make sure there is room for all of the notes */
+  if (status && (total > (int64_t) (EVENT_MAXNOTES - event_count()))) {
+    status = 0;
+    *per = ERR_MANYNOTES;
+  }
+  if (status && m_event_budget) {
+    if (!event_room(total, per)) {
+      status = 0;
+    }
+  }
+  
+  /* The selected time offsets of a section are one range, so all the
+   * chords are selected if the first and last ones are */
+  if (status && m_event_sel) {
+    if ((!event_selected(t, sect)) ||
+        (!event_selected((int32_t) tlast, sect))) {
+      m_event_stray = 1;
+    }
+  }
+  
+  /* In check mode, only count the notes, keeping track of the grace
+   * notes at the end the same way the counting sink does */
+  if (status && m_event_check) {
+    m_event_count += (int32_t) total;
+    if (dur < 0) {
+      m_event_graceRun += (int32_t) total;
+      if (-dur > m_event_graceMax) {
+        m_event_graceMax = -dur;
+      }
+    } else {
+      m_event_graceRun = 0;
+    }
+    return status;
+  }
+  
+  /* Add the chords to each output, with the fields that do not change
+   * filled in once */
+  for(i = 0; status && (i < m_event_outs); i++) {
+    po = &(m_event_out[i]);
+    
+    nt.dur = dur;
+    nt.sect = (uint16_t) sect;
+    if (po->pLayer != NULL) {
+      nt.layer_i = (po->pLayer)[layer - 1];
+    } else {
+      nt.layer_i = (uint16_t) (layer - 1);
+    }
+    
+    nt.t = t + po->t;
+    nt.art = (po->amap)[art0];
+    for(k = 0; k < count; k++) {
+      if (k > 0) {
+        nt.t += dur;
+        nt.art = (po->amap)[art];
+      }
+      for(j = 0; j < n; j++) {
+        nt.pitch = (int16_t) (pPitch[j] + po->pitch);
+        if (!nmf_append(po->pd, &nt)) {
+          status = 0;
+          *per = ERR_MANYNOTES;
+          break;
+        }
+      }
+      if (!status) {
+        break;
+      }
+    }
+  }
+  
+  /* Return status */
+  return status;
+}
+
+/*
+ * Record the start of a new section.
+ * 
+ * Parameters:
+ * 
+ *   offset - the time offset where the section begins
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if too many sections
+ */
+static int event_addSect(int32_t offset) {
+  
+  int32_t newcap = 0;
+  int32_t *pNew = NULL;
+  
+  /* Check parameter */
+  if (offset < 0) {
+    abort();
+  }
+  
+  /* Fail if there are already as many sections as NMF allows */
+  if (m_event_sects >= NMF_MAXSECT) {
+    return 0;
+  }
+  
+  /* Grow the table if necessary */
+  if (m_event_sects > m_event_startCap) {
+    newcap = m_event_startCap * 2;
+    if (newcap < 64) {
+      newcap = 64;
+    }
+    pNew = (int32_t *) realloc(
+              m_event_pStart, ((size_t) newcap) * sizeof(int32_t));
+    if (pNew == NULL) {
+      abort();
+    }
+    m_event_pStart = pNew;
+    m_event_startCap = newcap;
+  }
+  
+  /* Record the section */
+  m_event_pStart[m_event_sects - 1] = offset;
+  m_event_sects++;
+  
+  return 1;
+}
+
+/*
+ * Make a copy of an output that only has the selected events.
+ * 
+ * The section table is copied in full, so the events keep their time
+ * offsets and sections.
+ * 
+ * Parameters:
+ * 
+ *   po - the output
+ * 
+ * Return:
+ * 
+ *   a new NMF data object with the selected events
+ */
+static NMF_DATA *event_filter(const EVENT_OUT *po) {
+  
+  int32_t i = 0;
+  int32_t count = 0;
+  NMF_DATA *pd = NULL;
+  NMF_NOTE n;
+  
+  /* Initialize structure */
+  memset(&n, 0, sizeof(NMF_NOTE));
+  
+  /* Check parameter */
+  if ((po == NULL) || (po->pd == NULL)) {
+    abort();
+  }
+  
+  /* Copy the section table, which can not fail because it was already
+   * defined the same way in the output */
+  pd = nmf_alloc();
+  for(i = 1; i < m_event_sects; i++) {
+    if (!nmf_sect(pd, m_event_pStart[i - 1] + po->t)) {
+      abort();
+    }
+  }
+  
+  /* Copy the selected events, which fit because they are a subset */
+  count = nmf_notes(po->pd);
+  for(i = 0; i < count; i++) {
+    nmf_get(po->pd, i, &n);
+    if (event_selected(n.t - po->t, (int32_t) n.sect)) {
+      if (!nmf_append(pd, &n)) {
+        abort();
+      }
+    }
+  }
+  
+  /* Return the copy */
+  return pd;
+}
+
 /*
  * Public function implementations
  * ===============================
@@ -81,29 +693,234 @@ static void event_init(void) {
  * See the header for specifications.
  */
 
+/*
+ * event_param_init function.
+ */
+void event_param_init(EVENT_PARAM *pp) {
+  
+  int32_t i = 0;
+  
+  /* Check parameter */
+  if (pp == NULL) {
+    abort();
+  }
+  
+  /* Clear the structure and make the articulation table the
+   * identity */
+  memset(pp, 0, sizeof(EVENT_PARAM));
+  for(i = 0; i <= NMF_MAXART; i++) {
+    (pp->amap)[i] = i;
+  }
+}
+
+/*
+ * event_param function.
+ */
+void event_param(const EVENT_PARAM *pp) {
+  
+  /* Check state */
+  if (m_event_state != EVENT_STATE_NONE) {
+    abort();
+  }
+  
+  /* Set the parameters of the main output */
+  event_setOut(&(m_event_out[0]), pp);
+  m_event_param = 1;
+}
+
+/*
+ * event_variant function.
+ */
+int event_variant(const EVENT_PARAM *pp, FILE *pf) {
+  
+  int status = 1;
+  EVENT_OUT *po = NULL;
+  
+  /* Check state and parameters */
+  if ((m_event_state != EVENT_STATE_NONE) || m_event_check) {
+    abort();
+  }
+  if ((pp == NULL) || (pf == NULL)) {
+    abort();
+  }
+  
+  /* Add the variant if there is room */
+  if (m_event_outs <= EVENT_MAXVAR) {
+    po = &(m_event_out[m_event_outs]);
+    memset(po, 0, sizeof(EVENT_OUT));
+    event_setOut(po, pp);
+    po->pf = pf;
+    m_event_outs++;
+    
+  } else {
+    status = 0;
+  }
+  
+  /* Return status */
+  return status;
+}
+
+/*
+ * event_check function.
+ */
+void event_check(void) {
+  
+  /* Check state */
+  if ((m_event_state != EVENT_STATE_NONE) || (m_event_outs > 1)) {
+    abort();
+  }
+  
+  /* Send events to the counting sink */
+  m_event_check = 1;
+}
+
+/*
+ * event_budget function.
+ */
+void event_budget(int64_t max_events, int64_t max_bytes) {
+  
+  /* Check state and parameters */
+  if (m_event_state != EVENT_STATE_NONE) {
+    abort();
+  }
+  if ((max_events < 0) || (max_bytes < 0)) {
+    abort();
+  }
+  
+  /* Set the budgets */
+  m_event_maxEv = max_events;
+  m_event_maxBytes = max_bytes;
+  m_event_budget = ((max_events > 0) || (max_bytes > 0));
+}
+
+/*
+ * event_select function.
+ */
+void event_select(int32_t s0, int32_t s1, int32_t t0, int32_t t1) {
+  
+  /* Check state and parameters */
+  if (m_event_state != EVENT_STATE_NONE) {
+    abort();
+  }
+  if ((s0 < 0) || (s1 < s0) || (s1 >= NMF_MAXSECT) ||
+      (t0 < 0) || (t1 < t0)) {
+    abort();
+  }
+  
+  /* Set the selection */
+  m_event_sel = 1;
+  m_event_selS0 = s0;
+  m_event_selS1 = s1;
+  m_event_selT0 = t0;
+  m_event_selT1 = t1;
+}
+
+/*
+ * event_selected function.
+ */
+int event_selected(int32_t t, int32_t sect) {
+  
+  /* Everything is selected unless there is a selection */
+  if (!m_event_sel) {
+    return 1;
+  }
+  
+  return ((sect >= m_event_selS0) && (sect <= m_event_selS1) &&
+          (t >= m_event_selT0) && (t < m_event_selT1));
+}
+
+/*
+ * event_sections function.
+ */
+int32_t event_sections(void) {
+  return m_event_sects;
+}
+
+/*
+ * event_start function.
+ */
+int32_t event_start(int32_t sect) {
+  
+  /* Check parameter */
+  if ((sect < 0) || (sect >= m_event_sects)) {
+    abort();
+  }
+  
+  /* The first section begins at the start of the piece */
+  if (sect < 1) {
+    return 0;
+  }
+  return m_event_pStart[sect - 1];
+}
+
 /*
  * event_section function.
  */
-int event_section(int32_t offset) {
+int event_section(int32_t offset, int *per) {
+  
+  int status = 1;
+  int i = 0;
   
   /* Make sure module initialized */
   event_init();
   
-  /* Call through */
-  return nmf_sect(m_event_pd, offset);
+  /* Check parameters */
+  if ((offset < 0) || (per == NULL)) {
+    abort();
+  }
+  
+  /* Check that the offset is in range for every output */
+  for(i = 0; i < m_event_outs; i++) {
+    if (offset > INT32_MAX - m_event_out[i].t) {
+      status = 0;
+      *per = ERR_LONGPIECE;
+      break;
+    }
+  }
+  
+  /* Record where the section begins, which is all that check mode
+   * does */
+  if (status) {
+    if (!event_addSect(offset)) {
+      status = 0;
+      *per = ERR_MANYSECT;
+    }
+  }
+  if (status && m_event_check) {
+    return status;
+  }
+  
+  /* Define the section in every output */
+  if (status) {
+    for(i = 0; i < m_event_outs; i++) {
+      if (!nmf_sect(m_event_out[i].pd, offset + m_event_out[i].t)) {
+        status = 0;
+        *per = ERR_MANYSECT;
+        break;
+      }
+    }
+  }
+  
+  /* Return status */
+  return status;
 }
 
 /*
  * event_note function.
  */
 int event_note(
-    int32_t t,
-    int32_t dur,
-    int32_t pitch,
-    int32_t art,
-    int32_t sect,
-    int32_t layer) {
+    int32_t   t,
+    int32_t   dur,
+    int32_t   pitch,
+    int32_t   art,
+    int32_t   sect,
+    int32_t   layer,
+    int     * per) {
   
+  int status = 1;
+  int i = 0;
+  int32_t p = 0;
+  const EVENT_OUT *po = NULL;
   NMF_NOTE n;
   
   /* Initialize structure */
@@ -131,27 +948,125 @@ int event_note(
   if ((layer < 1) || (layer > NOIR_MAXLAYER)) {
     abort();
   }
+  if (per == NULL) {
+    abort();
+  }
+  
+  /* Check that the note is in range for every output before adding it
+   * to any of them */
+  for(i = 0; i < m_event_outs; i++) {
+    po = &(m_event_out[i]);
+    p = pitch + po->pitch;
+    if ((p < NMF_MINPITCH) || (p > NMF_MAXPITCH)) {
+      status = 0;
+      *per = ERR_TRANSRNG;
+      break;
+    }
+    if (t > INT32_MAX - po->t) {
+      status = 0;
+      *per = ERR_LONGPIECE;
+      break;
+    }
+  }
+  
+  /* Note whether an event that is not selected is being added */
+  if (m_event_sel && (!event_selected(t, sect))) {
+    m_event_stray = 1;
+  }
+  
+  /* Make sure the budgets allow another event */
+  if (status && m_event_budget) {
+    if (!event_room(1, per)) {
+      status = 0;
+    }
+  }
+  
+  /* In check mode, send the note to the counting sink */
+  if (status && m_event_check) {
+    return event_sink(dur, per);
+  }
+  
+  /* Fill in the note structure for each output and add it */
+  if (status) {
+    n.dur = dur;
+    n.sect = (uint16_t) sect;
+    
+    for(i = 0; i < m_event_outs; i++) {
+      po = &(m_event_out[i]);
+      
+      n.t = t + po->t;
+      n.pitch = (int16_t) (pitch + po->pitch);
+      n.art = (po->amap)[art];
+      if (po->pLayer != NULL) {
+        n.layer_i = (po->pLayer)[layer - 1];
+      } else {
+        n.layer_i = (uint16_t) (layer - 1);
+      }
+      
+      if (!nmf_append(po->pd, &n)) {
+        status = 0;
+        *per = ERR_MANYNOTES;
+        break;
+      }
+    }
+  }
+  
+  /* Return status */
+  return status;
+}
+
+/*
+ * event_run function.
+ */
+int event_run(
+          int32_t   t,
+          int32_t   dur,
+          int32_t   count,
+    const int32_t * pPitch,
+          int32_t   n,
+          int32_t   art0,
+          int32_t   art,
+          int32_t   sect,
+          int32_t   layer,
+          int     * per) {
+  
+  /* Check the parameters that only apply to runs */
+  if ((dur < 1) || (count < 1)) {
+    abort();
+  }
+  
+  /* Add the chords */
+  return event_batch(t, dur, count, pPitch, n, art0, art, sect, layer, per);
+}
 
-  /* Fill in the note structure */
-  n.t = t;
-  n.dur = dur;
-  n.pitch = (int16_t) pitch;
-  n.art = (uint16_t) art;
-  n.sect = (uint16_t) sect;
-  n.layer_i = (uint16_t) (layer - 1);
+/*
+ * event_chord function.
+ */
+int event_chord(
+          int32_t   t,
+          int32_t   dur,
+    const int32_t * pPitch,
+          int32_t   n,
+          int32_t   art,
+          int32_t   sect,
+          int32_t   layer,
+          int     * per) {
   
-  /* Call through */
-  return nmf_append(m_event_pd, &n);
+  /* Add the chord as a run of one */
+  return event_batch(t, dur, 1, pPitch, n, art, art, sect, layer, per);
 }
 
 /*
  * event_cue function.
  */
 int event_cue(
-    int32_t t,
-    int32_t sect,
-    int32_t cue_num) {
+    int32_t   t,
+    int32_t   sect,
+    int32_t   cue_num,
+    int     * per) {
   
+  int status = 1;
+  int i = 0;
   NMF_NOTE n;
   
   /* Initialize structure */
@@ -170,17 +1085,56 @@ int event_cue(
   if ((cue_num < 0) || (cue_num > NOIR_MAXCUE)) {
     abort();
   }
-
-  /* Fill in the note structure for a cue */
-  n.t = t;
-  n.dur = 0;
-  n.pitch = 0;
-  n.art = (uint16_t) (cue_num >> 16);
-  n.sect = (uint16_t) sect;
-  n.layer_i = (uint16_t) (cue_num & INT32_C(0xffff));
+  if (per == NULL) {
+    abort();
+  }
+  
+  /* Check that the time offset is in range for every output */
+  for(i = 0; i < m_event_outs; i++) {
+    if (t > INT32_MAX - m_event_out[i].t) {
+      status = 0;
+      *per = ERR_LONGPIECE;
+      break;
+    }
+  }
+  
+  /* Note whether an event that is not selected is being added */
+  if (m_event_sel && (!event_selected(t, sect))) {
+    m_event_stray = 1;
+  }
+  
+  /* Make sure the budgets allow another event */
+  if (status && m_event_budget) {
+    if (!event_room(1, per)) {
+      status = 0;
+    }
+  }
+  
+  /* In check mode, send the cue to the counting sink */
+  if (status && m_event_check) {
+    return event_sink(0, per);
+  }
   
-  /* Call through */
-  return nmf_append(m_event_pd, &n);
+  /* Fill in the note structure for a cue and add it to each output */
+  if (status) {
+    n.dur = 0;
+    n.pitch = 0;
+    n.art = (uint16_t) (cue_num >> 16);
+    n.sect = (uint16_t) sect;
+    n.layer_i = (uint16_t) (cue_num & INT32_C(0xffff));
+    
+    for(i = 0; i < m_event_outs; i++) {
+      n.t = t + m_event_out[i].t;
+      if (!nmf_append(m_event_out[i].pd, &n)) {
+        status = 0;
+        *per = ERR_MANYNOTES;
+        break;
+      }
+    }
+  }
+  
+  /* Return status */
+  return status;
 }
 
 /*
@@ -188,9 +1142,11 @@ int event_cue(
  */
 void event_flip(int32_t count, int32_t max_offs) {
   
+  int j = 0;
   int32_t i = 0;
   int32_t note_count = 0;
   int32_t flipped = 0;
+  NMF_DATA *pd = NULL;
   NMF_NOTE n;
   
   /* Initialize structures */
@@ -199,8 +1155,8 @@ void event_flip(int32_t count, int32_t max_offs) {
   /* Make sure module initialized */
   event_init();
   
-  /* Get note count */
-  note_count = nmf_notes(m_event_pd);
+  /* Get note count, which is the same for every output */
+  note_count = event_count();
   
   /* Check parameters */
   if ((count < 0) || (max_offs < 1)) {
@@ -210,59 +1166,262 @@ void event_flip(int32_t count, int32_t max_offs) {
     abort();
   }
   
+  /* In check mode, the sink only has the grace notes at the end, which
+   * must be the ones flipped, and the largest offset among them */
+  if (m_event_check) {
+    if ((count > m_event_graceRun) ||
+        ((count > 0) && (m_event_graceMax > max_offs))) {
+      abort();
+    }
+    m_event_graceMax = 0;
+    return;
+  }
+  
   /* Only proceed if count is non-zero */
   if (count > 0) {
     
-    /* Go through the relevant note events */
-    for(i = 1; i <= count; i++) {
-      
-      /* Get the current note */
-      nmf_get(m_event_pd, note_count - i, &n);
-      
-      /* Fault if current event note not a grace note */
-      if (n.dur >= 0) {
-        abort();
+    /* Go through the relevant note events in each output */
+    for(j = 0; j < m_event_outs; j++) {
+      pd = m_event_out[j].pd;
+      for(i = 1; i <= count; i++) {
+        
+        /* Get the current note */
+        nmf_get(pd, note_count - i, &n);
+        
+        /* Fault if current event note not a grace note */
+        if (n.dur >= 0) {
+          abort();
+        }
+        
+        /* Compute the flipped grace note offset */
+        flipped = (max_offs + 1) + n.dur;
+        
+        /* If flipped value is less than one, grace note offset exceeded
+         * max_offs, so fault */
+        if (flipped < 1) {
+          abort();
+        }
+        
+        /* The flipped duration is the negated value of flipped */
+        n.dur = -(flipped);
+        
+        /* Update the note */
+        nmf_set(pd, note_count - i, &n);
       }
-      
-      /* Compute the flipped grace note offset */
-      flipped = (max_offs + 1) + n.dur;
-      
-      /* If flipped value is less than one, grace note offset exceeded
-       * max_offs, so fault */
-      if (flipped < 1) {
-        abort();
+    }
+  }
+}
+
+/*
+ * event_count function.
+ */
+int32_t event_count(void) {
+  
+  /* Make sure module initialized */
+  event_init();
+  
+  /* In check mode, the sink has the count */
+  if (m_event_check) {
+    return m_event_count;
+  }
+  
+  /* The count is the same in every output */
+  return nmf_notes(m_event_out[0].pd);
+}
+
+/*
+ * event_replay function.
+ */
+int event_replay(
+    int32_t   first,
+    int32_t   len,
+    int32_t   count,
+    int32_t   tmax,
+    int     * per) {
+  
+  int status = 1;
+  int i = 0;
+  int32_t j = 0;
+  int32_t k = 0;
+  int32_t n = 0;
+  NMF_DATA *pd = NULL;
+  NMF_NOTE *pn = NULL;
+  int32_t *pt = NULL;
+  
+  /* Make sure module initialized */
+  event_init();
+  
+  /* Check parameters */
+  if ((first < 0) || (first > event_count()) ||
+      (len < 0) || (count < 0) || (tmax < 0) || (per == NULL)) {
+    abort();
+  }
+  
+  /* Get the number of events to replay */
+  n = event_count() - first;
+  
+  /* The last replay must not shift any time offset in any output out
+   * of range, which is checked before anything is added */
+  if ((n > 0) && (count > 0)) {
+    for(i = 0; i < m_event_outs; i++) {
+      if (((int64_t) len) * ((int64_t) count) >
+            ((int64_t) INT32_MAX) - tmax - m_event_out[i].t) {
+        status = 0;
+        *per = ERR_LONGPIECE;
+        break;
+      }
+    }
+  }
+  
+  /* The budgets must allow all of the replays, which is checked before
+   * anything is added */
+  if (status && m_event_budget && (n > 0) && (count > 0)) {
+    if (!event_room(((int64_t) n) * ((int64_t) count), per)) {
+      status = 0;
+    }
+  }
+  
+  /* In check mode, the sink only has to count the replayed events; if
+   * the replayed events are all grace notes at the end, the replays
+   * lengthen the run of grace notes, otherwise the run is in the last
+   * replay and keeps its length */
+  if (status && m_event_check && (n > 0) && (count > 0)) {
+    if (((int64_t) n) * ((int64_t) count) >
+          (int64_t) (EVENT_MAXNOTES - m_event_count)) {
+      status = 0;
+      *per = ERR_MANYNOTES;
+    }
+    if (status) {
+      m_event_count += n * count;
+      if (m_event_graceRun >= n) {
+        m_event_graceRun += n * count;
+      }
+    }
+    return status;
+  }
+  
+  /* Only proceed if there is something to replay; the replays are not
+   * checked against the selection one by one, so the outputs are
+   * filtered in the end */
+  if (status && (n > 0) && (count > 0)) {
+    if (m_event_sel) {
+      m_event_stray = 1;
+    }
+    
+    /* Allocate buffers for the events and their time offsets */
+    pn = (NMF_NOTE *) calloc((size_t) n, sizeof(NMF_NOTE));
+    pt = (int32_t *) calloc((size_t) n, sizeof(int32_t));
+    if ((pn == NULL) || (pt == NULL)) {
+      abort();
+    }
+    
+    /* Replay the events in each output; the time offsets are kept in
+     * their own array so that each shift is one add over a contiguous
+     * array, which the compiler can vectorize */
+    for(i = 0; status && (i < m_event_outs); i++) {
+      pd = m_event_out[i].pd;
+      for(j = 0; j < n; j++) {
+        nmf_get(pd, first + j, &(pn[j]));
+        pt[j] = pn[j].t;
       }
       
-      /* The flipped duration is the negated value of flipped */
-      n.dur = -(flipped);
-      
-      /* Update the note */
-      nmf_set(m_event_pd, note_count - i, &n);
+      for(k = 0; k < count; k++) {
+        for(j = 0; j < n; j++) {
+          pt[j] += len;
+        }
+        for(j = 0; j < n; j++) {
+          pn[j].t = pt[j];
+          if (!nmf_append(pd, &(pn[j]))) {
+            status = 0;
+            *per = ERR_MANYNOTES;
+            break;
+          }
+        }
+        if (!status) {
+          break;
+        }
+      }
     }
+    
+    /* Release the buffers */
+    free(pn);
+    free(pt);
+    pn = NULL;
+    pt = NULL;
   }
+  
+  /* Return status */
+  return status;
 }
 
 /*
  * event_finish function.
  */
-int event_finish(FILE *pf) {
+int event_finish(FILE *pf, int *per) {
   
-  int retval = 0;
+  int retval = 1;
+  int i = 0;
+  FILE *po = NULL;
+  NMF_DATA *pd = NULL;
   
   /* Make sure module initialized */
   event_init();
   
-  /* Check parameter */
-  if (pf == NULL) {
+  /* Check parameters */
+  if ((pf == NULL) || (per == NULL)) {
     abort();
   }
   
-  /* Call through */
-  retval = nmf_serialize(m_event_pd, pf);
+  /* In check mode, nothing is written, but an empty result is still
+   * an error */
+  if (m_event_check) {
+    if (m_event_count < 1) {
+      retval = 0;
+      *per = ERR_EMPTY;
+    }
+    m_event_state = EVENT_STATE_FINAL;
+    return retval;
+  }
   
-  /* Close down data object */
-  nmf_free(m_event_pd);
-  m_event_pd = NULL;
+  /* Write each output to its file, stopping at the first that fails,
+   * and close down the data objects */
+  for(i = 0; i < m_event_outs; i++) {
+    if (i > 0) {
+      po = m_event_out[i].pf;
+    } else {
+      po = pf;
+    }
+    
+    /* If some events were not selected, keep only the others; there
+     * was at least one note, so if none are left the selection is
+     * what is empty */
+    if (retval && m_event_stray) {
+      pd = event_filter(&(m_event_out[i]));
+      nmf_free(m_event_out[i].pd);
+      m_event_out[i].pd = pd;
+      pd = NULL;
+      
+      if (nmf_notes(m_event_out[i].pd) < 1) {
+        retval = 0;
+        *per = ERR_EMPTYSEL;
+      }
+    }
+    
+    if (retval) {
+      retval = nmf_serialize(m_event_out[i].pd, po);
+      if (!retval) {
+        *per = ERR_EMPTY;
+      }
+    }
+    
+    nmf_free(m_event_out[i].pd);
+    m_event_out[i].pd = NULL;
+    
+    if (m_event_out[i].pLayer != NULL) {
+      free(m_event_out[i].pLayer);
+      m_event_out[i].pLayer = NULL;
+    }
+  }
   
   /* Set state to FINAL */
   m_event_state = EVENT_STATE_FINAL;
@@ -6,6 +6,47 @@
  * 
  * Event Buffer module of the Noir compiler.
  * 
+ * Emission parameters
+ * ===================
+ * 
+ * Every event can be changed as it is added to the buffer by a set of
+ * emission parameters: a number of semitones added to each pitch, a
+ * number of quanta added to each time offset, and tables that remap
+ * layers and articulations.  Use event_param() to set the parameters
+ * of the main output.
+ * 
+ * The module can also build several variants of the output at once.
+ * Each variant has its own event buffer, its own emission parameters,
+ * and its own output file, and receives every event that the main
+ * output does.  Use event_variant() to add one.  A variant only costs
+ * the time it takes to add the events to its buffer, because the Noir
+ * notation is interpreted once for all of them.
+ * 
+ * Emission parameters and variants must be set before any events are
+ * added.
+ * 
+ * Selection
+ * =========
+ * 
+ * The output can be limited to a range of sections and a window of
+ * time offsets with event_select().  Events that are not selected are
+ * still added like any other, since repeat blocks may replay them into
+ * the selection, but the outputs are filtered before they are written.
+ * The interpreter can use event_selected() to avoid adding events that
+ * can never be selected in the first place.  The section table is
+ * always written in full, and the selected events keep their time
+ * offsets, so they line up with the output of the whole piece.
+ * 
+ * Check mode
+ * ==========
+ * 
+ * In check mode, events are not kept at all.  They go to a counting
+ * sink that only keeps the number of sections and events and what it
+ * needs to know about the grace notes at the end, so the memory used
+ * does not depend on the length of the piece.  Everything is checked
+ * the same way as it is otherwise, so the same errors are reported,
+ * but event_finish() writes nothing.  Use event_check() to select it.
+ * 
  * Compilation
  * ===========
  * 
@@ -15,6 +56,212 @@
 #include "noirdef.h"
 #include <stdio.h>
 
+/*
+ * The maximum number of variants that can be added with
+ * event_variant().
+ */
+#define EVENT_MAXVAR (16)
+
+/*
+ * The maximum number of layers that one set of emission parameters can
+ * remap.
+ */
+#define EVENT_MAXLMAP (256)
+
+/*
+ * Emission parameters.
+ * 
+ * Use event_param_init() to initialize the structure to parameters
+ * that leave every event unchanged.
+ */
+typedef struct {
+  
+  /*
+   * The number of semitones to add to the pitch of each note.  Each
+   * pitch must still be in range [NMF_MINPITCH, NMF_MAXPITCH]
+   * afterwards.
+   */
+  int32_t pitch;
+  
+  /*
+   * The number of quanta to add to the time offset of each section,
+   * note, and cue.  Zero or greater.
+   */
+  int32_t t;
+  
+  /*
+   * The number of layers that are remapped, in range [0,
+   * EVENT_MAXLMAP].
+   */
+  int32_t lmap_count;
+  
+  /*
+   * The layers that are remapped.  The first lmap_count elements of
+   * lmap_from are one-indexed layer numbers, none of which may appear
+   * twice, and the matching elements of lmap_to are the layer numbers
+   * that notes in those layers are moved to.  Layers that are not in
+   * lmap_from are not changed.  Layer numbers are in range [1,
+   * NOIR_MAXLAYER].
+   */
+  int32_t lmap_from[EVENT_MAXLMAP];
+  int32_t lmap_to[EVENT_MAXLMAP];
+  
+  /*
+   * The articulation that each articulation is remapped to.  Each
+   * element is in range [0, NMF_MAXART].
+   */
+  int32_t amap[NMF_MAXART + 1];
+  
+} EVENT_PARAM;
+
+/*
+ * Initialize emission parameters so that they leave every event
+ * unchanged.
+ * 
+ * Parameters:
+ * 
+ *   pp - the emission parameters to initialize
+ */
+void event_param_init(EVENT_PARAM *pp);
+
+/*
+ * Set the emission parameters of the main output.
+ * 
+ * The parameters are copied.  A fault occurs if they are invalid, or if
+ * any events have been added or the module has finished.
+ * 
+ * Parameters:
+ * 
+ *   pp - the emission parameters
+ */
+void event_param(const EVENT_PARAM *pp);
+
+/*
+ * Add a variant of the output.
+ * 
+ * The variant receives every section, note, and cue, changed by its own
+ * emission parameters, which are copied.  event_finish() writes it to
+ * pf, which must be open for writing and must stay open until then.
+ * The caller is responsible for closing pf afterwards.
+ * 
+ * A fault occurs if the parameters are invalid, if check mode has been
+ * selected, or if any events have been added or the module has
+ * finished.  The function fails if EVENT_MAXVAR variants have already
+ * been added.
+ * 
+ * Parameters:
+ * 
+ *   pp - the emission parameters of the variant
+ * 
+ *   pf - the file to write the variant to
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if too many variants
+ */
+int event_variant(const EVENT_PARAM *pp, FILE *pf);
+
+/*
+ * Select check mode.
+ * 
+ * See the module description.  The emission parameters of the main
+ * output still apply.  A fault occurs if any variants or events have
+ * been added or the module has finished.
+ */
+void event_check(void);
+
+/*
+ * Set the event budgets.
+ * 
+ * Once max_events events have been added, adding another fails with
+ * ERR_EVBUDGET.  The outputs may hold no more than max_bytes bytes of
+ * NMF note records, counting every variant, after which adding another
+ * event fails with ERR_MEMBUDGET; this budget does not apply in check
+ * mode, which holds no events.  A replay fails before anything is
+ * added if all of it would not fit.  Either budget is unlimited if it
+ * is zero, which is the default.  Negative values cause a fault, and so
+ * does calling this after any events have been added or the module has
+ * finished.
+ * 
+ * Parameters:
+ * 
+ *   max_events - the event budget, or zero
+ * 
+ *   max_bytes - the event buffer budget in bytes, or zero
+ */
+void event_budget(int64_t max_events, int64_t max_bytes);
+
+/*
+ * Select the part of the piece to write.
+ * 
+ * Only events in sections s0 up to and including s1 that begin at time
+ * offsets from t0 up to but excluding t1 are written.  Sections are
+ * numbered from zero, and time offsets are before any emission
+ * parameters are applied.  s0 must be zero or greater, s1 must be at
+ * least s0 and less than NMF_MAXSECT, t0 must be zero or greater, and
+ * t1 must be at least t0, or a fault occurs.  A fault also occurs if
+ * any events have been added or the module has finished.
+ * 
+ * Parameters:
+ * 
+ *   s0 - the first section
+ * 
+ *   s1 - the last section
+ * 
+ *   t0 - the first time offset
+ * 
+ *   t1 - the time offset after the last
+ */
+void event_select(int32_t s0, int32_t s1, int32_t t0, int32_t t1);
+
+/*
+ * Check whether an event would be selected.
+ * 
+ * Everything is selected if event_select() has not been called.
+ * 
+ * Parameters:
+ * 
+ *   t - the time offset of the event
+ * 
+ *   sect - the section of the event
+ * 
+ * Return:
+ * 
+ *   non-zero if the event would be written, zero if not
+ */
+int event_selected(int32_t t, int32_t sect);
+
+/*
+ * Get the number of sections that have been defined, counting the
+ * first section, which is always there.
+ * 
+ * This may be called at any time, including after event_finish().
+ * 
+ * Return:
+ * 
+ *   the number of sections
+ */
+int32_t event_sections(void);
+
+/*
+ * Get the time offset where a section begins.
+ * 
+ * sect must be zero or greater and less than event_sections(), or a
+ * fault occurs.  This is the offset that was given to event_section(),
+ * before any emission parameters are applied, or zero for the first
+ * section.  This may be called at any time, including after
+ * event_finish().
+ * 
+ * Parameters:
+ * 
+ *   sect - the section
+ * 
+ * Return:
+ * 
+ *   the time offset where the section begins
+ */
+int32_t event_start(int32_t sect);
+
 /*
  * Define a new section beginning at the given offset in quanta.
  * 
@@ -29,7 +276,9 @@
  * to the offset of the previous section or a fault occurs.
  * 
  * If the number of sections exceeds NMF_MAXSECT, then the function will
- * fail.
+ * fail with ERR_MANYSECT.  If the offset is out of range after the
+ * emission parameters of the main output or a variant are applied, the
+ * function fails with ERR_LONGPIECE.
  * 
  * A fault occurs if this is called after event_finish().
  * 
@@ -37,11 +286,13 @@
  * 
  *   offset - the offset of the new section
  * 
+ *   per - pointer to variable to receive error code
+ * 
  * Return:
  * 
- *   non-zero if successful, zero if too many sections
+ *   non-zero if successful, zero if error
  */
-int event_section(int32_t offset);
+int event_section(int32_t offset, int *per);
 
 /*
  * Define a new note event.
@@ -76,8 +327,15 @@ int event_section(int32_t offset);
  * given here.  The layer parameter is in [1, NOIR_MAXLAYER], where the
  * constant NOIR_MAXLAYER is given in noirdef.h
  * 
+ * The emission parameters of the main output and of each variant are
+ * applied to the note before it is added to their buffers.
+ * 
  * A fault occurs if any of the parameters are invalid.  The function
- * fails if too many notes have been added.
+ * fails with ERR_MANYNOTES if too many notes have been added, with
+ * ERR_TRANSRNG if the pitch is out of range after the emission
+ * parameters are applied, with ERR_LONGPIECE if the time offset is,
+ * or with ERR_EVBUDGET or ERR_MEMBUDGET if it would exceed a budget
+ * (see event_budget()).
  * 
  * A fault occurs if this is called after event_finish().
  * 
@@ -95,17 +353,127 @@ int event_section(int32_t offset);
  * 
  *   layer - the layer within that section the note belongs to
  * 
+ *   per - pointer to variable to receive error code
+ * 
  * Return:
  * 
- *   non-zero if successful, zero if too many notes
+ *   non-zero if successful, zero if error
  */
 int event_note(
-    int32_t t,
-    int32_t dur,
-    int32_t pitch,
-    int32_t art,
-    int32_t sect,
-    int32_t layer);
+    int32_t   t,
+    int32_t   dur,
+    int32_t   pitch,
+    int32_t   art,
+    int32_t   sect,
+    int32_t   layer,
+    int     * per);
+
+/*
+ * Define a chord of notes.
+ * 
+ * This is the same as calling event_note() for each pitch in turn,
+ * except that everything is checked once before anything is added, so
+ * that upon failure nothing has been added.  pPitch is an array of n
+ * pitches in ascending order.  n may be zero, in which case nothing
+ * happens.  The other parameters are the same as for event_note(), and
+ * dur may be negative for grace notes.
+ * 
+ * A fault occurs if any of the parameters are invalid.  The function
+ * fails with the same errors as event_note().
+ * 
+ * A fault occurs if this is called after event_finish().
+ * 
+ * Parameters:
+ * 
+ *   t - the time offset of the chord
+ * 
+ *   dur - the duration of each note
+ * 
+ *   pPitch - the pitches of the chord
+ * 
+ *   n - the number of pitches in the chord
+ * 
+ *   art - the articulation of the notes
+ * 
+ *   sect - the section the notes belong to
+ * 
+ *   layer - the layer within that section the notes belong to
+ * 
+ *   per - pointer to variable to receive error code
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if error
+ */
+int event_chord(
+          int32_t   t,
+          int32_t   dur,
+    const int32_t * pPitch,
+          int32_t   n,
+          int32_t   art,
+          int32_t   sect,
+          int32_t   layer,
+          int     * per);
+
+/*
+ * Define a run of repeated chords.
+ * 
+ * This is the same as calling event_note() for each pitch of the chord,
+ * count times over, at time offsets t, t + dur, t + 2 * dur, and so
+ * forth, except that everything is checked once before anything is
+ * added.  The first chord has articulation art0 and the others have
+ * articulation art.
+ * 
+ * dur must be greater than zero, since grace notes can not be repeated
+ * this way, and count must be at least one.  pPitch is an array of n
+ * pitches in ascending order, which are added in that order within
+ * each chord.  n may be zero, in which case nothing happens.
+ * 
+ * A fault occurs if any of the parameters are invalid.  The function
+ * fails with the same errors as event_note(), checking that the whole
+ * run fits before anything is added, so that upon failure nothing has
+ * been added.
+ * 
+ * A fault occurs if this is called after event_finish().
+ * 
+ * Parameters:
+ * 
+ *   t - the time offset of the first chord
+ * 
+ *   dur - the duration of each note, which is also the distance
+ *   between the chords
+ * 
+ *   count - the number of chords
+ * 
+ *   pPitch - the pitches of the chord
+ * 
+ *   n - the number of pitches in the chord
+ * 
+ *   art0 - the articulation of the first chord
+ * 
+ *   art - the articulation of the other chords
+ * 
+ *   sect - the section the notes belong to
+ * 
+ *   layer - the layer within that section the notes belong to
+ * 
+ *   per - pointer to variable to receive error code
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if error
+ */
+int event_run(
+          int32_t   t,
+          int32_t   dur,
+          int32_t   count,
+    const int32_t * pPitch,
+          int32_t   n,
+          int32_t   art0,
+          int32_t   art,
+          int32_t   sect,
+          int32_t   layer,
+          int     * per);
 
 /*
  * Define a new cue event.
@@ -129,27 +497,36 @@ int event_note(
  * least significant bits in the layer field and the most significant
  * bits in the articulation field.
  * 
+ * Only the time offset of a cue is changed by the emission parameters,
+ * since its other fields hold the cue number.
+ * 
  * A fault occurs if any of the parameters are invalid.  The function
- * fails if too many notes and cues have been added.
+ * fails with ERR_MANYNOTES if too many notes and cues have been added,
+ * with ERR_LONGPIECE if the time offset is out of range after the
+ * emission parameters are applied, or with ERR_EVBUDGET or
+ * ERR_MEMBUDGET if it would exceed a budget (see event_budget()).
  * 
  * A fault occurs if this is called after event_finish().
  * 
  * Parameters:
  * 
  *   t - the time offset of the cue
- *
+ * 
  *   sect - the section the cue belongs to
  * 
  *   cue_num - the number of the cue within the section
  * 
+ *   per - pointer to variable to receive error code
+ * 
  * Return:
  * 
- *   non-zero if successful, zero if too many notes
+ *   non-zero if successful, zero if error
  */
 int event_cue(
-    int32_t t,
-    int32_t sect,
-    int32_t cue_num);
+    int32_t   t,
+    int32_t   sect,
+    int32_t   cue_num,
+    int     * per);
 
 /*
  * Flip grace note offsets at the end of the event buffer.
@@ -167,6 +544,8 @@ int event_cue(
  * 
  * If count is zero or max_offs is one, then the function does nothing.
  * 
+ * The same events are flipped in every variant.
+ * 
  * Otherwise, the grace note offsets of each of the selected grace note
  * events are flipped so that the grace note sequence is in the proper
  * order.
@@ -181,15 +560,83 @@ int event_cue(
  */
 void event_flip(int32_t count, int32_t max_offs);
 
+/*
+ * Get the number of events that have been added.
+ * 
+ * This counts both notes and cues.  The count is the same in every
+ * variant.  A fault occurs if this is called after event_finish().
+ * 
+ * Return:
+ * 
+ *   the number of events
+ */
+int32_t event_count(void);
+
+/*
+ * Replay the events at the end of the event buffer.
+ * 
+ * first is the index of the first event to replay, where the events are
+ * indexed in the order they were added, starting at zero.  The events
+ * from first to the end of the buffer are added again count times, in
+ * the same order.  Each time, their time offsets are shifted by len
+ * quanta more than the time before.  first must be in range zero up to
+ * and including event_count(), len must be zero or greater, and count
+ * must be zero or greater, or a fault occurs.
+ * 
+ * tmax is the latest time offset among the events to replay, before
+ * any emission parameters are applied, which the caller must already
+ * know so that the events do not have to be read to check the range.
+ * It must be zero or greater, or a fault occurs.  It is ignored if
+ * there are no events to replay.
+ * 
+ * Any grace note sequence in the replayed events must already have been
+ * flipped with event_flip().
+ * 
+ * The function fails with ERR_LONGPIECE if a shifted time offset would
+ * be out of range, or with ERR_EVBUDGET or ERR_MEMBUDGET if the
+ * replays would exceed a budget, in which cases nothing is added, or
+ * with ERR_MANYNOTES if too many events have been added.
+ * 
+ * A fault occurs if this is called after event_finish().
+ * 
+ * Parameters:
+ * 
+ *   first - the index of the first event to replay
+ * 
+ *   len - the shift of each replay in quanta
+ * 
+ *   count - the number of replays
+ * 
+ *   tmax - the latest time offset among the events to replay
+ * 
+ *   per - pointer to variable to receive error code
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if error
+ */
+int event_replay(
+    int32_t   first,
+    int32_t   len,
+    int32_t   count,
+    int32_t   tmax,
+    int     * per);
+
 /*
  * Output the section table and all the notes in Noir Music File (NMF)
  * format to the given file.
  * 
  * pf is the file to write the output to.  It must be open for writing
- * or undefined behavior occurs.  Writing is fully sequential.
+ * or undefined behavior occurs.  Writing is fully sequential.  Each
+ * variant is then written to its own file.  Only the selected events
+ * are written, if there is a selection.  In check mode, nothing is
+ * written.
  * 
  * At least one note must have been defined with event_note() or the
- * function will fail.
+ * function fails with ERR_EMPTY.  If there is a selection, at least one
+ * note must have been selected, or the function fails with
+ * ERR_EMPTYSEL.  ERR_EMPTY is also returned if the output can not be
+ * written.
  * 
  * This function may only be used once.  Once the function has been
  * called, no further calls can be made to the event buffer module.
@@ -198,10 +645,12 @@ void event_flip(int32_t count, int32_t max_offs);
  * 
  *   pf - the file to write the NMF output to
  * 
+ *   per - pointer to variable to receive the error code
+ * 
  * Return:
  * 
- *   non-zero if successful, zero if no notes have been defined
+ *   non-zero if successful, zero if error
  */
-int event_finish(FILE *pf);
+int event_finish(FILE *pf, int *per);
 
 #endif
@@ -0,0 +1,803 @@
+/*
+ * incl.c
+ * 
+ * Implementation of incl.h
+ * 
+ * See the header for further information.
+ */
+
+/*
+ * On POSIX systems, libraries are compiled by child processes.  Define
+ * INCL_NO_SPAWN to only take them from the cache directory.  The X/Open
+ * level is asked for because realpath() is not part of base POSIX.
+ */
+#if !defined(INCL_NO_SPAWN) && \
+    (defined(__unix__) || (defined(__APPLE__) && defined(__MACH__)))
+#define INCL_SPAWN
+#define _XOPEN_SOURCE 700
+#endif
+
+#include "incl.h"
+#include "ir.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef INCL_SPAWN
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <spawn.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+extern char **environ;
+#endif
+
+/*
+ * Constants
+ * =========
+ */
+
+/*
+ * The FNV-1a offset basis and prime used to hash library content.
+ */
+#define INCL_BASIS (UINT64_C(0xcbf29ce484222325))
+#define INCL_PRIME (UINT64_C(0x100000001b3))
+
+/*
+ * The number of bytes read from a library at a time.
+ */
+#define INCL_READSIZE (65536)
+
+/*
+ * The maximum number of distinct libraries whose instructions are kept
+ * in memory for the rest of the run.  Further libraries are read again
+ * each time they are included.
+ */
+#define INCL_MAXLIB (64)
+
+/*
+ * The size of the buffer for the resolved path to the compiler
+ * program.
+ */
+#ifdef INCL_SPAWN
+#ifdef PATH_MAX
+#define INCL_EXESIZE (PATH_MAX + 1)
+#else
+#define INCL_EXESIZE (4097)
+#endif
+#endif
+
+/*
+ * The suffix of program files in the cache directory.
+ */
+#define INCL_SUFFIX ".nir"
+
+/*
+ * The name of temporary program files in the temporary directory, in
+ * the form that mkstemp() takes.
+ */
+#define INCL_TMPNAME "noirXXXXXX"
+
+/*
+ * Type declarations
+ * =================
+ */
+
+/*
+ * A library that has been read.
+ */
+typedef struct {
+  
+  /*
+   * The content hash and length of the library.
+   */
+  uint64_t hash;
+  int64_t len;
+  
+  /*
+   * The dynamically allocated instructions of the library, excluding
+   * the EOF instruction, and their number.
+   */
+  NVM_INSTR *pa;
+  int32_t count;
+  
+} INCL_LIB;
+
+/*
+ * Static data
+ * ===========
+ */
+
+/*
+ * Flag indicating whether the module has been initialized.
+ */
+static int m_incl_init = 0;
+
+/*
+ * Flag indicating whether including is allowed.
+ */
+static int m_incl_allow = 0;
+
+/*
+ * The path to the compiler program, the cache directory or NULL, and
+ * the budget spec or NULL.
+ * 
+ * m_incl_pSelf points to m_incl_exe when the program could be located
+ * by incl_locate().
+ */
+static const char *m_incl_pSelf = NULL;
+#ifdef INCL_SPAWN
+static char m_incl_exe[INCL_EXESIZE];
+#endif
+static const char *m_incl_pDir = NULL;
+static const char *m_incl_pBudget = NULL;
+
+/*
+ * The include depth of this process, which is zero unless it was
+ * started to compile a library.
+ */
+static int m_incl_depth = 0;
+
+/*
+ * The content hashes of the libraries that the ancestors of this
+ * process are compiling, from the outermost, and how many there are.
+ */
+static uint64_t m_incl_chain[INCL_MAXDEPTH];
+static int m_incl_chainLen = 0;
+
+/*
+ * The libraries that have been read, and how many there are.
+ */
+static INCL_LIB m_incl_lib[INCL_MAXLIB];
+static int32_t m_incl_libCount = 0;
+
+/*
+ * The read buffer for hashing libraries.
+ */
+static unsigned char m_incl_buf[INCL_READSIZE];
+
+/*
+ * Local functions
+ * ===============
+ */
+
+/* Prototypes */
+static int incl_hash(
+    const char     * pPath,
+          uint64_t * pHash,
+          int64_t  * pLen,
+          int      * pNest);
+static const char *incl_locate(const char *pSelf);
+static int incl_compile(
+    const char     * pSrc,
+    const char     * pProg,
+          uint64_t   hash);
+static int incl_load(
+    const char       * pSrc,
+          uint64_t     hash,
+          int64_t      len,
+          int          nest,
+          NVM_INSTR ** ppa,
+          int32_t    * pCount,
+          int        * per);
+
+/*
+ * Hash the content of a library.
+ * 
+ * *pNest is set if the library contains a % character anywhere, which
+ * means it might include other libraries.
+ * 
+ * Parameters:
+ * 
+ *   pPath - the path to the library
+ * 
+ *   pHash - pointer to variable to receive the hash
+ * 
+ *   pLen - pointer to variable to receive the length in bytes
+ * 
+ *   pNest - pointer to variable to receive the nesting flag
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if the library could not be read
+ */
+static int incl_hash(
+    const char     * pPath,
+          uint64_t * pHash,
+          int64_t  * pLen,
+          int      * pNest) {
+  
+  int status = 1;
+  FILE *pf = NULL;
+  uint64_t h = INCL_BASIS;
+  int64_t len = 0;
+  int nest = 0;
+  size_t n = 0;
+  size_t i = 0;
+  
+  /* Check parameters */
+  if ((pPath == NULL) || (pHash == NULL) || (pLen == NULL) ||
+      (pNest == NULL)) {
+    abort();
+  }
+  
+  /* Open the library */
+  pf = fopen(pPath, "rb");
+  if (pf == NULL) {
+    status = 0;
+  }
+  
+  /* Hash each block of content */
+  while (status) {
+    n = fread(m_incl_buf, 1, INCL_READSIZE, pf);
+    for(i = 0; i < n; i++) {
+      h = (h ^ ((uint64_t) m_incl_buf[i])) * INCL_PRIME;
+      if (m_incl_buf[i] == ASCII_PERCENT) {
+        nest = 1;
+      }
+    }
+    len += (int64_t) n;
+    
+    if (n < INCL_READSIZE) {
+      if (ferror(pf)) {
+        status = 0;
+      }
+      break;
+    }
+  }
+  
+  /* Close the library */
+  if (pf != NULL) {
+    fclose(pf);
+    pf = NULL;
+  }
+  
+  /* Store the results */
+  if (status) {
+    *pHash = h;
+    *pLen = len;
+    *pNest = nest;
+  }
+  
+  /* Return status */
+  return status;
+}
+
+/*
+ * Locate the compiler program.
+ * 
+ * pSelf is the path the program was started with, normally argv[0].
+ * Where the system can say which program is running, through
+ * /proc/self/exe, that is used, so that neither the name the program
+ * was started under nor a later change of directory matters.
+ * Otherwise, a path with a slash is made absolute, and a bare name is
+ * kept so that it is looked up on the PATH the same way the shell
+ * found it.  If the path can not be resolved, pSelf is used as it is.
+ * 
+ * Parameters:
+ * 
+ *   pSelf - the path the program was started with
+ * 
+ * Return:
+ * 
+ *   the path to use for starting the program
+ */
+static const char *incl_locate(const char *pSelf) {
+  
+  const char *pResult = NULL;
+#ifdef INCL_SPAWN
+  ssize_t rlen = 0;
+  char *pReal = NULL;
+#endif
+  
+  /* Check parameter */
+  if (pSelf == NULL) {
+    abort();
+  }
+  
+  /* Use the path as it is unless it can be resolved */
+  pResult = pSelf;
+  
+#ifdef INCL_SPAWN
+  /* Ask the system which program is running */
+  rlen = readlink("/proc/self/exe", m_incl_exe, INCL_EXESIZE - 1);
+  if ((rlen > 0) && (rlen < INCL_EXESIZE - 1)) {
+    /* The system knows, so use that */
+    m_incl_exe[rlen] = 0;
+    pResult = m_incl_exe;
+    
+  } else if (strchr(pSelf, '/') != NULL) {
+    /* Otherwise, make a path with a slash absolute */
+    pReal = realpath(pSelf, NULL);
+    if (pReal != NULL) {
+      if (strlen(pReal) < INCL_EXESIZE) {
+        strcpy(m_incl_exe, pReal);
+        pResult = m_incl_exe;
+      }
+      free(pReal);
+      pReal = NULL;
+    }
+  }
+#endif
+  
+  /* Return the path */
+  return pResult;
+}
+
+/*
+ * Compile a library to a program file in a child process.
+ * 
+ * The child is the compiler program itself, with the library as
+ * standard input and the --check and --save-ir options, so that it only
+ * writes the program file and builds no NMF output.  It inherits
+ * standard error, so it reports its own errors, and it shares the
+ * cache directory.  The hash of the library is added to the chain the
+ * child inherits, so that it fails if the library includes itself.
+ * 
+ * Parameters:
+ * 
+ *   pSrc - the path to the library
+ * 
+ *   pProg - the path to the program file to write
+ * 
+ *   hash - the content hash of the library
+ * 
+ * Return:
+ * 
+ *   non-zero if the child compiled the library successfully, zero
+ *   otherwise
+ */
+static int incl_compile(
+    const char     * pSrc,
+    const char     * pProg,
+          uint64_t   hash) {
+  
+  int status = 1;
+  
+#ifdef INCL_SPAWN
+  const char *argv[9];
+  int argc = 0;
+  char **envp = NULL;
+  char dvar[64];
+  char cvar[64 + (INCL_MAXDEPTH + 1) * 17];
+  size_t clen = 0;
+  posix_spawn_file_actions_t fa;
+  pid_t pid = 0;
+  int wst = 0;
+  int envc = 0;
+  int i = 0;
+  int j = 0;
+  size_t vlen = 0;
+  size_t wlen = 0;
+  
+  /* Check parameters */
+  if ((pSrc == NULL) || (pProg == NULL)) {
+    abort();
+  }
+  
+  /* Build the arguments */
+  argv[argc] = m_incl_pSelf;
+  argc++;
+  argv[argc] = "--check";
+  argc++;
+  argv[argc] = "--save-ir";
+  argc++;
+  argv[argc] = pProg;
+  argc++;
+  if (m_incl_pDir != NULL) {
+    argv[argc] = "--include-cache";
+    argc++;
+    argv[argc] = m_incl_pDir;
+    argc++;
+  }
+  if (m_incl_pBudget != NULL) {
+    argv[argc] = "--budget";
+    argc++;
+    argv[argc] = m_incl_pBudget;
+    argc++;
+  }
+  argv[argc] = NULL;
+  
+  /* Build the environment, replacing the include depth and the chain
+   * of libraries being compiled, which gets this library added */
+  sprintf(dvar, "%s=%d", INCL_ENVDEPTH, m_incl_depth + 1);
+  vlen = strlen(INCL_ENVDEPTH);
+  
+  sprintf(cvar, "%s=", INCL_ENVCHAIN);
+  wlen = strlen(INCL_ENVCHAIN);
+  clen = strlen(cvar);
+  for(i = 0; i < m_incl_chainLen; i++) {
+    sprintf(cvar + clen, "%016llx,", (unsigned long long) m_incl_chain[i]);
+    clen += 17;
+  }
+  sprintf(cvar + clen, "%016llx", (unsigned long long) hash);
+  
+  for(envc = 0; environ[envc] != NULL; envc++);
+  envp = (char **) malloc(((size_t) envc + 3) * sizeof(char *));
+  if (envp == NULL) {
+    abort();
+  }
+  for(i = 0; i < envc; i++) {
+    if (((strncmp(environ[i], INCL_ENVDEPTH, vlen) != 0) ||
+          (environ[i][vlen] != '=')) &&
+        ((strncmp(environ[i], INCL_ENVCHAIN, wlen) != 0) ||
+          (environ[i][wlen] != '='))) {
+      envp[j] = environ[i];
+      j++;
+    }
+  }
+  envp[j] = dvar;
+  envp[j + 1] = cvar;
+  envp[j + 2] = NULL;
+  
+  /* Redirect standard input from the library and standard output to
+   * the null device */
+  if (posix_spawn_file_actions_init(&fa)) {
+    abort();
+  }
+  if (posix_spawn_file_actions_addopen(&fa, 0, pSrc, O_RDONLY, 0) ||
+      posix_spawn_file_actions_addopen(
+        &fa, 1, "/dev/null", O_WRONLY, 0)) {
+    abort();
+  }
+  
+  /* Start the child and wait for it */
+  if (posix_spawnp(&pid, m_incl_pSelf, &fa, NULL,
+                    (char * const *) argv, envp)) {
+    status = 0;
+  }
+  if (status) {
+    while (waitpid(pid, &wst, 0) < 0) {
+      if (errno != EINTR) {
+        status = 0;
+        break;
+      }
+    }
+  }
+  if (status) {
+    if ((!WIFEXITED(wst)) || (WEXITSTATUS(wst) != 0)) {
+      status = 0;
+    }
+  }
+  
+  /* Release the spawn data */
+  posix_spawn_file_actions_destroy(&fa);
+  free(envp);
+  envp = NULL;
+  
+#else
+  /* Check parameters */
+  if ((pSrc == NULL) || (pProg == NULL)) {
+    abort();
+  }
+  
+  /* The hash is only passed on to child processes */
+  (void) hash;
+  
+  /* Libraries can not be compiled without child processes */
+  status = 0;
+#endif
+  
+  /* Return status */
+  return status;
+}
+
+/*
+ * Get the instructions of a library that is not in memory yet.
+ * 
+ * The program file in the cache directory is used if there is one and
+ * it can be read.  Otherwise, the library is compiled, to the cache
+ * directory if there is one and nest is zero, or to a temporary file
+ * that is removed afterwards.
+ * 
+ * Parameters:
+ * 
+ *   pSrc - the path to the library
+ * 
+ *   hash - the content hash of the library
+ * 
+ *   len - the length of the library
+ * 
+ *   nest - non-zero if the library might include other libraries
+ * 
+ *   ppa - pointer to variable to receive the instruction array, as
+ *   from ir_fetch()
+ * 
+ *   pCount - pointer to variable to receive the instruction count
+ * 
+ *   per - pointer to variable to receive the error code
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if error
+ */
+static int incl_load(
+    const char       * pSrc,
+          uint64_t     hash,
+          int64_t      len,
+          int          nest,
+          NVM_INSTR ** ppa,
+          int32_t    * pCount,
+          int        * per) {
+  
+  int status = 1;
+  int found = 0;
+  int temp = 0;
+  int dummy = 0;
+  char *pProg = NULL;
+#ifdef INCL_SPAWN
+  const char *pTmpDir = NULL;
+  int fd = -1;
+#endif
+  
+  /* Check parameters */
+  if ((pSrc == NULL) || (ppa == NULL) || (pCount == NULL) ||
+      (per == NULL)) {
+    abort();
+  }
+  
+  /* Try the program file in the cache directory */
+  if ((m_incl_pDir != NULL) && (!nest)) {
+    pProg = (char *) malloc(strlen(m_incl_pDir) + 64);
+    if (pProg == NULL) {
+      abort();
+    }
+    sprintf(pProg, "%s/%016llx-%llx%s",
+              m_incl_pDir,
+              (unsigned long long) hash,
+              (unsigned long long) len,
+              INCL_SUFFIX);
+    
+    if (ir_fetch(pProg, ppa, pCount, &dummy)) {
+      found = 1;
+    }
+    
+  } else {
+#ifdef INCL_SPAWN
+    /* Make a temporary file to compile to */
+    pTmpDir = getenv("TMPDIR");
+    if ((pTmpDir == NULL) || (pTmpDir[0] == 0)) {
+      pTmpDir = "/tmp";
+    }
+    pProg = (char *) malloc(strlen(pTmpDir) + strlen(INCL_TMPNAME) + 2);
+    if (pProg == NULL) {
+      abort();
+    }
+    sprintf(pProg, "%s/%s", pTmpDir, INCL_TMPNAME);
+    
+    fd = mkstemp(pProg);
+    if (fd >= 0) {
+      close(fd);
+      fd = -1;
+      temp = 1;
+    } else {
+      status = 0;
+      *per = ERR_INCLUDE;
+    }
+#else
+    status = 0;
+    *per = ERR_INCLUDE;
+#endif
+  }
+  
+  /* Compile the library if necessary and read the result */
+  if (status && (!found)) {
+    if (m_incl_depth >= INCL_MAXDEPTH) {
+      status = 0;
+      *per = ERR_INCDEEP;
+    }
+    
+    if (status) {
+      if (!incl_compile(pSrc, pProg, hash)) {
+        status = 0;
+        *per = ERR_INCLUDE;
+      }
+    }
+    
+    if (status) {
+      if (!ir_fetch(pProg, ppa, pCount, &dummy)) {
+        status = 0;
+        *per = ERR_INCLUDE;
+      }
+    }
+  }
+  
+  /* Remove the temporary file and free the path */
+  if (temp) {
+    remove(pProg);
+  }
+  free(pProg);
+  pProg = NULL;
+  
+  /* Return status */
+  return status;
+}
+
+/*
+ * Public function implementations
+ * ===============================
+ * 
+ * See the header for specifications.
+ */
+
+/*
+ * incl_init function.
+ */
+void incl_init(
+    const char * pSelf,
+    const char * pDir,
+    const char * pBudget,
+    int          allow) {
+  
+  const char *pv = NULL;
+  char *pe = NULL;
+  long d = 0;
+  
+  /* Check state and update it */
+  if (m_incl_init) {
+    abort();
+  } else {
+    m_incl_init = 1;
+  }
+  
+  /* Check parameter */
+  if (pSelf == NULL) {
+    abort();
+  }
+  
+  /* Store the paths, locating the compiler program now, before
+   * anything could change the current directory */
+  m_incl_pSelf = incl_locate(pSelf);
+  m_incl_pDir = pDir;
+  m_incl_pBudget = pBudget;
+  m_incl_allow = allow;
+  
+  /* Get the include depth of this process */
+  pv = getenv(INCL_ENVDEPTH);
+  if (pv != NULL) {
+    d = strtol(pv, NULL, 10);
+    if (d < 0) {
+      d = 0;
+    } else if (d > INCL_MAXDEPTH) {
+      d = INCL_MAXDEPTH;
+    }
+    m_incl_depth = (int) d;
+  }
+  
+  /* Get the chain of libraries that the ancestors of this process are
+   * compiling, which is no longer than the depth */
+  pv = getenv(INCL_ENVCHAIN);
+  if (pv != NULL) {
+    while ((*pv != 0) && (m_incl_chainLen < INCL_MAXDEPTH)) {
+      m_incl_chain[m_incl_chainLen] =
+        (uint64_t) strtoull(pv, &pe, 16);
+      m_incl_chainLen++;
+      if (*pe != ',') {
+        break;
+      }
+      pv = pe + 1;
+    }
+  }
+}
+
+/*
+ * incl_run function.
+ */
+int incl_run(const char *pPath, int64_t pos, int64_t *ppos, int *per) {
+  
+  int status = 1;
+  uint64_t hash = 0;
+  int64_t len = 0;
+  int nest = 0;
+  int32_t x = 0;
+  int32_t i = 0;
+  INCL_LIB lib;
+  NVM_INSTR ins;
+  
+  /* Initialize structures */
+  memset(&lib, 0, sizeof(INCL_LIB));
+  
+  /* Check state */
+  if (!m_incl_init) {
+    abort();
+  }
+  
+  /* Check parameters */
+  if ((pPath == NULL) || (ppos == NULL) || (per == NULL)) {
+    abort();
+  }
+  if ((strlen(pPath) < 1) || (strlen(pPath) > INCL_MAXPATH)) {
+    abort();
+  }
+  
+  /* Refuse to include anything if including is disabled */
+  if (!m_incl_allow) {
+    status = 0;
+    *per = ERR_NOINC;
+  }
+  
+  /* Hash the library */
+  if (status && (!incl_hash(pPath, &hash, &len, &nest))) {
+    status = 0;
+    *per = ERR_INCREAD;
+  }
+  
+  /* Fail if an ancestor process is compiling this same library */
+  if (status) {
+    for(i = 0; i < m_incl_chainLen; i++) {
+      if (m_incl_chain[i] == hash) {
+        status = 0;
+        *per = ERR_INCCYCLE;
+        break;
+      }
+    }
+  }
+  
+  /* Look for it among the libraries already read */
+  x = -1;
+  if (status) {
+    for(i = 0; i < m_incl_libCount; i++) {
+      if ((m_incl_lib[i].hash == hash) && (m_incl_lib[i].len == len)) {
+        x = i;
+        break;
+      }
+    }
+  }
+  
+  /* If not read yet, read it and check that it only uses operators that
+   * libraries may use, then keep it if there is room */
+  if (status && (x < 0)) {
+    lib.hash = hash;
+    lib.len = len;
+    if (!incl_load(pPath, hash, len, nest, &(lib.pa), &(lib.count), per)) {
+      status = 0;
+    }
+    
+    for(i = 0; status && (i < lib.count); i++) {
+      if (((lib.pa)[i].op == NVM_OP_SECTION) ||
+          ((lib.pa)[i].op == NVM_OP_RETURN) ||
+          ((lib.pa)[i].op == NVM_OP_SETBASE)) {
+        status = 0;
+        *per = ERR_INCOP;
+      }
+    }
+    
+    if (status && (m_incl_libCount < INCL_MAXLIB)) {
+      x = m_incl_libCount;
+      memcpy(&(m_incl_lib[x]), &lib, sizeof(INCL_LIB));
+      m_incl_libCount++;
+      lib.pa = NULL;
+    }
+  }
+  
+  /* Position for errors found before anything is emitted */
+  if (!status) {
+    *ppos = pos;
+  }
+  
+  /* Emit the instructions */
+  if (status) {
+    if (x >= 0) {
+      memcpy(&lib, &(m_incl_lib[x]), sizeof(INCL_LIB));
+    }
+    for(i = 0; i < lib.count; i++) {
+      memcpy(&ins, &((lib.pa)[i]), sizeof(NVM_INSTR));
+      ins.pos = pos;
+      if (!ir_emit(&ins, ppos, per)) {
+        status = 0;
+        break;
+      }
+    }
+  }
+  
+  /* Free the instructions unless they are kept */
+  if (x < 0) {
+    free(lib.pa);
+  }
+  lib.pa = NULL;
+  
+  /* Return status */
+  return status;
+}
@@ -0,0 +1,159 @@
+#ifndef INCL_H_INCLUDED
+#define INCL_H_INCLUDED
+
+/*
+ * incl.h
+ * 
+ * Include module of the Noir compiler.
+ * 
+ * The % operator includes another Noir notation file, called a library,
+ * at the point where it appears.  This module turns the library into
+ * instructions and emits them through the ir module, exactly as if the
+ * notation of the library had been written in place of the operator,
+ * so they run at the current cursor position, transposition, and layer
+ * state.
+ * 
+ * A library is never tokenized by the process that includes it.  It is
+ * compiled once by running the compiler again as a child process with
+ * the library as its input, saving the instruction stream to a program
+ * file (see ir.h), which is then read back with ir_fetch().  Libraries
+ * are identified by the length and a 64-bit hash of their content
+ * rather than their path, so a library that is included many times, or
+ * under different paths, is only compiled and read once per run.
+ * 
+ * If a cache directory is given, the program file of each library is
+ * kept there under a name made from its hash and length, so that later
+ * runs do not compile the library again until its content changes.  A
+ * library containing a % character might include other libraries,
+ * whose content is not part of its hash, so such libraries are never
+ * kept in the cache directory.  A cached program file that cannot be
+ * read is compiled again.  Without a cache directory, program files
+ * are written to temporary files and removed once they are read.
+ * 
+ * A library must be a complete Noir notation file that compiles on its
+ * own.  It may not use the $, @, or & operators, since the section and
+ * base layer belong to the file that includes it.  Libraries may
+ * include other libraries up to INCL_MAXDEPTH deep, which the child
+ * processes track through the INCL_ENVDEPTH environment variable.  A
+ * library may not include itself, directly or through other libraries,
+ * which the child processes detect by passing on the content hashes of
+ * the libraries they are compiling through the INCL_ENVCHAIN
+ * environment variable.
+ * 
+ * On POSIX platforms, child processes are started with posix_spawnp().
+ * Define INCL_NO_SPAWN to disable this, in which case libraries can
+ * only be included from a cache directory that already has them.
+ * 
+ * Requires the ir module, as well as the nvm and event modules because
+ * the ir module requires them.
+ */
+
+#include "noirdef.h"
+
+/*
+ * The maximum number of characters in a library path, excluding the
+ * terminating nul.
+ * 
+ * The include operation is lexed as one token, which holds at most
+ * TOKEN_MAXCHAR - 1 characters (see token.h).  The path is that token
+ * without the % and the semicolon, so it can not be longer than this,
+ * and a longer one fails to lex with ERR_LONGTOKEN.
+ */
+#define INCL_MAXPATH (29)
+
+/*
+ * The maximum depth of libraries including other libraries.
+ */
+#define INCL_MAXDEPTH (16)
+
+/*
+ * The environment variable that holds the include depth of a child
+ * process.
+ */
+#define INCL_ENVDEPTH "NOIR_INCLUDE_DEPTH"
+
+/*
+ * The environment variable that holds the content hashes of the
+ * libraries that the ancestors of a child process are compiling, from
+ * the outermost, as sixteen hexadecimal digits each, separated by
+ * commas.
+ */
+#define INCL_ENVCHAIN "NOIR_INCLUDE_CHAIN"
+
+/*
+ * Initialize the include module.
+ * 
+ * pSelf is the path the compiler program was started with, normally
+ * argv[0].  The program is located once, when this is called: through
+ * /proc/self/exe where the system has it, or else by making a path
+ * with a slash absolute, or else by looking a bare name up on the PATH
+ * the same way the shell would.  pDir is either NULL or the path to
+ * the cache directory, which must already exist.  pBudget is either
+ * NULL or a budget spec to pass on to the child processes with the
+ * --budget option.  The strings must remain valid while the module is
+ * in use.
+ * 
+ * If allow is zero, including is disabled, so that incl_run() fails
+ * with ERR_NOINC without reading any file or starting any process.
+ * 
+ * This must be called before incl_run(), and only once, or a fault
+ * occurs.
+ * 
+ * Parameters:
+ * 
+ *   pSelf - the path to the compiler program
+ * 
+ *   pDir - the cache directory, or NULL
+ * 
+ *   pBudget - the budget spec, or NULL
+ * 
+ *   allow - non-zero to allow including, zero to disable it
+ */
+void incl_init(
+    const char * pSelf,
+    const char * pDir,
+    const char * pBudget,
+    int          allow);
+
+/*
+ * Include a library.
+ * 
+ * pPath is the path to the library, relative to the current directory
+ * if it is not absolute.  It must have at least one and at most
+ * INCL_MAXPATH characters.
+ * 
+ * The instructions of the library are emitted with ir_emit(), all with
+ * the given position.  An error may therefore be returned for an
+ * instruction that was emitted earlier, in which case *ppos is set to
+ * its position, the same as ir_emit() does.  For any other error,
+ * *ppos is set to pos.
+ * 
+ * Errors are ERR_NOINC if including was disabled by incl_init(),
+ * ERR_INCREAD if the library cannot be read, ERR_INCCYCLE if the
+ * library is already being compiled by an ancestor process, so that it
+ * includes itself, ERR_INCLUDE if
+ * it does not compile or its program file cannot be read, ERR_INCOP if
+ * it uses an operator that libraries may not use, ERR_INCDEEP if
+ * libraries are nested too deeply, or an error from ir_emit().  The
+ * child process reports why a library does not compile on standard
+ * error.
+ * 
+ * Parameters:
+ * 
+ *   pPath - the path to the library
+ * 
+ *   pos - the position to give the instructions
+ * 
+ *   ppos - pointer to variable to receive the position in case of
+ *   error
+ * 
+ *   per - pointer to variable to receive the error number in case of
+ *   error
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if error
+ */
+int incl_run(const char *pPath, int64_t pos, int64_t *ppos, int *per);
+
+#endif
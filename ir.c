@@ -0,0 +1,1290 @@
+/*
+ * ir.c
+ * 
+ * Implementation of ir.h
+ * 
+ * See the header for further information.
+ */
+
+#include "ir.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Constants
+ * =========
+ */
+
+/*
+ * The signature at the start of a program file.
+ */
+#define IR_SIGNATURE "NoirIR01"
+
+/*
+ * The suffix added to the program file path for the temporary file
+ * that a new program file is written to.
+ */
+#define IR_TMPSUFFIX ".tmp"
+
+/*
+ * The number of instructions in a batch.
+ */
+#define IR_BATCH (1024)
+
+/*
+ * The number of bytes read at a time from a program file.
+ */
+#define IR_READSIZE (65536)
+
+/*
+ * The maximum number of bytes in a varint, which is enough for 64 bits.
+ */
+#define IR_MAXVARINT (10)
+
+/*
+ * The largest number of instructions that ir_fetch() reads from one
+ * program file.
+ */
+#define IR_FETCHMAX (1L << 24)
+
+/*
+ * Static data
+ * ===========
+ */
+
+/*
+ * The pending batch of instructions and the number of instructions in
+ * it.
+ */
+static NVM_INSTR m_ir_batch[IR_BATCH];
+static int32_t m_ir_count = 0;
+
+/*
+ * The number of instructions of the pending batch that each
+ * instruction stands for after the peephole pass.
+ * 
+ * Only entries for instructions that are run are valid.  When the pass
+ * folds instructions into one, the first is rewritten and the others
+ * are left where they are and skipped, so that their positions are
+ * still there for reporting errors.
+ */
+static int32_t m_ir_span[IR_BATCH];
+
+/*
+ * The number of instructions that reached the peephole pass, the
+ * number of them that it removed, and the number of repeats that it
+ * folded into multiples.  Folded repeats are not removed, since a
+ * multiple still runs each of them unless it can run them in bulk.
+ */
+static int64_t m_ir_total = 0;
+static int64_t m_ir_removed = 0;
+static int64_t m_ir_folded = 0;
+
+/*
+ * Flag indicating whether any instruction has been emitted, and flags
+ * indicating whether the EOF instruction has been emitted and whether
+ * it has been run.
+ */
+static int m_ir_used = 0;
+static int m_ir_ended = 0;
+static int m_ir_done = 0;
+
+/*
+ * Flag indicating whether ir_load() has been called.
+ */
+static int m_ir_loaded = 0;
+
+/*
+ * The program file being saved.
+ * 
+ * m_ir_pSave is the temporary file, or NULL if not saving.  m_ir_pPath
+ * is the program file path and m_ir_pTmp the dynamically allocated
+ * temporary file path.  m_ir_saveErr is set if writing failed.
+ */
+static FILE *m_ir_pSave = NULL;
+static const char *m_ir_pPath = NULL;
+static char *m_ir_pTmp = NULL;
+static int m_ir_saveErr = 0;
+
+/*
+ * The program file being loaded.
+ * 
+ * m_ir_pLoad is the file, m_ir_rbuf holds the bytes read from it, of
+ * which m_ir_rlen are valid and m_ir_rpos have been used.  m_ir_rerr
+ * is set if reading failed.
+ */
+static FILE *m_ir_pLoad = NULL;
+static unsigned char m_ir_rbuf[IR_READSIZE];
+static size_t m_ir_rlen = 0;
+static size_t m_ir_rpos = 0;
+static int m_ir_rerr = 0;
+
+/*
+ * Local functions
+ * ===============
+ */
+
+/* Prototypes */
+#ifdef IR_NO_RUNLOOP
+static int ir_run(const NVM_INSTR *pi, int *per);
+#endif
+#ifndef IR_NO_PEEPHOLE
+static int32_t ir_fold(int32_t i);
+#endif
+static void ir_peephole(void);
+static int ir_runBatch(int64_t *ppos, int *per);
+
+static void ir_putU(uint64_t v);
+static void ir_putS(int64_t v);
+static void ir_write(const NVM_INSTR *pi);
+
+static int ir_getByte(void);
+static int ir_getU(uint64_t *pv);
+static int ir_getS(int64_t *pv);
+static int ir_read(NVM_INSTR *pi);
+
+#ifdef IR_NO_RUNLOOP
+
+/*
+ * Make the nvm call for an instruction.
+ * 
+ * Parameters:
+ * 
+ *   pi - the instruction
+ * 
+ *   per - pointer to variable to receive error code
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if error
+ */
+static int ir_run(const NVM_INSTR *pi, int *per) {
+  
+  int status = 0;
+  
+  /* Check parameters */
+  if ((pi == NULL) || (per == NULL)) {
+    abort();
+  }
+  
+  /* Dispatch on the opcode */
+  switch (pi->op) {
+    case NVM_OP_EOF:
+      status = nvm_eof(per);
+      break;
+    
+    case NVM_OP_PSET:
+      status = nvm_pset(&(pi->ps), per);
+      break;
+    
+    case NVM_OP_DUR:
+      status = nvm_dur(pi->v, per);
+      break;
+    
+    case NVM_OP_REPEAT:
+      status = nvm_op_repeat(per);
+      break;
+    
+    case NVM_OP_MULTIPLE:
+      status = nvm_op_multiple(pi->v, per);
+      break;
+    
+    case NVM_OP_SECTION:
+      status = nvm_op_section(per);
+      break;
+    
+    case NVM_OP_RETURN:
+      status = nvm_op_return(per);
+      break;
+    
+    case NVM_OP_PUSHLOC:
+      status = nvm_op_pushloc(per);
+      break;
+    
+    case NVM_OP_RETLOC:
+      status = nvm_op_retloc(per);
+      break;
+    
+    case NVM_OP_POPLOC:
+      status = nvm_op_poploc(per);
+      break;
+    
+    case NVM_OP_PUSHTRANS:
+      status = nvm_op_pushtrans(pi->v, per);
+      break;
+    
+    case NVM_OP_POPTRANS:
+      status = nvm_op_poptrans(per);
+      break;
+    
+    case NVM_OP_IMMART:
+      status = nvm_op_immart((int) pi->v, per);
+      break;
+    
+    case NVM_OP_PUSHART:
+      status = nvm_op_pushart((int) pi->v, per);
+      break;
+    
+    case NVM_OP_POPART:
+      status = nvm_op_popart(per);
+      break;
+    
+    case NVM_OP_SETBASE:
+      status = nvm_op_setbase(pi->v, per);
+      break;
+    
+    case NVM_OP_PUSHLAYER:
+      status = nvm_op_pushlayer(pi->v, per);
+      break;
+    
+    case NVM_OP_POPLAYER:
+      status = nvm_op_poplayer(per);
+      break;
+    
+    case NVM_OP_CUE:
+      status = nvm_op_cue(pi->v, per);
+      break;
+    
+    case NVM_OP_TRYLOC:
+      status = nvm_op_tryloc(per);
+      break;
+    
+    case NVM_OP_TRYTRANS:
+      status = nvm_op_trytrans(pi->v, per);
+      break;
+    
+    case NVM_OP_TRYART:
+      status = nvm_op_tryart((int) pi->v, per);
+      break;
+    
+    case NVM_OP_TRYLAYER:
+      status = nvm_op_trylayer(pi->v, per);
+      break;
+    
+    case NVM_OP_BEGIN:
+      status = nvm_op_begin(per);
+      break;
+    
+    case NVM_OP_END:
+      status = nvm_op_end(pi->v, per);
+      break;
+    
+    default:
+      abort();  /* unrecognized opcode */
+  }
+  
+  /* Return status */
+  return status;
+}
+
+#endif
+
+#ifndef IR_NO_PEEPHOLE
+
+/*
+ * Fold the instructions of the pending batch that start at a given
+ * index into one, if they match one of the peephole patterns.
+ * 
+ * The instruction at index i is rewritten, and the ones after it that
+ * it now stands for are left alone.
+ * 
+ * Parameters:
+ * 
+ *   i - the index of the first instruction
+ * 
+ * Return:
+ * 
+ *   the index of the first instruction after the ones that the
+ *   instruction at i stands for
+ */
+static int32_t ir_fold(int32_t i) {
+  
+  int32_t j = 0;
+  NVM_INSTR *pi = NULL;
+  int pop = 0;
+  int tryop = 0;
+  
+  /* Check parameter */
+  if ((i < 0) || (i >= m_ir_count)) {
+    abort();
+  }
+  
+  /* Get the instruction */
+  pi = &(m_ir_batch[i]);
+  j = i + 1;
+  
+  /* Match the patterns */
+  switch (pi->op) {
+    case NVM_OP_REPEAT:
+      /* A run of repeats is a multiple */
+      while ((j < m_ir_count) && (m_ir_batch[j].op == NVM_OP_REPEAT)) {
+        j++;
+      }
+      if (j - i > 1) {
+        pi->op = NVM_OP_MULTIPLE;
+        pi->v = j - i;
+      }
+      break;
+    
+    case NVM_OP_PUSHLOC:
+    case NVM_OP_PUSHTRANS:
+    case NVM_OP_PUSHART:
+    case NVM_OP_PUSHLAYER:
+      /* A push that is popped at once only has to be checked */
+      if (pi->op == NVM_OP_PUSHLOC) {
+        pop = NVM_OP_POPLOC;
+        tryop = NVM_OP_TRYLOC;
+      } else if (pi->op == NVM_OP_PUSHTRANS) {
+        pop = NVM_OP_POPTRANS;
+        tryop = NVM_OP_TRYTRANS;
+      } else if (pi->op == NVM_OP_PUSHART) {
+        pop = NVM_OP_POPART;
+        tryop = NVM_OP_TRYART;
+      } else {
+        pop = NVM_OP_POPLAYER;
+        tryop = NVM_OP_TRYLAYER;
+      }
+      if ((j < m_ir_count) && (m_ir_batch[j].op == pop)) {
+        pi->op = tryop;
+        j++;
+      }
+      break;
+    
+    case NVM_OP_DUR:
+      /* A duration that is set again at once can take the new value,
+       * except when going from a non-grace duration to a grace
+       * duration, which flushes any grace notes before it */
+      while ((j < m_ir_count) && (m_ir_batch[j].op == NVM_OP_DUR) &&
+              ((pi->v == 0) || (m_ir_batch[j].v != 0))) {
+        pi->v = m_ir_batch[j].v;
+        j++;
+      }
+      break;
+    
+    case NVM_OP_IMMART:
+      /* An immediate articulation that is set again at once can take
+       * the new value */
+      while ((j < m_ir_count) && (m_ir_batch[j].op == NVM_OP_IMMART)) {
+        pi->v = m_ir_batch[j].v;
+        j++;
+      }
+      break;
+    
+    default:
+      break;
+  }
+  
+  /* Return the index after the folded instructions */
+  return j;
+}
+
+#endif
+
+/*
+ * Run the peephole pass over the pending batch.
+ * 
+ * This fills in m_ir_span for the batch.  See the header for the
+ * patterns that are rewritten.
+ */
+static void ir_peephole(void) {
+  
+  int32_t i = 0;
+  int32_t j = 0;
+  
+  /* Count the instructions */
+  m_ir_total += (int64_t) m_ir_count;
+  
+  /* Fold each instruction with the ones after it that it can stand
+   * for */
+  while (i < m_ir_count) {
+#ifdef IR_NO_PEEPHOLE
+    j = i + 1;
+#else
+    j = ir_fold(i);
+#endif
+    m_ir_span[i] = j - i;
+    if ((j - i > 1) && (m_ir_batch[i].op == NVM_OP_MULTIPLE)) {
+      m_ir_folded += (int64_t) (j - i);
+    } else {
+      m_ir_removed += (int64_t) (j - i - 1);
+    }
+    i = j;
+  }
+}
+
+/*
+ * Run the pending batch and empty it.
+ * 
+ * The peephole pass is run over the batch first.  Each instruction
+ * that runs successfully is also written to the program file if one is
+ * being saved.  If an instruction fails, the rest of the batch is
+ * dropped.
+ * 
+ * Parameters:
+ * 
+ *   ppos - pointer to variable to receive the position in case of
+ *   error
+ * 
+ *   per - pointer to variable to receive error code
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if error
+ */
+static int ir_runBatch(int64_t *ppos, int *per) {
+  
+  int status = 1;
+  int32_t fail = 0;
+  int32_t end = 0;
+  int32_t i = 0;
+#ifdef IR_NO_RUNLOOP
+  int32_t j = 0;
+  const NVM_INSTR *pi = NULL;
+#endif
+  
+  /* Check parameters */
+  if ((ppos == NULL) || (per == NULL)) {
+    abort();
+  }
+  
+  /* Rewrite the batch */
+  ir_peephole();
+  
+#ifdef IR_NO_RUNLOOP
+  /* Charge the batch to the operation budget, then run the
+   * instructions one at a time, stopping at the first that fails, with
+   * a run of repeats run one repeat at a time so that an error is
+   * reported at the repeat that failed */
+  if ((m_ir_count > 0) && (!nvm_charge(m_ir_count, per))) {
+    status = 0;
+    fail = 0;
+  }
+  while (status && (i < m_ir_count)) {
+    pi = &(m_ir_batch[i]);
+    if ((pi->op == NVM_OP_MULTIPLE) && (m_ir_span[i] > 1)) {
+      for(j = 0; j < m_ir_span[i]; j++) {
+        if (!nvm_op_repeat(per)) {
+          status = 0;
+          fail = i + j;
+          break;
+        }
+      }
+      
+    } else if (!ir_run(pi, per)) {
+      status = 0;
+      fail = i;
+    }
+    i += m_ir_span[i];
+  }
+#else
+  /* Run the instructions, stopping at the first that fails */
+  if (!nvm_run(m_ir_batch, m_ir_span, m_ir_count, &fail, per)) {
+    status = 0;
+  }
+#endif
+  
+  /* Report the position of the instruction that failed */
+  if (!status) {
+    *ppos = m_ir_batch[fail].pos;
+  }
+  
+  /* Save the instructions that ran successfully */
+  if (status) {
+    end = m_ir_count;
+  } else {
+    end = fail;
+  }
+  if (m_ir_pSave != NULL) {
+    for(i = 0; (i < end) && (i + m_ir_span[i] <= end);
+          i += m_ir_span[i]) {
+      ir_write(&(m_ir_batch[i]));
+    }
+  }
+  
+  /* The EOF instruction can only be the last in the batch */
+  if (status && (m_ir_count > 0)) {
+    if (m_ir_batch[m_ir_count - 1].op == NVM_OP_EOF) {
+      m_ir_done = 1;
+    }
+  }
+  
+  /* Empty the batch */
+  m_ir_count = 0;
+  
+  /* Return status */
+  return status;
+}
+
+/*
+ * Write an unsigned varint to the program file being saved.
+ * 
+ * Parameters:
+ * 
+ *   v - the value
+ */
+static void ir_putU(uint64_t v) {
+  
+  while (v >= 0x80) {
+    putc((int) ((v & 0x7f) | 0x80), m_ir_pSave);
+    v >>= 7;
+  }
+  putc((int) v, m_ir_pSave);
+}
+
+/*
+ * Write a signed varint to the program file being saved.
+ * 
+ * Parameters:
+ * 
+ *   v - the value
+ */
+static void ir_putS(int64_t v) {
+  if (v < 0) {
+    ir_putU((((uint64_t) (-(v + 1))) << 1) | 1);
+  } else {
+    ir_putU(((uint64_t) v) << 1);
+  }
+}
+
+/*
+ * Write an instruction to the program file being saved.
+ * 
+ * Write errors are picked up by ir_saveEnd().
+ * 
+ * Parameters:
+ * 
+ *   pi - the instruction
+ */
+static void ir_write(const NVM_INSTR *pi) {
+  
+  int32_t pa[IR_MAXPSET];
+  NVM_PITCHSET pset;
+  int32_t count = 0;
+  int32_t i = 0;
+  
+  /* Check state */
+  if (m_ir_pSave == NULL) {
+    abort();
+  }
+  
+  /* Check parameter */
+  if (pi == NULL) {
+    abort();
+  }
+  
+  /* Write the opcode */
+  putc(pi->op, m_ir_pSave);
+  
+  /* Write the payload according to the opcode */
+  switch (pi->op) {
+    case NVM_OP_PSET:
+      /* Get the pitches in ascending order */
+      memcpy(&pset, &(pi->ps), sizeof(NVM_PITCHSET));
+      while (!nvm_pitchset_isEmpty(&pset)) {
+        pa[count] = nvm_pitchset_least(&pset);
+        nvm_pitchset_drop(&pset, pa[count]);
+        count++;
+      }
+    
+      ir_putU((uint64_t) count);
+      for(i = 0; i < count; i++) {
+        if (i < 1) {
+          ir_putS((int64_t) pa[i]);
+        } else {
+          ir_putU((uint64_t) (pa[i] - pa[i - 1]));
+        }
+      }
+      break;
+    
+    case NVM_OP_DUR:
+      if (pi->v < 0) {
+        abort();
+      }
+      ir_putU((uint64_t) pi->v);
+      break;
+    
+    case NVM_OP_MULTIPLE:
+    case NVM_OP_PUSHTRANS:
+    case NVM_OP_SETBASE:
+    case NVM_OP_PUSHLAYER:
+    case NVM_OP_CUE:
+    case NVM_OP_TRYTRANS:
+    case NVM_OP_TRYLAYER:
+    case NVM_OP_END:
+      ir_putS((int64_t) pi->v);
+      break;
+    
+    case NVM_OP_IMMART:
+    case NVM_OP_PUSHART:
+    case NVM_OP_TRYART:
+      if ((pi->v < 0) || (pi->v > NMF_MAXART)) {
+        abort();
+      }
+      putc((int) pi->v, m_ir_pSave);
+      break;
+    
+    case NVM_OP_EOF:
+    case NVM_OP_REPEAT:
+    case NVM_OP_SECTION:
+    case NVM_OP_RETURN:
+    case NVM_OP_PUSHLOC:
+    case NVM_OP_RETLOC:
+    case NVM_OP_POPLOC:
+    case NVM_OP_POPTRANS:
+    case NVM_OP_POPART:
+    case NVM_OP_POPLAYER:
+    case NVM_OP_TRYLOC:
+    case NVM_OP_BEGIN:
+      break;
+    
+    default:
+      abort();  /* unrecognized opcode */
+  }
+}
+
+/*
+ * Read the next byte of the program file being loaded.
+ * 
+ * Return:
+ * 
+ *   the byte, or -1 at the end of the file or if reading failed
+ */
+static int ir_getByte(void) {
+  
+  int c = -1;
+  
+  /* Check state */
+  if (m_ir_pLoad == NULL) {
+    abort();
+  }
+  
+  /* Refill the buffer if necessary */
+  if ((m_ir_rpos >= m_ir_rlen) && (!m_ir_rerr)) {
+    m_ir_rlen = fread(m_ir_rbuf, 1, IR_READSIZE, m_ir_pLoad);
+    m_ir_rpos = 0;
+    if (ferror(m_ir_pLoad)) {
+      m_ir_rerr = 1;
+    }
+  }
+  
+  /* Get the next byte if there is one */
+  if (m_ir_rpos < m_ir_rlen) {
+    c = m_ir_rbuf[m_ir_rpos];
+    m_ir_rpos++;
+  }
+  
+  /* Return the byte */
+  return c;
+}
+
+/*
+ * Read an unsigned varint from the program file being loaded.
+ * 
+ * Parameters:
+ * 
+ *   pv - pointer to variable to receive the value
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if the varint is truncated or too long
+ */
+static int ir_getU(uint64_t *pv) {
+  
+  int status = 1;
+  uint64_t v = 0;
+  int shift = 0;
+  int c = 0;
+  
+  /* Check parameter */
+  if (pv == NULL) {
+    abort();
+  }
+  
+  /* Read groups of seven bits */
+  while (status) {
+    c = ir_getByte();
+    if ((c < 0) || (shift >= IR_MAXVARINT * 7)) {
+      status = 0;
+      break;
+    }
+    
+    if ((shift == (IR_MAXVARINT - 1) * 7) && ((c & 0x7f) > 1)) {
+      status = 0;
+      break;
+    }
+    
+    v |= ((uint64_t) (c & 0x7f)) << shift;
+    shift += 7;
+    
+    if (!(c & 0x80)) {
+      break;
+    }
+  }
+  
+  /* Store result */
+  if (status) {
+    *pv = v;
+  }
+  
+  /* Return status */
+  return status;
+}
+
+/*
+ * Read a signed varint from the program file being loaded.
+ * 
+ * Parameters:
+ * 
+ *   pv - pointer to variable to receive the value
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if the varint is truncated or too long
+ */
+static int ir_getS(int64_t *pv) {
+  
+  int status = 1;
+  uint64_t u = 0;
+  
+  /* Check parameter */
+  if (pv == NULL) {
+    abort();
+  }
+  
+  /* Read the zig-zag value and decode it */
+  if (!ir_getU(&u)) {
+    status = 0;
+  }
+  if (status) {
+    if (u & 1) {
+      *pv = -((int64_t) (u >> 1)) - 1;
+    } else {
+      *pv = (int64_t) (u >> 1);
+    }
+  }
+  
+  /* Return status */
+  return status;
+}
+
+/*
+ * Read and validate an instruction from the program file being loaded.
+ * 
+ * Parameters:
+ * 
+ *   pi - the instruction structure to fill in
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if the instruction is invalid or the
+ *   file ended
+ */
+static int ir_read(NVM_INSTR *pi) {
+  
+  int status = 1;
+  uint64_t count = 0;
+  uint64_t u = 0;
+  int64_t s = 0;
+  uint64_t i = 0;
+  int c = 0;
+  
+  /* Check parameter */
+  if (pi == NULL) {
+    abort();
+  }
+  
+  /* Reset instruction, except for the pitch set, which is only used
+   * by a pitch set instruction */
+  pi->op = 0;
+  pi->v = 0;
+  pi->pos = 0;
+  
+  /* Read the opcode */
+  c = ir_getByte();
+  if ((c < 0) || (c >= NVM_OP_COUNT)) {
+    status = 0;
+  }
+  if (status) {
+    pi->op = c;
+  }
+  
+  /* Read the payload according to the opcode */
+  if (status) {
+    switch (pi->op) {
+      case NVM_OP_PSET:
+        /* Pitch set -- count, then first pitch, then ascending
+         * differences */
+        nvm_pitchset_clear(&(pi->ps));
+        if (!ir_getU(&count)) {
+          status = 0;
+        }
+        if (status && (count > IR_MAXPSET)) {
+          status = 0;
+        }
+        for(i = 0; status && (i < count); i++) {
+          if (i < 1) {
+            if (!ir_getS(&s)) {
+              status = 0;
+            }
+          } else {
+            if (!ir_getU(&u)) {
+              status = 0;
+            }
+            if (status && ((u < 1) || (u > IR_MAXPSET))) {
+              status = 0;
+            }
+            if (status) {
+              s += (int64_t) u;
+            }
+          }
+        
+          if (status) {
+            if ((s < NMF_MINPITCH) || (s > NMF_MAXPITCH)) {
+              status = 0;
+            }
+          }
+          if (status) {
+            nvm_pitchset_add(&(pi->ps), (int32_t) s);
+          }
+        }
+        break;
+      
+      case NVM_OP_DUR:
+        /* Duration */
+        if (!ir_getU(&u)) {
+          status = 0;
+        }
+        if (status && (u > INT32_MAX)) {
+          status = 0;
+        }
+        if (status) {
+          pi->v = (int32_t) u;
+        }
+        break;
+      
+      case NVM_OP_MULTIPLE:
+      case NVM_OP_PUSHTRANS:
+      case NVM_OP_SETBASE:
+      case NVM_OP_PUSHLAYER:
+      case NVM_OP_CUE:
+      case NVM_OP_TRYTRANS:
+      case NVM_OP_TRYLAYER:
+      case NVM_OP_END:
+        /* Integer parameter */
+        if (!ir_getS(&s)) {
+          status = 0;
+        }
+        if (status && ((s < INT32_MIN) || (s > INT32_MAX))) {
+          status = 0;
+        }
+        if (status) {
+          pi->v = (int32_t) s;
+        }
+        break;
+      
+      case NVM_OP_IMMART:
+      case NVM_OP_PUSHART:
+      case NVM_OP_TRYART:
+        /* Articulation number */
+        c = ir_getByte();
+        if ((c < 0) || (c > NMF_MAXART)) {
+          status = 0;
+        }
+        if (status) {
+          pi->v = (int32_t) c;
+        }
+        break;
+      
+      default:
+        /* No payload */
+        break;
+    }
+  }
+  
+  /* Return status */
+  return status;
+}
+
+/*
+ * Public function implementations
+ * ===============================
+ * 
+ * See the header for specifications.
+ */
+
+/*
+ * ir_emit function.
+ */
+int ir_emit(const NVM_INSTR *pi, int64_t *ppos, int *per) {
+  
+  int status = 1;
+  
+  /* Check state */
+  if (m_ir_ended || m_ir_loaded) {
+    abort();
+  }
+  
+  /* Check parameters */
+  if ((pi == NULL) || (ppos == NULL) || (per == NULL)) {
+    abort();
+  }
+  if ((pi->op < 0) || (pi->op >= NVM_OP_COUNT)) {
+    abort();
+  }
+  
+  /* Run the batch first if it is full */
+  if (m_ir_count >= IR_BATCH) {
+    if (!ir_runBatch(ppos, per)) {
+      status = 0;
+    }
+  }
+  
+  /* Add the instruction to the batch */
+  if (status) {
+    memcpy(&(m_ir_batch[m_ir_count]), pi, sizeof(NVM_INSTR));
+    m_ir_count++;
+    m_ir_used = 1;
+    if (pi->op == NVM_OP_EOF) {
+      m_ir_ended = 1;
+    }
+  }
+  
+  /* Return status */
+  return status;
+}
+
+/*
+ * ir_flush function.
+ */
+int ir_flush(int64_t *ppos, int *per) {
+  
+  /* Check parameters */
+  if ((ppos == NULL) || (per == NULL)) {
+    abort();
+  }
+  
+  /* Run the batch */
+  return ir_runBatch(ppos, per);
+}
+
+/*
+ * ir_save function.
+ */
+int ir_save(const char *pPath) {
+  
+  int status = 1;
+  size_t plen = 0;
+  
+  /* Check state */
+  if (m_ir_used || m_ir_loaded || (m_ir_pPath != NULL)) {
+    abort();
+  }
+  
+  /* Check parameter */
+  if (pPath == NULL) {
+    abort();
+  }
+  m_ir_pPath = pPath;
+  
+  /* Build the temporary file path */
+  plen = strlen(pPath);
+  m_ir_pTmp = (char *) malloc(plen + sizeof(IR_TMPSUFFIX));
+  if (m_ir_pTmp == NULL) {
+    abort();
+  }
+  memcpy(m_ir_pTmp, pPath, plen);
+  memcpy(&(m_ir_pTmp[plen]), IR_TMPSUFFIX, sizeof(IR_TMPSUFFIX));
+  
+  /* Create the temporary file and write the signature */
+  m_ir_pSave = fopen(m_ir_pTmp, "wb");
+  if (m_ir_pSave == NULL) {
+    status = 0;
+  }
+  if (status) {
+    if (fwrite(IR_SIGNATURE, 1, 8, m_ir_pSave) != 8) {
+      m_ir_saveErr = 1;
+    }
+  }
+  
+  /* Release the path on failure */
+  if (!status) {
+    free(m_ir_pTmp);
+    m_ir_pTmp = NULL;
+  }
+  
+  /* Return status */
+  return status;
+}
+
+/*
+ * ir_saveEnd function.
+ */
+int ir_saveEnd(int keep) {
+  
+  int status = 1;
+  
+  /* Nothing to do unless saving */
+  if (m_ir_pSave != NULL) {
+    
+    /* Check state */
+    if (keep && (!m_ir_done)) {
+      abort();
+    }
+    
+    /* Close the temporary file, checking for write errors */
+    if (ferror(m_ir_pSave)) {
+      m_ir_saveErr = 1;
+    }
+    if (fclose(m_ir_pSave) != 0) {
+      m_ir_saveErr = 1;
+    }
+    m_ir_pSave = NULL;
+    
+    /* Replace the program file with it if it is to be kept; some
+     * platforms do not allow renaming over an existing file, so remove
+     * it first if that fails */
+    if (keep && m_ir_saveErr) {
+      status = 0;
+    }
+    if (keep && status) {
+      if (rename(m_ir_pTmp, m_ir_pPath) != 0) {
+        remove(m_ir_pPath);
+        if (rename(m_ir_pTmp, m_ir_pPath) != 0) {
+          status = 0;
+        }
+      }
+    }
+    
+    /* Clean up the temporary file unless it was put in place */
+    if ((!keep) || (!status)) {
+      remove(m_ir_pTmp);
+    }
+    
+    /* Release the path */
+    free(m_ir_pTmp);
+    m_ir_pTmp = NULL;
+  }
+  
+  /* Return status */
+  return status;
+}
+
+/*
+ * ir_load function.
+ */
+int ir_load(const char *pPath, int *per) {
+  
+  int status = 1;
+  unsigned char head[8];
+  int64_t pos = 0;
+  int64_t n = 0;
+  int eof = 0;
+  
+  /* Initialize structures */
+  memset(head, 0, sizeof(head));
+  
+  /* Check state and update it */
+  if (m_ir_used || m_ir_loaded || (m_ir_pPath != NULL)) {
+    abort();
+  } else {
+    m_ir_loaded = 1;
+  }
+  
+  /* Check parameters */
+  if ((pPath == NULL) || (per == NULL)) {
+    abort();
+  }
+  
+  /* Open the program file */
+  m_ir_pLoad = fopen(pPath, "rb");
+  if (m_ir_pLoad == NULL) {
+    status = 0;
+    *per = ERR_IOREAD;
+  }
+  
+  /* Check the signature */
+  if (status) {
+    if ((fread(head, 1, 8, m_ir_pLoad) != 8) ||
+        (memcmp(head, IR_SIGNATURE, 8) != 0)) {
+      status = 0;
+      *per = ERR_BADIR;
+      if (ferror(m_ir_pLoad)) {
+        *per = ERR_IOREAD;
+      }
+    }
+  }
+  
+  /* Read instructions in batches and run them, up to and including the
+   * EOF instruction, which must be the last thing in the file */
+  while (status && (!eof)) {
+    if (ir_read(&(m_ir_batch[m_ir_count]))) {
+      m_ir_batch[m_ir_count].pos = n;
+      n++;
+      if (m_ir_batch[m_ir_count].op == NVM_OP_EOF) {
+        eof = 1;
+        if (ir_getByte() >= 0) {
+          status = 0;
+          *per = ERR_BADIR;
+        }
+      }
+      m_ir_count++;
+      
+    } else {
+      status = 0;
+      *per = ERR_BADIR;
+    }
+    
+    if (m_ir_rerr) {
+      status = 0;
+      *per = ERR_IOREAD;
+    }
+    
+    if (status && (eof || (m_ir_count >= IR_BATCH))) {
+      if (!ir_runBatch(&pos, per)) {
+        status = 0;
+      }
+    }
+  }
+  
+  /* Drop anything left over after an error and close the file */
+  m_ir_count = 0;
+  if (m_ir_pLoad != NULL) {
+    fclose(m_ir_pLoad);
+    m_ir_pLoad = NULL;
+  }
+  
+  /* Return status */
+  return status;
+}
+
+/*
+ * ir_fetch function.
+ */
+int ir_fetch(
+    const char       * pPath,
+          NVM_INSTR ** ppa,
+          int32_t    * pCount,
+          int        * per) {
+  
+  int status = 1;
+  unsigned char head[8];
+  NVM_INSTR *pa = NULL;
+  int32_t count = 0;
+  int32_t cap = 0;
+  int eof = 0;
+  
+  /* Initialize structures */
+  memset(head, 0, sizeof(head));
+  
+  /* Check state */
+  if (m_ir_pLoad != NULL) {
+    abort();
+  }
+  
+  /* Check parameters */
+  if ((pPath == NULL) || (ppa == NULL) || (pCount == NULL) ||
+      (per == NULL)) {
+    abort();
+  }
+  
+  /* Reset the read buffer and open the program file */
+  m_ir_rlen = 0;
+  m_ir_rpos = 0;
+  m_ir_rerr = 0;
+  
+  m_ir_pLoad = fopen(pPath, "rb");
+  if (m_ir_pLoad == NULL) {
+    status = 0;
+    *per = ERR_IOREAD;
+  }
+  
+  /* Check the signature */
+  if (status) {
+    if ((fread(head, 1, 8, m_ir_pLoad) != 8) ||
+        (memcmp(head, IR_SIGNATURE, 8) != 0)) {
+      status = 0;
+      *per = ERR_BADIR;
+      if (ferror(m_ir_pLoad)) {
+        *per = ERR_IOREAD;
+      }
+    }
+  }
+  
+  /* Read instructions up to and including the EOF instruction, which
+   * must be the last thing in the file, growing the array as needed */
+  while (status && (!eof)) {
+    if (count >= cap) {
+      if (cap >= IR_FETCHMAX) {
+        status = 0;
+        *per = ERR_BADIR;
+        break;
+      }
+      if (cap < 1) {
+        cap = IR_BATCH;
+      } else {
+        cap *= 2;
+      }
+      pa = (NVM_INSTR *) realloc(pa, ((size_t) cap) * sizeof(NVM_INSTR));
+      if (pa == NULL) {
+        abort();
+      }
+    }
+    
+    if (ir_read(&(pa[count]))) {
+      if (pa[count].op == NVM_OP_EOF) {
+        eof = 1;
+        if (ir_getByte() >= 0) {
+          status = 0;
+          *per = ERR_BADIR;
+        }
+      } else {
+        count++;
+      }
+      
+    } else {
+      status = 0;
+      *per = ERR_BADIR;
+    }
+    
+    if (m_ir_rerr) {
+      status = 0;
+      *per = ERR_IOREAD;
+    }
+  }
+  
+  /* Close the file */
+  if (m_ir_pLoad != NULL) {
+    fclose(m_ir_pLoad);
+    m_ir_pLoad = NULL;
+  }
+  
+  /* Hand over the instructions, or free them on error */
+  if (status) {
+    *ppa = pa;
+    *pCount = count;
+  } else {
+    free(pa);
+    pa = NULL;
+  }
+  
+  /* Return status */
+  return status;
+}
+
+/*
+ * ir_stats function.
+ */
+void ir_stats(int64_t *pCount, int64_t *pRemoved, int64_t *pFolded) {
+  
+  /* Check parameters */
+  if ((pCount == NULL) || (pRemoved == NULL) || (pFolded == NULL)) {
+    abort();
+  }
+  
+  /* Return the statistics */
+  *pCount = m_ir_total;
+  *pRemoved = m_ir_removed;
+  *pFolded = m_ir_folded;
+}
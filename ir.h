@@ -0,0 +1,265 @@
+#ifndef IR_H_INCLUDED
+#define IR_H_INCLUDED
+
+/*
+ * ir.h
+ * 
+ * Instruction stream module of the Noir compiler.
+ * 
+ * This module sits between the modules that work out what the Noir
+ * notation says and the nvm module that runs it.  The entity module and
+ * the token cache do not call into the nvm module directly.  Instead,
+ * they emit instructions, which are the NVM_INSTR operations of nvm.h,
+ * one for each call they would have made.  This module runs the
+ * instructions in batches with nvm_run().
+ * 
+ * Every instruction carries a source position, which this module does
+ * not interpret.  When an instruction fails, its position is handed
+ * back, so that whoever emitted it can work out the line number to
+ * report.
+ * 
+ * Before a batch is run, a peephole pass rewrites instruction patterns
+ * that generated scores are full of into cheaper equivalents:
+ * 
+ *   (1) A run of NVM_OP_REPEAT becomes one NVM_OP_MULTIPLE.
+ * 
+ *   (2) A push immediately followed by the matching pop becomes one
+ *   NVM_OP_TRY instruction, which only checks that the push would have
+ *   succeeded.
+ * 
+ *   (3) An NVM_OP_DUR or NVM_OP_IMMART whose register is set again by
+ *   the next instruction, before anything uses it, is dropped, unless
+ *   that would change when a grace note sequence is flushed.
+ * 
+ * The rewritten batch makes exactly the same events as the original,
+ * and an instruction that fails reports the same error at the same
+ * position as the original would have.  Define IR_NO_PEEPHOLE to
+ * disable the pass.  ir_stats() reports how many instructions it
+ * removed, and separately how many repeats it folded into multiples,
+ * which are not removed because each of them still runs unless the
+ * multiple can run them in bulk.
+ * 
+ * Define IR_NO_RUNLOOP to run each instruction through the nvm_op
+ * functions one at a time instead of with nvm_run().  This is slower,
+ * but it is the reference that nvm_run() must agree with.
+ * 
+ * The instructions that are run can also be saved to a program file.
+ * These are the instructions after the peephole pass.  Running a saved
+ * program with ir_load() has the same result as compiling the Noir
+ * notation did, without reading or decoding any text at all.
+ * 
+ * Program file format
+ * -------------------
+ * 
+ * A program file begins with the eight ASCII characters "NoirIR01",
+ * followed by the instructions in order, the last of which is the EOF
+ * instruction, which must be followed by nothing.  Each instruction is
+ * its opcode byte, followed by a payload that depends on the opcode:
+ * 
+ *   NVM_OP_PSET - the number of pitches, then the first pitch, then the
+ *   difference between each further pitch and the one before it, in
+ *   ascending order; a rest has a count of zero
+ * 
+ *   NVM_OP_DUR - the duration in quanta
+ * 
+ *   NVM_OP_MULTIPLE NVM_OP_PUSHTRANS NVM_OP_SETBASE NVM_OP_PUSHLAYER
+ *   NVM_OP_CUE NVM_OP_TRYTRANS NVM_OP_TRYLAYER NVM_OP_END - the integer
+ *   parameter
+ * 
+ *   NVM_OP_IMMART NVM_OP_PUSHART NVM_OP_TRYART - the articulation
+ *   number, in one byte
+ * 
+ *   all other opcodes - no payload
+ * 
+ * Counts, durations, and pitch differences are unsigned varints, and
+ * the first pitch and integer parameters are signed varints, encoded
+ * the same way as in the token cache file; see cache.h.  Source
+ * positions are not saved, because a program is only saved when it ran
+ * without error.
+ * 
+ * Requires the nvm module, as well as the event module because the nvm
+ * module requires it.
+ */
+
+#include "noirdef.h"
+#include "nvm.h"
+
+/*
+ * The number of distinct pitches, which is the largest possible pitch
+ * set.
+ */
+#define IR_MAXPSET (NMF_MAXPITCH - NMF_MINPITCH + 1)
+
+/*
+ * Emit an instruction.
+ * 
+ * The instruction is added to the pending batch.  If the batch is
+ * full, it is run first, so an error may be returned for an
+ * instruction that was emitted earlier.  In that case, *ppos is set to
+ * the position of the instruction that failed and *per to the error,
+ * and the rest of the batch is dropped.
+ * 
+ * Instructions must not be emitted after the EOF instruction, or a
+ * fault occurs.
+ * 
+ * Parameters:
+ * 
+ *   pi - the instruction to emit
+ * 
+ *   ppos - pointer to variable to receive the position in case of
+ *   error
+ * 
+ *   per - pointer to variable to receive the error number in case of
+ *   error
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if error
+ */
+int ir_emit(const NVM_INSTR *pi, int64_t *ppos, int *per);
+
+/*
+ * Run all pending instructions.
+ * 
+ * This must be done before anything else calls into the nvm module,
+ * before an error found while emitting is reported, and after the EOF
+ * instruction.  An error in a pending instruction always comes before
+ * anything found after it was emitted, so it should be reported
+ * instead.
+ * 
+ * Errors are returned the same way as ir_emit() returns them.
+ * 
+ * Parameters:
+ * 
+ *   ppos - pointer to variable to receive the position in case of
+ *   error
+ * 
+ *   per - pointer to variable to receive the error number in case of
+ *   error
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if error
+ */
+int ir_flush(int64_t *ppos, int *per);
+
+/*
+ * Start saving the instructions that are run to a program file.
+ * 
+ * This must be called before any instruction is emitted, or a fault
+ * occurs.  The program is written to a temporary file next to the
+ * program file, which ir_saveEnd() then puts in place.
+ * 
+ * Parameters:
+ * 
+ *   pPath - the path to the program file
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if the temporary file could not be
+ *   created
+ */
+int ir_save(const char *pPath);
+
+/*
+ * Finish saving the program file.
+ * 
+ * If ir_save() was not called, nothing happens and the return value is
+ * non-zero.
+ * 
+ * If keep is non-zero, the EOF instruction must have been run, or a
+ * fault occurs.  The temporary file then replaces the program file.
+ * Otherwise, the temporary file is removed and the program file is
+ * left alone.
+ * 
+ * Parameters:
+ * 
+ *   keep - non-zero to keep the saved program, zero to discard it
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if keep is non-zero and the program
+ *   file could not be written
+ */
+int ir_saveEnd(int keep);
+
+/*
+ * Run a saved program file.
+ * 
+ * No instruction may have been emitted and ir_save() may not have been
+ * called, or a fault occurs.
+ * 
+ * The program file is read and run through the nvm module up to and
+ * including its EOF instruction.  Errors are ERR_IOREAD if the file
+ * cannot be read, ERR_BADIR if it is not a valid program file, or the
+ * error that running the program caused, although running a program
+ * that was saved by ir_saveEnd() always succeeds.  Since a program file
+ * has no line numbers, none can be reported.
+ * 
+ * Parameters:
+ * 
+ *   pPath - the path to the program file
+ * 
+ *   per - pointer to variable to receive the error number in case of
+ *   error
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if error
+ */
+int ir_load(const char *pPath, int *per);
+
+/*
+ * Read a saved program file into memory without running it.
+ * 
+ * This is how the include module loads a compiled library, which it
+ * then emits with ir_emit().  It may be called at any time, except
+ * while ir_load() is running.
+ * 
+ * The instructions up to but excluding the EOF instruction are stored
+ * in a dynamically allocated array, which the caller must free.  Their
+ * positions are zero.  Errors are ERR_IOREAD if the file cannot be
+ * read, or ERR_BADIR if it is not a valid program file or holds more
+ * than about sixteen million instructions.
+ * 
+ * Parameters:
+ * 
+ *   pPath - the path to the program file
+ * 
+ *   ppa - pointer to variable to receive the array
+ * 
+ *   pCount - pointer to variable to receive the number of instructions
+ * 
+ *   per - pointer to variable to receive the error number in case of
+ *   error
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if error
+ */
+int ir_fetch(
+    const char       * pPath,
+          NVM_INSTR ** ppa,
+          int32_t    * pCount,
+          int        * per);
+
+/*
+ * Get statistics about the instructions that were run.
+ * 
+ * *pCount receives the number of instructions that were emitted or
+ * loaded and reached the peephole pass, *pRemoved the number of those
+ * that the pass removed, and *pFolded the number of repeats that the
+ * pass folded into multiples.  Folded repeats are not counted as
+ * removed.
+ * 
+ * Parameters:
+ * 
+ *   pCount - pointer to variable to receive the instruction count
+ * 
+ *   pRemoved - pointer to variable to receive the removed count
+ * 
+ *   pFolded - pointer to variable to receive the folded count
+ */
+void ir_stats(int64_t *pCount, int64_t *pRemoved, int64_t *pFolded);
+
+#endif
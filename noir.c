@@ -8,10 +8,136 @@
  * Syntax
  * ------
  * 
- *   noir
+ *   noir [--cache path] [--save-ir path] [--include-cache dir]
+ *        [--emit spec] [--variant path spec]... [--select spec]
+ *        [--budget spec] [--no-include] [--stats]
+ *   noir --run-ir path [--emit spec] [--variant path spec]...
+ *        [--select spec] [--budget spec] [--stats]
+ *   noir --index path [--include-cache dir] [--emit spec]
+ *        [--variant path spec]... [--select spec] [--budget spec]
+ *        [--no-include] [--stats]
+ *   noir --check [--cache path] [--save-ir path] [--include-cache dir]
+ *        [--emit spec] [--budget spec] [--no-include] [--stats]
+ *   noir --check --run-ir path [--emit spec] [--budget spec] [--stats]
  * 
  * The input file is read from standard input, and the NMF file is
- * written to standard output.
+ * written to standard output.  The input file may be compressed with
+ * gzip or zstd, if support for them was compiled in; see below.
+ * 
+ * The --cache option names a token cache file.  If the cache file
+ * matches the input, the compiler replays the entities stored in it
+ * instead of tokenizing and decoding the input again.  Otherwise, the
+ * input is compiled normally and, if that succeeds, the cache file is
+ * written for next time.  If the input has been edited since the cache
+ * file was written, only the part of the input around the edit is
+ * tokenized again, and the rest is replayed from the cache file.  The
+ * cache is only used when standard input is seekable, such as when it
+ * is redirected from a file.  See cache.h for the cache file format.
+ * 
+ * The --save-ir option names a program file to save the compiled
+ * instruction stream to, which is written if compilation succeeds.
+ * The --run-ir option runs such a program file instead of compiling
+ * standard input, which is not read at all, so none of the text
+ * processing has to be done again.  See ir.h for the program file
+ * format.
+ * 
+ * The --include-cache option names an existing directory where the
+ * libraries that the input includes with the % operator are kept after
+ * they are compiled, keyed by their content, so that they do not have
+ * to be compiled again until they change.  Libraries are compiled by
+ * running this program again in a child process, so it must be
+ * possible to start it again by the name it was started with.  See
+ * incl.h for further information.
+ * 
+ * The --emit option gives emission parameters, which change every
+ * event as it is written to standard output.  The --variant option,
+ * which may be given up to 16 times, writes another NMF file to the
+ * given path with its own emission parameters.  The input is only
+ * interpreted once, however many variants there are.  Variant files
+ * are removed if compilation fails.  See event.h for what the emission
+ * parameters do.
+ * 
+ * The spec of emission parameters is a list of items separated by
+ * commas, with no whitespace:
+ * 
+ *   p<n> - add n semitones to every pitch
+ * 
+ *   t<n> - add n quanta to every time offset, where n is zero or more
+ * 
+ *   l<m>=<n> - move layer m to layer n
+ * 
+ *   a<j>=<k> - change articulation key j to articulation key k
+ * 
+ * For example, "p-7,t768,l1=3,aa=b".  Each layer and articulation key
+ * may only be remapped once in a spec.
+ * 
+ * The --select option only writes part of the piece, which is quicker
+ * to render for a preview.  The spec is a list of items separated by
+ * commas, with no whitespace:
+ * 
+ *   s<m> - only section m
+ * 
+ *   s<m>-<n> - only sections m up to and including n
+ * 
+ *   t<m>-<n> - only events that begin at time offsets from m quanta up
+ *   to but excluding n quanta
+ * 
+ * Sections are numbered from zero, the first "$" beginning section one.
+ * Time offsets are before any emission parameters are applied.  The
+ * selected events keep their time offsets, and the section table is
+ * written in full.  Events that can not be selected are skipped while
+ * the input is interpreted, except in repeat blocks.  If the piece has
+ * notes but none of them are selected, such as when the selection is
+ * past the last section, compilation fails with a "Selection is empty"
+ * error instead of writing a file with no notes.
+ * 
+ * The --index option names a section index file.  If it matches the
+ * input and the selection begins after section zero, interpreting
+ * starts at the "$" that begins the first selected section instead of
+ * at the beginning of the input, and errors before it are not
+ * reported.  Otherwise, the input is compiled in full and, if that
+ * succeeds, the index file is written for next time.  The index is
+ * only used when standard input is seekable.  See sidx.h for the index
+ * file format.
+ * 
+ * The --check option compiles the input without writing anything to
+ * standard output, and reports the same errors that compiling it
+ * normally would.  Events are only counted instead of being kept, so
+ * the memory needed does not grow with the length of the input.  It
+ * can not be combined with --variant or --select.
+ * 
+ * The --budget option limits the resources that compiling may use, so
+ * that input from an untrusted source can not run for a long time or
+ * use up memory.  Compilation fails as soon as a limit is exceeded.
+ * The spec is a list of items separated by commas, with no whitespace:
+ * 
+ *   e<n> - at most n events
+ * 
+ *   o<n> - at most n thousand interpreter operations
+ * 
+ *   m<n> - at most n KiB of events held for output, counting every
+ *   variant
+ * 
+ *   w<n> - at most n seconds of wall time
+ * 
+ * Each n must be at least one, and limits that are not given are not
+ * checked.  A repeat is charged in full before it runs.  The event
+ * buffer limit does not apply with --check, which holds no events.
+ * The budget also applies separately to each library that is compiled
+ * in a child process.
+ * 
+ * The --no-include option disables the % operator, which otherwise
+ * reads any file the compiler can read and starts child processes to
+ * compile it.  Any include in the input then fails with an error, so
+ * give this option together with --budget for input from an untrusted
+ * source.  It can not be combined with --include-cache or --run-ir; a
+ * program file already has its libraries built in.
+ * 
+ * The --stats option reports on standard error how many instructions
+ * the peephole pass removed, and how many repeats it folded into
+ * multiples, if compilation succeeds.  Folded repeats are not counted
+ * as removed, since a multiple still runs them one by one unless it
+ * can run them in bulk.
  * 
  * File formats
  * ------------
@@ -26,21 +152,63 @@
  * 
  * Compile with the following modules:
  * 
+ *   cache.c
  *   entity.c
  *   event.c 
+ *   incl.c
+ *   ir.c
  *   nvm.c
+ *   scan.c
+ *   sidx.c
+ *   source.c
  *   token.c
  * 
  * Compile with libnmf.
+ * 
+ * On POSIX platforms, when standard input is redirected from a regular
+ * file, token.c memory-maps it instead of reading it in blocks.  Define
+ * TOKEN_NO_MMAP to disable this.
+ * 
+ * Large mapped input is lexed in parallel with POSIX threads, so link
+ * with the threads library (-pthread) on POSIX platforms, unless
+ * TOKEN_NO_THREADS is defined.
+ * 
+ * Input compressed with gzip or zstd is decompressed as it is read if
+ * source.c is compiled with SOURCE_ZLIB defined and linked with zlib
+ * (-lz), or compiled with SOURCE_ZSTD defined and linked with libzstd
+ * (-lzstd), respectively.
+ * 
+ * On POSIX platforms, incl.c compiles libraries in child processes
+ * started with posix_spawnp().  Define INCL_NO_SPAWN to disable this,
+ * in which case libraries must already be in the include cache.
+ * 
+ * Define IR_NO_PEEPHOLE when compiling ir.c to disable the peephole
+ * pass over the instruction stream.
+ * 
+ * With GNU C, nvm.c runs the instruction stream with a direct-threaded
+ * dispatch loop.  Define NVM_NO_THREADED when compiling nvm.c to
+ * dispatch through a switch instead, or IR_NO_RUNLOOP when compiling
+ * ir.c to make one nvm call per instruction.
+ * 
+ * Pitch sets are as wide as the pitch range of libnmf needs.  When that
+ * takes at least four 64-bit words, nvm.c masks and counts them with
+ * AVX2 kernels on x86 with GCC or Clang, if the processor supports
+ * them.  Define NVM_NO_SIMD to only use portable code.
  */
 
 #include "noirdef.h"
+#include "cache.h"
 #include "entity.h"
 #include "event.h"
+#include "incl.h"
+#include "ir.h"
+#include "nvm.h"
+#include "sidx.h"
 #include "token.h"
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 /*
  * Local functions
@@ -48,7 +216,21 @@
  */
 
 /* Prototypes */
-static int noir(FILE *pIn, FILE *pOut, int32_t *pln, int *per);
+static int noir(
+          FILE    * pIn,
+          FILE    * pOut,
+    const char    * pCache,
+    const char    * pSave,
+    const char    * pRun,
+    const char    * pIndex,
+          int32_t   sect,
+          int32_t * pln,
+          int     * per);
+static int noir_key(int c);
+static int noir_int(const char **ppc, int32_t *pv);
+static int noir_spec(const char *pSpec, EVENT_PARAM *pp);
+static int noir_select(const char *pSpec, int32_t *pSel);
+static int noir_budget(const char *pSpec, int64_t *pBud);
 static const char *err_string(int code);
 
 /*
@@ -56,12 +238,26 @@ static const char *err_string(int code);
  * 
  * pIn is the file to read the Noir notation from.  It must be open for
  * reading and it must not be the same file as pOut or undefined
- * behavior occurs.  Reading is fully sequential.
+ * behavior occurs.  Reading is fully sequential, except that the token
+ * cache reads the input through once to hash it before rewinding it.
  * 
  * pOut is the file to write the NMF file to.  It must be open for
  * writing and it must not be the same file as pIn or undefined behavior
  * occurs.  Writing is fully sequential.
  * 
+ * pCache is either NULL or the path to the token cache file.  See
+ * cache.h for further information.
+ * 
+ * pSave is either NULL or the path to a program file to save the
+ * instruction stream to.  pRun is either NULL or the path to a program
+ * file to run instead of compiling pIn, in which case pCache and pSave
+ * must be NULL.  See ir.h for further information.
+ * 
+ * pIndex is either NULL or the path to the section index file, in which
+ * case pCache, pSave, and pRun must be NULL.  If the index matches the
+ * input, interpreting starts at the beginning of section sect, if the
+ * index has it.  See sidx.h for further information.
+ * 
  * pln is either NULL or it points to a variable to receive the line
  * number in the input in case of an error.  -1 is written to it if the
  * line number overflows, is unknown, or irrelevant, or if there is no
@@ -78,6 +274,16 @@ static const char *err_string(int code);
  * 
  *   pOut - the output NMF
  * 
+ *   pCache - the token cache file path, or NULL
+ * 
+ *   pSave - the program file path to save to, or NULL
+ * 
+ *   pRun - the program file path to run, or NULL
+ * 
+ *   pIndex - the section index file path, or NULL
+ * 
+ *   sect - the section to start interpreting at with the index
+ * 
  *   pln - pointer to line number, or NULL
  * 
  *   per - pointer to error, or NULL
@@ -86,16 +292,34 @@ static const char *err_string(int code);
  * 
  *   non-zero if successful, zero if error
  */
-static int noir(FILE *pIn, FILE *pOut, int32_t *pln, int *per) {
+static int noir(
+          FILE    * pIn,
+          FILE    * pOut,
+    const char    * pCache,
+    const char    * pSave,
+    const char    * pRun,
+    const char    * pIndex,
+          int32_t   sect,
+          int32_t * pln,
+          int     * per) {
   
   int status = 1;
+  int mode = CACHE_MISS;
   int dummy = 0;
   int32_t dummy32 = 0;
+  int64_t offs = 0;
   
   /* Check parameters */
   if ((pIn == NULL) || (pOut == NULL) || (pIn == pOut)) {
     abort();
   }
+  if ((pRun != NULL) && ((pCache != NULL) || (pSave != NULL))) {
+    abort();
+  }
+  if ((pIndex != NULL) &&
+      ((pCache != NULL) || (pSave != NULL) || (pRun != NULL))) {
+    abort();
+  }
   
   /* Redirect optional parameters if NULL */
   if (pln == NULL) {
@@ -109,27 +333,513 @@ static int noir(FILE *pIn, FILE *pOut, int32_t *pln, int *per) {
   *pln = -1;
   *per = ERR_OK;
   
-  /* Initialize the token module */
-  token_init(pIn);
+  /* Start saving the program file if there is one */
+  if (pSave != NULL) {
+    if (!ir_save(pSave)) {
+      status = 0;
+      *per = ERR_IRSAVE;
+    }
+  }
+  
+  /* Check the token cache if there is one */
+  if (status && (pCache != NULL)) {
+    mode = cache_open(pCache, pIn);
+  }
   
-  /* Run the input file and interpret it */
-  if (!entity_run(pln, per)) {
-    status = 0;
+  /* Check the section index if there is one, and find where to start
+   * interpreting */
+  if (status && (pIndex != NULL)) {
+    sidx_open(pIndex, pIn);
+    if (!sidx_resume(sect, &offs, per)) {
+      status = 0;
+    }
+  }
+  
+  /* Run the program file instead of the input if there is one */
+  if (status && (pRun != NULL)) {
+    if (!ir_load(pRun, per)) {
+      status = 0;
+    }
+  }
+  
+  /* Replay what the token cache has for the input */
+  if (status && (mode != CACHE_MISS)) {
+    if (!cache_replay(pln, per)) {
+      status = 0;
+    }
+  }
+  
+  /* Unless the program file or the token cache had all of it, run the
+   * input file from where the cache left off and interpret it, writing
+   * the token cache if it is recording */
+  if (status && (pRun == NULL) && (mode != CACHE_HIT)) {
+    token_init(pIn);
+    if (mode == CACHE_EDIT) {
+      token_seek(cache_resume());
+    } else if (offs > 0) {
+      token_seek(offs);
+    }
+    if (!entity_run(pln, per)) {
+      status = 0;
+    }
+    if (status && cache_recording()) {
+      cache_write();
+    }
+    if (status && (pIndex != NULL)) {
+      sidx_write();
+    }
   }
   
   /* Write event buffer and section table to output */
   if (status) {
-    if (!event_finish(pOut)) {
+    if (!event_finish(pOut, per)) {
       *pln = -1;
-      *per = ERR_EMPTY;
       status = 0;
     }
   }
   
+  /* Put the saved program file in place if successful, or discard it
+   * otherwise */
+  if (!ir_saveEnd(status)) {
+    *pln = -1;
+    *per = ERR_IRSAVE;
+    status = 0;
+  }
+  
   /* Return status */
   return status;
 }
 
+/*
+ * Get the articulation number of an articulation key.
+ * 
+ * Parameters:
+ * 
+ *   c - the key character
+ * 
+ * Return:
+ * 
+ *   the articulation number, or -1 if c is not a key character
+ */
+static int noir_key(int c) {
+  
+  int result = -1;
+  
+  if ((c >= '0') && (c <= '9')) {
+    result = c - '0';
+  } else if ((c >= 'A') && (c <= 'Z')) {
+    result = (c - 'A') + 10;
+  } else if ((c >= 'a') && (c <= 'z')) {
+    result = (c - 'a') + 36;
+  }
+  
+  return result;
+}
+
+/*
+ * Parse a signed decimal integer in an emission parameter spec.
+ * 
+ * *ppc points to the first character of the integer, which may be a
+ * sign.  Upon successful return, it is advanced past the integer.
+ * 
+ * Parameters:
+ * 
+ *   ppc - pointer to the parse position
+ * 
+ *   pv - pointer to variable to receive the integer
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if there is no integer or it is not
+ *   in 32-bit range
+ */
+static int noir_int(const char **ppc, int32_t *pv) {
+  
+  int status = 1;
+  int neg = 0;
+  int digits = 0;
+  int64_t v = 0;
+  const char *pc = NULL;
+  
+  /* Check parameters */
+  if ((ppc == NULL) || (pv == NULL)) {
+    abort();
+  }
+  pc = *ppc;
+  if (pc == NULL) {
+    abort();
+  }
+  
+  /* Read the sign, if there is one */
+  if (*pc == '-') {
+    neg = 1;
+    pc++;
+  } else if (*pc == '+') {
+    pc++;
+  }
+  
+  /* Read the digits, watching for overflow */
+  for( ; (*pc >= '0') && (*pc <= '9'); pc++) {
+    v = (v * 10) + (*pc - '0');
+    digits++;
+    if (v > INT32_MAX) {
+      status = 0;
+      break;
+    }
+  }
+  if (digits < 1) {
+    status = 0;
+  }
+  
+  /* Return the value */
+  if (status) {
+    if (neg) {
+      v = -v;
+    }
+    *pv = (int32_t) v;
+    *ppc = pc;
+  }
+  
+  return status;
+}
+
+/*
+ * Parse a spec of emission parameters.
+ * 
+ * See the program documentation at the top of this file for the
+ * format.  pp is initialized before the spec is parsed.
+ * 
+ * Parameters:
+ * 
+ *   pSpec - the spec
+ * 
+ *   pp - the emission parameters to fill in
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if the spec is invalid
+ */
+static int noir_spec(const char *pSpec, EVENT_PARAM *pp) {
+  
+  int status = 1;
+  int c = 0;
+  int i = 0;
+  int from = 0;
+  int to = 0;
+  int32_t m = 0;
+  int32_t n = 0;
+  const char *pc = NULL;
+  int art_set[NMF_MAXART + 1];
+  
+  /* Check parameters */
+  if ((pSpec == NULL) || (pp == NULL)) {
+    abort();
+  }
+  
+  /* Initialize */
+  event_param_init(pp);
+  memset(art_set, 0, sizeof(art_set));
+  
+  /* Parse each item */
+  pc = pSpec;
+  while (status) {
+    c = *pc;
+    pc++;
+    
+    if (c == 'p') {
+      /* Pitch offset */
+      if (noir_int(&pc, &n)) {
+        if ((n >= -(NMF_MAXPITCH - NMF_MINPITCH)) &&
+            (n <= NMF_MAXPITCH - NMF_MINPITCH)) {
+          pp->pitch = n;
+        } else {
+          status = 0;
+        }
+      } else {
+        status = 0;
+      }
+      
+    } else if (c == 't') {
+      /* Time offset */
+      if (noir_int(&pc, &n)) {
+        if (n >= 0) {
+          pp->t = n;
+        } else {
+          status = 0;
+        }
+      } else {
+        status = 0;
+      }
+      
+    } else if (c == 'l') {
+      /* Layer remap */
+      if (!noir_int(&pc, &m)) {
+        status = 0;
+      }
+      if (status && (*pc == '=')) {
+        pc++;
+      } else {
+        status = 0;
+      }
+      if (status) {
+        if (!noir_int(&pc, &n)) {
+          status = 0;
+        }
+      }
+      if (status) {
+        if ((m < 1) || (m > NOIR_MAXLAYER) ||
+            (n < 1) || (n > NOIR_MAXLAYER) ||
+            (pp->lmap_count >= EVENT_MAXLMAP)) {
+          status = 0;
+        }
+      }
+      if (status) {
+        for(i = 0; i < pp->lmap_count; i++) {
+          if ((pp->lmap_from)[i] == m) {
+            status = 0;
+            break;
+          }
+        }
+      }
+      if (status) {
+        (pp->lmap_from)[pp->lmap_count] = m;
+        (pp->lmap_to)[pp->lmap_count] = n;
+        (pp->lmap_count)++;
+      }
+      
+    } else if (c == 'a') {
+      /* Articulation remap */
+      from = noir_key(pc[0]);
+      if ((from >= 0) && (pc[1] == '=')) {
+        to = noir_key(pc[2]);
+      } else {
+        to = -1;
+      }
+      if ((to >= 0) && (!art_set[from])) {
+        (pp->amap)[from] = to;
+        art_set[from] = 1;
+        pc += 3;
+      } else {
+        status = 0;
+      }
+      
+    } else {
+      /* Unrecognized item */
+      status = 0;
+    }
+    
+    /* Items are separated by commas, and the spec ends after the last
+     * one */
+    if (status) {
+      if (*pc == ',') {
+        pc++;
+      } else if (*pc == 0) {
+        break;
+      } else {
+        status = 0;
+      }
+    }
+  }
+  
+  return status;
+}
+
+/*
+ * Parse a selection spec.
+ * 
+ * See the program documentation at the top of this file for the
+ * format.  pSel is an array of four elements that receives the first
+ * and last section and the time offsets that begin and end the window.
+ * 
+ * Parameters:
+ * 
+ *   pSpec - the spec
+ * 
+ *   pSel - the selection to fill in
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if the spec is invalid
+ */
+static int noir_select(const char *pSpec, int32_t *pSel) {
+  
+  int status = 1;
+  int c = 0;
+  int sects = 0;
+  int window = 0;
+  int32_t m = 0;
+  int32_t n = 0;
+  const char *pc = NULL;
+  
+  /* Check parameters */
+  if ((pSpec == NULL) || (pSel == NULL)) {
+    abort();
+  }
+  
+  /* Initialize to everything */
+  pSel[0] = 0;
+  pSel[1] = NMF_MAXSECT - 1;
+  pSel[2] = 0;
+  pSel[3] = INT32_MAX;
+  
+  /* Parse each item */
+  pc = pSpec;
+  while (status) {
+    c = *pc;
+    pc++;
+    
+    if (((c == 's') && (!sects)) || ((c == 't') && (!window))) {
+      /* Section range, where the last section is optional, or time
+       * window */
+      if (!noir_int(&pc, &m)) {
+        status = 0;
+      }
+      if (status && (*pc == '-')) {
+        pc++;
+        if (!noir_int(&pc, &n)) {
+          status = 0;
+        }
+      } else if (status && (c == 's')) {
+        n = m;
+      } else {
+        status = 0;
+      }
+      if (status) {
+        if (c == 's') {
+          if ((m < 0) || (n < m) || (n >= NMF_MAXSECT)) {
+            status = 0;
+          } else {
+            pSel[0] = m;
+            pSel[1] = n;
+            sects = 1;
+          }
+        } else {
+          if ((m < 0) || (n < m)) {
+            status = 0;
+          } else {
+            pSel[2] = m;
+            pSel[3] = n;
+            window = 1;
+          }
+        }
+      }
+      
+    } else {
+      /* Unrecognized or repeated item */
+      status = 0;
+    }
+    
+    /* Items are separated by commas, and the spec ends after the last
+     * one */
+    if (status) {
+      if (*pc == ',') {
+        pc++;
+      } else if (*pc == 0) {
+        break;
+      } else {
+        status = 0;
+      }
+    }
+  }
+  
+  return status;
+}
+
+/*
+ * Parse a budget spec.
+ * 
+ * See the program documentation at the top of this file for the
+ * format.  pBud is an array of four elements that receives the event
+ * budget, the operation budget, the event buffer budget in bytes, and
+ * the time budget in seconds, each zero if it is not given.
+ * 
+ * Parameters:
+ * 
+ *   pSpec - the spec
+ * 
+ *   pBud - the budgets to fill in
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if the spec is invalid
+ */
+static int noir_budget(const char *pSpec, int64_t *pBud) {
+  
+  int status = 1;
+  int c = 0;
+  int i = 0;
+  int32_t n = 0;
+  const char *pc = NULL;
+  
+  /* Check parameters */
+  if ((pSpec == NULL) || (pBud == NULL)) {
+    abort();
+  }
+  
+  /* Initialize to no budgets */
+  for(i = 0; i < 4; i++) {
+    pBud[i] = 0;
+  }
+  
+  /* Parse each item */
+  pc = pSpec;
+  while (status) {
+    c = *pc;
+    pc++;
+    
+    /* Get the element for the item */
+    if (c == 'e') {
+      i = 0;
+    } else if (c == 'o') {
+      i = 1;
+    } else if (c == 'm') {
+      i = 2;
+    } else if (c == 'w') {
+      i = 3;
+    } else {
+      status = 0;
+    }
+    
+    /* Each item takes a positive count and may only be given once */
+    if (status) {
+      if ((pBud[i] != 0) || (*pc == '-') || (*pc == '+')) {
+        status = 0;
+      }
+    }
+    if (status) {
+      if (!noir_int(&pc, &n)) {
+        status = 0;
+      } else if (n < 1) {
+        status = 0;
+      }
+    }
+    
+    /* Scale operations to thousands and the event buffer to KiB */
+    if (status) {
+      pBud[i] = (int64_t) n;
+      if (i == 1) {
+        pBud[i] *= INT64_C(1000);
+      } else if (i == 2) {
+        pBud[i] *= INT64_C(1024);
+      }
+    }
+    
+    /* Items are separated by commas, and the spec ends after the last
+     * one */
+    if (status) {
+      if (*pc == ',') {
+        pc++;
+      } else if (*pc == 0) {
+        break;
+      } else {
+        status = 0;
+      }
+    }
+  }
+  
+  return status;
+}
+
 /*
  * Given an error code, return an error message string for it.
  * 
@@ -289,6 +999,70 @@ static const char *err_string(int code) {
       ps = "Cue number out of range";
       break;
     
+    case ERR_NOCODEC:
+      ps = "Input compression format not supported";
+      break;
+    
+    case ERR_BADCODEC:
+      ps = "Compressed input is damaged or truncated";
+      break;
+    
+    case ERR_BADIR:
+      ps = "Program file is damaged or invalid";
+      break;
+    
+    case ERR_IRSAVE:
+      ps = "Program file could not be saved";
+      break;
+    
+    case ERR_VARIANT:
+      ps = "Variant output file could not be written";
+      break;
+    
+    case ERR_INCREAD:
+      ps = "Included file could not be read";
+      break;
+    
+    case ERR_INCLUDE:
+      ps = "Included file could not be compiled";
+      break;
+    
+    case ERR_INCOP:
+      ps = "Included file may not use $, @, or &";
+      break;
+    
+    case ERR_INCDEEP:
+      ps = "Includes nested too deeply";
+      break;
+    
+    case ERR_EVBUDGET:
+      ps = "Event budget exceeded";
+      break;
+    
+    case ERR_MEMBUDGET:
+      ps = "Event buffer budget exceeded";
+      break;
+    
+    case ERR_OPBUDGET:
+      ps = "Operation budget exceeded";
+      break;
+    
+    case ERR_TIMEOUT:
+      ps = "Time budget exceeded";
+      break;
+    
+    case ERR_NOINC:
+      ps = "Including is disabled";
+      break;
+    
+    case ERR_INCCYCLE:
+      ps = "Included file includes itself";
+      break;
+    
+    case ERR_EMPTYSEL:
+      ps = "Selection is empty";
+      break;
+    
     default:
       ps = "Unknown error";
   }
@@ -304,9 +1078,43 @@ static const char *err_string(int code) {
 int main(int argc, char *argv[]) {
   
   int status = 1;
+  int i = 0;
   const char *pModule = NULL;
+  const char *pCache = NULL;
+  const char *pSave = NULL;
+  const char *pRun = NULL;
+  const char *pDir = NULL;
+  const char *pIndex = NULL;
+  const char *pBudget = NULL;
+  int32_t sel[4];
+  int64_t bud[4];
+  int select = 0;
+  int stats = 0;
+  int check = 0;
+  int noinc = 0;
+  int emit = 0;
+  int vars = 0;
+  int j = 0;
+  const char *pVarPath[EVENT_MAXVAR];
+  FILE *pVarFile[EVENT_MAXVAR];
+  int64_t count = 0;
+  int64_t removed = 0;
+  int64_t folded = 0;
   int32_t line = 0;
   int errcode = 0;
+  EVENT_PARAM *pp = NULL;
+  
+  /* Initialize arrays and allocate the emission parameters */
+  memset(sel, 0, sizeof(sel));
+  memset(bud, 0, sizeof(bud));
+  for(j = 0; j < EVENT_MAXVAR; j++) {
+    pVarPath[j] = NULL;
+    pVarFile[j] = NULL;
+  }
+  pp = (EVENT_PARAM *) malloc(sizeof(EVENT_PARAM));
+  if (pp == NULL) {
+    abort();
+  }
   
   /* Get module name */
   if (argc > 0) {
@@ -320,15 +1128,145 @@ int main(int argc, char *argv[]) {
     pModule = "noir";
   }
   
-  /* Check that there are no parameters */
-  if (argc > 1) {
-    fprintf(stderr, "%s: Not expecting parameters!\n", pModule);
+  /* Parse the options */
+  for(i = 1; i < argc; i++) {
+    if ((strcmp(argv[i], "--cache") == 0) && (i + 1 < argc) &&
+        (pCache == NULL)) {
+      i++;
+      pCache = argv[i];
+      
+    } else if ((strcmp(argv[i], "--save-ir") == 0) && (i + 1 < argc) &&
+                (pSave == NULL)) {
+      i++;
+      pSave = argv[i];
+      
+    } else if ((strcmp(argv[i], "--run-ir") == 0) && (i + 1 < argc) &&
+                (pRun == NULL)) {
+      i++;
+      pRun = argv[i];
+      
+    } else if ((strcmp(argv[i], "--include-cache") == 0) &&
+                (i + 1 < argc) && (pDir == NULL)) {
+      i++;
+      pDir = argv[i];
+      
+    } else if ((strcmp(argv[i], "--emit") == 0) && (i + 1 < argc) &&
+                (!emit)) {
+      i++;
+      if (noir_spec(argv[i], pp)) {
+        event_param(pp);
+        emit = 1;
+      } else {
+        fprintf(stderr, "%s: Invalid emission parameters!\n", pModule);
+        status = 0;
+        break;
+      }
+      
+    } else if ((strcmp(argv[i], "--variant") == 0) && (i + 2 < argc) &&
+                (vars < EVENT_MAXVAR)) {
+      i += 2;
+      if (noir_spec(argv[i], pp)) {
+        pVarPath[vars] = argv[i - 1];
+        pVarFile[vars] = fopen(pVarPath[vars], "wb");
+        if (pVarFile[vars] == NULL) {
+          fprintf(stderr, "%s: %s!\n", pModule, err_string(ERR_VARIANT));
+          status = 0;
+          break;
+        }
+        if (!event_variant(pp, pVarFile[vars])) {
+          abort();  /* vars is checked against EVENT_MAXVAR */
+        }
+        vars++;
+        
+      } else {
+        fprintf(stderr, "%s: Invalid emission parameters!\n", pModule);
+        status = 0;
+        break;
+      }
+      
+    } else if ((strcmp(argv[i], "--index") == 0) && (i + 1 < argc) &&
+                (pIndex == NULL)) {
+      i++;
+      pIndex = argv[i];
+      
+    } else if ((strcmp(argv[i], "--select") == 0) && (i + 1 < argc) &&
+                (!select)) {
+      i++;
+      if (noir_select(argv[i], sel)) {
+        event_select(sel[0], sel[1], sel[2], sel[3]);
+        select = 1;
+      } else {
+        fprintf(stderr, "%s: Invalid selection!\n", pModule);
+        status = 0;
+        break;
+      }
+      
+    } else if ((strcmp(argv[i], "--budget") == 0) && (i + 1 < argc) &&
+                (pBudget == NULL)) {
+      i++;
+      if (noir_budget(argv[i], bud)) {
+        event_budget(bud[0], bud[2]);
+        pBudget = argv[i];
+      } else {
+        fprintf(stderr, "%s: Invalid budget!\n", pModule);
+        status = 0;
+        break;
+      }
+      
+    } else if ((strcmp(argv[i], "--no-include") == 0) && (!noinc)) {
+      noinc = 1;
+      
+    } else if ((strcmp(argv[i], "--stats") == 0) && (!stats)) {
+      stats = 1;
+      
+    } else if ((strcmp(argv[i], "--check") == 0) && (!check)) {
+      check = 1;
+      
+    } else {
+      fprintf(stderr, "%s: Invalid parameters!\n", pModule);
+      status = 0;
+      break;
+    }
+  }
+  
+  /* A program file can not be run together with the other options */
+  if (status && (pRun != NULL) && ((pCache != NULL) || (pSave != NULL))) {
+    fprintf(stderr, "%s: Invalid parameters!\n", pModule);
+    status = 0;
+  }
+  
+  /* The section index replaces the token cache and can not start in
+   * the middle of a program file, which can not be saved from the
+   * middle of the input either */
+  if (status && (pIndex != NULL) &&
+      ((pCache != NULL) || (pSave != NULL) || (pRun != NULL))) {
+    fprintf(stderr, "%s: Invalid parameters!\n", pModule);
+    status = 0;
+  }
+  
+  /* Without includes there is nothing to cache, and a program file has
+   * no includes left to disable */
+  if (status && noinc && ((pDir != NULL) || (pRun != NULL))) {
+    fprintf(stderr, "%s: Invalid parameters!\n", pModule);
+    status = 0;
+  }
+  
+  /* Check mode has no output, so it can not have variants or a
+   * selection either */
+  if (status && check && ((vars > 0) || select)) {
+    fprintf(stderr, "%s: Invalid parameters!\n", pModule);
     status = 0;
   }
   
   /* Call through to main function */
   if (status) {
-    if (!noir(stdin, stdout, &line, &errcode)) {
+    incl_init(pModule, pDir, pBudget, !noinc);
+    if (check) {
+      event_check();
+    }
+    nvm_budget(bud[1], (int32_t) bud[3]);
+    if (!noir(stdin, stdout, pCache, pSave, pRun, pIndex, sel[0],
+                &line, &errcode)) {
       if (line >= 0) {
         fprintf(stderr, "%s: [Line %ld] %s!\n",
                   pModule,
@@ -342,6 +1280,36 @@ int main(int argc, char *argv[]) {
     }
   }
   
+  /* Close the variant files, and remove them if compilation failed */
+  for(j = 0; j < vars; j++) {
+    if (fclose(pVarFile[j])) {
+      if (status) {
+        fprintf(stderr, "%s: %s!\n", pModule, err_string(ERR_VARIANT));
+        status = 0;
+      }
+    }
+    pVarFile[j] = NULL;
+  }
+  if (!status) {
+    for(j = 0; j < vars; j++) {
+      remove(pVarPath[j]);
+    }
+  }
+  free(pp);
+  pp = NULL;
+  
+  /* Report statistics if requested */
+  if (status && stats) {
+    ir_stats(&count, &removed, &folded);
+    fprintf(stderr,
+              "%s: %lld of %lld instructions removed, "
+              "%lld repeats folded into multiples\n",
+              pModule,
+              (long long) removed,
+              (long long) count,
+              (long long) folded);
+  }
+  
   /* Invert status and return */
   if (status) {
     status = 0;
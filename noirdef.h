@@ -62,6 +62,22 @@
 #define ERR_LONGPIECE (31)  /* Cursor overflow */
 #define ERR_MANYNOTES (32)  /* Too many notes and cues */
 #define ERR_CUENUM    (33)  /* Cue number out of range */
+#define ERR_NOCODEC   (34)  /* Compression format not supported */
+#define ERR_BADCODEC  (35)  /* Damaged compressed input */
+#define ERR_BADIR     (36)  /* Invalid program file */
+#define ERR_IRSAVE    (37)  /* Program file could not be saved */
+#define ERR_VARIANT   (38)  /* Variant output could not be written */
+#define ERR_INCREAD   (39)  /* Included file could not be read */
+#define ERR_INCLUDE   (40)  /* Included file could not be compiled */
+#define ERR_INCOP     (41)  /* Included file changes section or base */
+#define ERR_INCDEEP   (42)  /* Includes nested too deeply */
+#define ERR_EVBUDGET  (43)  /* Event budget exceeded */
+#define ERR_MEMBUDGET (44)  /* Event buffer budget exceeded */
+#define ERR_OPBUDGET  (45)  /* Operation budget exceeded */
+#define ERR_TIMEOUT   (46)  /* Time budget exceeded */
+#define ERR_NOINC     (47)  /* Including is disabled */
+#define ERR_INCCYCLE  (48)  /* Library includes itself */
+#define ERR_EMPTYSEL  (49)  /* No notes selected */
 
 /*
  * ASCII characters.
@@ -73,6 +89,7 @@
 #define ASCII_EXCLAIM (0x21)  /* ! */
 #define ASCII_NUMSIGN (0x23)  /* # */
 #define ASCII_DOLLAR  (0x24)  /* $ */
+#define ASCII_PERCENT (0x25)  /* % */
 #define ASCII_AMP     (0x26)  /* & */
 #define ASCII_APOS    (0x27)  /* ' */
 #define ASCII_LPAREN  (0x28)  /* ( */
@@ -87,7 +104,9 @@
 #define ASCII_NINE    (0x39)  /* 9 */
 #define ASCII_COLON   (0x3a)  /* : */
 #define ASCII_SEMICOL (0x3b)  /* ; */
+#define ASCII_LT      (0x3c)  /* < */
 #define ASCII_EQUALS  (0x3d)  /* = */
+#define ASCII_GT      (0x3e)  /* > */
 #define ASCII_ATSIGN  (0x40)  /* @ */
 #define ASCII_A_UPPER (0x41)  /* A */
 #define ASCII_B_UPPER (0x42)  /* B */
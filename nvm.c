@@ -6,10 +6,59 @@
  * See the header for further information.
  */
 
+/*
+ * With GNU C, nvm_run() jumps from each operation straight to the code
+ * for the next one through a table of label addresses.  Define
+ * NVM_NO_THREADED to always dispatch through a switch.
+ */
+#if defined(__GNUC__) && !defined(NVM_NO_THREADED)
+#define NVM_THREADED
+#endif
+
+/*
+ * With GNU C, bits are scanned with the compiler builtins, which
+ * compile to single instructions on most processors.  Define
+ * NVM_NO_BUILTIN_BITS to use the portable code instead.
+ */
+#if defined(__GNUC__) && !defined(NVM_NO_BUILTIN_BITS)
+#define NVM_BUILTIN_BITS
+#endif
+
+/*
+ * On POSIX systems, the time budget is measured with the monotonic
+ * clock, which is finer than a second and does not jump when the
+ * system time is set.  Elsewhere, it is measured with time().
+ */
+#if defined(__unix__) || (defined(__APPLE__) && defined(__MACH__))
+#define NVM_MONOTONIC
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+/*
+ * The vectorized pitch set kernels are only built for x86 with GCC or
+ * Clang, which provide the target attribute and runtime processor
+ * detection, the same as the kernels in scan.c.  They are also only
+ * built when a pitch set has at least four words, so that an AVX2
+ * kernel has a whole block to work on; narrower pitch sets are handled
+ * inline, a word at a time, which the compiler can unroll.  Define
+ * NVM_NO_SIMD to always do that.
+ */
+#if !defined(NVM_NO_SIMD) && \
+    (defined(__GNUC__) || defined(__clang__)) && \
+    (defined(__x86_64__) || defined(__i386__))
+#define NVM_X86
+#endif
+
 #include "nvm.h"
 #include "event.h"
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+
+#if defined(NVM_X86) && (NVM_PSWORDS >= 4)
+#define NVM_PSAVX2
+#include <immintrin.h>
+#endif
 
 /*
  * Constants
@@ -27,6 +76,19 @@
  */
 #define NVM_INITCAP (8)
 
+/*
+ * The maximum number of pitches in a pitch set.
+ */
+#define NVM_MAXCHORD (NMF_MAXPITCH - NMF_MINPITCH + 1)
+
+/*
+ * The number of operations between checks of the time budget.  The
+ * mask is used within multiple operations, and is one less than a
+ * power of two.
+ */
+#define NVM_CLOCKOPS (INT64_C(65536))
+#define NVM_CLOCKMASK (0xffff)
+
 /*
  * Type declarations
  * =================
@@ -70,7 +132,7 @@ typedef struct {
    * Pointer to the dynamically-allocated stack.
    */
   int32_t *pst;
-
+  
 } NVM_ISTACK;
 
 /*
@@ -97,11 +159,38 @@ typedef struct {
   
 } NVM_LSTACK;
 
+/*
+ * Function pointer types for the pitch set kernels, which work on
+ * arrays of pitch set words of the given length.
+ */
+#ifdef NVM_PSAVX2
+typedef void (*NVM_PSOP_FP)(uint64_t *, const uint64_t *, int);
+typedef int32_t (*NVM_PSCOUNT_FP)(const uint64_t *, int);
+#endif
+
 /*
  * Static data
  * ===========
  */
 
+/*
+ * Flag indicating whether the range pitch set has been filled and the
+ * pitch set kernels selected yet.
+ */
+static int m_nvm_psinit = 0;
+
+/*
+ * A pitch set that holds every pitch in range, and the selected pitch
+ * set kernels.
+ * 
+ * Only valid if m_nvm_psinit.
+ */
+static NVM_PITCHSET m_nvm_psrange;
+#ifdef NVM_PSAVX2
+static NVM_PSOP_FP m_nvm_psintersect = NULL;
+static NVM_PSCOUNT_FP m_nvm_pscount = NULL;
+#endif
+
 /*
  * Flag indicating whether the module has been initialized yet.
  */
@@ -192,6 +281,55 @@ static NVM_ISTACK m_nvm_artstack;
  */
 static int32_t m_nvm_immart = -1;
 
+/*
+ * The emission context of the repeat operation.
+ * 
+ * Only valid if m_nvm_init and m_nvm_ctx.
+ * 
+ * m_nvm_ctxArt is the articulation on top of the articulation stack,
+ * or zero if it is empty, and m_nvm_ctxLayer is the layer register on
+ * top of the layer stack, or the base layer if it is empty.  Every
+ * change to the articulation stack, the layer stack, or the base layer
+ * clears m_nvm_ctx, and nvm_context() works them out again the next
+ * time they are needed.  The immediate articulation register is not
+ * part of the context, since it only applies to one repeat.
+ */
+static int m_nvm_ctx = 0;
+static int32_t m_nvm_ctxArt = 0;
+static NVM_LAYERREG m_nvm_ctxLayer;
+
+/*
+ * The repeat block stacks.
+ * 
+ * Only valid if m_nvm_init.
+ * 
+ * For each open repeat block, m_nvm_blockt has the cursor position
+ * where it began, m_nvm_blocke has the number of events that had been
+ * made before it began, and m_nvm_blockm has the latest time offset of
+ * the events made in it so far, or -1 if there are none.
+ */
+static NVM_ISTACK m_nvm_blockt;
+static NVM_ISTACK m_nvm_blocke;
+static NVM_ISTACK m_nvm_blockm;
+
+/*
+ * The operation and time budgets.
+ * 
+ * m_nvm_ops is the number of operations charged so far, which may not
+ * exceed m_nvm_maxOps.  If m_nvm_secs is greater than zero, no more
+ * than that many seconds may pass after m_nvm_start, which is checked
+ * each time m_nvm_ops reaches m_nvm_clockAt.
+ */
+static int64_t m_nvm_ops = 0;
+static int64_t m_nvm_maxOps = INT64_MAX;
+static int32_t m_nvm_secs = 0;
+#ifdef NVM_MONOTONIC
+static struct timespec m_nvm_start;
+#else
+static time_t m_nvm_start;
+#endif
+static int64_t m_nvm_clockAt = NVM_CLOCKOPS;
+
 /*
  * The grace note count register.
  * 
@@ -218,18 +356,154 @@ static void nvm_init(void);
 
 static void nvm_lstack_init(NVM_LSTACK *ps);
 static int nvm_lstack_isEmpty(NVM_LSTACK *ps);
+static int nvm_lstack_isFull(NVM_LSTACK *ps);
 static int nvm_lstack_push(NVM_LSTACK *ps, const NVM_LAYERREG *pv);
 static int nvm_lstack_pop(NVM_LSTACK *ps);
 static int nvm_lstack_peek(NVM_LSTACK *ps, NVM_LAYERREG *pv);
 
 static void nvm_istack_init(NVM_ISTACK *ps);
 static int nvm_istack_isEmpty(NVM_ISTACK *ps);
+static int nvm_istack_isFull(NVM_ISTACK *ps);
 static int nvm_istack_push(NVM_ISTACK *ps, int32_t v);
 static int nvm_istack_pop(NVM_ISTACK *ps);
 static int nvm_istack_peek(NVM_ISTACK *ps, int32_t *pv);
 
-static int nvm_bit_most(uint64_t v);
 static int nvm_bit_least(uint64_t v);
+static int nvm_bit_count(uint64_t v);
+
+static void nvm_psinit(void);
+static void nvm_psintersect_scalar(
+          uint64_t * pa,
+    const uint64_t * pb,
+          int        n);
+static int32_t nvm_pscount_scalar(const uint64_t *pa, int n);
+
+#ifdef NVM_PSAVX2
+static void nvm_psintersect_avx2(
+          uint64_t * pa,
+    const uint64_t * pb,
+          int        n);
+static int32_t nvm_pscount_avx2(const uint64_t *pa, int n);
+#endif
+
+static int32_t nvm_chord(const NVM_PITCHSET *ps, int32_t *pPitch);
+static int nvm_emit(
+    const NVM_PITCHSET * ps,
+          int32_t        durval,
+          int32_t        art,
+    const NVM_LAYERREG * plr,
+          int          * per);
+
+static void nvm_context(void);
+static int nvm_plainRepeat(void);
+static int nvm_fastRepeat(int *per);
+static int nvm_runRepeat(int *per);
+static int nvm_bulkRepeat(int32_t t);
+
+static void nvm_blockMark(int32_t t);
+static int nvm_wanted(int32_t sect);
+static int nvm_clock(int *per);
+
+/*
+ * Record that an event was made at time offset t in the innermost open
+ * repeat block, if there is one.
+ * 
+ * Parameters:
+ * 
+ *   t - the time offset of the event
+ */
+static void nvm_blockMark(int32_t t) {
+  
+  int32_t tmax = 0;
+  
+  /* Initialize if needed */
+  nvm_init();
+  
+  /* Update the latest time offset of the block */
+  if (nvm_istack_peek(&m_nvm_blockm, &tmax)) {
+    if (t > tmax) {
+      if (!nvm_istack_pop(&m_nvm_blockm)) {
+        abort();
+      }
+      if (!nvm_istack_push(&m_nvm_blockm, t)) {
+        abort();
+      }
+    }
+  }
+}
+
+/*
+ * Check whether events made at the cursor in the given section might
+ * be written.
+ * 
+ * Events that the event module would not select are not made at all,
+ * except in repeat blocks, whose replays might be selected.
+ * 
+ * Parameters:
+ * 
+ *   sect - the section of the events
+ * 
+ * Return:
+ * 
+ *   non-zero if the events should be made, zero if they can be skipped
+ */
+static int nvm_wanted(int32_t sect) {
+  
+  /* Initialize if needed */
+  nvm_init();
+  
+  /* Events in repeat blocks are always made */
+  if (!nvm_istack_isEmpty(&m_nvm_blockt)) {
+    return 1;
+  }
+  
+  return event_selected(m_nvm_cursor, sect);
+}
+
+/*
+ * Check the time budget, if there is one.
+ * 
+ * Parameters:
+ * 
+ *   per - pointer to variable to receive error code
+ * 
+ * Return:
+ * 
+ *   non-zero if there is time left, zero if the time budget is spent
+ */
+static int nvm_clock(int *per) {
+  
+  int status = 1;
+  double passed = 0.0;
+#ifdef NVM_MONOTONIC
+  struct timespec now;
+#endif
+  
+  /* Check parameter */
+  if (per == NULL) {
+    abort();
+  }
+  
+  /* Compare the time that has passed to the budget */
+  if (m_nvm_secs > 0) {
+#ifdef NVM_MONOTONIC
+    if (clock_gettime(CLOCK_MONOTONIC, &now)) {
+      abort();
+    }
+    passed = ((double) (now.tv_sec - m_nvm_start.tv_sec)) +
+              ((double) (now.tv_nsec - m_nvm_start.tv_nsec)) / 1.0e9;
+#else
+    passed = difftime(time(NULL), m_nvm_start);
+#endif
+    if (passed > (double) m_nvm_secs) {
+      status = 0;
+      *per = ERR_TIMEOUT;
+    }
+  }
+  
+  /* Return status */
+  return status;
+}
 
 /*
  * Flush a grace note sequence, if necessary.
@@ -297,6 +571,14 @@ static void nvm_init(void) {
     nvm_istack_init(&m_nvm_artstack);
     m_nvm_immart = -1;
     
+    m_nvm_ctx = 0;
+    m_nvm_ctxArt = 0;
+    memset(&m_nvm_ctxLayer, 0, sizeof(NVM_LAYERREG));
+    
+    nvm_istack_init(&m_nvm_blockt);
+    nvm_istack_init(&m_nvm_blocke);
+    nvm_istack_init(&m_nvm_blockm);
+    
     m_nvm_gracecount = 0;
     m_nvm_graceoffset = 0;
     
@@ -369,6 +651,38 @@ static int nvm_lstack_isEmpty(NVM_LSTACK *ps) {
   return result;
 }
 
+/*
+ * Check whether the given stack is full.
+ * 
+ * The stack must be initialized first.  A push fails exactly when the
+ * stack is full.
+ * 
+ * Parameters:
+ * 
+ *   ps - the stack to check
+ * 
+ * Return:
+ * 
+ *   non-zero if full, zero if not
+ */
+static int nvm_lstack_isFull(NVM_LSTACK *ps) {
+  
+  int result = 0;
+  
+  /* Check parameter */
+  if (ps == NULL) {
+    abort();
+  }
+  
+  /* Check if full */
+  if (ps->count >= NVM_MAXSTACK) {
+    result = 1;
+  }
+  
+  /* Return result */
+  return result;
+}
+
 /*
  * Push a layer register value onto the stack.
  * 
@@ -583,6 +897,38 @@ static int nvm_istack_isEmpty(NVM_ISTACK *ps) {
   return result;
 }
 
+/*
+ * Check whether the given stack is full.
+ * 
+ * The stack must be initialized first.  A push fails exactly when the
+ * stack is full.
+ * 
+ * Parameters:
+ * 
+ *   ps - the stack to check
+ * 
+ * Return:
+ * 
+ *   non-zero if full, zero if not
+ */
+static int nvm_istack_isFull(NVM_ISTACK *ps) {
+  
+  int result = 0;
+  
+  /* Check parameter */
+  if (ps == NULL) {
+    abort();
+  }
+  
+  /* Check if full */
+  if (ps->count >= NVM_MAXSTACK) {
+    result = 1;
+  }
+  
+  /* Return result */
+  return result;
+}
+
 /*
  * Push an integer value onto the stack.
  * 
@@ -732,82 +1078,6 @@ static int nvm_istack_peek(NVM_ISTACK *ps, int32_t *pv) {
   return status;
 }
 
-/*
- * Return the offset of the most significant bit that is set in the
- * given unsigned value.
- * 
- * An offset of zero means the least significant bit, an offset of one
- * means the second least significant bit, and so forth.
- * 
- * If v is zero, -1 is returned.
- * 
- * Parameters:
- * 
- *   v - the binary value to check
- * 
- * Return:
- * 
- *   the offset of the most significant bit that is set, or -1 if all
- *   bits are zero
- */
-static int nvm_bit_most(uint64_t v) {
-  
-  int result = 0;
-  
-  /* Only proceed if v is non-zero */
-  if (v != 0) {
-    
-    /* If most significant 32 bits are non-zero, then shift v right by
-     * 32 and add 32 to result */
-    if (v & UINT64_C(0xffffffff00000000)) {
-      v >>= 32;
-      result += 32;
-    }
-    
-    /* v now confined to 32 bits; if most significant 16 bits are
-     * non-zero, then shift v right by 16 and add 16 to result */
-    if (v & UINT64_C(0xffff0000)) {
-      v >>= 16;
-      result += 16;
-    }
-    
-    /* v now confined to 16 bits; if most significant 8 bits are
-     * non-zero, then shift v right by 8 and add 8 to result */
-    if (v & UINT64_C(0xff00)) {
-      v >>= 8;
-      result += 8;
-    }
-    
-    /* v now confined to 8 bits; if most significant 4 bits are
-     * non-zero, then shift v right by 4 and add 4 to result */
-    if (v & UINT64_C(0xf0)) {
-      v >>= 4;
-      result += 4;
-    }
-    
-    /* v now confined to 4 bits; if most significant 2 bits are
-     * non-zero, then shift v right by 2 and add 2 to result */
-    if (v & UINT64_C(0xc)) {
-      v >>= 2;
-      result += 2;
-    }
-    
-    /* v now confined to 2 bits; if most significant bit is non-zero,
-     * then shift v right by 1 and add 1 to result */
-    if (v & UINT64_C(0x2)) {
-      v >>= 1;
-      result++;
-    }
-    
-  } else {
-    /* v is zero, so return -1 */
-    result = -1;
-  }
-  
-  /* Return result */
-  return result;
-}
-
 /*
  * Return the offset of the least significant bit that is set in the
  * given unsigned value.
@@ -828,8 +1098,16 @@ static int nvm_bit_most(uint64_t v) {
  */
 static int nvm_bit_least(uint64_t v) {
   
+#ifdef NVM_BUILTIN_BITS
+  /* Count the trailing zeros, which is undefined for zero */
+  if (v != 0) {
+    return __builtin_ctzll((unsigned long long) v);
+  } else {
+    return -1;
+  }
+#else
   int result = 0;
-
+  
   /* Only proceed if v is non-zero */
   if (v != 0) {
     
@@ -839,35 +1117,35 @@ static int nvm_bit_least(uint64_t v) {
       v >>= 32;
       result += 32;
     }
-
+    
     /* Low 32 bits are now non-zero; if least significant 16 bits are
      * zero, then shift v right by 16 and add 16 to result */
     if ((v & UINT64_C(0xffff)) == 0) {
       v >>= 16;
       result += 16;
     }
-
+    
     /* Low 16 bits are now non-zero; if least significant 8 bits are
      * zero, then shift v right by 8 and add 8 to result */
     if ((v & UINT64_C(0xff)) == 0) {
       v >>= 8;
       result += 8;
     }
-
+    
     /* Low 8 bits are now non-zero; if least significant 4 bits are 
      * zero, then shift v right by 4 and add 4 to result */
     if ((v & UINT64_C(0xf)) == 0) {
       v >>= 4;
       result += 4;
     }
-
+    
     /* Low 4 bits are now non-zero; if least significant 2 bits are
      * zero, then shift v right by 2 and add 2 to result */
     if ((v & UINT64_C(0x3)) == 0) {
       v >>= 2;
       result += 2;
     }
-
+    
     /* Low 2 bits are now non-zero; if least significant bit is zero,
      * then shift v right by 1 and add 1 to result */
     if ((v & UINT64_C(0x1)) == 0) {
@@ -882,203 +1160,731 @@ static int nvm_bit_least(uint64_t v) {
   
   /* Return result */
   return result;
+#endif
 }
 
 /*
- * Public function implementations
- * ===============================
+ * Return the number of bits that are set in the given unsigned value.
  * 
- * See the header for specifications.
- */
-
-/*
- * nvm_pitchset_clear function.
+ * Parameters:
+ * 
+ *   v - the binary value to check
+ * 
+ * Return:
+ * 
+ *   the number of bits that are set
  */
-void nvm_pitchset_clear(NVM_PITCHSET *ps) {
+static int nvm_bit_count(uint64_t v) {
   
-  /* Check parameter */
-  if (ps == NULL) {
-    abort();
+#ifdef NVM_BUILTIN_BITS
+  return __builtin_popcountll((unsigned long long) v);
+#else
+  int result = 0;
+  
+  /* Clear the least significant bit that is set until none are */
+  while (v != 0) {
+    v &= v - 1;
+    result++;
   }
   
-  /* Clear pitch set */
-  memset(ps, 0, sizeof(NVM_PITCHSET));
-  ps->a = 0;
-  ps->b = 0;
+  /* Return result */
+  return result;
+#endif
 }
 
 /*
- * nvm_pitchset_isEmpty function.
+ * Fill the range pitch set and select the pitch set kernels, if not
+ * already done.
+ * 
+ * The AVX2 kernels are preferred where they are built, and otherwise
+ * the scalar kernels are used.
  */
-int nvm_pitchset_isEmpty(const NVM_PITCHSET *ps) {
+static void nvm_psinit(void) {
   
-  int result = 0;
+  int32_t p = 0;
   
-  /* Check parameter */
-  if (ps == NULL) {
-    abort();
+  /* Only proceed if not yet initialized */
+  if (!m_nvm_psinit) {
+    
+    /* Fill the range pitch set */
+    nvm_pitchset_clear(&m_nvm_psrange);
+    for(p = NMF_MINPITCH; p <= NMF_MAXPITCH; p++) {
+      nvm_pitchset_add(&m_nvm_psrange, p);
+    }
+    
+#ifdef NVM_PSAVX2
+    /* Start with the scalar kernels */
+    m_nvm_psintersect = &nvm_psintersect_scalar;
+    m_nvm_pscount = &nvm_pscount_scalar;
+    
+    /* Upgrade to vectorized kernels if supported */
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+      m_nvm_psintersect = &nvm_psintersect_avx2;
+      m_nvm_pscount = &nvm_pscount_avx2;
+    }
+#endif
+    
+    /* Set the initialized flag */
+    m_nvm_psinit = 1;
   }
+}
+
+/*
+ * Scalar version of the intersection kernel.
+ * 
+ * Parameters:
+ * 
+ *   pa - the words to modify
+ * 
+ *   pb - the words to mask them with
+ * 
+ *   n - the number of words
+ */
+static void nvm_psintersect_scalar(
+          uint64_t * pa,
+    const uint64_t * pb,
+          int        n) {
   
-  /* Check if empty */
-  if ((ps->a == 0) && (ps->b == 0)) {
-    result = 1;
+  int i = 0;
+  
+  for(i = 0; i < n; i++) {
+    pa[i] &= pb[i];
+  }
+}
+
+/*
+ * Scalar version of the count kernel.
+ * 
+ * Parameters:
+ * 
+ *   pa - the words to count
+ * 
+ *   n - the number of words
+ * 
+ * Return:
+ * 
+ *   the number of bits set in the words
+ */
+static int32_t nvm_pscount_scalar(const uint64_t *pa, int n) {
+  
+  int32_t result = 0;
+  int i = 0;
+  
+  for(i = 0; i < n; i++) {
+    result += (int32_t) nvm_bit_count(pa[i]);
   }
   
-  /* Return result */
   return result;
 }
 
+#ifdef NVM_PSAVX2
+
 /*
- * nvm_pitchset_add function.
+ * AVX2 version of the intersection kernel.
+ * 
+ * Four words are masked at a time.  The rest are handled by the scalar
+ * kernel.
  */
-void nvm_pitchset_add(NVM_PITCHSET *ps, int32_t pitch) {
+__attribute__((target("avx2")))
+static void nvm_psintersect_avx2(
+          uint64_t * pa,
+    const uint64_t * pb,
+          int        n) {
+  
+  int i = 0;
+  
+  for(i = 0; i + 4 <= n; i += 4) {
+    _mm256_storeu_si256((__m256i *) (pa + i),
+      _mm256_and_si256(
+        _mm256_loadu_si256((const __m256i *) (pa + i)),
+        _mm256_loadu_si256((const __m256i *) (pb + i))));
+  }
+  
+  nvm_psintersect_scalar(pa + i, pb + i, n - i);
+}
+
+/*
+ * AVX2 version of the count kernel.
+ * 
+ * The bits of each nibble of four words are counted at once by looking
+ * them up in a table with a byte shuffle, and the bytes of each word
+ * are added up with a sum of absolute differences against zero.  The
+ * rest of the words are handled by the scalar kernel.
+ */
+__attribute__((target("avx2")))
+static int32_t nvm_pscount_avx2(const uint64_t *pa, int n) {
   
-  int shv = 0;
+  __m256i vt, m4, vz, v, vsum;
+  uint64_t sum[4];
+  int i = 0;
+  
+  vt = _mm256_setr_epi8(
+          0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+          0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+  m4 = _mm256_set1_epi8((char) 0x0f);
+  vz = _mm256_setzero_si256();
+  vsum = _mm256_setzero_si256();
+  
+  for(i = 0; i + 4 <= n; i += 4) {
+    v = _mm256_loadu_si256((const __m256i *) (pa + i));
+    v = _mm256_add_epi8(
+          _mm256_shuffle_epi8(vt, _mm256_and_si256(v, m4)),
+          _mm256_shuffle_epi8(vt,
+            _mm256_and_si256(_mm256_srli_epi16(v, 4), m4)));
+    vsum = _mm256_add_epi64(vsum, _mm256_sad_epu8(v, vz));
+  }
+  
+  _mm256_storeu_si256((__m256i *) sum, vsum);
+  return (int32_t) (sum[0] + sum[1] + sum[2] + sum[3]) +
+            nvm_pscount_scalar(pa + i, n - i);
+}
+
+#endif
+
+/*
+ * Get the pitches in a pitch set in ascending order.
+ * 
+ * Each word of the pitch set is scanned from its least significant
+ * bit, which is where the lowest pitch in it is.
+ * 
+ * Parameters:
+ * 
+ *   ps - the pitch set
+ * 
+ *   pPitch - the array to receive the pitches, which must have room for
+ *   NVM_MAXCHORD pitches
+ * 
+ * Return:
+ * 
+ *   the number of pitches
+ */
+static int32_t nvm_chord(const NVM_PITCHSET *ps, int32_t *pPitch) {
+  
+  int32_t n = 0;
+  int32_t base = 0;
+  int i = 0;
+  uint64_t v = 0;
   
   /* Check parameters */
-  if ((ps == NULL) ||
-      (pitch < NMF_MINPITCH) || (pitch > NMF_MAXPITCH)) {
+  if ((ps == NULL) || (pPitch == NULL)) {
     abort();
   }
   
-  /* Set appropriate bit */
-  if (pitch < 0) {
-    /* Pitch is less than zero, so we are using the A register; invert
-     * the pitch and decrement it to get the shift-left value */
-    shv = (int) (-(pitch) - 1);
-    
-    /* Add the pitch if not already present */
-    ps->a |= (((uint64_t) 1) << shv);
-    
-  } else {
-    /* Pitch is zero or greater, so we are using the B register; the
-     * pitch is the shift-right value from the most significant bit */
-    shv = (int) pitch;
-    
-    /* Add the pitch if not already present */
-    ps->b |= (UINT64_C(0x8000000000000000) >> shv);
+  /* Bit offset zero of each word is 64 pitches above that of the word
+   * before, starting at the lowest pitch */
+  base = NMF_MINPITCH;
+  for(i = 0; i < NVM_PSWORDS; i++) {
+    for(v = (ps->w)[i]; v != 0; v &= v - 1) {
+      pPitch[n] = base + (int32_t) nvm_bit_least(v);
+      n++;
+    }
+    base += 64;
   }
+  
+  /* Return the number of pitches */
+  return n;
 }
 
 /*
- * nvm_pitchset_drop function.
+ * Output the notes of a repeat operation at the cursor.
+ * 
+ * The whole chord is added with one call to event_chord().  Grace
+ * notes are counted in the grace note count register.
+ * 
+ * Parameters:
+ * 
+ *   ps - the pitches to output
+ * 
+ *   durval - the duration value of the notes
+ * 
+ *   art - the articulation of the notes
+ * 
+ *   plr - the section and layer of the notes
+ * 
+ *   per - pointer to variable to receive error code
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if error
  */
-void nvm_pitchset_drop(NVM_PITCHSET *ps, int32_t pitch) {
+static int nvm_emit(
+    const NVM_PITCHSET * ps,
+          int32_t        durval,
+          int32_t        art,
+    const NVM_LAYERREG * plr,
+          int          * per) {
   
-  int shv = 0;
+  int status = 1;
+  int32_t n = 0;
+  int32_t pitch[NVM_MAXCHORD];
   
   /* Check parameters */
-  if ((ps == NULL) ||
-      (pitch < NMF_MINPITCH) || (pitch > NMF_MAXPITCH)) {
+  if ((ps == NULL) || (plr == NULL) || (per == NULL)) {
     abort();
   }
   
-  /* Clear appropriate bit */
-  if (pitch < 0) {
-    /* Pitch is less than zero, so we are using the A register; invert
-     * the pitch and decrement it to get the shift-left value */
-    shv = (int) (-(pitch) - 1);
-    
-    /* Drop the pitch if present */
-    ps->a &= ~(((uint64_t) 1) << shv);
+  /* Get the pitches, and only proceed if there are any */
+  n = nvm_chord(ps, pitch);
+  if (n < 1) {
+    return status;
+  }
+  
+  /* Record the events about to be made in the enclosing repeat block */
+  nvm_blockMark(m_nvm_cursor);
+  
+  /* Make sure the grace note count will not overflow */
+  if ((durval < 0) && (m_nvm_gracecount > INT32_MAX - n)) {
+    status = 0;
+    *per = ERR_HUGEGRACE;
+  }
+  
+  /* Report the note events */
+  if (status) {
+    if (!event_chord(
+            m_nvm_cursor,
+            durval,
+            pitch,
+            n,
+            art,
+            plr->sect,
+            ((int32_t) plr->layer_i) + 1,
+            per)) {
+      status = 0;
+    }
+  }
+  
+  /* Count grace notes */
+  if (status && (durval < 0)) {
+    m_nvm_gracecount += n;
+  }
+  
+  /* Return status */
+  return status;
+}
+
+/*
+ * Work out the emission context again, if it was cleared.
+ */
+static void nvm_context(void) {
+  
+  /* Only proceed if the context was cleared */
+  if (m_nvm_ctx) {
+    return;
+  }
+  
+  /* Articulation from the top of the stack, or zero */
+  if (!nvm_istack_peek(&m_nvm_artstack, &m_nvm_ctxArt)) {
+    m_nvm_ctxArt = 0;
+  }
+  
+  /* Section and layer from the top of the stack, or the base layer */
+  if (!nvm_lstack_peek(&m_nvm_layerstack, &m_nvm_ctxLayer)) {
+    memcpy(&m_nvm_ctxLayer, &m_nvm_baselayer, sizeof(NVM_LAYERREG));
+  }
+  
+  m_nvm_ctx = 1;
+}
+
+/*
+ * Check whether the repeat operation can take the fast path.
+ * 
+ * This is the common case of a non-empty pitch set with a duration
+ * that is not a grace note, with no grace note offset and no immediate
+ * articulation, which can not fail except at the limits of the event
+ * buffer and the cursor.
+ * 
+ * Return:
+ * 
+ *   non-zero if nvm_fastRepeat() can be used, zero if not
+ */
+static int nvm_plainRepeat(void) {
+  return (m_nvm_pitch_filled && (m_nvm_dur > 0) &&
+          (m_nvm_graceoffset == 0) && (m_nvm_immart < 0) &&
+          (!nvm_pitchset_isEmpty(&m_nvm_pitch)));
+}
+
+/*
+ * The repeat operation on the fast path.
+ * 
+ * This is the same as nvm_op_repeat(), except that the caller must
+ * have initialized the module, checked per, and checked that
+ * nvm_plainRepeat() is true.
+ * 
+ * Parameters:
+ * 
+ *   per - pointer to an error variable
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if error
+ */
+static int nvm_fastRepeat(int *per) {
+  
+  int32_t n = 0;
+  int32_t pitch[NVM_MAXCHORD];
+  
+  /* Make sure the context is current */
+  nvm_context();
+  
+  /* Output the chord, unless it can not be selected */
+  if (nvm_wanted((int32_t) m_nvm_ctxLayer.sect)) {
+    n = nvm_chord(&m_nvm_pitch, pitch);
+    nvm_blockMark(m_nvm_cursor);
+    if (!event_chord(
+            m_nvm_cursor,
+            m_nvm_dur,
+            pitch,
+            n,
+            m_nvm_ctxArt,
+            (int32_t) m_nvm_ctxLayer.sect,
+            ((int32_t) m_nvm_ctxLayer.layer_i) + 1,
+            per)) {
+      return 0;
+    }
+  }
+  
+  /* Advance the cursor */
+  if (m_nvm_cursor > INT32_MAX - m_nvm_dur) {
+    *per = ERR_LONGPIECE;
+    return 0;
+  }
+  m_nvm_cursor += m_nvm_dur;
+  
+  return 1;
+}
+
+/*
+ * The repeat operation as nvm_run() performs it.
+ * 
+ * This is the same as nvm_op_repeat(), except that the caller must
+ * have initialized the module and checked per, and the stacks are read
+ * directly.
+ * 
+ * Parameters:
+ * 
+ *   per - pointer to an error variable
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if error
+ */
+static int nvm_runRepeat(int *per) {
+  
+  int status = 1;
+  int32_t durval = 0;
+  int32_t art = 0;
+  
+  /* Take the fast path in the common case */
+  if (nvm_plainRepeat()) {
+    return nvm_fastRepeat(per);
+  }
+  
+  /* Current pitch and current duration must be defined */
+  if (!m_nvm_pitch_filled) {
+    status = 0;
+    *per = ERR_NOPITCH;
     
-  } else {
-    /* Pitch is zero or greater, so we are using the B register; the
-     * pitch is the shift-right value from the most significant bit */
-    shv = (int) pitch;
+  } else if (m_nvm_dur < 0) {
+    status = 0;
+    *per = ERR_NODUR;
+  }
+  
+  /* If current duration is grace note, then increment grace offset
+   * register, watching for overflow */
+  if (status && (m_nvm_dur == 0)) {
+    if (m_nvm_graceoffset < INT32_MAX) {
+      m_nvm_graceoffset++;
+    } else {
+      status = 0;
+      *per = ERR_HUGEGRACE;
+    }
+  }
+  
+  /* Determine duration and articulation the same way as the repeat
+   * operation, and make sure the context is current */
+  if (status) {
+    if (m_nvm_graceoffset > 0) {
+      durval = -(m_nvm_graceoffset);
+    } else {
+      durval = m_nvm_dur;
+    }
     
-    /* Drop the pitch if present */
-    ps->b &= ~(UINT64_C(0x8000000000000000) >> shv);
+    nvm_context();
+    if (m_nvm_immart >= 0) {
+      art = m_nvm_immart;
+      m_nvm_immart = -1;
+    } else {
+      art = m_nvm_ctxArt;
+    }
+  }
+  
+  /* Output notes, unless they can not be selected */
+  if (status && nvm_wanted((int32_t) m_nvm_ctxLayer.sect)) {
+    if (!nvm_emit(&m_nvm_pitch, durval, art, &m_nvm_ctxLayer, per)) {
+      status = 0;
+    }
   }
+  
+  /* If duration not a grace note, advance cursor by that much */
+  if (status && (durval > 0)) {
+    if (m_nvm_cursor <= INT32_MAX - durval) {
+      m_nvm_cursor += durval;
+    } else {
+      status = 0;
+      *per = ERR_LONGPIECE;
+    }
+  }
+  
+  /* Return status */
+  return status;
 }
 
 /*
- * nvm_pitchset_least function.
+ * Run a multiple operation in bulk, if possible.
+ * 
+ * This does the same as running the repeat operation t times, with one
+ * call to event_run() for the whole strided run of chords instead of
+ * one call to event_note() per note.  The immediate articulation only
+ * applies to the first repeat, as always.
+ * 
+ * Only notes with a duration are done in bulk, and only when the whole
+ * run would be selected or is in a repeat block.  Everything is
+ * checked before anything is changed, so if this returns zero, the
+ * state is untouched and the caller runs the repeats one by one, which
+ * reports any error at the repeat where it happens.
+ * 
+ * Parameters:
+ * 
+ *   t - the number of repeats
+ * 
+ * Return:
+ * 
+ *   non-zero if the repeats were done, zero if they must be run one by
+ *   one
  */
-int32_t nvm_pitchset_least(const NVM_PITCHSET *ps) {
+static int nvm_bulkRepeat(int32_t t) {
   
-  int32_t result = 0;
+  int32_t art0 = 0;
+  int32_t art = 0;
+  int32_t tlast = 0;
+  int32_t n = 0;
+  int32_t pitch[NVM_MAXCHORD];
+  int err = 0;
+  
+  /* Initialize if necessary */
+  nvm_init();
   
   /* Check parameter */
-  if (ps == NULL) {
+  if (t < 1) {
     abort();
   }
   
-  /* Check that pitch set is not empty */
-  if (nvm_pitchset_isEmpty(ps)) {
-    abort();
+  /* The registers must be defined, the notes must not be grace notes,
+   * and the cursor must not overflow */
+  if ((!m_nvm_pitch_filled) || (m_nvm_dur < 1) ||
+      (m_nvm_graceoffset > 0)) {
+    return 0;
+  }
+  if (((int64_t) m_nvm_dur) * ((int64_t) t) >
+        (int64_t) (INT32_MAX - m_nvm_cursor)) {
+    return 0;
   }
+  tlast = m_nvm_cursor + m_nvm_dur * (t - 1);
   
-  /* Determine which register to use */
-  if (ps->a) {
-    /* Register A is non-zero, so determine lowest pitch there */
-    result = (int32_t) nvm_bit_most(ps->a);
-    if (result < 0) {
-      abort();  /* Shouldn't happen */
-    }
-    
-    /* Add one to result and then invert it to get the pitch offset */
-    result = -(result + 1);
-    
+  /* Determine the articulations the same way as the repeat operation,
+   * and make sure the context is current */
+  nvm_context();
+  art = m_nvm_ctxArt;
+  if (m_nvm_immart >= 0) {
+    art0 = m_nvm_immart;
   } else {
-    /* Register B is non-zero, so determine lowest pitch there */
-    result = (int32_t) nvm_bit_most(ps->b);
-    if (result < 0) {
-      abort();  /* Shouldn't happen */
+    art0 = art;
+  }
+  
+  /* Decompose the pitch set once for the whole run */
+  n = nvm_chord(&m_nvm_pitch, pitch);
+  
+  /* Outside of repeat blocks, the whole run must be selected, which it
+   * is if the first and last repeats are, since the selected time
+   * offsets of a section are one range */
+  if ((n > 0) && nvm_istack_isEmpty(&m_nvm_blockt)) {
+    if ((!event_selected(m_nvm_cursor, (int32_t) m_nvm_ctxLayer.sect)) ||
+        (!event_selected(tlast, (int32_t) m_nvm_ctxLayer.sect))) {
+      return 0;
     }
-    
-    /* Determine the pitch from the bit offset */
-    result = 63 - result;
   }
   
-  /* Verify that result is in range */
-  if ((result > NMF_MAXPITCH) || (result < NMF_MINPITCH)) {
-    abort();  /* invalid pitch set */
+  /* Add the run, which either adds everything or nothing */
+  if (n > 0) {
+    if (!event_run(
+            m_nvm_cursor,
+            m_nvm_dur,
+            t,
+            pitch,
+            n,
+            art0,
+            art,
+            (int32_t) m_nvm_ctxLayer.sect,
+            ((int32_t) m_nvm_ctxLayer.layer_i) + 1,
+            &err)) {
+      return 0;
+    }
+    nvm_blockMark(tlast);
   }
   
-  /* Return result */
-  return result;
+  /* Clear the immediate articulation and advance the cursor past the
+   * run */
+  m_nvm_immart = -1;
+  m_nvm_cursor = tlast + m_nvm_dur;
+  
+  return 1;
+}
+
+/*
+ * Public function implementations
+ * ===============================
+ * 
+ * See the header for specifications.
+ */
+
+/*
+ * nvm_pitchset_clear function.
+ */
+void nvm_pitchset_clear(NVM_PITCHSET *ps) {
+  
+  /* Check parameter */
+  if (ps == NULL) {
+    abort();
+  }
+  
+  /* Clear pitch set */
+  memset(ps, 0, sizeof(NVM_PITCHSET));
 }
 
 /*
- * nvm_pitchset_most function.
+ * nvm_pitchset_isEmpty function.
  */
-int32_t nvm_pitchset_most(const NVM_PITCHSET *ps) {
+int nvm_pitchset_isEmpty(const NVM_PITCHSET *ps) {
   
-  int32_t result = 0;
+  int i = 0;
+  uint64_t v = 0;
   
   /* Check parameter */
   if (ps == NULL) {
     abort();
   }
   
-  /* Check that pitch set is not empty */
-  if (nvm_pitchset_isEmpty(ps)) {
+  /* Combine all the words, which the compiler can do in parallel */
+  for(i = 0; i < NVM_PSWORDS; i++) {
+    v |= (ps->w)[i];
+  }
+  
+  /* Return result */
+  return (v == 0);
+}
+
+/*
+ * nvm_pitchset_add function.
+ */
+void nvm_pitchset_add(NVM_PITCHSET *ps, int32_t pitch) {
+  
+  int32_t k = 0;
+  
+  /* Check parameters */
+  if ((ps == NULL) ||
+      (pitch < NMF_MINPITCH) || (pitch > NMF_MAXPITCH)) {
     abort();
   }
+  
+  /* Set the bit of the pitch, if not already set */
+  k = pitch - NMF_MINPITCH;
+  (ps->w)[k >> 6] |= (((uint64_t) 1) << (k & 63));
+}
 
-  /* Determine which register to use */
-  if (ps->b) {
-    /* Register B is non-zero, so determine highest pitch there */
-    result = (int32_t) nvm_bit_least(ps->b);
+/*
+ * nvm_pitchset_drop function.
+ */
+void nvm_pitchset_drop(NVM_PITCHSET *ps, int32_t pitch) {
+  
+  int32_t k = 0;
+  
+  /* Check parameters */
+  if ((ps == NULL) ||
+      (pitch < NMF_MINPITCH) || (pitch > NMF_MAXPITCH)) {
+    abort();
+  }
+  
+  /* Clear the bit of the pitch, if set */
+  k = pitch - NMF_MINPITCH;
+  (ps->w)[k >> 6] &= ~(((uint64_t) 1) << (k & 63));
+}
 
-    if (result < 0) {
-      abort();  /* Shouldn't happen */
-    }
+/*
+ * nvm_pitchset_intersect function.
+ */
+void nvm_pitchset_intersect(NVM_PITCHSET *ps, const NVM_PITCHSET *pb) {
+  
+  /* Check parameters */
+  if ((ps == NULL) || (pb == NULL)) {
+    abort();
+  }
+  
+  /* Mask the words */
+#ifdef NVM_PSAVX2
+  nvm_psinit();
+  (*m_nvm_psintersect)(ps->w, pb->w, NVM_PSWORDS);
+#else
+  nvm_psintersect_scalar(ps->w, pb->w, NVM_PSWORDS);
+#endif
+}
 
-    /* Determine the pitch from the bit offset */
-    result = 63 - result;
-           
-  } else {
-    /* Register A is non-zero, so determine highest pitch there */
-    result = (int32_t) nvm_bit_least(ps->a);
-    if (result < 0) {
-      abort();  /* Shouldn't happen */
+/*
+ * nvm_pitchset_count function.
+ */
+int32_t nvm_pitchset_count(const NVM_PITCHSET *ps) {
+  
+  /* Check parameter */
+  if (ps == NULL) {
+    abort();
+  }
+  
+  /* Count the bits in the words */
+#ifdef NVM_PSAVX2
+  nvm_psinit();
+  return (*m_nvm_pscount)(ps->w, NVM_PSWORDS);
+#else
+  return nvm_pscount_scalar(ps->w, NVM_PSWORDS);
+#endif
+}
+
+/*
+ * nvm_pitchset_least function.
+ */
+int32_t nvm_pitchset_least(const NVM_PITCHSET *ps) {
+  
+  int32_t result = 0;
+  int i = 0;
+  
+  /* Check parameter */
+  if (ps == NULL) {
+    abort();
+  }
+  
+  /* Find the first word that is not zero, faulting if the pitch set is
+   * empty */
+  for(i = 0; i < NVM_PSWORDS; i++) {
+    if ((ps->w)[i] != 0) {
+      break;
     }
-    
-    /* Add one to result and then invert it to get the pitch offset */
-    result = -(result + 1);
   }
+  if (i >= NVM_PSWORDS) {
+    abort();
+  }
+  
+  /* The lowest pitch is the least significant bit in that word */
+  result = NMF_MINPITCH + (i * 64) +
+              (int32_t) nvm_bit_least((ps->w)[i]);
   
   /* Verify that result is in range */
   if ((result > NMF_MAXPITCH) || (result < NMF_MINPITCH)) {
@@ -1095,68 +1901,72 @@ int32_t nvm_pitchset_most(const NVM_PITCHSET *ps) {
 int nvm_pitchset_transpose(NVM_PITCHSET *ps, int32_t offset) {
   
   int status = 1;
-  int32_t bound_pitch = 0;
-  int shv = 0;
+  int32_t d = 0;
+  int i = 0;
+  int q = 0;
+  int r = 0;
+  uint64_t v = 0;
+  NVM_PITCHSET pss;
   
   /* Check parameters */
   if (ps == NULL) {
     abort();
   }
   
-  /* Only do something if offset is non-zero and pitch set non-empty */
-  if ((offset != 0) && (!nvm_pitchset_isEmpty(ps))) {
-
-    /* Determine whether transposing up or down */
-    if (offset < 0) {
-
-      /* Transposing down -- find lowest pitch in set */
-      bound_pitch = nvm_pitchset_least(ps);
-      
-      /* Only proceed if lowest pitch transposed down is not out of
-       * range; otherwise, fail */
-      if (offset >= NMF_MINPITCH - bound_pitch) {
-        
-        /* We can safely transpose down without anything going out of
-         * range; shift value is inverse of the offset */
-        shv = (int) (-(offset));
-        
-        /* Begin by shifting register A left */
-        ps->a <<= shv;
-        
-        /* Transfer the top bits of register B to the bottom of A */
-        ps->a |= (ps->b >> (64 - shv));
-        
-        /* Shift register B left */
-        ps->b <<= shv;
-        
-      } else {
-        /* Transposition would take pitch out of range */
-        status = 0;
-      }
-      
+  /* Only do something if offset is non-zero */
+  if (offset != 0) {
+    
+    /* An offset as wide as the range takes every pitch out of it, so
+     * only an empty pitch set can be transposed that far; otherwise,
+     * the shift is less than the width of the set, so split it into
+     * whole words and bits */
+    if ((offset >= NVM_MAXCHORD) || (offset <= -NVM_MAXCHORD)) {
+      status = nvm_pitchset_isEmpty(ps);
     } else {
-      /* Transposing up -- find highest pitch in set */
-      bound_pitch = nvm_pitchset_most(ps);
-      
-      /* Only proceed if highest pitch transposed up is not out of
-       * range; otherwise, fail */
-      if (offset <= NMF_MAXPITCH - bound_pitch) {
-        
-        /* We can safely tranpose up without anything going out of
-         * range; shift value is the offset */
-        shv = (int) offset;
-        
-        /* Begin by shifting register B right */
-        ps->b >>= shv;
-        
-        /* Transfer the bottom bits of register A to the top of B */
-        ps->b |= (ps->a << (64 - shv));
-        
-        /* Shift register A right */
-        ps->a >>= shv;
+      d = (offset < 0) ? -offset : offset;
+      q = (int) (d >> 6);
+      r = (int) (d & 63);
+    }
+    
+    /* Shift the words into a copy */
+    if ((d > 0) && (offset < 0)) {
+      /* Transposing down -- shift the words down, bringing the bottom
+       * bits of the word above into the top of each */
+      for(i = 0; i < NVM_PSWORDS; i++) {
+        v = 0;
+        if (i + q < NVM_PSWORDS) {
+          v = (ps->w)[i + q] >> r;
+          if ((r > 0) && (i + q + 1 < NVM_PSWORDS)) {
+            v |= (ps->w)[i + q + 1] << (64 - r);
+          }
+        }
+        (pss.w)[i] = v;
+      }
       
+    } else if (d > 0) {
+      /* Transposing up -- shift the words up, bringing the top bits of
+       * the word below into the bottom of each */
+      for(i = 0; i < NVM_PSWORDS; i++) {
+        v = 0;
+        if (i - q >= 0) {
+          v = (ps->w)[i - q] << r;
+          if ((r > 0) && (i - q - 1 >= 0)) {
+            v |= (ps->w)[i - q - 1] >> (64 - r);
+          }
+        }
+        (pss.w)[i] = v;
+      }
+    }
+    
+    /* Drop whatever was shifted past the top of the range; all the
+     * pitches stayed in range exactly when none were lost, and
+     * otherwise the pitch set is left as it was */
+    if (d > 0) {
+      nvm_psinit();
+      nvm_pitchset_intersect(&pss, &m_nvm_psrange);
+      if (nvm_pitchset_count(&pss) == nvm_pitchset_count(ps)) {
+        memcpy(ps, &pss, sizeof(NVM_PITCHSET));
       } else {
-        /* Transposition would take pitch out of range */
         status = 0;
       }
     }
@@ -1188,7 +1998,7 @@ int nvm_pset(const NVM_PITCHSET *ps, int *per) {
   
   /* Copy given pitch set to local variable */
   memcpy(&pss, ps, sizeof(NVM_PITCHSET));
-
+  
   /* If transposition stack is not empty, get value on top of it; else,
    * set transposition value to zero */
   if (!nvm_istack_isEmpty(&m_nvm_transstack)) {
@@ -1201,19 +2011,19 @@ int nvm_pset(const NVM_PITCHSET *ps, int *per) {
     /* Transposition stack empty */
     tranv = 0;
   }
-
+  
   /* Apply current transposition setting */
   if (!nvm_pitchset_transpose(&pss, tranv)) {
     status = 0;
     *per = ERR_TRANSRNG;
   }
-
+  
   /* Copy new value to pitch register */
   if (status) {
     memcpy(&m_nvm_pitch, &pss, sizeof(NVM_PITCHSET));
     m_nvm_pitch_filled = 1;
   }
-
+  
   /* Rest of operation is equivalent to running a repeat operation
    * here */
   if (status) {
@@ -1269,12 +2079,13 @@ int nvm_eof(int *per) {
   /* Initialize if necessary */
   nvm_init();
   
-  /* Location, transposition, layer, and articulation stacks must be
-   * empty */
+  /* Location, transposition, layer, articulation, and repeat block
+   * stacks must be empty */
   if ((!nvm_istack_isEmpty(&m_nvm_locstack)) ||
       (!nvm_istack_isEmpty(&m_nvm_transstack)) ||
       (!nvm_lstack_isEmpty(&m_nvm_layerstack)) ||
-      (!nvm_istack_isEmpty(&m_nvm_artstack))) {
+      (!nvm_istack_isEmpty(&m_nvm_artstack)) ||
+      (!nvm_istack_isEmpty(&m_nvm_blockt))) {
     status = 0;
     *per = ERR_LINGER;
   }
@@ -1302,13 +2113,6 @@ int nvm_op_repeat(int *per) {
   int status = 1;
   int32_t durval = 0;
   int32_t art = 0;
-  int32_t pitch = 0;
-  NVM_LAYERREG lr;
-  NVM_PITCHSET ps;
-  
-  /* Initialize structures */
-  memset(&lr, 0, sizeof(NVM_LAYERREG));
-  nvm_pitchset_clear(&ps);
   
   /* Check parameters */
   if (per == NULL) {
@@ -1318,6 +2122,11 @@ int nvm_op_repeat(int *per) {
   /* Initialize if necessary */
   nvm_init();
   
+  /* Take the fast path in the common case */
+  if (nvm_plainRepeat()) {
+    return nvm_fastRepeat(per);
+  }
+  
   /* Current pitch must be defined */
   if (!m_nvm_pitch_filled) {
     status = 0;
@@ -1353,6 +2162,12 @@ int nvm_op_repeat(int *per) {
     }
   }
   
+  /* Make sure the context is current, which has the section and layer
+   * and the articulation from the stack */
+  if (status) {
+    nvm_context();
+  }
+  
   /* Determine the articulation value that will be used */
   if (status) {
     if (m_nvm_immart >= 0) {
@@ -1362,75 +2177,15 @@ int nvm_op_repeat(int *per) {
       m_nvm_immart = -1;
       
     } else {
-      /* No immediate articulation, try stack next */
-      if (!nvm_istack_isEmpty(&m_nvm_artstack)) {
-        /* Articulation stack not empty, so use value on top */
-        if (!nvm_istack_peek(&m_nvm_artstack, &art)) {
-          abort();  /* shouldn't happen */
-        }
-        
-      } else {
-        /* Articulation stack empty, so just use articulation zero */
-        art = 0;
-      }
-    }
-  }
-  
-  /* Determine section and layer */
-  if (status) {
-    if (!nvm_lstack_isEmpty(&m_nvm_layerstack)) {
-      /* Layer stack not empty, so peek value on top */
-      if (!nvm_lstack_peek(&m_nvm_layerstack, &lr)) {
-        abort();  /* shouldn't happen */
-      }
-      
-    } else {
-      /* Layer stack empty, so use base layer */
-      memcpy(&lr, &m_nvm_baselayer, sizeof(NVM_LAYERREG));
+      /* No immediate articulation, so use the articulation stack */
+      art = m_nvm_ctxArt;
     }
   }
-  
-  /* Output notes */
-  if (status) {
-    
-    /* Get a local copy of the pitch register */
-    memcpy(&ps, &m_nvm_pitch, sizeof(NVM_PITCHSET));
-    
-    /* Output events until pitch set is empty */
-    while (!nvm_pitchset_isEmpty(&ps)) {
-      
-      /* Get the lowest pitch in the pitch set */
-      pitch = nvm_pitchset_least(&ps);
-
-      /* Drop the pitch we just got from the set */
-      nvm_pitchset_drop(&ps, pitch);
-
-      /* Report the note event */
-      if (!event_note(
-              m_nvm_cursor,
-              durval,
-              pitch,
-              art,
-              lr.sect,
-              ((int32_t) lr.layer_i) + 1)) {
-        status = 0;
-        *per = ERR_MANYNOTES;
-      }
-
-      /* Increase grace note count if grace note */
-      if (status && durval < 0) {
-        if (m_nvm_gracecount < INT32_MAX) {
-          m_nvm_gracecount++;
-        } else {
-          status = 0;
-          *per = ERR_HUGEGRACE;
-        }
-      }
-      
-      /* Leave loop if error */
-      if (!status) {
-        break;
-      }
+  
+  /* Output notes, unless they can not be selected */
+  if (status && nvm_wanted((int32_t) m_nvm_ctxLayer.sect)) {
+    if (!nvm_emit(&m_nvm_pitch, durval, art, &m_nvm_ctxLayer, per)) {
+      status = 0;
     }
   }
   
@@ -1467,13 +2222,27 @@ int nvm_op_multiple(int32_t t, int *per) {
     *per = ERR_MULTCOUNT;
   }
   
-  /* Call through to repeat operation for each time */
+  /* Charge the repeats after the first, which was charged as the
+   * operation itself, to the budget before running any of them */
   if (status) {
+    if (!nvm_charge(t - 1, per)) {
+      status = 0;
+    }
+  }
+  
+  /* Run the repeats in bulk if possible, or else call through to the
+   * repeat operation for each time, checking the time budget now and
+   * then */
+  if (status && (!nvm_bulkRepeat(t))) {
     for(i = 0; i < t; i++) {
       if (!nvm_op_repeat(per)) {
         status = 0;
         break;
       }
+      if (((i & NVM_CLOCKMASK) == NVM_CLOCKMASK) && (!nvm_clock(per))) {
+        status = 0;
+        break;
+      }
     }
   }
   
@@ -1496,12 +2265,13 @@ int nvm_op_section(int *per) {
   /* Initialize if necessary */
   nvm_init();
   
-  /* Location, transposition, layer, and articulation stacks must be
-   * empty */
+  /* Location, transposition, layer, articulation, and repeat block
+   * stacks must be empty */
   if ((!nvm_istack_isEmpty(&m_nvm_locstack)) ||
       (!nvm_istack_isEmpty(&m_nvm_transstack)) ||
       (!nvm_lstack_isEmpty(&m_nvm_layerstack)) ||
-      (!nvm_istack_isEmpty(&m_nvm_artstack))) {
+      (!nvm_istack_isEmpty(&m_nvm_artstack)) ||
+      (!nvm_istack_isEmpty(&m_nvm_blockt))) {
     status = 0;
     *per = ERR_LINGER;
   }
@@ -1524,9 +2294,8 @@ int nvm_op_section(int *per) {
   
   /* Report section to event module */
   if (status) {
-    if (!event_section(m_nvm_cursor)) {
+    if (!event_section(m_nvm_cursor, per)) {
       status = 0;
-      *per = ERR_MANYSECT;
     }
   }
   
@@ -1537,6 +2306,7 @@ int nvm_op_section(int *per) {
     m_nvm_baset = m_nvm_cursor;
     m_nvm_baselayer.sect = (uint16_t) m_nvm_sect;
     m_nvm_baselayer.layer_i = 0;
+    m_nvm_ctx = 0;
   }
   
   /* Return status */
@@ -1558,12 +2328,13 @@ int nvm_op_return(int *per) {
   /* Initialize if necessary */
   nvm_init();
   
-  /* Location, transposition, layer, and articulation stacks must be
-   * empty */
+  /* Location, transposition, layer, articulation, and repeat block
+   * stacks must be empty */
   if ((!nvm_istack_isEmpty(&m_nvm_locstack)) ||
       (!nvm_istack_isEmpty(&m_nvm_transstack)) ||
       (!nvm_lstack_isEmpty(&m_nvm_layerstack)) ||
-      (!nvm_istack_isEmpty(&m_nvm_artstack))) {
+      (!nvm_istack_isEmpty(&m_nvm_artstack)) ||
+      (!nvm_istack_isEmpty(&m_nvm_blockt))) {
     status = 0;
     *per = ERR_LINGER;
   }
@@ -1580,6 +2351,7 @@ int nvm_op_return(int *per) {
     nvm_resetCurrent();
     m_nvm_cursor = m_nvm_baset;
     m_nvm_baselayer.layer_i = 0;
+    m_nvm_ctx = 0;
   }
   
   /* Return status */
@@ -1768,17 +2540,280 @@ int nvm_op_immart(int art, int *per) {
   /* Initialize if necessary */
   nvm_init();
   
-  /* Set register */
-  m_nvm_immart = art;
+  /* Set register */
+  m_nvm_immart = art;
+  
+  /* Return status */
+  return status;
+}
+
+/*
+ * nvm_op_pushart function.
+ */
+int nvm_op_pushart(int art, int *per) {
+  
+  int status = 1;
+  
+  /* Check parameters */
+  if ((per == NULL) || (art < 0) || (art > NMF_MAXART)) {
+    abort();
+  }
+  
+  /* Initialize if necessary */
+  nvm_init();
+  
+  /* Try to push value on stack */
+  if (!nvm_istack_push(&m_nvm_artstack, (int32_t) art)) {
+    status = 0;
+    *per = ERR_STACKFULL;
+  }
+  m_nvm_ctx = 0;
+  
+  /* Return status */
+  return status;
+}
+
+/*
+ * nvm_op_popart function.
+ */
+int nvm_op_popart(int *per) {
+  
+  int status = 1;
+  
+  /* Check parameter */
+  if (per == NULL) {
+    abort();
+  }
+  
+  /* Initialize if necessary */
+  nvm_init();
+  
+  /* Try to pop articulation stack */
+  if (!nvm_istack_pop(&m_nvm_artstack)) {
+    status = 0;
+    *per = ERR_UNDERFLOW;
+  }
+  m_nvm_ctx = 0;
+  
+  /* Return status */
+  return status;
+}
+
+/*
+ * nvm_op_setbase function.
+ */
+int nvm_op_setbase(int32_t layer, int *per) {
+  
+  int status = 1;
+  
+  /* Check parameters */
+  if (per == NULL) {
+    abort();
+  }
+  
+  /* Initialize if necessary */
+  nvm_init();
+  
+  /* Range-check layer */
+  if ((layer < 1) || (layer > NOIR_MAXLAYER)) {
+    status = 0;
+    *per = ERR_BADLAYER;
+  }
+  
+  /* Update layer ID of base layer register */
+  if (status) {
+    m_nvm_baselayer.layer_i = (uint16_t) (layer - 1);
+    m_nvm_ctx = 0;
+  }
+  
+  /* Return status */
+  return status;
+}
+
+/*
+ * nvm_op_pushlayer function.
+ */
+int nvm_op_pushlayer(int32_t layer, int *per) {
+  
+  int status = 1;
+  NVM_LAYERREG lr;
+  
+  /* Initialize structure */
+  memset(&lr, 0, sizeof(NVM_LAYERREG));
+  
+  /* Check parameters */
+  if (per == NULL) {
+    abort();
+  }
+  
+  /* Initialize if necessary */
+  nvm_init();
+  
+  /* Range-check layer */
+  if ((layer < 1) || (layer > NOIR_MAXLAYER)) {
+    status = 0;
+    *per = ERR_BADLAYER;
+  }
+  
+  /* Set layer structure */
+  if (status) {
+    lr.sect = (uint16_t) m_nvm_sect;
+    lr.layer_i = (uint16_t) (layer - 1);
+  }
+  
+  /* Push value on stack */
+  if (status) {
+    if (!nvm_lstack_push(&m_nvm_layerstack, &lr)) {
+      status = 0;
+      *per = ERR_STACKFULL;
+    }
+    m_nvm_ctx = 0;
+  }
+  
+  /* Return status */
+  return status;
+}
+
+/*
+ * nvm_op_poplayer function.
+ */
+int nvm_op_poplayer(int *per) {
+  
+  int status = 1;
+  
+  /* Check parameter */
+  if (per == NULL) {
+    abort();
+  }
+  
+  /* Initialize if necessary */
+  nvm_init();
+  
+  /* Try to pop the layer stack */
+  if (!nvm_lstack_pop(&m_nvm_layerstack)) {
+    status = 0;
+    *per = ERR_UNDERFLOW;
+  }
+  m_nvm_ctx = 0;
+  
+  /* Return status */
+  return status;
+}
+
+/*
+ * nvm_op_cue function.
+ */
+int nvm_op_cue(int32_t cue_num, int *per) {
+  
+  int status = 1;
+  
+  /* Check parameters */
+  if (per == NULL) {
+    abort();
+  }
+  
+  /* Initialize if necessary */
+  nvm_init();
+  
+  /* Check range of cue number */
+  if ((cue_num < 0) || (cue_num > NOIR_MAXCUE)) {
+    status = 0;
+    *per = ERR_CUENUM;
+  }
+  
+  /* Perform a grace note flush if necessary */
+  if (status) {
+    nvm_graceFlush();
+  }
+  
+  /* Report the cue event, unless it can not be selected */
+  if (status && nvm_wanted(m_nvm_sect)) {
+    if (!event_cue(
+            m_nvm_cursor,
+            m_nvm_sect,
+            cue_num,
+            per)) {
+      status = 0;
+    }
+  }
+  if (status) {
+    nvm_blockMark(m_nvm_cursor);
+  }
+  
+  /* Return status */
+  return status;
+}
+
+/*
+ * nvm_op_tryloc function.
+ */
+int nvm_op_tryloc(int *per) {
+  
+  int status = 1;
+  
+  /* Check parameter */
+  if (per == NULL) {
+    abort();
+  }
+  
+  /* Initialize if necessary */
+  nvm_init();
+  
+  /* The push would fail if the location stack is full */
+  if (nvm_istack_isFull(&m_nvm_locstack)) {
+    status = 0;
+    *per = ERR_STACKFULL;
+  }
+  
+  /* Return status */
+  return status;
+}
+
+/*
+ * nvm_op_trytrans function.
+ */
+int nvm_op_trytrans(int32_t t, int *per) {
+  
+  int status = 1;
+  int64_t newtrans = 0;
+  int32_t curtrans = 0;
+  
+  /* Check parameters */
+  if (per == NULL) {
+    abort();
+  }
+  
+  /* Initialize if necessary */
+  nvm_init();
+  
+  /* Range-check the cumulative transposition the same way as the push
+   * operation */
+  if (!nvm_istack_isEmpty(&m_nvm_transstack)) {
+    if (!nvm_istack_peek(&m_nvm_transstack, &curtrans)) {
+      abort();  /* shouldn't happen */
+    }
+    
+    newtrans = ((int64_t) curtrans) + ((int64_t) t);
+    if ((newtrans < INT32_MIN) || (newtrans > INT32_MAX)) {
+      status = 0;
+      *per = ERR_HUGETRANS;
+    }
+  }
+  
+  /* The push would fail if the transposition stack is full */
+  if (status && nvm_istack_isFull(&m_nvm_transstack)) {
+    status = 0;
+    *per = ERR_STACKFULL;
+  }
   
   /* Return status */
   return status;
 }
 
 /*
- * nvm_op_pushart function.
+ * nvm_op_tryart function.
  */
-int nvm_op_pushart(int art, int *per) {
+int nvm_op_tryart(int art, int *per) {
   
   int status = 1;
   
@@ -1790,8 +2825,8 @@ int nvm_op_pushart(int art, int *per) {
   /* Initialize if necessary */
   nvm_init();
   
-  /* Try to push value on stack */
-  if (!nvm_istack_push(&m_nvm_artstack, (int32_t) art)) {
+  /* The push would fail if the articulation stack is full */
+  if (nvm_istack_isFull(&m_nvm_artstack)) {
     status = 0;
     *per = ERR_STACKFULL;
   }
@@ -1801,13 +2836,13 @@ int nvm_op_pushart(int art, int *per) {
 }
 
 /*
- * nvm_op_popart function.
+ * nvm_op_trylayer function.
  */
-int nvm_op_popart(int *per) {
+int nvm_op_trylayer(int32_t layer, int *per) {
   
   int status = 1;
   
-  /* Check parameter */
+  /* Check parameters */
   if (per == NULL) {
     abort();
   }
@@ -1815,10 +2850,16 @@ int nvm_op_popart(int *per) {
   /* Initialize if necessary */
   nvm_init();
   
-  /* Try to pop articulation stack */
-  if (!nvm_istack_pop(&m_nvm_artstack)) {
+  /* Range-check layer */
+  if ((layer < 1) || (layer > NOIR_MAXLAYER)) {
     status = 0;
-    *per = ERR_UNDERFLOW;
+    *per = ERR_BADLAYER;
+  }
+  
+  /* The push would fail if the layer stack is full */
+  if (status && nvm_lstack_isFull(&m_nvm_layerstack)) {
+    status = 0;
+    *per = ERR_STACKFULL;
   }
   
   /* Return status */
@@ -1826,13 +2867,13 @@ int nvm_op_popart(int *per) {
 }
 
 /*
- * nvm_op_setbase function.
+ * nvm_op_begin function.
  */
-int nvm_op_setbase(int32_t layer, int *per) {
+int nvm_op_begin(int *per) {
   
   int status = 1;
   
-  /* Check parameters */
+  /* Check parameter */
   if (per == NULL) {
     abort();
   }
@@ -1840,15 +2881,37 @@ int nvm_op_setbase(int32_t layer, int *per) {
   /* Initialize if necessary */
   nvm_init();
   
-  /* Range-check layer */
-  if ((layer < 1) || (layer > NOIR_MAXLAYER)) {
+  /* Location, transposition, layer, and articulation stacks must be
+   * empty */
+  if ((!nvm_istack_isEmpty(&m_nvm_locstack)) ||
+      (!nvm_istack_isEmpty(&m_nvm_transstack)) ||
+      (!nvm_lstack_isEmpty(&m_nvm_layerstack)) ||
+      (!nvm_istack_isEmpty(&m_nvm_artstack))) {
     status = 0;
-    *per = ERR_BADLAYER;
+    *per = ERR_LINGER;
   }
   
-  /* Update layer ID of base layer register */
+  /* Immediate articulation register must be empty */
+  if (status && (m_nvm_immart >= 0)) {
+    status = 0;
+    *per = ERR_DANGLEART;
+  }
+  
+  /* Make sure there is room for another block */
+  if (status && nvm_istack_isFull(&m_nvm_blockt)) {
+    status = 0;
+    *per = ERR_STACKFULL;
+  }
+  
+  /* Flush grace notes so that none of the events before the block are
+   * changed inside it, and then record where the block begins */
   if (status) {
-    m_nvm_baselayer.layer_i = (uint16_t) (layer - 1);
+    nvm_graceFlush();
+    if ((!nvm_istack_push(&m_nvm_blockt, m_nvm_cursor)) ||
+        (!nvm_istack_push(&m_nvm_blocke, event_count())) ||
+        (!nvm_istack_push(&m_nvm_blockm, -1))) {
+      abort();  /* checked above */
+    }
   }
   
   /* Return status */
@@ -1856,17 +2919,17 @@ int nvm_op_setbase(int32_t layer, int *per) {
 }
 
 /*
- * nvm_op_pushlayer function.
+ * nvm_op_end function.
  */
-int nvm_op_pushlayer(int32_t layer, int *per) {
+int nvm_op_end(int32_t t, int *per) {
   
   int status = 1;
-  NVM_LAYERREG lr;
+  int32_t start = 0;
+  int32_t first = 0;
+  int32_t len = 0;
+  int32_t tmax = -1;
   
-  /* Initialize structure */
-  memset(&lr, 0, sizeof(NVM_LAYERREG));
-  
-  /* Check parameters */
+  /* Check parameter */
   if (per == NULL) {
     abort();
   }
@@ -1874,23 +2937,74 @@ int nvm_op_pushlayer(int32_t layer, int *per) {
   /* Initialize if necessary */
   nvm_init();
   
-  /* Range-check layer */
-  if ((layer < 1) || (layer > NOIR_MAXLAYER)) {
+  /* Check the count */
+  if (t < 1) {
     status = 0;
-    *per = ERR_BADLAYER;
+    *per = ERR_MULTCOUNT;
   }
   
-  /* Set layer structure */
+  /* There must be an open block */
   if (status) {
-    lr.sect = (uint16_t) m_nvm_sect;
-    lr.layer_i = (uint16_t) (layer - 1);
+    if ((!nvm_istack_peek(&m_nvm_blockt, &start)) ||
+        (!nvm_istack_peek(&m_nvm_blocke, &first)) ||
+        (!nvm_istack_peek(&m_nvm_blockm, &tmax))) {
+      status = 0;
+      *per = ERR_UNDERFLOW;
+    }
   }
   
-  /* Push value on stack */
+  /* Location, transposition, layer, and articulation stacks must be
+   * empty */
+  if (status && (
+      (!nvm_istack_isEmpty(&m_nvm_locstack)) ||
+      (!nvm_istack_isEmpty(&m_nvm_transstack)) ||
+      (!nvm_lstack_isEmpty(&m_nvm_layerstack)) ||
+      (!nvm_istack_isEmpty(&m_nvm_artstack)))) {
+    status = 0;
+    *per = ERR_LINGER;
+  }
+  
+  /* Immediate articulation register must be empty */
+  if (status && (m_nvm_immart >= 0)) {
+    status = 0;
+    *per = ERR_DANGLEART;
+  }
+  
+  /* The block length is how far the cursor moved, which the repeats
+   * must not push past the end of the cursor range */
   if (status) {
-    if (!nvm_lstack_push(&m_nvm_layerstack, &lr)) {
+    if (m_nvm_cursor < start) {
+      abort();  /* the cursor can't move back past an open block */
+    }
+    len = m_nvm_cursor - start;
+    if (((int64_t) len) * ((int64_t) (t - 1)) >
+          (int64_t) (INT32_MAX - m_nvm_cursor)) {
+      status = 0;
+      *per = ERR_LONGPIECE;
+    }
+  }
+  
+  /* Flush grace notes so that the events of the block are final, then
+   * replay them instead of interpreting the block again */
+  if (status) {
+    nvm_graceFlush();
+    if (!event_replay(first, len, t - 1, (tmax >= 0) ? tmax : 0, per)) {
       status = 0;
-      *per = ERR_STACKFULL;
+    }
+  }
+  
+  /* Advance the cursor past the repeats and close the block; the last
+   * replay has the latest events of the block, which are now events of
+   * the enclosing block, if there is one */
+  if (status) {
+    m_nvm_cursor += len * (t - 1);
+    if ((!nvm_istack_pop(&m_nvm_blockt)) ||
+        (!nvm_istack_pop(&m_nvm_blocke)) ||
+        (!nvm_istack_pop(&m_nvm_blockm))) {
+      abort();
+    }
+    if (tmax >= 0) {
+      nvm_blockMark(tmax + len * (t - 1));
     }
   }
   
@@ -1899,24 +3013,57 @@ int nvm_op_pushlayer(int32_t layer, int *per) {
 }
 
 /*
- * nvm_op_poplayer function.
+ * nvm_budget function.
  */
-int nvm_op_poplayer(int *per) {
+void nvm_budget(int64_t max_ops, int32_t secs) {
   
-  int status = 1;
+  /* Check parameters */
+  if ((max_ops < 0) || (secs < 0)) {
+    abort();
+  }
   
-  /* Check parameter */
-  if (per == NULL) {
+  /* Set the budgets, starting the clock now */
+  if (max_ops > 0) {
+    m_nvm_maxOps = max_ops;
+  } else {
+    m_nvm_maxOps = INT64_MAX;
+  }
+  m_nvm_secs = secs;
+#ifdef NVM_MONOTONIC
+  if (clock_gettime(CLOCK_MONOTONIC, &m_nvm_start)) {
     abort();
   }
+#else
+  m_nvm_start = time(NULL);
+#endif
+}
+
+/*
+ * nvm_charge function.
+ */
+int nvm_charge(int64_t n, int *per) {
   
-  /* Initialize if necessary */
-  nvm_init();
+  int status = 1;
   
-  /* Try to pop the layer stack */
-  if (!nvm_lstack_pop(&m_nvm_layerstack)) {
+  /* Check parameters */
+  if ((n < 0) || (per == NULL)) {
+    abort();
+  }
+  
+  /* Charge the operations if there are enough left */
+  if (n <= m_nvm_maxOps - m_nvm_ops) {
+    m_nvm_ops += n;
+  } else {
     status = 0;
-    *per = ERR_UNDERFLOW;
+    *per = ERR_OPBUDGET;
+  }
+  
+  /* Check the clock every so often */
+  if (status && (m_nvm_ops >= m_nvm_clockAt)) {
+    m_nvm_clockAt = m_nvm_ops + NVM_CLOCKOPS;
+    if (!nvm_clock(per)) {
+      status = 0;
+    }
   }
   
   /* Return status */
@@ -1924,42 +3071,397 @@ int nvm_op_poplayer(int *per) {
 }
 
 /*
- * nvm_op_cue function.
+ * nvm_skip function.
  */
-int nvm_op_cue(int32_t cue_num, int *per) {
+void nvm_skip(int32_t t) {
+  
+  /* Initialize if necessary */
+  nvm_init();
+  
+  /* Check state and parameter */
+  if ((!nvm_istack_isEmpty(&m_nvm_locstack)) ||
+      (!nvm_istack_isEmpty(&m_nvm_transstack)) ||
+      (!nvm_lstack_isEmpty(&m_nvm_layerstack)) ||
+      (!nvm_istack_isEmpty(&m_nvm_artstack)) ||
+      (!nvm_istack_isEmpty(&m_nvm_blockt)) ||
+      (m_nvm_immart >= 0) || m_nvm_pitch_filled || (m_nvm_dur >= 0) ||
+      (m_nvm_gracecount > 0) || (m_nvm_graceoffset > 0)) {
+    abort();
+  }
+  if (t < m_nvm_cursor) {
+    abort();
+  }
+  
+  /* Move the cursor */
+  m_nvm_cursor = t;
+}
+
+/*
+ * Jump to the code for the operation at pi.
+ */
+#ifdef NVM_THREADED
+#define NVM_DISPATCH __extension__ ({ goto *(pLabel[pi->op]); })
+#else
+#define NVM_DISPATCH goto dispatch
+#endif
+
+/*
+ * Move on to the operation after the one at slot i, and jump to its
+ * code, or to the end if there are no more.
+ */
+#define NVM_NEXT \
+  do { \
+    if (pSpan != NULL) { \
+      i += pSpan[i]; \
+    } else { \
+      i++; \
+    } \
+    if (i >= count) { \
+      goto done; \
+    } \
+    pi = &(pa[i]); \
+    if ((pi->op < 0) || (pi->op >= NVM_OP_COUNT)) { \
+      abort(); \
+    } \
+    NVM_DISPATCH; \
+  } while (0)
+
+/*
+ * nvm_run function.
+ */
+int nvm_run(
+    const NVM_INSTR * pa,
+    const int32_t   * pSpan,
+          int32_t     count,
+          int32_t   * pIndex,
+          int       * per) {
   
   int status = 1;
+  int32_t i = 0;
+  int32_t k = 0;
+  int32_t off = 0;
+  int32_t span = 0;
+  int32_t tv = 0;
+  int64_t newtrans = 0;
+  const NVM_INSTR *pi = NULL;
+  NVM_PITCHSET pss;
+#ifdef NVM_THREADED
+  static const void *pLabel[NVM_OP_COUNT] = {
+    __extension__ &&op_eof,
+    __extension__ &&op_pset,
+    __extension__ &&op_dur,
+    __extension__ &&op_repeat,
+    __extension__ &&op_multiple,
+    __extension__ &&op_section,
+    __extension__ &&op_return,
+    __extension__ &&op_pushloc,
+    __extension__ &&op_retloc,
+    __extension__ &&op_poploc,
+    __extension__ &&op_pushtrans,
+    __extension__ &&op_poptrans,
+    __extension__ &&op_immart,
+    __extension__ &&op_pushart,
+    __extension__ &&op_popart,
+    __extension__ &&op_setbase,
+    __extension__ &&op_pushlayer,
+    __extension__ &&op_poplayer,
+    __extension__ &&op_cue,
+    __extension__ &&op_tryloc,
+    __extension__ &&op_trytrans,
+    __extension__ &&op_tryart,
+    __extension__ &&op_trylayer,
+    __extension__ &&op_begin,
+    __extension__ &&op_end
+  };
+#endif
   
-  /* Check parameters */
-  if (per == NULL) {
+  /* Initialize structures */
+  nvm_pitchset_clear(&pss);
+  
+  /* Check parameters once for the whole stream */
+  if ((pa == NULL) || (count < 0) || (pIndex == NULL) || (per == NULL)) {
     abort();
   }
   
   /* Initialize if necessary */
   nvm_init();
   
-  /* Check range of cue number */
-  if ((cue_num < 0) || (cue_num > NOIR_MAXCUE)) {
-    status = 0;
-    *per = ERR_CUENUM;
+  /* Start at the first operation, if there is one, and if the stream
+   * fits in the budget */
+  if (count < 1) {
+    goto done;
+  }
+  if (!nvm_charge(count, per)) {
+    goto fail;
+  }
+  i = 0;
+  pi = pa;
+  if ((pi->op < 0) || (pi->op >= NVM_OP_COUNT)) {
+    abort();
+  }
+  NVM_DISPATCH;
+  
+#ifndef NVM_THREADED
+dispatch:
+  switch (pi->op) {
+    case NVM_OP_EOF:       goto op_eof;
+    case NVM_OP_PSET:      goto op_pset;
+    case NVM_OP_DUR:       goto op_dur;
+    case NVM_OP_REPEAT:    goto op_repeat;
+    case NVM_OP_MULTIPLE:  goto op_multiple;
+    case NVM_OP_SECTION:   goto op_section;
+    case NVM_OP_RETURN:    goto op_return;
+    case NVM_OP_PUSHLOC:   goto op_pushloc;
+    case NVM_OP_RETLOC:    goto op_retloc;
+    case NVM_OP_POPLOC:    goto op_poploc;
+    case NVM_OP_PUSHTRANS: goto op_pushtrans;
+    case NVM_OP_POPTRANS:  goto op_poptrans;
+    case NVM_OP_IMMART:    goto op_immart;
+    case NVM_OP_PUSHART:   goto op_pushart;
+    case NVM_OP_POPART:    goto op_popart;
+    case NVM_OP_SETBASE:   goto op_setbase;
+    case NVM_OP_PUSHLAYER: goto op_pushlayer;
+    case NVM_OP_POPLAYER:  goto op_poplayer;
+    case NVM_OP_CUE:       goto op_cue;
+    case NVM_OP_TRYLOC:    goto op_tryloc;
+    case NVM_OP_TRYTRANS:  goto op_trytrans;
+    case NVM_OP_TRYART:    goto op_tryart;
+    case NVM_OP_TRYLAYER:  goto op_trylayer;
+    case NVM_OP_BEGIN:     goto op_begin;
+    case NVM_OP_END:       goto op_end;
+    default:
+      abort();  /* unrecognized operation */
+  }
+#endif
+  
+  /* The common operations are run in place */
+op_pset:
+  if (m_nvm_transstack.count > 0) {
+    tv = (m_nvm_transstack.pst)[m_nvm_transstack.count - 1];
+  } else {
+    tv = 0;
+  }
+  memcpy(&pss, &(pi->ps), sizeof(NVM_PITCHSET));
+  if (!nvm_pitchset_transpose(&pss, tv)) {
+    *per = ERR_TRANSRNG;
+    goto fail;
+  }
+  memcpy(&m_nvm_pitch, &pss, sizeof(NVM_PITCHSET));
+  m_nvm_pitch_filled = 1;
+  if (!nvm_runRepeat(per)) {
+    goto fail;
   }
+  NVM_NEXT;
   
-  /* Perform a grace note flush if necessary */
-  if (status) {
+op_dur:
+  if (pi->v < 0) {
+    abort();
+  }
+  if ((m_nvm_dur == 0) && (pi->v != 0)) {
     nvm_graceFlush();
   }
+  m_nvm_dur = pi->v;
+  NVM_NEXT;
   
-  /* Report the cue event */
-  if (status) {
-    if (!event_cue(
-            m_nvm_cursor,
-            m_nvm_sect,
-            cue_num)) {
-      status = 0;
-      *per = ERR_MANYNOTES;
+op_repeat:
+  if (!nvm_runRepeat(per)) {
+    goto fail;
+  }
+  NVM_NEXT;
+  
+op_multiple:
+  /* A multiple that takes several slots is a folded run of repeats, so
+   * an error is reported at the slot of the repeat that failed */
+  if (pi->v < 1) {
+    *per = ERR_MULTCOUNT;
+    goto fail;
+  }
+  span = (pSpan != NULL) ? pSpan[i] : 1;
+  if ((pi->v > span) && (!nvm_charge(pi->v - span, per))) {
+    goto fail;
+  }
+  if (nvm_bulkRepeat(pi->v)) {
+    NVM_NEXT;
+  }
+  for(k = 0; k < pi->v; k++) {
+    if ((!nvm_runRepeat(per)) ||
+        (((k & NVM_CLOCKMASK) == NVM_CLOCKMASK) && (!nvm_clock(per)))) {
+      if ((pSpan != NULL) && (k < pSpan[i])) {
+        off = k;
+      }
+      goto fail;
+    }
+  }
+  NVM_NEXT;
+  
+op_pushtrans:
+  if (m_nvm_transstack.count > 0) {
+    newtrans = ((int64_t) (m_nvm_transstack.pst)[
+                  m_nvm_transstack.count - 1]) + ((int64_t) pi->v);
+    if ((newtrans < INT32_MIN) || (newtrans > INT32_MAX)) {
+      *per = ERR_HUGETRANS;
+      goto fail;
+    }
+  } else {
+    newtrans = pi->v;
+  }
+  if (!nvm_istack_push(&m_nvm_transstack, (int32_t) newtrans)) {
+    *per = ERR_STACKFULL;
+    goto fail;
+  }
+  NVM_NEXT;
+  
+op_poptrans:
+  if (!nvm_istack_pop(&m_nvm_transstack)) {
+    *per = ERR_UNDERFLOW;
+    goto fail;
+  }
+  NVM_NEXT;
+  
+op_trytrans:
+  if (m_nvm_transstack.count > 0) {
+    newtrans = ((int64_t) (m_nvm_transstack.pst)[
+                  m_nvm_transstack.count - 1]) + ((int64_t) pi->v);
+    if ((newtrans < INT32_MIN) || (newtrans > INT32_MAX)) {
+      *per = ERR_HUGETRANS;
+      goto fail;
     }
   }
+  if (nvm_istack_isFull(&m_nvm_transstack)) {
+    *per = ERR_STACKFULL;
+    goto fail;
+  }
+  NVM_NEXT;
+  
+op_immart:
+  if ((pi->v < 0) || (pi->v > NMF_MAXART)) {
+    abort();
+  }
+  m_nvm_immart = pi->v;
+  NVM_NEXT;
+  
+op_pushart:
+  if ((pi->v < 0) || (pi->v > NMF_MAXART)) {
+    abort();
+  }
+  if (!nvm_istack_push(&m_nvm_artstack, pi->v)) {
+    *per = ERR_STACKFULL;
+    goto fail;
+  }
+  m_nvm_ctx = 0;
+  NVM_NEXT;
+  
+op_popart:
+  if (!nvm_istack_pop(&m_nvm_artstack)) {
+    *per = ERR_UNDERFLOW;
+    goto fail;
+  }
+  m_nvm_ctx = 0;
+  NVM_NEXT;
+  
+op_tryart:
+  if ((pi->v < 0) || (pi->v > NMF_MAXART)) {
+    abort();
+  }
+  if (nvm_istack_isFull(&m_nvm_artstack)) {
+    *per = ERR_STACKFULL;
+    goto fail;
+  }
+  NVM_NEXT;
+  
+  /* The rest go through the operation functions */
+op_eof:
+  if (!nvm_eof(per)) {
+    goto fail;
+  }
+  NVM_NEXT;
+  
+op_section:
+  if (!nvm_op_section(per)) {
+    goto fail;
+  }
+  NVM_NEXT;
+  
+op_return:
+  if (!nvm_op_return(per)) {
+    goto fail;
+  }
+  NVM_NEXT;
+  
+op_pushloc:
+  if (!nvm_op_pushloc(per)) {
+    goto fail;
+  }
+  NVM_NEXT;
+  
+op_retloc:
+  if (!nvm_op_retloc(per)) {
+    goto fail;
+  }
+  NVM_NEXT;
+  
+op_poploc:
+  if (!nvm_op_poploc(per)) {
+    goto fail;
+  }
+  NVM_NEXT;
+  
+op_setbase:
+  if (!nvm_op_setbase(pi->v, per)) {
+    goto fail;
+  }
+  NVM_NEXT;
   
+op_pushlayer:
+  if (!nvm_op_pushlayer(pi->v, per)) {
+    goto fail;
+  }
+  NVM_NEXT;
+  
+op_poplayer:
+  if (!nvm_op_poplayer(per)) {
+    goto fail;
+  }
+  NVM_NEXT;
+  
+op_cue:
+  if (!nvm_op_cue(pi->v, per)) {
+    goto fail;
+  }
+  NVM_NEXT;
+  
+op_tryloc:
+  if (!nvm_op_tryloc(per)) {
+    goto fail;
+  }
+  NVM_NEXT;
+  
+op_trylayer:
+  if (!nvm_op_trylayer(pi->v, per)) {
+    goto fail;
+  }
+  NVM_NEXT;
+  
+op_begin:
+  if (!nvm_op_begin(per)) {
+    goto fail;
+  }
+  NVM_NEXT;
+  
+op_end:
+  if (!nvm_op_end(pi->v, per)) {
+    goto fail;
+  }
+  NVM_NEXT;
+  
+fail:
+  status = 0;
+  *pIndex = i + off;
+  
+done:
   /* Return status */
   return status;
 }
+
+#undef NVM_NEXT
+#undef NVM_DISPATCH
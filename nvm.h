@@ -14,6 +14,17 @@
 
 #include "noirdef.h"
 
+/*
+ * The number of 64-bit words in a pitch set.
+ * 
+ * A pitch set has one bit for each pitch in the range [NMF_MINPITCH,
+ * NMF_MAXPITCH].  The range is that of the NMF library that the
+ * compiler is built with, since every pitch must be written to an NMF
+ * file, and is not configured separately here.  The 88 keys of the
+ * piano take two words, and a range of 256 pitches would take four.
+ */
+#define NVM_PSWORDS (((NMF_MAXPITCH - NMF_MINPITCH) / 64) + 1)
+
 /*
  * Definition of pitch set structure.
  * 
@@ -23,20 +34,85 @@
 typedef struct {
   
   /*
-   * Bitmap storing pitches with negative value, where -1 is the least
-   * significant bit, -2 is the second least significant bit, and so
-   * forth.
+   * Bitmap storing the pitches, where the least significant bit of the
+   * first word is NMF_MINPITCH, the next bit is one semitone higher,
+   * and so forth, continuing from the least significant bit of each
+   * word after the most significant bit of the word before.  Bits past
+   * NMF_MAXPITCH are always clear.
    */
-  uint64_t a;
+  uint64_t w[NVM_PSWORDS];
+  
+} NVM_PITCHSET;
+
+/*
+ * The operation codes of a decoded operation stream.
+ * 
+ * Each code stands for one of the functions that run an operation,
+ * which nvm_run() does without the function calls.  The NVM_OP_TRY
+ * codes are only made by the peephole pass of the ir module.
+ */
+#define NVM_OP_EOF       (0)   /* nvm_eof() */
+#define NVM_OP_PSET      (1)   /* nvm_pset() */
+#define NVM_OP_DUR       (2)   /* nvm_dur() */
+#define NVM_OP_REPEAT    (3)   /* nvm_op_repeat() */
+#define NVM_OP_MULTIPLE  (4)   /* nvm_op_multiple() */
+#define NVM_OP_SECTION   (5)   /* nvm_op_section() */
+#define NVM_OP_RETURN    (6)   /* nvm_op_return() */
+#define NVM_OP_PUSHLOC   (7)   /* nvm_op_pushloc() */
+#define NVM_OP_RETLOC    (8)   /* nvm_op_retloc() */
+#define NVM_OP_POPLOC    (9)   /* nvm_op_poploc() */
+#define NVM_OP_PUSHTRANS (10)  /* nvm_op_pushtrans() */
+#define NVM_OP_POPTRANS  (11)  /* nvm_op_poptrans() */
+#define NVM_OP_IMMART    (12)  /* nvm_op_immart() */
+#define NVM_OP_PUSHART   (13)  /* nvm_op_pushart() */
+#define NVM_OP_POPART    (14)  /* nvm_op_popart() */
+#define NVM_OP_SETBASE   (15)  /* nvm_op_setbase() */
+#define NVM_OP_PUSHLAYER (16)  /* nvm_op_pushlayer() */
+#define NVM_OP_POPLAYER  (17)  /* nvm_op_poplayer() */
+#define NVM_OP_CUE       (18)  /* nvm_op_cue() */
+#define NVM_OP_TRYLOC    (19)  /* nvm_op_tryloc() */
+#define NVM_OP_TRYTRANS  (20)  /* nvm_op_trytrans() */
+#define NVM_OP_TRYART    (21)  /* nvm_op_tryart() */
+#define NVM_OP_TRYLAYER  (22)  /* nvm_op_trylayer() */
+#define NVM_OP_BEGIN     (23)  /* nvm_op_begin() */
+#define NVM_OP_END       (24)  /* nvm_op_end() */
+
+/*
+ * One more than the greatest operation code.
+ */
+#define NVM_OP_COUNT (25)
+
+/*
+ * An operation of a decoded operation stream.
+ */
+typedef struct {
   
   /*
-   * Bitmap storing pitches with zero or positive value, where zero is
-   * the most significant bit, 1 is the second most significant bit,
-   * and so forth.
+   * The operation code, which is one of the NVM_OP constants.
    */
-  uint64_t b;
+  int op;
   
-} NVM_PITCHSET;
+  /*
+   * The duration for NVM_OP_DUR, the integer parameter for the
+   * operations that have one, or the articulation number for
+   * NVM_OP_IMMART, NVM_OP_PUSHART, and NVM_OP_TRYART.  Zero for
+   * everything else.
+   */
+  int32_t v;
+  
+  /*
+   * The source position of the operation, which this module does not
+   * use.  See ir.h.
+   */
+  int64_t pos;
+  
+  /*
+   * The pitch set for NVM_OP_PSET, which is empty for a rest.  Ignored
+   * for everything else, so it need not be set.
+   */
+  NVM_PITCHSET ps;
+  
+} NVM_INSTR;
 
 /*
  * Clear a pitch set so it contains no pitches.
@@ -91,23 +167,32 @@ void nvm_pitchset_add(NVM_PITCHSET *ps, int32_t pitch);
 void nvm_pitchset_drop(NVM_PITCHSET *ps, int32_t pitch);
 
 /*
- * Return the lowest pitch in the given pitch set.
+ * Drop every pitch from a pitch set that is not also in another.
  * 
- * The returned pitch will be in range [NMF_MINPITCH, NMF_MAXPITCH].  A
- * fault occurs if the pitch set is empty.
+ * Parameters:
+ * 
+ *   ps - the pitch set to modify
+ * 
+ *   pb - the pitch set with the pitches to keep
+ */
+void nvm_pitchset_intersect(NVM_PITCHSET *ps, const NVM_PITCHSET *pb);
+
+/*
+ * Return the number of pitches in the given pitch set.
  * 
  * Parameters:
  * 
- *   ps - the pitch set to search
+ *   ps - the pitch set to count
  * 
  * Return:
  * 
- *   the lowest pitch in the pitch set
+ *   the number of pitches, in range zero up to the number of pitches
+ *   in [NMF_MINPITCH, NMF_MAXPITCH]
  */
-int32_t nvm_pitchset_least(const NVM_PITCHSET *ps);
+int32_t nvm_pitchset_count(const NVM_PITCHSET *ps);
 
 /*
- * Return the highest pitch in the given pitch set.
+ * Return the lowest pitch in the given pitch set.
  * 
  * The returned pitch will be in range [NMF_MINPITCH, NMF_MAXPITCH].  A
  * fault occurs if the pitch set is empty.
@@ -118,9 +203,9 @@ int32_t nvm_pitchset_least(const NVM_PITCHSET *ps);
  * 
  * Return:
  * 
- *   the highest pitch in the pitch set
+ *   the lowest pitch in the pitch set
  */
-int32_t nvm_pitchset_most(const NVM_PITCHSET *ps);
+int32_t nvm_pitchset_least(const NVM_PITCHSET *ps);
 
 /*
  * Transpose all pitches in a given pitch set by the given number of
@@ -507,4 +592,252 @@ int nvm_op_poplayer(int *per);
  */
 int nvm_op_cue(int32_t cue_num, int *per);
 
+
+/*
+ * A "{" push location operation followed at once by a "}" pop location
+ * stack operation.
+ * 
+ * This has the same result as calling nvm_op_pushloc() and then
+ * nvm_op_poploc(), but it leaves the location stack alone.  The pop can
+ * not fail after the push succeeded, so the only errors are those of
+ * the push.
+ * 
+ * per points to a variable to receive an error code if the function
+ * fails.  The error codes are defined in noirdef.h
+ * 
+ * Parameters:
+ * 
+ *   per - pointer to an error variable
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if error
+ */
+int nvm_op_tryloc(int *per);
+
+/*
+ * A "^" push transposition operation followed at once by a "=" pop
+ * transposition operation.
+ * 
+ * This has the same result as calling nvm_op_pushtrans() and then
+ * nvm_op_poptrans(), but it leaves the transposition stack alone.  The
+ * only errors are those of the push.
+ * 
+ * per points to a variable to receive an error code if the function
+ * fails.  The error codes are defined in noirdef.h
+ * 
+ * Parameters:
+ * 
+ *   t - the transposition count
+ * 
+ *   per - pointer to an error variable
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if error
+ */
+int nvm_op_trytrans(int32_t t, int *per);
+
+/*
+ * A "!" push articulation operation followed at once by a "~" pop
+ * articulation operation.
+ * 
+ * This has the same result as calling nvm_op_pushart() and then
+ * nvm_op_popart(), but it leaves the articulation stack alone.  The
+ * only errors are those of the push.  art must be in the range
+ * [0, NMF_MAXART] or a fault occurs.
+ * 
+ * per points to a variable to receive an error code if the function
+ * fails.  The error codes are defined in noirdef.h
+ * 
+ * Parameters:
+ * 
+ *   art - the articulation
+ * 
+ *   per - pointer to an error variable
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if error
+ */
+int nvm_op_tryart(int art, int *per);
+
+/*
+ * A "+" push layer operation followed at once by a "-" pop layer
+ * operation.
+ * 
+ * This has the same result as calling nvm_op_pushlayer() and then
+ * nvm_op_poplayer(), but it leaves the layer stack alone.  The only
+ * errors are those of the push.
+ * 
+ * per points to a variable to receive an error code if the function
+ * fails.  The error codes are defined in noirdef.h
+ * 
+ * Parameters:
+ * 
+ *   layer - the layer
+ * 
+ *   per - pointer to an error variable
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if error
+ */
+int nvm_op_trylayer(int32_t layer, int *per);
+
+/*
+ * The "<" repeat block begin operation.
+ * 
+ * The events that are made until the matching ">" are recorded so that
+ * nvm_op_end() can replay them.  Blocks may be nested.
+ * 
+ * per points to a variable to receive an error code if the function
+ * fails.  The error codes are defined in noirdef.h
+ * 
+ * Parameters:
+ * 
+ *   per - pointer to an error variable
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if error
+ */
+int nvm_op_begin(int *per);
+
+/*
+ * The ">" repeat block end operation.
+ * 
+ * t is the number of times the block is played in all, including the
+ * time it was interpreted.  This function will range-check and report
+ * an error if necessary.  The block is not interpreted again; the
+ * events it made are replayed t - 1 times, each time shifted by the
+ * length of the block.
+ * 
+ * per points to a variable to receive an error code if the function
+ * fails.  The error codes are defined in noirdef.h
+ * 
+ * Parameters:
+ * 
+ *   t - the repeat count
+ * 
+ *   per - pointer to an error variable
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if error
+ */
+int nvm_op_end(int32_t t, int *per);
+
+/*
+ * Set the operation and time budgets.
+ * 
+ * Every operation that is run is charged to the operation budget, a
+ * multiple operation with a count of t being charged t operations
+ * before any of them are run, so that a huge count fails at once.
+ * Once max_ops operations have been charged, the next charge fails
+ * with ERR_OPBUDGET.  Once secs seconds of wall time have passed since
+ * this function was called, the interpreter fails with ERR_TIMEOUT,
+ * which is checked about every 65536 operations.  Either budget is
+ * unlimited if it is zero, which is the default.  Negative values
+ * cause a fault.
+ * 
+ * Parameters:
+ * 
+ *   max_ops - the operation budget, or zero
+ * 
+ *   secs - the time budget in seconds, or zero
+ */
+void nvm_budget(int64_t max_ops, int32_t secs);
+
+/*
+ * Charge operations to the budgets.
+ * 
+ * nvm_run() charges every operation that it runs.  A client that calls
+ * the operation functions directly must charge one for each call, and
+ * nvm_op_multiple() then charges the rest of its repeats itself.  n
+ * must be zero or greater, or a fault occurs.
+ * The function fails with ERR_OPBUDGET if there are not n operations
+ * left in the budget, in which case nothing is charged, or with
+ * ERR_TIMEOUT if the time budget is spent.
+ * 
+ * Parameters:
+ * 
+ *   n - the number of operations
+ * 
+ *   per - pointer to an error variable
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if error
+ */
+int nvm_charge(int64_t n, int *per);
+
+/*
+ * Move the cursor forward without interpreting anything.
+ * 
+ * This is used to start interpreting at a "$" section operation in the
+ * middle of the input, since the state of the virtual machine after a
+ * section operation only depends on the cursor and the number of
+ * sections.  Skip to the start of each section in turn and run the
+ * section operation, then skip to where the section operation that
+ * interpreting starts at was.
+ * 
+ * t must be at least the cursor position, and the virtual machine must
+ * be in the state that a section operation leaves it in, with every
+ * stack and register empty, or a fault occurs.
+ * 
+ * Parameters:
+ * 
+ *   t - the new cursor position
+ */
+void nvm_skip(int32_t t);
+
+/*
+ * Run a decoded operation stream.
+ * 
+ * This has the same result as calling the function that each operation
+ * stands for in turn, stopping at the first that fails, but it is
+ * faster.  The checks that those functions make on every call are made
+ * once for the whole stream, the common operations are run in place,
+ * and with GNU C, the code for each operation jumps straight to the
+ * code for the next (direct threading).  The nvm_op functions remain
+ * the reference for what each operation does.
+ * 
+ * pa is an array of count slots, each of which holds an operation.
+ * pSpan is either NULL, in which case each operation takes one slot, or
+ * an array giving the number of slots, at least one, that the
+ * operation starting in each slot takes.  The slots that an operation
+ * takes after its first are skipped, and their entries in pSpan are not
+ * read.  An NVM_OP_MULTIPLE that takes more than one slot stands for a
+ * run of repeats, one per slot.
+ * 
+ * If an operation fails, *pIndex receives the index of the slot where
+ * it failed, and *per the error.  This is the first slot of the
+ * operation, except for a multiple that takes several slots, where it
+ * is the slot of the repeat that failed.
+ * 
+ * Parameters:
+ * 
+ *   pa - the operation slots
+ * 
+ *   pSpan - the number of slots each operation takes, or NULL
+ * 
+ *   count - the number of slots
+ * 
+ *   pIndex - pointer to variable to receive the slot index in case of
+ *   error
+ * 
+ *   per - pointer to an error variable
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if error
+ */
+int nvm_run(
+    const NVM_INSTR * pa,
+    const int32_t   * pSpan,
+          int32_t     count,
+          int32_t   * pIndex,
+          int       * per);
+
 #endif
@@ -0,0 +1,649 @@
+/*
+ * scan.c
+ * 
+ * Implementation of scan.h
+ * 
+ * See the header for further information.
+ */
+
+#include "scan.h"
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * The vectorized kernels are only built for x86 with GCC or Clang,
+ * which provide the target attribute and runtime processor detection.
+ */
+#if !defined(SCAN_NO_SIMD) && \
+    (defined(__GNUC__) || defined(__clang__)) && \
+    (defined(__x86_64__) || defined(__i386__))
+#define SCAN_X86
+#include <immintrin.h>
+#endif
+
+/*
+ * Type declarations
+ * =================
+ */
+
+/*
+ * Function pointer types for the kernels.
+ */
+typedef const unsigned char *(*SCAN_SPACE_FP)(
+    const unsigned char *, const unsigned char *, int64_t *);
+typedef const unsigned char *(*SCAN_LINE_FP)(
+    const unsigned char *, const unsigned char *);
+typedef int64_t (*SCAN_COUNT_FP)(
+    const unsigned char *, const unsigned char *);
+typedef void (*SCAN_MASK_FP)(
+    const unsigned char *, const unsigned char *, uint64_t *);
+
+/*
+ * Static data
+ * ===========
+ */
+
+/*
+ * Flag indicating whether the kernels have been selected yet.
+ */
+static int m_scan_init = 0;
+
+/*
+ * The selected kernels.
+ * 
+ * Only valid if m_scan_init.
+ */
+static SCAN_SPACE_FP m_scan_space = NULL;
+static SCAN_LINE_FP m_scan_line = NULL;
+static SCAN_COUNT_FP m_scan_count = NULL;
+static SCAN_MASK_FP m_scan_mask = NULL;
+
+/*
+ * Local functions
+ * ===============
+ */
+
+/* Prototypes */
+static void scan_init(void);
+
+static const unsigned char *scan_space_scalar(
+    const unsigned char * p,
+    const unsigned char * pEnd,
+          int64_t       * pLines);
+static const unsigned char *scan_line_scalar(
+    const unsigned char * p,
+    const unsigned char * pEnd);
+static int64_t scan_count_scalar(
+    const unsigned char * p,
+    const unsigned char * pEnd);
+static void scan_mask_scalar(
+    const unsigned char * p,
+    const unsigned char * pEnd,
+          uint64_t      * pMask);
+
+#ifdef SCAN_X86
+static const unsigned char *scan_space_sse2(
+    const unsigned char * p,
+    const unsigned char * pEnd,
+          int64_t       * pLines);
+static const unsigned char *scan_line_sse2(
+    const unsigned char * p,
+    const unsigned char * pEnd);
+static int64_t scan_count_sse2(
+    const unsigned char * p,
+    const unsigned char * pEnd);
+static void scan_mask_sse2(
+    const unsigned char * p,
+    const unsigned char * pEnd,
+          uint64_t      * pMask);
+static const unsigned char *scan_space_avx2(
+    const unsigned char * p,
+    const unsigned char * pEnd,
+          int64_t       * pLines);
+static const unsigned char *scan_line_avx2(
+    const unsigned char * p,
+    const unsigned char * pEnd);
+static int64_t scan_count_avx2(
+    const unsigned char * p,
+    const unsigned char * pEnd);
+static void scan_mask_avx2(
+    const unsigned char * p,
+    const unsigned char * pEnd,
+          uint64_t      * pMask);
+#endif
+
+/*
+ * Select the kernels, if not already done.
+ * 
+ * AVX2 kernels are preferred, then SSE2 kernels, then the scalar
+ * kernels.
+ */
+static void scan_init(void) {
+  
+  /* Only proceed if not yet initialized */
+  if (!m_scan_init) {
+    
+    /* Start with the scalar kernels */
+    m_scan_space = &scan_space_scalar;
+    m_scan_line = &scan_line_scalar;
+    m_scan_count = &scan_count_scalar;
+    m_scan_mask = &scan_mask_scalar;
+
+#ifdef SCAN_X86
+    /* Upgrade to vectorized kernels if supported */
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+      m_scan_space = &scan_space_avx2;
+      m_scan_line = &scan_line_avx2;
+      m_scan_count = &scan_count_avx2;
+      m_scan_mask = &scan_mask_avx2;
+    
+    } else if (__builtin_cpu_supports("sse2")) {
+      m_scan_space = &scan_space_sse2;
+      m_scan_line = &scan_line_sse2;
+      m_scan_count = &scan_count_sse2;
+      m_scan_mask = &scan_mask_sse2;
+    }
+#endif
+    
+    /* Set the initialized flag */
+    m_scan_init = 1;
+  }
+}
+
+/*
+ * Scalar version of scan_space().
+ */
+static const unsigned char *scan_space_scalar(
+    const unsigned char * p,
+    const unsigned char * pEnd,
+          int64_t       * pLines) {
+  
+  int64_t lines = 0;
+  int c = 0;
+  
+  /* Skip whitespace, counting line feeds */
+  for( ; p < pEnd; p++) {
+    c = *p;
+    if (c == ASCII_LF) {
+      lines++;
+    } else if ((c != ASCII_SP) && (c != ASCII_HT) && (c != ASCII_CR)) {
+      break;
+    }
+  }
+  
+  /* Update line count and return position */
+  *pLines += lines;
+  
+  return p;
+}
+
+/*
+ * Scalar version of scan_line().
+ */
+static const unsigned char *scan_line_scalar(
+    const unsigned char * p,
+    const unsigned char * pEnd) {
+  
+  const unsigned char *pf = NULL;
+  
+  /* The C library search is the fastest portable way */
+  if (p < pEnd) {
+    pf = (const unsigned char *) memchr(
+            p, ASCII_LF, (size_t) (pEnd - p));
+  }
+  if (pf == NULL) {
+    pf = pEnd;
+  }
+  
+  return pf;
+}
+
+/*
+ * Scalar version of scan_count().
+ */
+static int64_t scan_count_scalar(
+    const unsigned char * p,
+    const unsigned char * pEnd) {
+  
+  int64_t lines = 0;
+  
+  for( ; p < pEnd; p++) {
+    if (*p == ASCII_LF) {
+      lines++;
+    }
+  }
+  
+  return lines;
+}
+
+/*
+ * Scalar version of scan_mask().
+ */
+static void scan_mask_scalar(
+    const unsigned char * p,
+    const unsigned char * pEnd,
+          uint64_t      * pMask) {
+  
+  uint64_t m = 0;
+  int i = 0;
+  
+  /* Build one mask word for each group of up to 64 bytes */
+  while (p < pEnd) {
+    m = 0;
+    for(i = 0; (i < 64) && (p < pEnd); i++) {
+      if (*p == ASCII_LF) {
+        m |= UINT64_C(1) << i;
+      }
+      p++;
+    }
+    *pMask = m;
+    pMask++;
+  }
+}
+
+#ifdef SCAN_X86
+
+/*
+ * SSE2 version of scan_space().
+ * 
+ * Each 16-byte block is compared against the four whitespace
+ * characters.  If the whole block is whitespace, the line feeds in it
+ * are counted and the scan moves on; otherwise, only the line feeds
+ * before the first non-whitespace byte are counted.  The tail of the
+ * range is handled by the scalar kernel.
+ */
+__attribute__((target("sse2")))
+static const unsigned char *scan_space_sse2(
+    const unsigned char * p,
+    const unsigned char * pEnd,
+          int64_t       * pLines) {
+  
+  __m128i vsp, vht, vlf, vcr, v, vlfm;
+  unsigned int ws = 0;
+  unsigned int lf = 0;
+  int64_t lines = 0;
+  int found = 0;
+  int i = 0;
+  
+  vsp = _mm_set1_epi8((char) ASCII_SP);
+  vht = _mm_set1_epi8((char) ASCII_HT);
+  vlf = _mm_set1_epi8((char) ASCII_LF);
+  vcr = _mm_set1_epi8((char) ASCII_CR);
+  
+  while (pEnd - p >= 16) {
+    v = _mm_loadu_si128((const __m128i *) p);
+    vlfm = _mm_cmpeq_epi8(v, vlf);
+    lf = (unsigned int) _mm_movemask_epi8(vlfm);
+    ws = (unsigned int) _mm_movemask_epi8(
+            _mm_or_si128(
+              _mm_or_si128(
+                _mm_cmpeq_epi8(v, vsp), _mm_cmpeq_epi8(v, vht)),
+              _mm_or_si128(vlfm, _mm_cmpeq_epi8(v, vcr))));
+    
+    if (ws != 0xffffu) {
+      /* Found a non-whitespace byte in this block */
+      i = __builtin_ctz(~ws);
+      lines += __builtin_popcount(lf & ((1u << i) - 1u));
+      p += i;
+      found = 1;
+      break;
+    }
+    
+    lines += __builtin_popcount(lf);
+    p += 16;
+  }
+  
+  /* Update line count and finish the tail */
+  *pLines += lines;
+  if (!found) {
+    p = scan_space_scalar(p, pEnd, pLines);
+  }
+  
+  return p;
+}
+
+/*
+ * SSE2 version of scan_line().
+ */
+__attribute__((target("sse2")))
+static const unsigned char *scan_line_sse2(
+    const unsigned char * p,
+    const unsigned char * pEnd) {
+  
+  __m128i vlf;
+  unsigned int m = 0;
+  int found = 0;
+  
+  vlf = _mm_set1_epi8((char) ASCII_LF);
+  
+  while (pEnd - p >= 16) {
+    m = (unsigned int) _mm_movemask_epi8(
+          _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) p), vlf));
+    if (m != 0) {
+      p += __builtin_ctz(m);
+      found = 1;
+      break;
+    }
+    p += 16;
+  }
+  
+  if (!found) {
+    p = scan_line_scalar(p, pEnd);
+  }
+  
+  return p;
+}
+
+/*
+ * SSE2 version of scan_count().
+ */
+__attribute__((target("sse2")))
+static int64_t scan_count_sse2(
+    const unsigned char * p,
+    const unsigned char * pEnd) {
+  
+  __m128i vlf;
+  int64_t lines = 0;
+  
+  vlf = _mm_set1_epi8((char) ASCII_LF);
+  
+  while (pEnd - p >= 16) {
+    lines += __builtin_popcount((unsigned int) _mm_movemask_epi8(
+              _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) p), vlf)));
+    p += 16;
+  }
+  
+  return lines + scan_count_scalar(p, pEnd);
+}
+
+/*
+ * SSE2 version of scan_mask().
+ * 
+ * Each full mask word is assembled from the masks of four 16-byte
+ * blocks.  A partial word at the end is handled by the scalar kernel.
+ */
+__attribute__((target("sse2")))
+static void scan_mask_sse2(
+    const unsigned char * p,
+    const unsigned char * pEnd,
+          uint64_t      * pMask) {
+  
+  __m128i vlf;
+  uint64_t m = 0;
+  int i = 0;
+  
+  vlf = _mm_set1_epi8((char) ASCII_LF);
+  
+  while (pEnd - p >= 64) {
+    m = 0;
+    for(i = 0; i < 4; i++) {
+      m |= ((uint64_t) (unsigned int) _mm_movemask_epi8(
+              _mm_cmpeq_epi8(
+                _mm_loadu_si128((const __m128i *) (p + 16 * i)), vlf)))
+            << (16 * i);
+    }
+    *pMask = m;
+    pMask++;
+    p += 64;
+  }
+  
+  scan_mask_scalar(p, pEnd, pMask);
+}
+
+/*
+ * AVX2 version of scan_space().
+ * 
+ * Works the same way as the SSE2 version, with 32-byte blocks.
+ */
+__attribute__((target("avx2")))
+static const unsigned char *scan_space_avx2(
+    const unsigned char * p,
+    const unsigned char * pEnd,
+          int64_t       * pLines) {
+  
+  __m256i vsp, vht, vlf, vcr, v, vlfm;
+  uint32_t ws = 0;
+  uint32_t lf = 0;
+  int64_t lines = 0;
+  int found = 0;
+  int i = 0;
+  
+  vsp = _mm256_set1_epi8((char) ASCII_SP);
+  vht = _mm256_set1_epi8((char) ASCII_HT);
+  vlf = _mm256_set1_epi8((char) ASCII_LF);
+  vcr = _mm256_set1_epi8((char) ASCII_CR);
+  
+  while (pEnd - p >= 32) {
+    v = _mm256_loadu_si256((const __m256i *) p);
+    vlfm = _mm256_cmpeq_epi8(v, vlf);
+    lf = (uint32_t) _mm256_movemask_epi8(vlfm);
+    ws = (uint32_t) _mm256_movemask_epi8(
+            _mm256_or_si256(
+              _mm256_or_si256(
+                _mm256_cmpeq_epi8(v, vsp), _mm256_cmpeq_epi8(v, vht)),
+              _mm256_or_si256(vlfm, _mm256_cmpeq_epi8(v, vcr))));
+    
+    if (ws != UINT32_C(0xffffffff)) {
+      /* Found a non-whitespace byte in this block */
+      i = __builtin_ctz(~ws);
+      lines += __builtin_popcount(lf & ((UINT32_C(1) << i) - 1u));
+      p += i;
+      found = 1;
+      break;
+    }
+    
+    lines += __builtin_popcount(lf);
+    p += 32;
+  }
+  
+  /* Update line count and finish the tail */
+  *pLines += lines;
+  if (!found) {
+    p = scan_space_sse2(p, pEnd, pLines);
+  }
+  
+  return p;
+}
+
+/*
+ * AVX2 version of scan_line().
+ */
+__attribute__((target("avx2")))
+static const unsigned char *scan_line_avx2(
+    const unsigned char * p,
+    const unsigned char * pEnd) {
+  
+  __m256i vlf;
+  uint32_t m = 0;
+  int found = 0;
+  
+  vlf = _mm256_set1_epi8((char) ASCII_LF);
+  
+  while (pEnd - p >= 32) {
+    m = (uint32_t) _mm256_movemask_epi8(
+          _mm256_cmpeq_epi8(
+            _mm256_loadu_si256((const __m256i *) p), vlf));
+    if (m != 0) {
+      p += __builtin_ctz(m);
+      found = 1;
+      break;
+    }
+    p += 32;
+  }
+  
+  if (!found) {
+    p = scan_line_sse2(p, pEnd);
+  }
+  
+  return p;
+}
+
+/*
+ * AVX2 version of scan_count().
+ */
+__attribute__((target("avx2")))
+static int64_t scan_count_avx2(
+    const unsigned char * p,
+    const unsigned char * pEnd) {
+  
+  __m256i vlf;
+  int64_t lines = 0;
+  
+  vlf = _mm256_set1_epi8((char) ASCII_LF);
+  
+  while (pEnd - p >= 32) {
+    lines += __builtin_popcount((uint32_t) _mm256_movemask_epi8(
+              _mm256_cmpeq_epi8(
+                _mm256_loadu_si256((const __m256i *) p), vlf)));
+    p += 32;
+  }
+  
+  return lines + scan_count_sse2(p, pEnd);
+}
+
+/*
+ * AVX2 version of scan_mask().
+ * 
+ * Works the same way as the SSE2 version, with two 32-byte blocks per
+ * mask word.
+ */
+__attribute__((target("avx2")))
+static void scan_mask_avx2(
+    const unsigned char * p,
+    const unsigned char * pEnd,
+          uint64_t      * pMask) {
+  
+  __m256i vlf;
+  uint64_t lo = 0;
+  uint64_t hi = 0;
+  
+  vlf = _mm256_set1_epi8((char) ASCII_LF);
+  
+  while (pEnd - p >= 64) {
+    lo = (uint32_t) _mm256_movemask_epi8(
+            _mm256_cmpeq_epi8(
+              _mm256_loadu_si256((const __m256i *) p), vlf));
+    hi = (uint32_t) _mm256_movemask_epi8(
+            _mm256_cmpeq_epi8(
+              _mm256_loadu_si256((const __m256i *) (p + 32)), vlf));
+    *pMask = lo | (hi << 32);
+    pMask++;
+    p += 64;
+  }
+  
+  scan_mask_scalar(p, pEnd, pMask);
+}
+
+#endif
+
+/*
+ * Public function implementations
+ * ===============================
+ * 
+ * See the header for specifications.
+ */
+
+/*
+ * scan_space function.
+ */
+const unsigned char *scan_space(
+    const unsigned char * p,
+    const unsigned char * pEnd,
+          int64_t       * pLines) {
+  
+  /* Check parameters */
+  if ((p == NULL) || (pEnd == NULL) || (pLines == NULL) || (p > pEnd)) {
+    abort();
+  }
+  
+  /* Select kernels if necessary and call through */
+  scan_init();
+  return (*m_scan_space)(p, pEnd, pLines);
+}
+
+/*
+ * scan_line function.
+ */
+const unsigned char *scan_line(
+    const unsigned char * p,
+    const unsigned char * pEnd) {
+  
+  /* Check parameters */
+  if ((p == NULL) || (pEnd == NULL) || (p > pEnd)) {
+    abort();
+  }
+  
+  /* Select kernels if necessary and call through */
+  scan_init();
+  return (*m_scan_line)(p, pEnd);
+}
+
+/*
+ * scan_count function.
+ */
+int64_t scan_count(
+    const unsigned char * p,
+    const unsigned char * pEnd) {
+  
+  /* Check parameters */
+  if ((p == NULL) || (pEnd == NULL) || (p > pEnd)) {
+    abort();
+  }
+  
+  /* Select kernels if necessary and call through */
+  scan_init();
+  return (*m_scan_count)(p, pEnd);
+}
+
+/*
+ * scan_mask function.
+ */
+void scan_mask(
+    const unsigned char * p,
+    const unsigned char * pEnd,
+          uint64_t      * pMask) {
+  
+  /* Check parameters */
+  if ((p == NULL) || (pEnd == NULL) || (pMask == NULL) || (p > pEnd)) {
+    abort();
+  }
+  
+  /* Select kernels if necessary and call through */
+  scan_init();
+  (*m_scan_mask)(p, pEnd, pMask);
+}
+
+/*
+ * scan_bits function.
+ */
+int64_t scan_bits(const uint64_t *pMask, int64_t n) {
+  
+  int64_t result = 0;
+  uint64_t m = 0;
+  
+  /* Check parameters */
+  if ((pMask == NULL) || (n < 0)) {
+    abort();
+  }
+  
+  /* Count each word, masking off the bits beyond n in the last one */
+  for( ; n > 0; n -= 64) {
+    m = *pMask;
+    pMask++;
+    if (n < 64) {
+      m &= (UINT64_C(1) << n) - 1;
+    }
+
+#if defined(__GNUC__) || defined(__clang__)
+    result += (int64_t) __builtin_popcountll(m);
+#else
+    for( ; m != 0; m &= m - 1) {
+      result++;
+    }
+#endif
+  }
+  
+  /* Return count */
+  return result;
+}
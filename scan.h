@@ -0,0 +1,140 @@
+#ifndef SCAN_H_INCLUDED
+#define SCAN_H_INCLUDED
+
+/*
+ * scan.h
+ * 
+ * Byte scanning kernels of the Noir compiler.
+ * 
+ * These functions scan runs of filtered input, in which all line breaks
+ * have already been converted to LF.  On x86 platforms compiled with
+ * GCC or Clang, vectorized SSE2 and AVX2 versions of the kernels are
+ * used, selected at runtime according to what the processor supports.
+ * Everywhere else, and if SCAN_NO_SIMD is defined, portable scalar
+ * versions are used.  All versions give identical results.
+ * 
+ * Bit counting uses the compiler's population count builtin with GCC
+ * and Clang, and a portable loop elsewhere.
+ */
+
+#include "noirdef.h"
+
+/*
+ * Skip over a run of whitespace.
+ * 
+ * p points to the first byte to examine and pEnd points one beyond the
+ * last byte that may be examined.  p must not be greater than pEnd.
+ * 
+ * Whitespace is HT, SP, LF, and CR.  The return value points to the
+ * first byte in the range that is not whitespace, or it is pEnd if the
+ * whole range is whitespace.
+ * 
+ * pLines points to a counter that is incremented by the number of LF
+ * bytes that were skipped.
+ * 
+ * Parameters:
+ * 
+ *   p - the first byte to examine
+ * 
+ *   pEnd - one beyond the last byte to examine
+ * 
+ *   pLines - the counter to increment by the number of skipped LFs
+ * 
+ * Return:
+ * 
+ *   pointer to the first non-whitespace byte, or pEnd
+ */
+const unsigned char *scan_space(
+    const unsigned char * p,
+    const unsigned char * pEnd,
+          int64_t       * pLines);
+
+/*
+ * Jump to the end of a line.
+ * 
+ * p points to the first byte to examine and pEnd points one beyond the
+ * last byte that may be examined.  p must not be greater than pEnd.
+ * 
+ * The return value points to the first LF in the range, or it is pEnd
+ * if there is no LF in the range.  Since a comment runs up to but
+ * excluding the next LF, this jumps over the rest of a comment without
+ * skipping any line break.
+ * 
+ * Parameters:
+ * 
+ *   p - the first byte to examine
+ * 
+ *   pEnd - one beyond the last byte to examine
+ * 
+ * Return:
+ * 
+ *   pointer to the first LF, or pEnd
+ */
+const unsigned char *scan_line(
+    const unsigned char * p,
+    const unsigned char * pEnd);
+
+/*
+ * Count the line feeds in a range.
+ * 
+ * p points to the first byte to examine and pEnd points one beyond the
+ * last byte that may be examined.  p must not be greater than pEnd.
+ * 
+ * Parameters:
+ * 
+ *   p - the first byte to examine
+ * 
+ *   pEnd - one beyond the last byte to examine
+ * 
+ * Return:
+ * 
+ *   the number of LF bytes in the range
+ */
+int64_t scan_count(
+    const unsigned char * p,
+    const unsigned char * pEnd);
+
+/*
+ * Build a bit mask of the line feeds in a range.
+ * 
+ * p points to the first byte to examine and pEnd points one beyond the
+ * last byte that may be examined.  p must not be greater than pEnd.
+ * 
+ * pMask points to an array that receives one mask word for each group
+ * of 64 bytes in the range, the last group possibly being shorter.
+ * Bit i of word k is set if byte (k * 64) + i of the range is an LF.
+ * Bits beyond the end of the range are clear.
+ * 
+ * Parameters:
+ * 
+ *   p - the first byte to examine
+ * 
+ *   pEnd - one beyond the last byte to examine
+ * 
+ *   pMask - the array to receive the mask words
+ */
+void scan_mask(
+    const unsigned char * p,
+    const unsigned char * pEnd,
+          uint64_t      * pMask);
+
+/*
+ * Count the set bits at the start of a bit mask.
+ * 
+ * pMask points to mask words in the format of scan_mask().  The first
+ * n bits are counted, which covers (n + 63) / 64 words.  n must not be
+ * negative.
+ * 
+ * Parameters:
+ * 
+ *   pMask - the mask words
+ * 
+ *   n - the number of bits to count
+ * 
+ * Return:
+ * 
+ *   the number of set bits among the first n bits
+ */
+int64_t scan_bits(const uint64_t *pMask, int64_t n);
+
+#endif
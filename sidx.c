@@ -0,0 +1,453 @@
+/*
+ * sidx.c
+ * 
+ * Implementation of sidx.h
+ * 
+ * See the header for further information.
+ */
+
+#include "sidx.h"
+#include "cache.h"
+#include "event.h"
+#include "nvm.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Constants
+ * =========
+ */
+
+/*
+ * The signature at the start of an index file, and the lengths of the
+ * header and of each entry.
+ */
+#define SIDX_SIGNATURE "NoirSIx1"
+#define SIDX_HEADLEN (32)
+#define SIDX_ENTLEN (16)
+
+/*
+ * The suffix added to the index file path for the temporary file that
+ * a new index file is written to.
+ */
+#define SIDX_TMPSUFFIX ".tmp"
+
+/*
+ * Static data
+ * ===========
+ */
+
+/*
+ * Flag indicating whether sidx_open() has been called.
+ */
+static int m_sidx_opened = 0;
+
+/*
+ * The index file path, or NULL if the index is disabled.
+ */
+static const char *m_sidx_pPath = NULL;
+
+/*
+ * The filtered input length and hash.
+ */
+static int64_t m_sidx_len = 0;
+static uint64_t m_sidx_key = 0;
+
+/*
+ * Set if the index file matches the input, in which case m_sidx_pOffs
+ * and m_sidx_pStart are the token offsets and time offsets of its
+ * m_sidx_count entries.
+ */
+static int m_sidx_match = 0;
+static int64_t *m_sidx_pOffs = NULL;
+static int32_t *m_sidx_pStart = NULL;
+static int32_t m_sidx_count = 0;
+
+/*
+ * Set if recording, in which case m_sidx_pMark has the token offsets
+ * of the m_sidx_marks section operations so far, and m_sidx_markCap is
+ * its capacity.
+ */
+static int m_sidx_rec = 0;
+static int64_t *m_sidx_pMark = NULL;
+static int32_t m_sidx_marks = 0;
+static int32_t m_sidx_markCap = 0;
+
+/*
+ * Local functions
+ * ===============
+ */
+
+/* Prototypes */
+static uint64_t sidx_word(const unsigned char *p);
+static void sidx_putWord(unsigned char *p, uint64_t v);
+static int sidx_load(void);
+
+/*
+ * Decode an unsigned 64-bit little endian integer.
+ * 
+ * Parameters:
+ * 
+ *   p - the eight bytes to decode
+ * 
+ * Return:
+ * 
+ *   the integer
+ */
+static uint64_t sidx_word(const unsigned char *p) {
+  
+  uint64_t v = 0;
+  int i = 0;
+  
+  /* Check parameter */
+  if (p == NULL) {
+    abort();
+  }
+  
+  /* Decode the bytes, most significant first */
+  for(i = 7; i >= 0; i--) {
+    v = (v << 8) | ((uint64_t) p[i]);
+  }
+  
+  return v;
+}
+
+/*
+ * Encode an unsigned 64-bit little endian integer.
+ * 
+ * Parameters:
+ * 
+ *   p - the eight bytes to encode into
+ * 
+ *   v - the integer
+ */
+static void sidx_putWord(unsigned char *p, uint64_t v) {
+  
+  int i = 0;
+  
+  /* Check parameter */
+  if (p == NULL) {
+    abort();
+  }
+  
+  /* Encode the bytes, least significant first */
+  for(i = 0; i < 8; i++) {
+    p[i] = (unsigned char) (v & 0xff);
+    v >>= 8;
+  }
+}
+
+/*
+ * Load the index file into m_sidx_pOffs and m_sidx_pStart, if it
+ * matches the input and is valid.
+ * 
+ * Return:
+ * 
+ *   non-zero if the index file was loaded, zero if it does not exist,
+ *   does not match, or is damaged
+ */
+static int sidx_load(void) {
+  
+  int status = 1;
+  FILE *pf = NULL;
+  unsigned char head[SIDX_HEADLEN];
+  unsigned char ent[SIDX_ENTLEN];
+  uint64_t count = 0;
+  uint64_t offs = 0;
+  uint64_t t = 0;
+  int32_t i = 0;
+  
+  /* Initialize structures */
+  memset(head, 0, sizeof(head));
+  memset(ent, 0, sizeof(ent));
+  
+  /* Open the index file and read the header */
+  pf = fopen(m_sidx_pPath, "rb");
+  if (pf == NULL) {
+    status = 0;
+  }
+  if (status) {
+    if (fread(head, 1, SIDX_HEADLEN, pf) != SIDX_HEADLEN) {
+      status = 0;
+    }
+  }
+  
+  /* Check the header against the input */
+  if (status) {
+    count = sidx_word(&(head[24]));
+    if ((memcmp(head, SIDX_SIGNATURE, 8) != 0) ||
+        (sidx_word(&(head[8])) != (uint64_t) m_sidx_len) ||
+        (sidx_word(&(head[16])) != m_sidx_key) ||
+        (count >= (uint64_t) NMF_MAXSECT)) {
+      status = 0;
+    }
+  }
+  
+  /* Allocate the entry arrays, with at least one element each */
+  if (status) {
+    m_sidx_count = (int32_t) count;
+    m_sidx_pOffs = (int64_t *) calloc(
+                      (size_t) (m_sidx_count + 1), sizeof(int64_t));
+    m_sidx_pStart = (int32_t *) calloc(
+                      (size_t) (m_sidx_count + 1), sizeof(int32_t));
+    if ((m_sidx_pOffs == NULL) || (m_sidx_pStart == NULL)) {
+      abort();
+    }
+  }
+  
+  /* Read the entries, checking that they are in order and in range */
+  for(i = 0; status && (i < m_sidx_count); i++) {
+    if (fread(ent, 1, SIDX_ENTLEN, pf) != SIDX_ENTLEN) {
+      status = 0;
+      break;
+    }
+    offs = sidx_word(ent);
+    t = sidx_word(&(ent[8]));
+    if ((offs >= (uint64_t) m_sidx_len) || (t > (uint64_t) INT32_MAX)) {
+      status = 0;
+      break;
+    }
+    if (i > 0) {
+      if ((offs <= (uint64_t) m_sidx_pOffs[i - 1]) ||
+          (t < (uint64_t) m_sidx_pStart[i - 1])) {
+        status = 0;
+        break;
+      }
+    }
+    m_sidx_pOffs[i] = (int64_t) offs;
+    m_sidx_pStart[i] = (int32_t) t;
+  }
+  
+  /* The entries must be followed by nothing */
+  if (status) {
+    if (fread(ent, 1, 1, pf) != 0) {
+      status = 0;
+    }
+  }
+  
+  /* Close the index file */
+  if (pf != NULL) {
+    fclose(pf);
+    pf = NULL;
+  }
+  
+  /* Release the entries if loading failed */
+  if (!status) {
+    free(m_sidx_pOffs);
+    free(m_sidx_pStart);
+    m_sidx_pOffs = NULL;
+    m_sidx_pStart = NULL;
+    m_sidx_count = 0;
+  }
+  
+  /* Return status */
+  return status;
+}
+
+/*
+ * Public function implementations
+ * ===============================
+ * 
+ * See the header for specifications.
+ */
+
+/*
+ * sidx_open function.
+ */
+int sidx_open(const char *pPath, FILE *pIn) {
+  
+  /* Check state and update it */
+  if (m_sidx_opened) {
+    abort();
+  } else {
+    m_sidx_opened = 1;
+  }
+  
+  /* Check parameters */
+  if ((pPath == NULL) || (pIn == NULL)) {
+    abort();
+  }
+  
+  /* Hash the input, leaving the index disabled if that fails, then
+   * load the index file if it matches and record otherwise */
+  if (cache_digest(pIn, &m_sidx_len, &m_sidx_key)) {
+    m_sidx_pPath = pPath;
+    if (sidx_load()) {
+      m_sidx_match = 1;
+    } else {
+      m_sidx_rec = 1;
+    }
+  }
+  
+  /* Return whether the index matches */
+  return m_sidx_match;
+}
+
+/*
+ * sidx_resume function.
+ */
+int sidx_resume(int32_t sect, int64_t *pOffs, int *per) {
+  
+  int status = 1;
+  int32_t i = 0;
+  
+  /* Check parameters */
+  if ((pOffs == NULL) || (per == NULL)) {
+    abort();
+  }
+  
+  /* Start at the beginning unless the index has the section */
+  *pOffs = 0;
+  if ((!m_sidx_match) || (sect < 1) || (sect > m_sidx_count)) {
+    return status;
+  }
+  
+  /* Define the sections before it, then move the cursor to where the
+   * section operation was */
+  for(i = 0; i < sect - 1; i++) {
+    nvm_skip(m_sidx_pStart[i]);
+    if (!nvm_op_section(per)) {
+      status = 0;
+      break;
+    }
+  }
+  if (status) {
+    nvm_skip(m_sidx_pStart[sect - 1]);
+    *pOffs = m_sidx_pOffs[sect - 1];
+  }
+  
+  /* Return status */
+  return status;
+}
+
+/*
+ * sidx_mark function.
+ */
+void sidx_mark(int64_t offs) {
+  
+  int32_t newcap = 0;
+  
+  /* Only proceed if recording */
+  if (!m_sidx_rec) {
+    return;
+  }
+  
+  /* Check parameter */
+  if (offs < 0) {
+    abort();
+  }
+  
+  /* Grow the array if necessary */
+  if (m_sidx_marks >= m_sidx_markCap) {
+    if (m_sidx_markCap >= NMF_MAXSECT) {
+      return;  /* too many sections, which fails compilation anyway */
+    }
+    newcap = m_sidx_markCap * 2;
+    if (newcap < 64) {
+      newcap = 64;
+    }
+    m_sidx_pMark = (int64_t *) realloc(
+                      m_sidx_pMark, ((size_t) newcap) * sizeof(int64_t));
+    if (m_sidx_pMark == NULL) {
+      abort();
+    }
+    m_sidx_markCap = newcap;
+  }
+  
+  /* Record the offset */
+  m_sidx_pMark[m_sidx_marks] = offs;
+  m_sidx_marks++;
+}
+
+/*
+ * sidx_write function.
+ */
+int sidx_write(void) {
+  
+  int status = 1;
+  unsigned char head[SIDX_HEADLEN];
+  unsigned char ent[SIDX_ENTLEN];
+  char *pTmp = NULL;
+  size_t plen = 0;
+  FILE *pf = NULL;
+  int32_t i = 0;
+  
+  /* Initialize structures */
+  memset(head, 0, sizeof(head));
+  memset(ent, 0, sizeof(ent));
+  
+  /* Only proceed if recording */
+  if (!m_sidx_rec) {
+    return status;
+  }
+  
+  /* There must be a section operation for every section after the
+   * first */
+  if (m_sidx_marks != event_sections() - 1) {
+    abort();
+  }
+  
+  /* Build the header */
+  memcpy(head, SIDX_SIGNATURE, 8);
+  sidx_putWord(&(head[8]), (uint64_t) m_sidx_len);
+  sidx_putWord(&(head[16]), m_sidx_key);
+  sidx_putWord(&(head[24]), (uint64_t) m_sidx_marks);
+  
+  /* Build the temporary file path */
+  plen = strlen(m_sidx_pPath);
+  pTmp = (char *) malloc(plen + sizeof(SIDX_TMPSUFFIX));
+  if (pTmp == NULL) {
+    abort();
+  }
+  memcpy(pTmp, m_sidx_pPath, plen);
+  memcpy(&(pTmp[plen]), SIDX_TMPSUFFIX, sizeof(SIDX_TMPSUFFIX));
+  
+  /* Write the header and the entries to the temporary file */
+  pf = fopen(pTmp, "wb");
+  if (pf == NULL) {
+    status = 0;
+  }
+  if (status) {
+    if (fwrite(head, 1, SIDX_HEADLEN, pf) != SIDX_HEADLEN) {
+      status = 0;
+    }
+  }
+  for(i = 0; status && (i < m_sidx_marks); i++) {
+    sidx_putWord(ent, (uint64_t) m_sidx_pMark[i]);
+    sidx_putWord(&(ent[8]), (uint64_t) event_start(i + 1));
+    if (fwrite(ent, 1, SIDX_ENTLEN, pf) != SIDX_ENTLEN) {
+      status = 0;
+    }
+  }
+  if (pf != NULL) {
+    if (fclose(pf) != 0) {
+      status = 0;
+    }
+    pf = NULL;
+  }
+  
+  /* Replace the index file with it; some platforms do not allow
+   * renaming over an existing file, so remove it first if that
+   * fails */
+  if (status) {
+    if (rename(pTmp, m_sidx_pPath) != 0) {
+      remove(m_sidx_pPath);
+      if (rename(pTmp, m_sidx_pPath) != 0) {
+        status = 0;
+      }
+    }
+  }
+  
+  /* Clean up the temporary file on failure */
+  if (!status) {
+    remove(pTmp);
+  }
+  
+  /* Release the path */
+  free(pTmp);
+  pTmp = NULL;
+  
+  /* Return status */
+  return status;
+}
@@ -0,0 +1,141 @@
+#ifndef SIDX_H_INCLUDED
+#define SIDX_H_INCLUDED
+
+/*
+ * sidx.h
+ * 
+ * Section index module of the Noir compiler.
+ * 
+ * A section index file records where each "$" section operation is in
+ * a Noir notation file, and where its section begins in time, so that
+ * a later run that only wants the sections from some point on can
+ * start interpreting there instead of at the beginning.
+ * 
+ * This works because the state of the virtual machine after a section
+ * operation only depends on the cursor position and the number of
+ * sections: the section operation fails unless every stack is empty,
+ * and it resets the registers.  To start at the section operation that
+ * begins section n, the sections before it are defined from the index
+ * with nvm_skip() and nvm_op_section(), the cursor is moved to where
+ * section n begins, and the token module is seeked to the section
+ * operation.  Nothing before it is interpreted, so errors there are not
+ * reported.
+ * 
+ * The index is keyed by the length and hash of the filtered input, the
+ * same as the token cache (see cache.h), so an index is only used with
+ * the exact input it was made from.  Otherwise, the entity module
+ * records the offset of each section operation with sidx_mark() while
+ * the input is compiled in full, and sidx_write() writes a new index.
+ * 
+ * Section index file format
+ * -------------------------
+ * 
+ * All integers are unsigned 64-bit little endian.  The file has a
+ * 32-byte header:
+ * 
+ *   (1) The eight ASCII characters "NoirSIx1"
+ *   (2) Filtered input length in bytes
+ *   (3) Filtered input hash
+ *   (4) Number of entries
+ * 
+ * The header is followed by the entries, one for each section after the
+ * first, in order.  Each entry has two integers:
+ * 
+ *   (1) Offset of the "$" token in the filtered input
+ *   (2) Time offset where the section begins
+ * 
+ * The token offsets must be strictly ascending and less than the input
+ * length, the time offsets must be ascending and no greater than
+ * INT32_MAX, and there must be fewer than NMF_MAXSECT entries, or the
+ * index is ignored.
+ * 
+ * Requires the cache, event, and nvm modules.
+ */
+
+#include "noirdef.h"
+#include <stdio.h>
+
+/*
+ * Check a section index file against the input file.
+ * 
+ * This function may only be called once, before anything else is done
+ * with the input file.  The input is read through to hash it, and its
+ * position is then restored, which requires it to be seekable.
+ * 
+ * If the index file matches the input, it is loaded for sidx_resume(),
+ * and nothing is recorded.  Otherwise, recording is turned on, so that
+ * sidx_write() can write a new index file.  If the input is not
+ * seekable, the index is disabled altogether.
+ * 
+ * Parameters:
+ * 
+ *   pPath - the path to the index file, which must remain valid while
+ *   the module is in use
+ * 
+ *   pIn - the input file
+ * 
+ * Return:
+ * 
+ *   non-zero if the index file matches the input, zero otherwise
+ */
+int sidx_open(const char *pPath, FILE *pIn);
+
+/*
+ * Prepare to start interpreting at the section operation that begins a
+ * given section.
+ * 
+ * If the index matches the input and sect is at least one and not more
+ * than the number of entries, the sections before sect are defined,
+ * the cursor is moved to where sect begins, and *pOffs receives the
+ * offset of its section operation, which the token module should be
+ * seeked to.  Otherwise, nothing is done and *pOffs receives zero, so
+ * interpreting starts at the beginning.
+ * 
+ * This must be called before anything is interpreted.  Defining the
+ * sections may fail with the same errors as nvm_op_section().
+ * 
+ * Parameters:
+ * 
+ *   sect - the section to start at
+ * 
+ *   pOffs - pointer to variable to receive the input offset to start
+ *   at
+ * 
+ *   per - pointer to variable to receive the error code in case of
+ *   error
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if error
+ */
+int sidx_resume(int32_t sect, int64_t *pOffs, int *per);
+
+/*
+ * Record a section operation.
+ * 
+ * The entity module calls this with the offset of each "$" token that
+ * it interprets.  Nothing happens unless recording is on.
+ * 
+ * Parameters:
+ * 
+ *   offs - the offset of the token in the filtered input
+ */
+void sidx_mark(int64_t offs);
+
+/*
+ * Write a new index file, if recording is on.
+ * 
+ * This should only be called once the input has been compiled
+ * successfully.  The time offsets are taken from the event module.
+ * The index file is written to a temporary file first and then renamed
+ * over the old one, so a failed write leaves the old index file in
+ * place.
+ * 
+ * Return:
+ * 
+ *   non-zero if successful or there is nothing to write, zero if the
+ *   index file could not be written
+ */
+int sidx_write(void);
+
+#endif
@@ -0,0 +1,570 @@
+/*
+ * source.c
+ * 
+ * Implementation of source.h
+ * 
+ * See the header for further information.
+ */
+
+#include "source.h"
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef SOURCE_ZLIB
+#include <zlib.h>
+#endif
+
+#ifdef SOURCE_ZSTD
+#include <zstd.h>
+#endif
+
+/*
+ * Constants
+ * =========
+ */
+
+/*
+ * The number of raw bytes read from the input file at a time.
+ */
+#define SOURCE_BLOCKSIZE (65536)
+
+/*
+ * Static data
+ * ===========
+ */
+
+/*
+ * Flag indicating whether an input is open.
+ */
+static int m_source_open = 0;
+
+/*
+ * The input file.
+ * 
+ * Only valid if m_source_open is set.
+ */
+static FILE *m_source_pIn = NULL;
+
+/*
+ * The compression format of the input.
+ * 
+ * Only valid if m_source_open is set.
+ */
+static int m_source_codec = SOURCE_FMT_PLAIN;
+
+/*
+ * The raw input buffer.
+ * 
+ * The first m_source_inLen bytes hold raw input, m_source_inPos of
+ * which have already been consumed.  m_source_rawEnd is set once a
+ * short read shows that the input file has no more raw bytes, and then
+ * m_source_rawErr is ERR_IOREAD if that was because of an I/O error, or
+ * else ERR_OK.
+ * 
+ * Only valid if m_source_open is set.
+ */
+static unsigned char m_source_in[SOURCE_BLOCKSIZE];
+static size_t m_source_inLen = 0;
+static size_t m_source_inPos = 0;
+static int m_source_rawEnd = 0;
+static int m_source_rawErr = ERR_OK;
+
+/*
+ * Flag indicating whether input is exhausted, and the condition that
+ * exhausted it, which is ERR_OK at the end of input.
+ * 
+ * Only valid if m_source_open is set.
+ */
+static int m_source_done = 0;
+static int m_source_err = ERR_OK;
+
+/*
+ * Flag indicating whether the decompressor is at a boundary between
+ * gzip members or zstd frames, where input may end cleanly.
+ * 
+ * Only valid if m_source_open is set.
+ */
+static int m_source_ended = 0;
+
+#ifdef SOURCE_ZLIB
+/*
+ * The gzip decompression stream.
+ * 
+ * Only valid if m_source_open is set and m_source_codec is
+ * SOURCE_FMT_GZIP.
+ */
+static z_stream m_source_z;
+#endif
+
+#ifdef SOURCE_ZSTD
+/*
+ * The zstd decompression stream.
+ * 
+ * Only valid if m_source_open is set and m_source_codec is
+ * SOURCE_FMT_ZSTD.
+ */
+static ZSTD_DStream *m_source_pZstd = NULL;
+#endif
+
+/*
+ * Local functions
+ * ===============
+ */
+
+/* Prototypes */
+static void source_fill(void);
+static void source_fail(int err);
+#if defined(SOURCE_ZLIB) || defined(SOURCE_ZSTD)
+static void source_end(void);
+#endif
+static size_t source_plain(unsigned char *p, size_t n);
+static size_t source_gzip(unsigned char *p, size_t n);
+static size_t source_zstd(unsigned char *p, size_t n);
+
+/*
+ * Read the next block of raw input into the raw input buffer.
+ * 
+ * All raw bytes in the buffer must have been consumed, or a fault
+ * occurs.  Nothing happens if there are no more raw bytes.
+ */
+static void source_fill(void) {
+  
+  /* Check state */
+  if (m_source_inPos < m_source_inLen) {
+    abort();
+  }
+  
+  /* Only proceed if there are more raw bytes */
+  if (!m_source_rawEnd) {
+    m_source_inLen = fread(m_source_in, 1, SOURCE_BLOCKSIZE, m_source_pIn);
+    m_source_inPos = 0;
+    
+    /* A short read means we reached EOF or an I/O error */
+    if (m_source_inLen < SOURCE_BLOCKSIZE) {
+      m_source_rawEnd = 1;
+      if (ferror(m_source_pIn)) {
+        m_source_rawErr = ERR_IOREAD;
+      }
+    }
+  }
+}
+
+/*
+ * Exhaust input with an error.
+ * 
+ * Nothing happens if input is already exhausted, so that the first
+ * condition is the one reported.
+ * 
+ * Parameters:
+ * 
+ *   err - the error code
+ */
+static void source_fail(int err) {
+  if (!m_source_done) {
+    m_source_done = 1;
+    m_source_err = err;
+  }
+}
+
+#if defined(SOURCE_ZLIB) || defined(SOURCE_ZSTD)
+/*
+ * Exhaust input when the decompressor can make no more progress with
+ * the raw bytes there are.
+ * 
+ * An I/O error on the raw input is reported as such.  Otherwise, input
+ * ends cleanly only at a boundary between gzip members or zstd frames,
+ * and anywhere else the compressed input has been truncated.
+ */
+static void source_end(void) {
+  if (m_source_rawErr != ERR_OK) {
+    source_fail(m_source_rawErr);
+  } else if (m_source_ended) {
+    source_fail(ERR_OK);
+  } else {
+    source_fail(ERR_BADCODEC);
+  }
+}
+#endif
+
+/*
+ * Read plain input bytes.
+ * 
+ * Bytes left in the raw input buffer are returned first, and then the
+ * rest are read straight from the input file into the caller's buffer.
+ * 
+ * Parameters:
+ * 
+ *   p - the buffer to receive the bytes
+ * 
+ *   n - the number of bytes to read
+ * 
+ * Return:
+ * 
+ *   the number of bytes read, which is less than n only if input is
+ *   exhausted
+ */
+static size_t source_plain(unsigned char *p, size_t n) {
+  
+  size_t count = 0;
+  size_t rlen = 0;
+  
+  /* Check parameter */
+  if (p == NULL) {
+    abort();
+  }
+  
+  /* Take what is left in the raw input buffer */
+  count = m_source_inLen - m_source_inPos;
+  if (count > n) {
+    count = n;
+  }
+  if (count > 0) {
+    memcpy(p, &(m_source_in[m_source_inPos]), count);
+    m_source_inPos += count;
+  }
+  
+  /* Read the rest straight from the file */
+  if ((count < n) && (!m_source_rawEnd)) {
+    rlen = fread(&(p[count]), 1, n - count, m_source_pIn);
+    count += rlen;
+    if (count < n) {
+      m_source_rawEnd = 1;
+      if (ferror(m_source_pIn)) {
+        m_source_rawErr = ERR_IOREAD;
+      }
+    }
+  }
+  
+  /* A short count exhausts input */
+  if (count < n) {
+    source_fail(m_source_rawErr);
+  }
+  
+  /* Return count */
+  return count;
+}
+
+/*
+ * Decompress gzip input.
+ * 
+ * Parameters:
+ * 
+ *   p - the buffer to receive the bytes
+ * 
+ *   n - the number of bytes to read
+ * 
+ * Return:
+ * 
+ *   the number of bytes read, which is less than n only if input is
+ *   exhausted
+ */
+static size_t source_gzip(unsigned char *p, size_t n) {
+  
+  size_t count = 0;
+
+#ifdef SOURCE_ZLIB
+  size_t avail = 0;
+  int r = 0;
+  
+  /* Check parameter */
+  if (p == NULL) {
+    abort();
+  }
+  
+  /* Decompress until the buffer is full or input is exhausted; avail_out
+   * is limited to what zlib can take in one call */
+  while ((count < n) && (!m_source_done)) {
+    
+    /* Refill the raw input buffer if it is used up */
+    if ((m_source_inPos >= m_source_inLen) && (!m_source_rawEnd)) {
+      source_fill();
+      continue;
+    }
+    
+    /* Decompress as much as possible */
+    avail = n - count;
+    if (avail > UINT32_MAX) {
+      avail = UINT32_MAX;
+    }
+    m_source_z.next_in = &(m_source_in[m_source_inPos]);
+    m_source_z.avail_in = (uInt) (m_source_inLen - m_source_inPos);
+    m_source_z.next_out = &(p[count]);
+    m_source_z.avail_out = (uInt) avail;
+    
+    r = inflate(&m_source_z, Z_NO_FLUSH);
+    
+    if (m_source_z.avail_in < m_source_inLen - m_source_inPos) {
+      m_source_ended = 0;
+    }
+    m_source_inPos = m_source_inLen - m_source_z.avail_in;
+    count += avail - m_source_z.avail_out;
+    
+    if (r == Z_STREAM_END) {
+      /* End of a member, so get ready for another one */
+      m_source_ended = 1;
+      if (inflateReset(&m_source_z) != Z_OK) {
+        abort();
+      }
+    
+    } else if ((r == Z_BUF_ERROR) && (m_source_inPos >= m_source_inLen) &&
+                m_source_rawEnd) {
+      /* No progress possible without more input */
+      source_end();
+    
+    } else if (r == Z_MEM_ERROR) {
+      abort();
+    
+    } else if (r != Z_OK) {
+      source_fail(ERR_BADCODEC);
+    }
+  }
+#else
+  /* Check parameter */
+  if (p == NULL) {
+    abort();
+  }
+  
+  /* gzip not enabled, so n is not used */
+  (void) n;
+  source_fail(ERR_NOCODEC);
+#endif
+  
+  /* Return count */
+  return count;
+}
+
+/*
+ * Decompress zstd input.
+ * 
+ * Parameters:
+ * 
+ *   p - the buffer to receive the bytes
+ * 
+ *   n - the number of bytes to read
+ * 
+ * Return:
+ * 
+ *   the number of bytes read, which is less than n only if input is
+ *   exhausted
+ */
+static size_t source_zstd(unsigned char *p, size_t n) {
+  
+  size_t count = 0;
+
+#ifdef SOURCE_ZSTD
+  ZSTD_inBuffer zin;
+  ZSTD_outBuffer zout;
+  size_t before = 0;
+  size_t r = 0;
+  
+  /* Initialize structures */
+  memset(&zin, 0, sizeof(ZSTD_inBuffer));
+  memset(&zout, 0, sizeof(ZSTD_outBuffer));
+  
+  /* Check parameter */
+  if (p == NULL) {
+    abort();
+  }
+  
+  /* Decompress until the buffer is full or input is exhausted */
+  zout.dst = p;
+  zout.size = n;
+  zout.pos = 0;
+  while ((zout.pos < zout.size) && (!m_source_done)) {
+    
+    /* Refill the raw input buffer if it is used up */
+    if ((m_source_inPos >= m_source_inLen) && (!m_source_rawEnd)) {
+      source_fill();
+      continue;
+    }
+    
+    /* Decompress as much as possible */
+    zin.src = m_source_in;
+    zin.size = m_source_inLen;
+    zin.pos = m_source_inPos;
+    before = zout.pos;
+    
+    r = ZSTD_decompressStream(m_source_pZstd, &zout, &zin);
+    
+    if (ZSTD_isError(r)) {
+      source_fail(ERR_BADCODEC);
+    
+    } else if ((zin.pos != m_source_inPos) || (zout.pos != before)) {
+      /* Zero means a frame has been completely decoded and flushed */
+      m_source_ended = (r == 0);
+    
+    } else if ((zin.pos >= zin.size) && m_source_rawEnd) {
+      /* No progress possible without more input */
+      source_end();
+    }
+    
+    m_source_inPos = zin.pos;
+  }
+  count = zout.pos;
+#else
+  /* Check parameter */
+  if (p == NULL) {
+    abort();
+  }
+  
+  /* zstd not enabled, so n is not used */
+  (void) n;
+  source_fail(ERR_NOCODEC);
+#endif
+  
+  /* Return count */
+  return count;
+}
+
+/*
+ * Public function implementations
+ * ===============================
+ * 
+ * See the header for specifications.
+ */
+
+/*
+ * source_detect function.
+ */
+int source_detect(const unsigned char *p, size_t n) {
+  
+  int result = SOURCE_FMT_PLAIN;
+  
+  /* Check parameter */
+  if (p == NULL) {
+    abort();
+  }
+  
+  /* Check the magic bytes */
+  if ((n >= 2) && (p[0] == 0x1f) && (p[1] == 0x8b)) {
+    result = SOURCE_FMT_GZIP;
+  
+  } else if ((n >= 4) && (p[0] == 0x28) && (p[1] == 0xb5) &&
+              (p[2] == 0x2f) && (p[3] == 0xfd)) {
+    result = SOURCE_FMT_ZSTD;
+  }
+  
+  /* Return result */
+  return result;
+}
+
+/*
+ * source_open function.
+ */
+void source_open(FILE *pIn) {
+  
+  /* Check state */
+  if (m_source_open) {
+    abort();
+  }
+  
+  /* Check parameter */
+  if (pIn == NULL) {
+    abort();
+  }
+  
+  /* Initialize variables */
+  m_source_open = 1;
+  m_source_pIn = pIn;
+  m_source_inLen = 0;
+  m_source_inPos = 0;
+  m_source_rawEnd = 0;
+  m_source_rawErr = ERR_OK;
+  m_source_done = 0;
+  m_source_err = ERR_OK;
+  m_source_ended = 0;
+  
+  /* Read the first block and detect the compression format */
+  source_fill();
+  m_source_codec = source_detect(m_source_in, m_source_inLen);
+  
+  /* Set up the decompressor */
+#ifdef SOURCE_ZLIB
+  if (m_source_codec == SOURCE_FMT_GZIP) {
+    memset(&m_source_z, 0, sizeof(z_stream));
+    m_source_z.zalloc = Z_NULL;
+    m_source_z.zfree = Z_NULL;
+    m_source_z.opaque = Z_NULL;
+    if (inflateInit2(&m_source_z, 16 + MAX_WBITS) != Z_OK) {
+      abort();
+    }
+  }
+#endif
+
+#ifdef SOURCE_ZSTD
+  if (m_source_codec == SOURCE_FMT_ZSTD) {
+    m_source_pZstd = ZSTD_createDStream();
+    if (m_source_pZstd == NULL) {
+      abort();
+    }
+    if (ZSTD_isError(ZSTD_initDStream(m_source_pZstd))) {
+      abort();
+    }
+  }
+#endif
+}
+
+/*
+ * source_read function.
+ */
+size_t source_read(unsigned char *p, size_t n, int *per) {
+  
+  size_t count = 0;
+  
+  /* Check state */
+  if (!m_source_open) {
+    abort();
+  }
+  
+  /* Check parameters */
+  if ((p == NULL) || (per == NULL)) {
+    abort();
+  }
+  
+  /* Read according to the format */
+  if (!m_source_done) {
+    if (m_source_codec == SOURCE_FMT_GZIP) {
+      count = source_gzip(p, n);
+    } else if (m_source_codec == SOURCE_FMT_ZSTD) {
+      count = source_zstd(p, n);
+    } else {
+      count = source_plain(p, n);
+    }
+  }
+  
+  /* Report the end condition if input is exhausted */
+  if (count < n) {
+    *per = m_source_err;
+  }
+  
+  /* Return count */
+  return count;
+}
+
+/*
+ * source_close function.
+ */
+void source_close(void) {
+  
+  /* Only if an input is open */
+  if (m_source_open) {
+    
+    /* Release the decompressor */
+#ifdef SOURCE_ZLIB
+    if (m_source_codec == SOURCE_FMT_GZIP) {
+      inflateEnd(&m_source_z);
+    }
+#endif
+
+#ifdef SOURCE_ZSTD
+    if (m_source_codec == SOURCE_FMT_ZSTD) {
+      ZSTD_freeDStream(m_source_pZstd);
+      m_source_pZstd = NULL;
+    }
+#endif
+    
+    /* Update state */
+    m_source_open = 0;
+    m_source_pIn = NULL;
+  }
+}
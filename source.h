@@ -0,0 +1,120 @@
+#ifndef SOURCE_H_INCLUDED
+#define SOURCE_H_INCLUDED
+
+/*
+ * source.h
+ * 
+ * Input source module of the Noir compiler.
+ * 
+ * This module reads the raw bytes of the input file, transparently
+ * decompressing input that was compressed with gzip or zstd.  The
+ * compression format is detected from the magic bytes at the start of
+ * input, so plain text input is passed through unchanged.  Input is
+ * decompressed as it is read, so a compressed file never has to be
+ * expanded in full, in memory or on disk.
+ * 
+ * gzip input may consist of several concatenated members, and zstd
+ * input of several concatenated frames, which are decompressed one
+ * after the other as a single input.
+ * 
+ * Decompression uses zlib for gzip and libzstd for zstd.  Define
+ * SOURCE_ZLIB when compiling source.c to enable gzip and link with
+ * zlib (-lz), and define SOURCE_ZSTD to enable zstd and link with
+ * libzstd (-lzstd).  Compressed input in a format that was not enabled
+ * is reported as an error rather than being read as text.
+ * 
+ * Only one input can be open at a time.  The module keeps no state
+ * between closing one input and opening the next, so the same file can
+ * be read through more than once, as long as its position is restored
+ * in between.
+ */
+
+#include "noirdef.h"
+#include <stddef.h>
+#include <stdio.h>
+
+/*
+ * The compression formats that can be detected.
+ */
+#define SOURCE_FMT_PLAIN (0)
+#define SOURCE_FMT_GZIP  (1)
+#define SOURCE_FMT_ZSTD  (2)
+
+/*
+ * The number of bytes at the start of input that are needed to detect
+ * any compression format.
+ */
+#define SOURCE_MAGICLEN (4)
+
+/*
+ * Detect the compression format from the start of input.
+ * 
+ * p points to the first n bytes of input.  If fewer than
+ * SOURCE_MAGICLEN bytes are given, only formats with magic bytes that
+ * fit are detected.
+ * 
+ * Parameters:
+ * 
+ *   p - the start of input
+ * 
+ *   n - the number of bytes at p
+ * 
+ * Return:
+ * 
+ *   SOURCE_FMT_PLAIN, SOURCE_FMT_GZIP, or SOURCE_FMT_ZSTD
+ */
+int source_detect(const unsigned char *p, size_t n);
+
+/*
+ * Open an input file for reading through this module.
+ * 
+ * No other input may be open, or a fault occurs.
+ * 
+ * pIn is the input file, which must be open for reading in binary mode.
+ * Reading starts at its current position.  The first block of input is
+ * read immediately to detect its compression format.
+ * 
+ * Parameters:
+ * 
+ *   pIn - the input file
+ */
+void source_open(FILE *pIn);
+
+/*
+ * Read raw input bytes, decompressed if necessary.
+ * 
+ * An input must be open, or a fault occurs.
+ * 
+ * Up to n bytes are read into the buffer at p.  The return value is
+ * less than n only when input is exhausted, in which case *per is set
+ * to ERR_OK at the end of input, or to the error that stopped reading.
+ * The errors are ERR_IOREAD for an I/O error, ERR_NOCODEC for
+ * compressed input in a format that was not enabled at build time, and
+ * ERR_BADCODEC for compressed input that is damaged or truncated.  All
+ * bytes decompressed before an error are returned first.  Once input is
+ * exhausted, further calls return zero with the same condition.
+ * 
+ * Parameters:
+ * 
+ *   p - the buffer to receive the bytes
+ * 
+ *   n - the number of bytes to read
+ * 
+ *   per - pointer to variable to receive the end condition
+ * 
+ * Return:
+ * 
+ *   the number of bytes read
+ */
+size_t source_read(unsigned char *p, size_t n, int *per);
+
+/*
+ * Close the open input.
+ * 
+ * The input file itself is not closed, and its position is left
+ * wherever reading got to, which may be beyond the last byte returned.
+ * Nothing happens if no input is open.
+ */
+void source_close(void);
+
+#endif
@@ -6,10 +6,346 @@
  * See the header for further information.
  */
 
+/*
+ * On POSIX systems, input that is a regular file is memory-mapped
+ * instead of being read block by block.  Define TOKEN_NO_MMAP to always
+ * use block reads.
+ */
+#if !defined(TOKEN_NO_MMAP) && \
+    (defined(__unix__) || (defined(__APPLE__) && defined(__MACH__)))
+#define TOKEN_MMAP
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+/*
+ * Large memory-mapped input is lexed in parallel chunks with POSIX
+ * threads.  Define TOKEN_NO_THREADS to always lex serially.
+ */
+#if defined(TOKEN_MMAP) && !defined(TOKEN_NO_THREADS)
+#define TOKEN_THREADS
+#endif
+
 #include "token.h"
+#include "scan.h"
+#include "source.h"
 #include <stdlib.h>
 #include <string.h>
 
+#ifdef TOKEN_MMAP
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#endif
+
+#ifdef TOKEN_THREADS
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+/*
+ * Constants
+ * =========
+ */
+
+/*
+ * The number of bytes read from the input file at a time.
+ */
+#define TOKEN_BLOCKSIZE (65536)
+
+/*
+ * Parallel lexing parameters.
+ * 
+ * Mapped input is only lexed in parallel if it has at least
+ * TOKEN_PARMIN raw bytes.  It must also be shorter than INT32_MAX
+ * bytes, so that it cannot have too many lines for a line number.
+ * 
+ * Each worker thread lexes a chunk of about TOKEN_CHUNKSIZE filtered
+ * bytes at a time.  At most TOKEN_MAXTHREAD chunks are lexed at once.
+ * 
+ * TOKEN_RECINIT is the initial capacity of the token record array of
+ * each chunk.
+ */
+#define TOKEN_PARMIN (INT64_C(4194304))
+#define TOKEN_CHUNKSIZE (INT64_C(1048576))
+#define TOKEN_MAXTHREAD (16)
+#define TOKEN_RECINIT (4096)
+
+/*
+ * Character classes of the lexer.
+ * 
+ * TOKEN_C_END is only used for the nul character, which is how
+ * token_readByteFinal() reports End Of File.  TOKEN_C_PRINT holds the
+ * printing characters that do not belong to any of the more specific
+ * classes, and TOKEN_C_OTHER holds everything that is neither printing
+ * nor whitespace.
+ */
+#define TOKEN_C_END     (0)   /* End Of File */
+#define TOKEN_C_SPACE   (1)   /* HT LF CR SP */
+#define TOKEN_C_ATOM    (2)   /* ( ) R r [ ] / $ @ { : } = ~ - < */
+#define TOKEN_C_PITCH   (3)   /* A-G a-g */
+#define TOKEN_C_ACC     (4)   /* x X s S n N h H t T */
+#define TOKEN_C_SUFFIX  (5)   /* ' , . */
+#define TOKEN_C_DIGIT   (6)   /* 0-9 */
+#define TOKEN_C_PARAM   (7)   /* \ ^ & + ` > % */
+#define TOKEN_C_KEY     (8)   /* * ! */
+#define TOKEN_C_SEMI    (9)   /* ; */
+#define TOKEN_C_PRINT  (10)   /* other printing characters */
+#define TOKEN_C_OTHER  (11)   /* everything else */
+
+#define TOKEN_CLASS_COUNT (12)
+
+/*
+ * States of the lexer.
+ * 
+ * TOKEN_S_START is the state before the first character of the token
+ * has been read.  The other states are entered after the first
+ * character of a non-atomic token:
+ * 
+ *   TOKEN_S_ACC - pitch letter and possibly accidentals read
+ *   TOKEN_S_SUFFIX - pitch with at least one register suffix read
+ *   TOKEN_S_RHYTHM - rhythm digit read
+ *   TOKEN_S_PARAM - parameter operation and possibly parameter read
+ *   TOKEN_S_KEY - key operation read
+ */
+#define TOKEN_S_START   (0)
+#define TOKEN_S_ACC     (1)
+#define TOKEN_S_SUFFIX  (2)
+#define TOKEN_S_RHYTHM  (3)
+#define TOKEN_S_PARAM   (4)
+#define TOKEN_S_KEY     (5)
+
+#define TOKEN_STATE_COUNT (6)
+
+/*
+ * Actions of the lexer.
+ * 
+ * A transition table entry that is zero or greater means the character
+ * is added to the token and the lexer moves to that state.  Otherwise,
+ * the entry is one of these actions:
+ * 
+ *   TOKEN_A_SKIP - ignore the character (whitespace before a token)
+ *   TOKEN_A_TAKE - add the character, and the token is complete
+ *   TOKEN_A_STOP - push the character back, and the token is complete
+ *   TOKEN_A_END - End Of File reached before any token character
+ *   TOKEN_A_BADCHAR - fail with ERR_BADCHAR
+ *   TOKEN_A_PARAMTK - fail with ERR_PARAMTK
+ *   TOKEN_A_KEYTOKEN - fail with ERR_KEYTOKEN
+ */
+#define TOKEN_A_SKIP     (-1)
+#define TOKEN_A_TAKE     (-2)
+#define TOKEN_A_STOP     (-3)
+#define TOKEN_A_END      (-4)
+#define TOKEN_A_BADCHAR  (-5)
+#define TOKEN_A_PARAMTK  (-6)
+#define TOKEN_A_KEYTOKEN (-7)
+
+/*
+ * Character class table, indexed by unsigned byte value.
+ * 
+ * This table is written by hand, sixteen characters per row, and must
+ * be kept in sync with the class definitions above whenever they
+ * change.
+ */
+static const unsigned char m_token_class[256] = {
+   0,11,11,11,11,11,11,11,11, 1, 1,11,11, 1,11,11,  /* 00 */
+  11,11,11,11,11,11,11,11,11,11,11,11,11,11,11,11,  /* 10 */
+   1, 8,10,10, 2, 7, 7, 5, 2, 2, 8, 7, 5, 2, 5, 2,  /* 20 */
+   6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 2, 9, 2, 2, 7,10,  /* 30 */
+   2, 3, 3, 3, 3, 3, 3, 3, 4,10,10,10,10,10, 4,10,  /* 40 */
+  10,10, 2, 4, 4,10,10,10, 4,10,10, 2, 7, 2, 7,10,  /* 50 */
+   7, 3, 3, 3, 3, 3, 3, 3, 4,10,10,10,10,10, 4,10,  /* 60 */
+  10,10, 2, 4, 4,10,10,10, 4,10,10, 2,10, 2, 2,11,  /* 70 */
+  11,11,11,11,11,11,11,11,11,11,11,11,11,11,11,11,  /* 80 */
+  11,11,11,11,11,11,11,11,11,11,11,11,11,11,11,11,  /* 90 */
+  11,11,11,11,11,11,11,11,11,11,11,11,11,11,11,11,  /* A0 */
+  11,11,11,11,11,11,11,11,11,11,11,11,11,11,11,11,  /* B0 */
+  11,11,11,11,11,11,11,11,11,11,11,11,11,11,11,11,  /* C0 */
+  11,11,11,11,11,11,11,11,11,11,11,11,11,11,11,11,  /* D0 */
+  11,11,11,11,11,11,11,11,11,11,11,11,11,11,11,11,  /* E0 */
+  11,11,11,11,11,11,11,11,11,11,11,11,11,11,11,11   /* F0 */
+};
+
+/*
+ * State transition table, indexed by state and then by character
+ * class.
+ */
+static const signed char m_token_trans
+    [TOKEN_STATE_COUNT][TOKEN_CLASS_COUNT] = {
+  
+  /* TOKEN_S_START */
+  { TOKEN_A_END,     TOKEN_A_SKIP,    TOKEN_A_TAKE,    TOKEN_S_ACC,
+    TOKEN_A_BADCHAR, TOKEN_A_BADCHAR, TOKEN_S_RHYTHM,  TOKEN_S_PARAM,
+    TOKEN_S_KEY,     TOKEN_A_BADCHAR, TOKEN_A_BADCHAR, TOKEN_A_BADCHAR },
+  
+  /* TOKEN_S_ACC */
+  { TOKEN_A_STOP,    TOKEN_A_STOP,    TOKEN_A_STOP,    TOKEN_A_STOP,
+    TOKEN_S_ACC,     TOKEN_S_SUFFIX,  TOKEN_A_STOP,    TOKEN_A_STOP,
+    TOKEN_A_STOP,    TOKEN_A_STOP,    TOKEN_A_STOP,    TOKEN_A_STOP },
+  
+  /* TOKEN_S_SUFFIX */
+  { TOKEN_A_STOP,    TOKEN_A_STOP,    TOKEN_A_STOP,    TOKEN_A_STOP,
+    TOKEN_A_STOP,    TOKEN_S_SUFFIX,  TOKEN_A_STOP,    TOKEN_A_STOP,
+    TOKEN_A_STOP,    TOKEN_A_STOP,    TOKEN_A_STOP,    TOKEN_A_STOP },
+  
+  /* TOKEN_S_RHYTHM */
+  { TOKEN_A_STOP,    TOKEN_A_STOP,    TOKEN_A_STOP,    TOKEN_A_STOP,
+    TOKEN_A_STOP,    TOKEN_A_TAKE,    TOKEN_A_STOP,    TOKEN_A_STOP,
+    TOKEN_A_STOP,    TOKEN_A_STOP,    TOKEN_A_STOP,    TOKEN_A_STOP },
+  
+  /* TOKEN_S_PARAM */
+  { TOKEN_A_PARAMTK, TOKEN_A_PARAMTK, TOKEN_S_PARAM,   TOKEN_S_PARAM,
+    TOKEN_S_PARAM,   TOKEN_S_PARAM,   TOKEN_S_PARAM,   TOKEN_S_PARAM,
+    TOKEN_S_PARAM,   TOKEN_A_TAKE,    TOKEN_S_PARAM,   TOKEN_A_PARAMTK },
+  
+  /* TOKEN_S_KEY */
+  { TOKEN_A_KEYTOKEN, TOKEN_A_KEYTOKEN, TOKEN_A_TAKE,  TOKEN_A_TAKE,
+    TOKEN_A_TAKE,     TOKEN_A_TAKE,     TOKEN_A_TAKE,  TOKEN_A_TAKE,
+    TOKEN_A_TAKE,     TOKEN_A_TAKE,     TOKEN_A_TAKE,  TOKEN_A_KEYTOKEN }
+};
+
+/*
+ * Starting value table, indexed by unsigned byte value.
+ * 
+ * This is the value of a token after its first character.  Pitch
+ * letters give their pitch in semitones relative to middle C, with
+ * uppercase letters an octave below lowercase, and rhythm digits give
+ * their quanta, where zero is a grace note.  Everything else is zero.
+ * The table is laid out like m_token_class.
+ */
+static const int16_t m_token_start[256] = {
+    0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  /* 00 */
+    0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  /* 10 */
+    0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  /* 20 */
+    0,  6, 12, 24, 48, 96,192,384, 32, 64,  0,  0,  0,  0,  0,  0,  /* 30 */
+    0, -3, -1,-12,-10, -8, -7, -5,  0,  0,  0,  0,  0,  0,  0,  0,  /* 40 */
+    0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  /* 50 */
+    0,  9, 11,  0,  2,  4,  5,  7,  0,  0,  0,  0,  0,  0,  0,  0,  /* 60 */
+    0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  /* 70 */
+    0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  /* 80 */
+    0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  /* 90 */
+    0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  /* A0 */
+    0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  /* B0 */
+    0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  /* C0 */
+    0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  /* D0 */
+    0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  /* E0 */
+    0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0   /* F0 */
+};
+
+/*
+ * Type declarations
+ * =================
+ */
+
+/*
+ * Decoder state of the token being lexed.
+ * 
+ * See token_decode() for how it is used.
+ */
+typedef struct {
+  
+  /*
+   * The value decoded so far, and ERR_OK or the first error found.
+   */
+  int32_t value;
+  int err;
+  
+  /*
+   * For a parameter operation, whether the parameter is negative and
+   * the number of digits in it so far.
+   */
+  int neg;
+  int32_t digits;
+  
+} TOKEN_DEC;
+
+/*
+ * Newline index entry for a block of filtered input.
+ */
+typedef struct {
+  
+  /*
+   * The offset of the first byte of the block within the filtered
+   * input.
+   */
+  int64_t start;
+  
+  /*
+   * The number of LFs in the filtered input before the block.
+   */
+  int64_t lines;
+  
+  /*
+   * Bit mask of the LFs within the block, in the format of scan_mask().
+   */
+  uint64_t mask[TOKEN_BLOCKSIZE / 64];
+  
+  /*
+   * The number of LFs in the block before each 1024-byte sub-block, so
+   * that a lookup only has to count the mask bits of one sub-block.
+   */
+  uint16_t sub[TOKEN_BLOCKSIZE / 1024];
+  
+} TOKEN_NLBLOCK;
+
+#ifdef TOKEN_THREADS
+
+/*
+ * Compact record of a token lexed from a chunk.
+ * 
+ * Only successfully read tokens are recorded.
+ */
+typedef struct {
+  int64_t offset;
+  int32_t len;
+  int32_t value;
+  int vstatus;
+} TOKEN_REC;
+
+/*
+ * A chunk of filtered input that is lexed in parallel with others.
+ */
+typedef struct {
+  
+  /*
+   * The range of the chunk within the filtered input buffer.
+   * 
+   * Unless the chunk is the last one, the byte before end is an LF, so
+   * that no token and no comment crosses the end of the chunk.
+   */
+  int64_t start;
+  int64_t end;
+  
+  /*
+   * Flag indicating that this chunk runs to the end of the filtered
+   * input, in which case lexing it ends with the EOF token or with the
+   * condition in m_token_endErr.
+   */
+  int last;
+  
+  /*
+   * The token records lexed from the chunk.
+   * 
+   * recCount is the number of records and recCap is the capacity of
+   * the dynamically allocated array.  recPos is the index of the next
+   * record to hand out.
+   */
+  TOKEN_REC *pRec;
+  int32_t recCount;
+  int32_t recCap;
+  int32_t recPos;
+  
+  /*
+   * ERR_OK if the chunk was lexed completely, else the error that
+   * stopped lexing, and the offset in the filtered input just past the
+   * last byte read before the error.
+   */
+  int err;
+  int64_t errOffs;
+  
+} TOKEN_CHUNK;
+
+#endif
+
 /*
  * Static data
  * ===========
@@ -20,6 +356,13 @@
  */
 static int m_token_init = 0;
 
+/*
+ * Flag indicating whether any token has been read yet.
+ * 
+ * Only valid if m_token_init is non-zero.
+ */
+static int m_token_started = 0;
+
 /*
  * Flag indicating whether about to read the first byte.
  * 
@@ -30,34 +373,162 @@ static int m_token_init = 0;
 static int m_token_first = 1;
 
 /*
- * The previous byte read, or zero if EOF, or -1 if no bytes read yet.
+ * The previous raw byte passed through the line break filter, or -1 if
+ * no bytes filtered yet or the previous byte completed a line break
+ * pair.
  * 
  * Only valid if m_token_init is non-zero.
  */
 static int m_token_prev = -1;
 
 /*
- * The line number counter.
+ * Pushback register.
  * 
  * Only valid if m_token_init is non-zero.
+ * 
+ * -1 if pushback register is empty.
  */
-static int32_t m_token_line = 1;
+static int m_token_pushback = -1;
 
 /*
- * Pushback register.
+ * The input block buffer.
+ * 
+ * Unless the input is memory-mapped, blocks of raw input are read into
+ * this buffer through the source module, which decompresses them if
+ * necessary, and then filtered in place by token_fill().
+ * 
+ * Only valid if m_token_init is non-zero.
+ */
+static unsigned char m_token_block[TOKEN_BLOCKSIZE];
+
+/*
+ * Flag indicating whether the input file is memory-mapped.
  * 
  * Only valid if m_token_init is non-zero.
+ */
+static int m_token_mapped = 0;
+
+/*
+ * The filtered input buffer.
  * 
- * -1 if pushback register is empty.
+ * m_token_pBuf points either to m_token_block or, if the input is
+ * memory-mapped, to the first byte of input within the mapping.  The
+ * first m_token_bufLen bytes hold filtered input, m_token_bufPos of
+ * which have already been consumed.
+ * 
+ * m_token_bufOffs is the offset within the filtered input of the first
+ * byte in the buffer.  It is always zero when the input is mapped,
+ * because then filtered input accumulates in place and the whole of it
+ * stays addressable.
+ * 
+ * Only valid if m_token_init is non-zero.
  */
-static int m_token_pushback = -1;
+static unsigned char *m_token_pBuf = NULL;
+static int64_t m_token_bufLen = 0;
+static int64_t m_token_bufPos = 0;
+static int64_t m_token_bufOffs = 0;
+
+/*
+ * The raw mapped input.
+ * 
+ * When the input is memory-mapped, m_token_rawLen is the total number
+ * of raw input bytes starting at m_token_pBuf, and m_token_rawPos is
+ * the number of those raw bytes that have already been filtered.
+ * 
+ * Only valid if m_token_init is non-zero and m_token_mapped is set.
+ */
+static int64_t m_token_rawLen = 0;
+static int64_t m_token_rawPos = 0;
+
+/*
+ * Flag indicating whether the input file has been exhausted.
+ * 
+ * When this flag is set, no more blocks will be read, and once the
+ * filtered bytes remaining in the block buffer have been consumed, the
+ * condition in m_token_endErr is reported.
+ * 
+ * Only valid if m_token_init is non-zero.
+ */
+static int m_token_done = 0;
+
+/*
+ * The condition reported after the last filtered byte.
+ * 
+ * ERR_OK means End Of File (EOF).  Any other value is the error code
+ * that stopped filtering, such as ERR_IOREAD or ERR_NULCHAR.
+ * 
+ * Only valid if m_token_init is non-zero.
+ */
+static int m_token_endErr = ERR_OK;
+
+/*
+ * The newline index of block-read input.
+ * 
+ * Unless the input is memory-mapped, each filtered block gets an entry
+ * in this dynamically allocated array when it is read.  Memory-mapped
+ * input needs no index, because all of the filtered input stays
+ * addressable and its LFs can be counted directly.  See token_lineAt().
+ * 
+ * m_token_nlCount is the number of entries and m_token_nlCap is the
+ * capacity of the array.
+ * 
+ * Only valid if m_token_init is non-zero.
+ */
+static TOKEN_NLBLOCK *m_token_pNl = NULL;
+static int32_t m_token_nlCount = 0;
+static int32_t m_token_nlCap = 0;
+
+/*
+ * The result of the last line lookup for memory-mapped input, which is
+ * the number of LFs in the filtered input before offset
+ * m_token_lastOffs.
+ * 
+ * Lookups at increasing offsets only count the LFs since the last one.
+ * 
+ * Only valid if m_token_init is non-zero.
+ */
+static int64_t m_token_lastOffs = 0;
+static int64_t m_token_lastLines = 0;
+
+#ifdef TOKEN_THREADS
 
 /*
- * The input file.
+ * Flag indicating whether the input is lexed in parallel chunks.
+ * 
+ * When set, tokens are handed out from the chunk records instead of
+ * being lexed by token_lex().
  * 
  * Only valid if m_token_init is non-zero.
  */
-static FILE *m_token_pIn = NULL;
+static int m_token_par = 0;
+
+/*
+ * The number of chunks lexed at once in parallel mode.
+ * 
+ * Only valid if m_token_par is set.
+ */
+static int m_token_threads = 0;
+
+/*
+ * The chunks of the current round in parallel mode.
+ * 
+ * m_token_chunkCount is the number of chunks in the current round and
+ * m_token_chunkCur is the index of the chunk whose records are being
+ * handed out.
+ * 
+ * Once the EOF token or an error has been handed out, it is stored in
+ * m_token_parLast and m_token_parEnd is set, so that it is repeated on
+ * any further reads.
+ * 
+ * Only valid if m_token_par is set.
+ */
+static TOKEN_CHUNK m_token_chunk[TOKEN_MAXTHREAD];
+static int m_token_chunkCount = 0;
+static int m_token_chunkCur = 0;
+static int m_token_parEnd = 0;
+static TOKEN m_token_parLast;
+
+#endif
 
 /*
  * Local functions
@@ -65,193 +536,164 @@ static FILE *m_token_pIn = NULL;
  */
 
 /* Prototypes */
+static int token_map(FILE *pIn);
+static void token_filter(int64_t i, int64_t rend);
+static void token_fill(void);
 static int token_readByteFilter(int *per);
 static int token_readByteFinal(int *per);
 static void token_pushback(int c);
+static void token_skip(void);
+static void token_decode(TOKEN_DEC *pd, int state, int c, int i);
+static void token_decodeEnd(TOKEN_DEC *pd, int state);
+static int token_scan(
+    const unsigned char * p,
+    const unsigned char * pEnd,
+          TOKEN_DEC     * pd,
+          int           * pstate);
+static int token_lex(TOKEN *ptk);
+static void token_index(void);
+static int64_t token_lineAt(int64_t offs);
 
-static int token_isWhitespace(int c);
-static int token_isPrinting(int c);
-static int token_isSuffix(int c);
-static int token_isAccidental(int c);
+#ifdef TOKEN_THREADS
+static int token_threads(void);
+static int64_t token_cut(int64_t target);
+static void token_lexChunk(TOKEN_CHUNK *pc);
+static void *token_worker(void *pParam);
+static void token_round(void);
+static int token_parNext(TOKEN *ptk);
+#endif
 
-static int token_isAtomic(int c);
-static int token_isPitchString(int c);
-static int token_isRhythmString(int c);
-static int token_isParamOp(int c);
-static int token_isKeyOp(int c);
+static int token_next(TOKEN *ptk);
 
 /*
- * Read a byte from input, with some basic filters.
- * 
- * The module must be initialized or a fault occurs.
- * 
- * This function uses the m_token_first flag to determine whether the
- * very first byte is being read.  If the very first byte is 0xEF, then
- * there must be two more bytes and they must be 0xBB and 0xBF, forming
- * a UTF-8 Byte Order Mark (BOM), which is then discarded and ignored.
- * If the first byte is 0xEF but it isn't part of a UTF-8 BOM, then
- * there is an invalid character error.
+ * Attempt to memory-map the input file.
  * 
- * This function also makes sure that no literal nul (0x0) characters
- * are present in input, causing an invalid character error in those
- * cases.
+ * This only succeeds if memory mapping is supported on this platform,
+ * pIn is a regular file, there is at least one byte between the
+ * current file position and the end of the file, and the input is not
+ * compressed.  The mapping is private and writable, so that
+ * token_fill() can filter it in place.  Copy-on-write means that pages
+ * the filter leaves untouched, which for LF-only input is all of them,
+ * are never copied.
  * 
- * This function keeps track of m_token_prev as a buffer for the
- * previous character read.  This is used to convert all line breaks to
- * LF-only style.
+ * The mapping is kept for the rest of the process, so that token spans
+ * remain valid.  The file must not be truncated while it is mapped.
  * 
- * The filter therefore removes an optional UTF-8 BOM from the beginning
- * of input, makes sure nul is not present in the input data, and
- * converts line breaks to LF-only.
- * 
- * per points to a variable to receive the error status on error.  End
- * Of File (EOF) is represented as a successful read of a terminating
- * nul character.
+ * On success, the buffer variables are set up for mapped input.
  * 
  * Parameters:
  * 
- *   per - pointer to error variable
+ *   pIn - the input file
  * 
  * Return:
  * 
- *   the next filtered byte read (1-255), or zero if EOF, or -1 if error
+ *   non-zero if input was mapped, zero if block reads must be used
  */
-static int token_readByteFilter(int *per) {
+static int token_map(FILE *pIn) {
   
-  int status = 1;
-  int c = 0;
+  int status = 0;
   
-  /* Check state */
-  if (!m_token_init) {
-    abort();
-  }
+#ifdef TOKEN_MMAP
+  int fd = -1;
+  off_t start = 0;
+  struct stat st;
+  void *pm = NULL;
+  
+  /* Initialize structure */
+  memset(&st, 0, sizeof(struct stat));
   
   /* Check parameter */
-  if (per == NULL) {
+  if (pIn == NULL) {
     abort();
   }
   
-  /* Read a byte */
-  c = getc(m_token_pIn);
-  
-  /* If we read terminating nul, error */
-  if (c == 0) {
-    *per = ERR_NULCHAR;
-    status = 0;
-  }
-  
-  /* Check for I/O error and EOF */
-  if (status) {
-    if (c == EOF) {
-      if (feof(m_token_pIn)) {
-        /* End Of File (EOF) */
-        c = 0;
-      
-      } else {
-        /* I/O error */
-        *per = ERR_IOREAD;
-        status = 0;
+  /* Only map regular files that have data beyond the current
+   * position */
+  fd = fileno(pIn);
+  if (fd >= 0) {
+    start = ftello(pIn);
+    if ((start >= 0) && (fstat(fd, &st) == 0)) {
+      if (S_ISREG(st.st_mode) && (st.st_size > start) &&
+          ((uint64_t) st.st_size <= (uint64_t) SIZE_MAX)) {
+        status = 1;
       }
     }
   }
   
-  /* Special handling if very first byte */
-  if (status && m_token_first) {
-    
-    /* Check if UTF-8 BOM */
-    if (c == 0xef) {
-      /* UTF-8 BOM, so make sure we read the rest of it */
-      if (getc(m_token_pIn) != 0xbb) {
-        *per = ERR_BADCHAR;
-        status = 0;
-      }
-      if (status) {
-        if (getc(m_token_pIn) != 0xbf) {
-          *per = ERR_BADCHAR;
-          status = 0;
-        }
-      }
-      
-      /* Clear first character flag */
-      m_token_first = 0;
-      
-      /* If we read the BOM successfully, recursively call this function
-       * to read whatever comes after the BOM */
-      if (status) {
-        return token_readByteFilter(per);
-      }
-      
-    } else {
-      /* No UTF-8 BOM, so just clear flag and continue on */
-      m_token_first = 0;
+  /* Map the whole file */
+  if (status) {
+    pm = mmap(NULL, (size_t) st.st_size,
+              PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if (pm == MAP_FAILED) {
+      status = 0;
     }
   }
   
-  /* If the current character is an LF and the previous character was a
-   * CR, or the current character is a CR and the previous character was
-   * an LF, then clear the previous character register and recursively
-   * call the function again to read whatever is after the line break
-   * pair */
-  if (status && (
-        ((c == ASCII_LF) && (m_token_prev == ASCII_CR)) ||
-        ((c == ASCII_CR) && (m_token_prev == ASCII_LF))
-      )) {
-    m_token_prev = -1;
-    return token_readByteFilter(per);
-  }
-  
-  /* Update previous character register */
+  /* Compressed input must be read through the source module instead */
   if (status) {
-    m_token_prev = c;
+    if (source_detect(((unsigned char *) pm) + start,
+                      (size_t) (st.st_size - start)) != SOURCE_FMT_PLAIN) {
+      munmap(pm, (size_t) st.st_size);
+      status = 0;
+    }
   }
   
-  /* Convert CR to LF */
-  if (status && (c == ASCII_CR)) {
-    c = ASCII_LF;
+  /* Set up the buffer on the mapping */
+  if (status) {
+    posix_madvise(pm, (size_t) st.st_size, POSIX_MADV_SEQUENTIAL);
+    
+    m_token_pBuf = ((unsigned char *) pm) + start;
+    m_token_rawLen = (int64_t) (st.st_size - start);
+    m_token_rawPos = 0;
   }
-  
-  /* Set character to -1 if error */
-  if (!status) {
-    c = -1;
+#else
+  /* Check parameter */
+  if (pIn == NULL) {
+    abort();
   }
+#endif
   
-  /* Return character, or zero for EOF, or -1 for error */
-  return c;
+  /* Return status */
+  return status;
 }
 
 /*
- * Read a byte from input, with all filters applied.
- * 
- * The module must be initialized or a fault occurs.
- * 
- * This is a wrapper around token_readByteFilter(), so it has the BOM,
- * nul, and line break filtering functionality of that function.
- * 
- * This function will also update the line counter appropriately,
- * incrementing it on each filtered LF.
- * 
- * Furthermore, if this function reads a "#" character, it will discard
- * that character and all characters up to but excluding the next
- * filtered LF or the End Of File (EOF), whichever comes first.  This
- * has the effect of removing comments from input.
- * 
- * Finally, if the pushback register is not empty, this function simply
- * returns that register content and clears the register.
- * 
- * per points to a variable to receive the error status on error.  End
- * Of File (EOF) is represented as a successful read of a terminating
- * nul character.
+ * Filter raw input bytes in place, appending them to the filtered
+ * input buffer.
+ * 
+ * The raw bytes are at indices [i, rend) in m_token_pBuf, and filtered
+ * bytes are written starting at index m_token_bufLen, which must not be
+ * greater than i.  Since the filter never produces more bytes than it
+ * consumes, the write index never passes the read index.  Bytes are
+ * only written when filtering changes them, so that unmodified pages of
+ * a memory mapping are not copied.
+ * 
+ * The filter removes an optional UTF-8 Byte Order Mark (BOM) from the
+ * beginning of input, makes sure nul is not present in the input data,
+ * and converts line breaks to LF-only.  m_token_first and m_token_prev
+ * carry the filter state from one call to the next, so line break
+ * pairs that straddle two calls are handled correctly.
+ * 
+ * If the very first byte of input is 0xEF, then there must be two more
+ * bytes and they must be 0xBB and 0xBF, forming a UTF-8 BOM, which is
+ * then discarded and ignored.  If the first byte is 0xEF but it isn't
+ * part of a UTF-8 BOM, then there is an invalid character error.
+ * 
+ * Filtering stops at the first nul byte.  In that case and when the BOM
+ * is invalid, m_token_done is set and m_token_endErr records the error,
+ * so that it is reported only once all filtered bytes before it have
+ * been consumed.  Errors therefore surface at exactly the same point in
+ * input as they would if bytes were read one at a time.
  * 
  * Parameters:
  * 
- *   per - pointer to error variable
- * 
- * Return:
+ *   i - index of the first raw byte
  * 
- *   the next filtered byte read (1-255), or zero if EOF, or -1 if error
+ *   rend - index one beyond the last raw byte
  */
-static int token_readByteFinal(int *per) {
+static void token_filter(int64_t i, int64_t rend) {
   
+  int64_t j = 0;
   int c = 0;
   
   /* Check state */
@@ -259,38 +701,267 @@ static int token_readByteFinal(int *per) {
     abort();
   }
   
-  /* Check parameter */
-  if (per == NULL) {
+  /* Check parameters */
+  if ((m_token_bufLen > i) || (i > rend)) {
     abort();
   }
   
-  /* If pushback value, just return that */
-  if (m_token_pushback >= 0) {
-    c = m_token_pushback;
-    m_token_pushback = -1;
-    return c;
+  /* Special handling if very first byte */
+  if (m_token_first && (i < rend)) {
+    
+    /* Clear first byte flag */
+    m_token_first = 0;
+    
+    /* Check if UTF-8 BOM */
+    if (m_token_pBuf[i] == 0xef) {
+      /* UTF-8 BOM, so make sure we have the rest of it */
+      if ((rend - i < 3) ||
+          (m_token_pBuf[i + 1] != 0xbb) ||
+          (m_token_pBuf[i + 2] != 0xbf)) {
+        m_token_done = 1;
+        m_token_endErr = ERR_BADCHAR;
+        rend = i;
+        
+      } else {
+        /* Skip over the BOM */
+        i += 3;
+      }
+    }
   }
   
-  /* Call through to filter function */
-  c = token_readByteFilter(per);
-  
-  /* If we read a number sign, then discard everything until we get an
-   * error, EOF, or an LF */
-  if (c == ASCII_NUMSIGN) {
-    for(c = token_readByteFilter(per);
-        (c > 0) && (c != ASCII_LF);
-        c = token_readByteFilter(per));
-  }
+  /* Filter the bytes */
+  for(j = m_token_bufLen; i < rend; i++) {
+    
+    /* Get current byte */
+    c = m_token_pBuf[i];
+    
+    /* If we read nul, stop filtering with an error */
+    if (c == 0) {
+      m_token_done = 1;
+      m_token_endErr = ERR_NULCHAR;
+      break;
+    }
+    
+    /* If the current character is an LF and the previous character was
+     * a CR, or the current character is a CR and the previous character
+     * was an LF, then clear the previous character register and drop
+     * the second character of the line break pair */
+    if (((c == ASCII_LF) && (m_token_prev == ASCII_CR)) ||
+        ((c == ASCII_CR) && (m_token_prev == ASCII_LF))) {
+      m_token_prev = -1;
+      continue;
+    }
+    
+    /* Update previous character register */
+    m_token_prev = c;
+    
+    /* Convert CR to LF and store the filtered byte if changed */
+    if (c == ASCII_CR) {
+      m_token_pBuf[j] = (unsigned char) ASCII_LF;
+    } else if (j != i) {
+      m_token_pBuf[j] = (unsigned char) c;
+    }
+    j++;
+  }
+  
+  /* Update the filtered length */
+  m_token_bufLen = j;
+}
+
+/*
+ * Extend the filtered input buffer with the next block of input.
+ * 
+ * The module must be initialized, or a fault occurs.  Unless the input
+ * is memory-mapped, all bytes currently in the buffer must have been
+ * consumed, or a fault occurs.  Nothing happens if the input file has
+ * already been exhausted.
+ * 
+ * If the input is memory-mapped, the next block of the mapping is
+ * filtered in place and appended to the bytes already filtered.
+ * Otherwise, the next block is read into m_token_block, replacing its
+ * contents.  Either way, the filter runs over the whole block at once;
+ * see token_filter() for details.
+ * 
+ * Input is exhausted at End Of File (EOF), at a read error reported by
+ * the source module, and at the first error detected by the filter.
+ * In all these cases, m_token_done is set and m_token_endErr records
+ * the condition.
+ */
+static void token_fill(void) {
   
-  /* If we read an LF, update line count, watching for overflow */
-  if (c == ASCII_LF) {
-    if (m_token_line < INT32_MAX) {
-      m_token_line++;
+  size_t rlen = 0;
+  int64_t rend = 0;
+  int err = ERR_OK;
+  
+  /* Check state */
+  if (!m_token_init) {
+    abort();
+  }
+  if ((!m_token_mapped) && (m_token_bufPos < m_token_bufLen)) {
+    abort();
+  }
+  
+  /* Only proceed if input not exhausted */
+  if (!m_token_done) {
+    
+    if (m_token_mapped) {
+      /* Filter the next block of the mapping */
+      rend = m_token_rawLen;
+      if (rend - m_token_rawPos > TOKEN_BLOCKSIZE) {
+        rend = m_token_rawPos + TOKEN_BLOCKSIZE;
+      } else {
+        m_token_done = 1;
+        m_token_endErr = ERR_OK;
+      }
+      
+      token_filter(m_token_rawPos, rend);
+      m_token_rawPos = rend;
+      
     } else {
-      *per = ERR_OVERLINE;
-      c = -1;
+      /* Discard the consumed block */
+      m_token_bufOffs += m_token_bufLen;
+      m_token_bufLen = 0;
+      m_token_bufPos = 0;
+      
+      /* Read a raw block */
+      rlen = source_read(m_token_block, TOKEN_BLOCKSIZE, &err);
+      
+      /* A short read means we reached EOF or an error */
+      if (rlen < TOKEN_BLOCKSIZE) {
+        m_token_done = 1;
+        m_token_endErr = err;
+      }
+      
+      /* Filter the block */
+      token_filter(0, (int64_t) rlen);
+      
+      /* Add the block to the newline index */
+      token_index();
     }
   }
+}
+
+/*
+ * Read a byte from input, with some basic filters.
+ * 
+ * The module must be initialized or a fault occurs.
+ * 
+ * Bytes are taken from the filtered input buffer, which is extended
+ * with token_fill() whenever it runs empty.  See token_filter() for the
+ * filters that are applied.  The filter therefore removes an optional
+ * UTF-8 BOM from the beginning of input, makes sure nul is not present
+ * in the input data, and converts line breaks to LF-only.
+ * 
+ * per points to a variable to receive the error status on error.  End
+ * Of File (EOF) is represented as a successful read of a terminating
+ * nul character.
+ * 
+ * Parameters:
+ * 
+ *   per - pointer to error variable
+ * 
+ * Return:
+ * 
+ *   the next filtered byte read (1-255), or zero if EOF, or -1 if error
+ */
+static int token_readByteFilter(int *per) {
+  
+  int c = 0;
+  
+  /* Check state */
+  if (!m_token_init) {
+    abort();
+  }
+  
+  /* Check parameter */
+  if (per == NULL) {
+    abort();
+  }
+  
+  /* Refill the block buffer if necessary; a block can filter down to
+   * nothing, so keep going until we have a byte or input is done */
+  while ((m_token_bufPos >= m_token_bufLen) && (!m_token_done)) {
+    token_fill();
+  }
+  
+  /* Return the next byte, or the final condition */
+  if (m_token_bufPos < m_token_bufLen) {
+    c = m_token_pBuf[m_token_bufPos];
+    m_token_bufPos++;
+    
+  } else if (m_token_endErr == ERR_OK) {
+    /* End Of File (EOF) */
+    c = 0;
+    
+  } else {
+    /* Error */
+    *per = m_token_endErr;
+    c = -1;
+  }
+  
+  /* Return character, or zero for EOF, or -1 for error */
+  return c;
+}
+
+/*
+ * Read a byte from input, with all filters applied.
+ * 
+ * The module must be initialized or a fault occurs.
+ * 
+ * This is a wrapper around token_readByteFilter(), so it has the BOM,
+ * nul, and line break filtering functionality of that function.
+ * 
+ * Furthermore, if this function reads a "#" character, it will discard
+ * that character and all characters up to but excluding the next
+ * filtered LF or the End Of File (EOF), whichever comes first.  This
+ * has the effect of removing comments from input.
+ * 
+ * Finally, if the pushback register is not empty, this function simply
+ * returns that register content and clears the register.
+ * 
+ * per points to a variable to receive the error status on error.  End
+ * Of File (EOF) is represented as a successful read of a terminating
+ * nul character.
+ * 
+ * Parameters:
+ * 
+ *   per - pointer to error variable
+ * 
+ * Return:
+ * 
+ *   the next filtered byte read (1-255), or zero if EOF, or -1 if error
+ */
+static int token_readByteFinal(int *per) {
+  
+  int c = 0;
+  
+  /* Check state */
+  if (!m_token_init) {
+    abort();
+  }
+  
+  /* Check parameter */
+  if (per == NULL) {
+    abort();
+  }
+  
+  /* If pushback value, just return that */
+  if (m_token_pushback >= 0) {
+    c = m_token_pushback;
+    m_token_pushback = -1;
+    return c;
+  }
+  
+  /* Call through to filter function */
+  c = token_readByteFilter(per);
+  
+  /* If we read a number sign, then discard everything until we get an
+   * error, EOF, or an LF */
+  if (c == ASCII_NUMSIGN) {
+    for(c = token_readByteFilter(per);
+        (c > 0) && (c != ASCII_LF);
+        c = token_readByteFilter(per));
+  }
   
   /* Return c */
   return c;
@@ -323,224 +994,1240 @@ static void token_pushback(int c) {
 }
 
 /*
- * Determine whether the given character qualifies as whitespace.
+ * Skip whitespace and comments in bulk.
+ * 
+ * The module must be initialized and the pushback register must be
+ * empty, or a fault occurs.
+ * 
+ * This works directly on the filtered input buffer with the scan
+ * module kernels, which are much faster than going through
+ * token_readByteFinal() one byte at a time.  A comment is skipped up to
+ * but excluding its terminating LF, which is then skipped as
+ * whitespace.
+ * 
+ * The function stops in front of the first byte that is neither
+ * whitespace nor part of a comment, or when the buffer is empty and the
+ * input is exhausted.  token_readByteFinal() then carries on from
+ * exactly where this function left off, so the result is the same as
+ * if no bytes had been skipped in bulk.
+ */
+static void token_skip(void) {
+  
+  const unsigned char *p = NULL;
+  const unsigned char *pEnd = NULL;
+  int64_t lines = 0;
+  int comment = 0;
+  int done = 0;
+  
+  /* Check state */
+  if ((!m_token_init) || (m_token_pushback >= 0)) {
+    abort();
+  }
+  
+  /* The gap between tokens is usually a single space or nothing at
+   * all, so handle those directly rather than starting up the scan
+   * kernel for them */
+  if (m_token_bufPos < m_token_bufLen) {
+    p = m_token_pBuf + m_token_bufPos;
+    pEnd = m_token_pBuf + m_token_bufLen;
+    if ((p[0] == ASCII_SP) && (p + 1 < pEnd)) {
+      p++;
+    }
+    if ((m_token_class[*p] != TOKEN_C_SPACE) && (*p != ASCII_NUMSIGN)) {
+      m_token_bufPos = (int64_t) (p - m_token_pBuf);
+      done = 1;
+    }
+  }
+  
+  /* Otherwise, keep skipping until we find something else */
+  while (!done) {
+    
+    /* Refill the buffer if necessary, leaving if input exhausted */
+    if (m_token_bufPos >= m_token_bufLen) {
+      if (m_token_done) {
+        break;
+      }
+      token_fill();
+      continue;
+    }
+    
+    /* Get the unconsumed part of the buffer */
+    p = m_token_pBuf + m_token_bufPos;
+    pEnd = m_token_pBuf + m_token_bufLen;
+    
+    if (comment) {
+      /* Skip the rest of the comment */
+      p = scan_line(p, pEnd);
+      if (p < pEnd) {
+        comment = 0;
+      }
+      
+    } else {
+      /* Skip whitespace; line feeds are counted by the kernel, but
+       * lines are only worked out on demand by token_lineAt() */
+      p = scan_space(p, pEnd, &lines);
+      
+      /* If we stopped on a comment, skip the number sign; otherwise, if
+       * we stopped on something else, we are done */
+      if (p < pEnd) {
+        if (*p == ASCII_NUMSIGN) {
+          comment = 1;
+          p++;
+        } else {
+          m_token_bufPos = (int64_t) (p - m_token_pBuf);
+          break;
+        }
+      }
+    }
+    
+    /* Update position */
+    m_token_bufPos = (int64_t) (p - m_token_pBuf);
+  }
+}
+
+/*
+ * Decode a character that the lexer added to a token after its first.
+ * 
+ * pd is the decoder state.  Before the first character of each token,
+ * it must be cleared to zero, and the value then set from
+ * m_token_start for the first character.  state is the lexer state that
+ * the character was read in, which must not be TOKEN_S_START, c is the
+ * character, and i is its index within the token.
+ * 
+ * The value of the token is worked out a character at a time, in the
+ * same pass as the token is recognized, by the same rules the entity
+ * module used to apply to the finished text of pitches, durations, and
+ * operations.  The lexer only adds characters of the right classes in
+ * each state, so only the finer distinctions within a class need
+ * checking here.  Once an error is found, the rest of the token is
+ * ignored, so the first error is the one that is kept, as it would be
+ * when parsing the finished token.
+ * 
+ * Pitches are too short to overflow before they are complete, and they
+ * are only range-checked at the end by token_decodeEnd().
  * 
  * Parameters:
  * 
- *   c - the character to check
+ *   pd - the decoder state
+ * 
+ *   state - the lexer state the character was read in
+ * 
+ *   c - the character
+ * 
+ *   i - the index of the character within the token
+ */
+static void token_decode(TOKEN_DEC *pd, int state, int c, int i) {
+  
+  int d = 0;
+  
+  /* Ignore the rest of the token after an error */
+  if (pd->err != ERR_OK) {
+    return;
+  }
+  
+  switch (state) {
+    
+    case TOKEN_S_ACC:
+    case TOKEN_S_SUFFIX:
+      /* Accidental or register suffix of a pitch */
+      switch (c) {
+        case ASCII_X_LOWER:
+        case ASCII_X_UPPER:
+          /* Double-sharp */
+          pd->value += 2;
+          break;
+        
+        case ASCII_S_LOWER:
+        case ASCII_S_UPPER:
+          /* Sharp */
+          pd->value++;
+          break;
+        
+        case ASCII_N_LOWER:
+        case ASCII_N_UPPER:
+          /* Natural -- do nothing */
+          break;
+        
+        case ASCII_H_LOWER:
+        case ASCII_H_UPPER:
+          /* Flat */
+          pd->value--;
+          break;
+        
+        case ASCII_T_LOWER:
+        case ASCII_T_UPPER:
+          /* Double-flat */
+          pd->value -= 2;
+          break;
+        
+        case ASCII_APOS:
+          /* Up one octave */
+          pd->value += 12;
+          break;
+        
+        case ASCII_COMMA:
+          /* Down one octave */
+          pd->value -= 12;
+          break;
+        
+        default:
+          /* Unrecognized modifier */
+          pd->err = ERR_BADPITCH;
+      }
+      break;
+    
+    case TOKEN_S_RHYTHM:
+      /* Duration suffix, which a grace note may not have */
+      if (pd->value == 0) {
+        pd->err = ERR_BADDUR;
+      } else if (c == ASCII_APOS) {
+        pd->value *= 2;
+      } else if (c == ASCII_PERIOD) {
+        pd->value = pd->value + (pd->value / 2);
+      } else {
+        pd->value /= 2;
+      }
+      break;
+    
+    case TOKEN_S_PARAM:
+      /* Parameter up to the final semicolon, which may have a sign
+       * right after the operation character, and which must have at
+       * least one digit */
+      if (c == ASCII_SEMICOL) {
+        if (pd->digits < 1) {
+          pd->err = ERR_BADOP;
+        } else if (pd->neg) {
+          pd->value = -(pd->value);
+        }
+        
+      } else if ((i == 1) &&
+                  ((c == ASCII_PLUS) || (c == ASCII_HYPHEN))) {
+        if (c == ASCII_HYPHEN) {
+          pd->neg = 1;
+        }
+        
+      } else if ((c >= ASCII_ZERO) && (c <= ASCII_NINE)) {
+        d = c - ASCII_ZERO;
+        if ((pd->value <= INT32_MAX / 10) &&
+            (pd->value * 10 <= INT32_MAX - d)) {
+          pd->value = (pd->value * 10) + ((int32_t) d);
+          (pd->digits)++;
+        } else {
+          pd->err = ERR_BADOP;  /* overflow */
+        }
+        
+      } else {
+        pd->err = ERR_BADOP;
+      }
+      break;
+    
+    case TOKEN_S_KEY:
+      /* Articulation key */
+      if ((c >= ASCII_ZERO) && (c <= ASCII_NINE)) {
+        /* 0 through 9 */
+        pd->value = (int32_t) (c - ASCII_ZERO);
+        
+      } else if ((c >= ASCII_A_UPPER) && (c <= ASCII_Z_UPPER)) {
+        /* A through Z */
+        pd->value = (int32_t) ((c - ASCII_A_UPPER) + 10);
+        
+      } else if ((c >= ASCII_A_LOWER) && (c <= ASCII_Z_LOWER)) {
+        /* a through z */
+        pd->value = (int32_t) ((c - ASCII_A_LOWER) + 36);
+        
+      } else {
+        /* Invalid articulation key */
+        pd->err = ERR_BADOP;
+      }
+      break;
+    
+    default:
+      abort();  /* unrecognized state */
+  }
+}
+
+/*
+ * Finish decoding a complete token.
+ * 
+ * pd is the decoder state after the last character of the token, and
+ * state is the lexer state the token ended in.  A pitch is checked
+ * against the range of NMF pitches.  If there was an error, the value
+ * is cleared.
+ * 
+ * Parameters:
+ * 
+ *   pd - the decoder state
+ * 
+ *   state - the final lexer state of the token
+ */
+static void token_decodeEnd(TOKEN_DEC *pd, int state) {
+  
+  /* Range-check pitches */
+  if ((pd->err == ERR_OK) &&
+      ((state == TOKEN_S_ACC) || (state == TOKEN_S_SUFFIX))) {
+    if ((pd->value < NMF_MINPITCH) || (pd->value > NMF_MAXPITCH)) {
+      pd->err = ERR_PITCHR;
+    }
+  }
+  
+  /* Failed tokens have no value */
+  if (pd->err != ERR_OK) {
+    pd->value = 0;
+  }
+}
+
+/*
+ * Lex and decode a whole token straight from filtered input.
+ * 
+ * This is the fast path of the lexer.  p points to the first character
+ * of the token in the filtered input buffer, which must not be
+ * whitespace, and pEnd points just past the last filtered byte that is
+ * available.  The token is recognized with the same transition table
+ * as the character-at-a-time lexer and decoded with token_decode() in
+ * the same pass over its characters, without going through
+ * token_readByteFinal() for each of them.
+ * 
+ * Only tokens that are complete before pEnd, that contain no comment,
+ * and that lex without error are handled here.  For anything else,
+ * zero is returned and *pd and *pstate are left alone, and the caller
+ * must lex the token a character at a time instead, which handles
+ * every case.
+ * 
+ * On success, *pd is the decoder state of the token, which still has
+ * to be finished with token_decodeEnd(), and *pstate is the lexer state
+ * the token ended in.  The character after the token, if it was looked
+ * at, is not part of the token and has not been consumed.
+ * 
+ * Parameters:
+ * 
+ *   p - the first character of the token
+ * 
+ *   pEnd - the end of the available input
+ * 
+ *   pd - the decoder state to fill in
+ * 
+ *   pstate - pointer to variable to receive the final lexer state
  * 
  * Return:
  * 
- *   non-zero if whitespace, zero if not
+ *   the number of characters in the token, or zero if the token must be
+ *   lexed a character at a time
  */
-static int token_isWhitespace(int c) {
+static int token_scan(
+    const unsigned char * p,
+    const unsigned char * pEnd,
+          TOKEN_DEC     * pd,
+          int           * pstate) {
   
+  TOKEN_DEC dec;
+  int count = 0;
+  int state = 0;
+  int act = 0;
+  int c = 0;
   int result = 0;
   
-  if ((c == ASCII_SP) || (c == ASCII_HT) ||
-      (c == ASCII_LF) || (c == ASCII_CR)) {
-    result = 1;
+  /* Reset the decoder */
+  memset(&dec, 0, sizeof(TOKEN_DEC));
+  
+  /* Run the lexer until the token is complete, giving up at the end of
+   * the available input, at a comment, or at anything that is not part
+   * of a valid token */
+  state = TOKEN_S_START;
+  while ((result < 1) && (p < pEnd)) {
+    
+    /* Get the next character, which must not start a comment */
+    c = *p;
+    if (c == ASCII_NUMSIGN) {
+      break;
+    }
+    
+    /* Look up the action for this state and character */
+    act = (int) m_token_trans[state][m_token_class[c]];
+    
+    /* If the action takes the character, decode it, giving up if the
+     * token is too long */
+    if ((act >= 0) || (act == TOKEN_A_TAKE)) {
+      if (count >= TOKEN_MAXCHAR - 1) {
+        break;
+      }
+      
+      if (state == TOKEN_S_START) {
+        dec.value = (int32_t) m_token_start[c];
+      } else {
+        token_decode(&dec, state, c, count);
+      }
+      count++;
+      p++;
+    }
+    
+    /* Perform the rest of the action */
+    if (act >= 0) {
+      state = act;
+    } else if ((act == TOKEN_A_TAKE) || (act == TOKEN_A_STOP)) {
+      result = count;
+    } else {
+      break;
+    }
   }
   
+  /* Return the decoder and final state if successful */
+  if (result > 0) {
+    memcpy(pd, &dec, sizeof(TOKEN_DEC));
+    *pstate = state;
+  }
+  
+  /* Return result */
   return result;
 }
 
 /*
- * Determine whether a given character is a printing character.
+ * Read the next token.
  * 
- * Whitespace characters are never printing characters.
+ * This is the implementation of token_read(), without the checks of
+ * module state and parameters, so that token_readBatch() only has to
+ * check them once per batch.
+ * 
+ * Every field of the structure is written, except that the copy of
+ * the token characters is left alone for non-empty tokens of mapped
+ * input.
  * 
  * Parameters:
  * 
- *   c - the character to check
+ *   ptk - the token structure to fill in
  * 
  * Return:
  * 
- *   non-zero if printing, zero if not
+ *   non-zero if successful, zero if error
  */
-static int token_isPrinting(int c) {
+static int token_lex(TOKEN *ptk) {
   
-  int result = 0;
+  TOKEN_DEC dec;
+  int status = 1;
+  int errnum = ERR_OK;
+  int64_t pos = 0;
+  int c = 0;
+  int count = 0;
+  int copy = 0;
+  int state = 0;
+  int act = 0;
+  int done = 0;
+  
+  /* Token characters only need to be copied if the input is not
+   * mapped */
+  if (!m_token_mapped) {
+    copy = 1;
+  }
+  
+  /* Reset token structure fields and the decoder */
+  ptk->status = ERR_OK;
+  ptk->len = 0;
+  ptk->offset = 0;
+  memset(&dec, 0, sizeof(TOKEN_DEC));
+  
+  /* Unless there is a character in the pushback register, skip
+   * whitespace and comments in bulk, and then try the fast path that
+   * lexes and decodes the token straight from the buffer */
+  state = TOKEN_S_START;
+  if (m_token_pushback < 0) {
+    token_skip();
+    count = token_scan(
+              m_token_pBuf + m_token_bufPos,
+              m_token_pBuf + m_token_bufLen,
+              &dec, &state);
+    if (count > 0) {
+      ptk->offset = m_token_bufOffs + m_token_bufPos;
+      if (copy) {
+        memcpy(ptk->str, m_token_pBuf + m_token_bufPos, (size_t) count);
+      }
+      m_token_bufPos += count;
+      done = 1;
+    }
+  }
+  
+  /* Otherwise, run the lexer a character at a time until the token is
+   * complete or there is an error; whitespace before the token is
+   * skipped by the start state */
+  while (status && (!done)) {
+    
+    /* Read the next character */
+    c = token_readByteFinal(&errnum);
+    if (c < 0) {
+      status = 0;
+      break;
+    }
+    
+    /* Look up the action for this state and character */
+    act = (int) m_token_trans[state][m_token_class[c]];
+    
+    /* Leaving the start state, set the offset; if we read a character,
+     * it is the one just before the current position, else EOF is at
+     * the current position */
+    if ((state == TOKEN_S_START) && (act != TOKEN_A_SKIP)) {
+      ptk->offset = m_token_bufOffs + m_token_bufPos;
+      if (c > 0) {
+        (ptk->offset)--;
+      }
+    }
+    
+    /* If the action takes the character, add it and decode it,
+     * watching for buffer overflow */
+    if ((act >= 0) || (act == TOKEN_A_TAKE)) {
+      if (count < TOKEN_MAXCHAR - 1) {
+        /* No overflow, so add character */
+        if (copy) {
+          (ptk->str)[count] = (char) c;
+        }
+        
+        /* Decode it; the first character just sets the starting
+         * value */
+        if (state == TOKEN_S_START) {
+          dec.value = (int32_t) m_token_start[c];
+        } else {
+          token_decode(&dec, state, c, count);
+        }
+        count++;
+        
+      } else {
+        /* Buffer overflow */
+        status = 0;
+        errnum = ERR_LONGTOKEN;
+      }
+    }
+    
+    /* Perform the rest of the action */
+    if (status) {
+      if (act >= 0) {
+        state = act;
+      
+      } else if (act != TOKEN_A_SKIP) {
+        switch (act) {
+          case TOKEN_A_TAKE:
+          case TOKEN_A_END:
+            done = 1;
+            break;
+          
+          case TOKEN_A_STOP:
+            token_pushback(c);
+            done = 1;
+            break;
+          
+          case TOKEN_A_BADCHAR:
+            status = 0;
+            errnum = ERR_BADCHAR;
+            break;
+          
+          case TOKEN_A_PARAMTK:
+            status = 0;
+            errnum = ERR_PARAMTK;
+            break;
+          
+          case TOKEN_A_KEYTOKEN:
+            status = 0;
+            errnum = ERR_KEYTOKEN;
+            break;
+          
+          default:
+            abort();  /* unrecognized action */
+        }
+      }
+    }
+  }
   
-  if ((c >= ASCII_MINPRNT) && (c <= ASCII_MAXPRNT)) {
-    result = 1;
+  /* Input of INT32_MAX bytes or more might have more lines than a line
+   * number can represent, in which case reading stops with an error */
+  pos = m_token_bufOffs + m_token_bufPos;
+  if (status && (pos >= INT32_MAX)) {
+    if (token_lineAt(pos) > INT32_MAX) {
+      status = 0;
+      errnum = ERR_OVERLINE;
+    }
+  }
+  
+  /* Set the token length and decoded value, and nul-terminate the copy
+   * if there is one; the EOF token always gets an empty copy, since
+   * token_text() refers to it */
+  if (status) {
+    ptk->len = (int32_t) count;
+    token_decodeEnd(&dec, state);
+    ptk->vstatus = dec.err;
+    ptk->value = dec.value;
+    if (copy || (count < 1)) {
+      (ptk->str)[count] = (char) 0;
+    }
+  }
+  
+  /* If we got an error, set structure appropriately; the offset of an
+   * error is just past the last byte that was read */
+  if (!status) {
+    ptk->status = errnum;
+    ptk->len = 0;
+    ptk->offset = pos;
+    ptk->vstatus = ERR_OK;
+    ptk->value = 0;
+    (ptk->str)[0] = (char) 0;
+  }
+  
+  /* Return status */
+  return status;
+}
+
+/*
+ * Add the block that was just read to the newline index.
+ * 
+ * The module must be initialized and the input must not be
+ * memory-mapped, or a fault occurs.  The whole block buffer must hold
+ * a freshly filtered block.
+ */
+static void token_index(void) {
+  
+  TOKEN_NLBLOCK *pb = NULL;
+  int64_t lines = 0;
+  int32_t i = 0;
+  
+  /* Check state */
+  if ((!m_token_init) || m_token_mapped) {
+    abort();
+  }
+  
+  /* Count the LFs before this block from the previous entry */
+  if (m_token_nlCount > 0) {
+    pb = &(m_token_pNl[m_token_nlCount - 1]);
+    lines = pb->lines + (pb->sub)[TOKEN_BLOCKSIZE / 1024 - 1] +
+              scan_bits(&((pb->mask)[TOKEN_BLOCKSIZE / 64 - 16]), 1024);
+  }
+  
+  /* Grow the index if necessary */
+  if (m_token_nlCount >= m_token_nlCap) {
+    if (m_token_nlCap < 1) {
+      m_token_nlCap = 16;
+    } else if (m_token_nlCap <= INT32_MAX / 2) {
+      m_token_nlCap *= 2;
+    } else {
+      abort();
+    }
+    
+    m_token_pNl = (TOKEN_NLBLOCK *) realloc(
+                    m_token_pNl,
+                    ((size_t) m_token_nlCap) * sizeof(TOKEN_NLBLOCK));
+    if (m_token_pNl == NULL) {
+      abort();
+    }
+  }
+  
+  /* Fill in the new entry, clearing mask words beyond the block */
+  pb = &(m_token_pNl[m_token_nlCount]);
+  m_token_nlCount++;
+  
+  pb->start = m_token_bufOffs;
+  pb->lines = lines;
+  scan_mask(m_token_pBuf, m_token_pBuf + m_token_bufLen, pb->mask);
+  
+  i = (int32_t) ((m_token_bufLen + 63) / 64);
+  if (i < TOKEN_BLOCKSIZE / 64) {
+    memset(&((pb->mask)[i]), 0,
+            ((size_t) (TOKEN_BLOCKSIZE / 64 - i)) * sizeof(uint64_t));
+  }
+  
+  /* Accumulate the sub-block counts */
+  (pb->sub)[0] = 0;
+  for(i = 1; i < TOKEN_BLOCKSIZE / 1024; i++) {
+    (pb->sub)[i] = (uint16_t) ((pb->sub)[i - 1] +
+                      scan_bits(&((pb->mask)[(i - 1) * 16]), 1024));
+  }
+}
+
+/*
+ * Determine the line number at a position in the filtered input.
+ * 
+ * The module must be initialized or a fault occurs.  offs must be in
+ * the range of filtered input that has been read so far.
+ * 
+ * The line number is one plus the number of LFs in the filtered input
+ * before offs.  For memory-mapped input, the LFs are counted directly
+ * in the mapping, continuing from the previous lookup if offs is not
+ * before it.  Otherwise, the newline index is searched for the block
+ * containing offs, and the LFs before offs within its sub-block are
+ * counted in its mask.
+ * 
+ * The result is not limited to the range of int32_t.
+ * 
+ * Parameters:
+ * 
+ *   offs - the offset in the filtered input
+ * 
+ * Return:
+ * 
+ *   the line number at that offset
+ */
+static int64_t token_lineAt(int64_t offs) {
+  
+  const TOKEN_NLBLOCK *pb = NULL;
+  int64_t lines = 0;
+  int64_t rel = 0;
+  int32_t lo = 0;
+  int32_t hi = 0;
+  int32_t mid = 0;
+  
+  /* Check state */
+  if (!m_token_init) {
+    abort();
+  }
+  
+  /* Check parameter */
+  if (offs < 0) {
+    abort();
+  }
+  
+  if (m_token_mapped) {
+    /* Count directly in the mapping */
+    if (offs > m_token_bufLen) {
+      abort();
+    }
+    
+    if (offs < m_token_lastOffs) {
+      m_token_lastOffs = 0;
+      m_token_lastLines = 0;
+    }
+    m_token_lastLines += scan_count(
+                            m_token_pBuf + m_token_lastOffs,
+                            m_token_pBuf + offs);
+    m_token_lastOffs = offs;
+    lines = m_token_lastLines;
+    
+  } else if (m_token_nlCount > 0) {
+    /* Find the last block starting at or before offs */
+    lo = 0;
+    hi = m_token_nlCount - 1;
+    while (lo < hi) {
+      mid = lo + (hi - lo + 1) / 2;
+      if (m_token_pNl[mid].start <= offs) {
+        lo = mid;
+      } else {
+        hi = mid - 1;
+      }
+    }
+    pb = &(m_token_pNl[lo]);
+    
+    /* Count the LFs before the block and within it */
+    rel = offs - pb->start;
+    if ((rel < 0) || (rel > TOKEN_BLOCKSIZE)) {
+      abort();
+    }
+    
+    lines = pb->lines + (pb->sub)[rel / 1024];
+    if (rel % 1024 != 0) {
+      lines += scan_bits(&((pb->mask)[(rel / 1024) * 16]), rel % 1024);
+    }
+  }
+  
+  /* Return the line number */
+  return lines + 1;
+}
+
+#ifdef TOKEN_THREADS
+
+/*
+ * Determine how many chunks to lex at once.
+ * 
+ * This is the number of online processors, limited to TOKEN_MAXTHREAD.
+ * 
+ * Return:
+ * 
+ *   the number of chunks to lex at once, at least one
+ */
+static int token_threads(void) {
+  
+  long n = 0;
+  
+  /* Query the processor count */
+  n = sysconf(_SC_NPROCESSORS_ONLN);
+  
+  /* Clamp to supported range */
+  if (n < 1) {
+    n = 1;
+  } else if (n > TOKEN_MAXTHREAD) {
+    n = TOKEN_MAXTHREAD;
+  }
+  
+  /* Return count */
+  return (int) n;
+}
+
+/*
+ * Find a safe place to end a chunk.
+ * 
+ * The input must be memory-mapped or a fault occurs.
+ * 
+ * The return value is the position just after the first LF at or after
+ * target in the filtered input, filtering more of the mapping as
+ * necessary.  Since neither tokens nor comments contain an LF, lexing
+ * can always start fresh after one.  If there is no such LF, the input
+ * is filtered to the end and the filtered length is returned.
+ * 
+ * Parameters:
+ * 
+ *   target - the earliest position to look for an LF
+ * 
+ * Return:
+ * 
+ *   the position to end the chunk at
+ */
+static int64_t token_cut(int64_t target) {
+  
+  const unsigned char *p = NULL;
+  int64_t result = -1;
+  
+  /* Check state */
+  if ((!m_token_init) || (!m_token_mapped)) {
+    abort();
+  }
+  
+  /* Check parameter */
+  if (target < 0) {
+    abort();
+  }
+  
+  /* Search for an LF, filtering more input until one is found or the
+   * input is exhausted */
+  while (result < 0) {
+    
+    /* Filter enough input to reach the target */
+    while ((m_token_bufLen <= target) && (!m_token_done)) {
+      token_fill();
+    }
+    
+    if (target >= m_token_bufLen) {
+      /* Target is beyond the end of input */
+      result = m_token_bufLen;
+      
+    } else {
+      /* Look for an LF in what is filtered so far */
+      p = scan_line(
+            m_token_pBuf + target, m_token_pBuf + m_token_bufLen);
+      if (p < m_token_pBuf + m_token_bufLen) {
+        result = (int64_t) (p - m_token_pBuf) + 1;
+      } else if (m_token_done) {
+        result = m_token_bufLen;
+      } else {
+        target = m_token_bufLen;
+      }
+    }
+  }
+  
+  /* Return result */
+  return result;
+}
+
+/*
+ * Lex a chunk of filtered input into token records.
+ * 
+ * This works the same way as token_lex(), using the same transition
+ * table and decoder, but on a range of the filtered input buffer that
+ * is already complete, and without touching any module state.  It is
+ * therefore safe to lex several chunks at once on different threads.
+ * 
+ * The start, end, and last fields of the chunk must be set.  The
+ * records, line count, and error fields are filled in.  The record
+ * array is grown as necessary.
+ * 
+ * Parameters:
+ * 
+ *   pc - the chunk to lex
+ */
+static void token_lexChunk(TOKEN_CHUNK *pc) {
+  
+  TOKEN_DEC dec;
+  const unsigned char *p = NULL;
+  const unsigned char *q = NULL;
+  const unsigned char *pEnd = NULL;
+  int64_t lines = 0;
+  int64_t offset = 0;
+  int count = 0;
+  int state = 0;
+  int act = 0;
+  int c = 0;
+  
+  /* Check parameter */
+  if (pc == NULL) {
+    abort();
+  }
+  
+  /* Reset output fields */
+  pc->recCount = 0;
+  pc->recPos = 0;
+  pc->err = ERR_OK;
+  pc->errOffs = 0;
+  
+  /* Get the range */
+  p = m_token_pBuf + pc->start;
+  pEnd = m_token_pBuf + pc->end;
+  
+  /* Lex tokens until the chunk is finished */
+  for(;;) {
+    
+    /* Skip whitespace and comments, handling a gap of a single space
+     * or nothing directly, the same way as token_skip(), and anything
+     * else in bulk */
+    q = p;
+    if ((q + 1 < pEnd) && (q[0] == ASCII_SP)) {
+      q++;
+    }
+    if ((q < pEnd) &&
+        (m_token_class[*q] != TOKEN_C_SPACE) && (*q != ASCII_NUMSIGN)) {
+      p = q;
+    } else {
+      for(;;) {
+        p = scan_space(p, pEnd, &lines);
+        if ((p < pEnd) && (*p == ASCII_NUMSIGN)) {
+          p = scan_line(p + 1, pEnd);
+        } else {
+          break;
+        }
+      }
+    }
+    
+    /* The end of a chunk that is not the last one is always between
+     * tokens, so leave at the end of the range */
+    if ((!(pc->last)) && (p >= pEnd)) {
+      break;
+    }
+    
+    /* Try the fast path that lexes and decodes the whole token in one
+     * go, and otherwise run the lexer a character at a time until the
+     * token is complete or there is an error */
+    state = TOKEN_S_START;
+    memset(&dec, 0, sizeof(TOKEN_DEC));
+    count = token_scan(p, pEnd, &dec, &state);
+    if (count > 0) {
+      offset = (int64_t) (p - m_token_pBuf);
+      p += count;
+    } else {
+      act = TOKEN_A_SKIP;
+      while ((act >= 0) || (act == TOKEN_A_SKIP)) {
+        
+        /* Read the next character, skipping a comment up to its LF;
+         * reaching the end of the range gives EOF or the condition that
+         * ended the input */
+        c = 0;
+        if (p < pEnd) {
+          c = *p;
+          p++;
+          if (c == ASCII_NUMSIGN) {
+            p = scan_line(p, pEnd);
+            if (p < pEnd) {
+              c = ASCII_LF;
+              p++;
+            } else {
+              c = 0;
+            }
+          }
+        }
+        
+        if (c == 0) {
+          if (!(pc->last)) {
+            abort();  /* chunk ended inside a token */
+          } else if (m_token_endErr != ERR_OK) {
+            pc->err = m_token_endErr;
+            break;
+          }
+        }
+        
+        /* Look up the action for this state and character */
+        act = (int) m_token_trans[state][m_token_class[c]];
+        
+        /* Leaving the start state, record where the token starts */
+        if ((state == TOKEN_S_START) && (act != TOKEN_A_SKIP)) {
+          offset = (int64_t) (p - m_token_pBuf);
+          if (c > 0) {
+            offset--;
+          }
+        }
+        
+        /* If the action takes the character, count it and decode it,
+         * watching for buffer overflow */
+        if ((act >= 0) || (act == TOKEN_A_TAKE)) {
+          if (count < TOKEN_MAXCHAR - 1) {
+            if (state == TOKEN_S_START) {
+              dec.value = (int32_t) m_token_start[c];
+            } else {
+              token_decode(&dec, state, c, count);
+            }
+            count++;
+          } else {
+            pc->err = ERR_LONGTOKEN;
+            break;
+          }
+        }
+        
+        /* Perform the rest of the action */
+        if (act >= 0) {
+          state = act;
+          
+        } else if (act == TOKEN_A_STOP) {
+          /* Push back the character by stepping back over it */
+          if (c > 0) {
+            p--;
+          }
+          
+        } else if (act == TOKEN_A_BADCHAR) {
+          pc->err = ERR_BADCHAR;
+        } else if (act == TOKEN_A_PARAMTK) {
+          pc->err = ERR_PARAMTK;
+        } else if (act == TOKEN_A_KEYTOKEN) {
+          pc->err = ERR_KEYTOKEN;
+        }
+      }
+    }
+    
+    /* Leave if error */
+    if (pc->err != ERR_OK) {
+      pc->errOffs = (int64_t) (p - m_token_pBuf);
+      break;
+    }
+    
+    /* Grow the record array if necessary */
+    if (pc->recCount >= pc->recCap) {
+      if (pc->recCap < 1) {
+        pc->recCap = TOKEN_RECINIT;
+      } else if (pc->recCap <= INT32_MAX / 2) {
+        pc->recCap *= 2;
+      } else {
+        abort();
+      }
+      
+      pc->pRec = (TOKEN_REC *) realloc(
+                    pc->pRec, ((size_t) pc->recCap) * sizeof(TOKEN_REC));
+      if (pc->pRec == NULL) {
+        abort();
+      }
+    }
+    
+    /* Record the token */
+    token_decodeEnd(&dec, state);
+    (pc->pRec)[pc->recCount].offset = offset;
+    (pc->pRec)[pc->recCount].len = (int32_t) count;
+    (pc->pRec)[pc->recCount].value = dec.value;
+    (pc->pRec)[pc->recCount].vstatus = dec.err;
+    (pc->recCount)++;
+    
+    /* Leave after the EOF token */
+    if (count < 1) {
+      break;
+    }
   }
-  
-  return result;
 }
 
 /*
- * Determine whether the given character is a pitch register suffix or
- * rhythmic duration suffix.
+ * Thread start routine that lexes a chunk.
  * 
  * Parameters:
  * 
- *   c - the character to check
+ *   pParam - the chunk to lex
  * 
  * Return:
  * 
- *   non-zero if yes, zero if not
+ *   NULL
  */
-static int token_isSuffix(int c) {
-  
-  int result = 0;
-  
-  if ((c == ASCII_APOS) || (c == ASCII_COMMA) || (c == ASCII_PERIOD)) {
-    result = 1;
-  }
-  
-  return result;
+static void *token_worker(void *pParam) {
+  token_lexChunk((TOKEN_CHUNK *) pParam);
+  return NULL;
 }
 
 /*
- * Determine whether the given character is a pitch accidental.
- * 
- * Parameters:
- * 
- *   c - the character to check
+ * Lex the next round of chunks in parallel.
  * 
- * Return:
+ * Parallel mode must be on and all chunks of the previous round must
+ * have been handed out, or a fault occurs.
  * 
- *   non-zero if yes, zero if not
+ * The round starts at m_token_bufPos, which is moved to the end of the
+ * round.  Chunks are cut at safe places with token_cut(), up to
+ * m_token_threads of them, stopping early at the last chunk of input.
+ * The first chunk is lexed on the calling thread, and the others on
+ * worker threads.  If a worker thread cannot be started, its chunk is
+ * lexed on the calling thread instead.
  */
-static int token_isAccidental(int c) {
+static void token_round(void) {
   
-  int result = 0;
+  pthread_t tid[TOKEN_MAXTHREAD];
+  int started[TOKEN_MAXTHREAD];
+  TOKEN_CHUNK *pc = NULL;
+  int64_t pos = 0;
+  int i = 0;
   
-  if ((c == ASCII_X_LOWER) || (c == ASCII_X_UPPER) ||
-      (c == ASCII_S_LOWER) || (c == ASCII_S_UPPER) ||
-      (c == ASCII_N_LOWER) || (c == ASCII_N_UPPER) ||
-      (c == ASCII_H_LOWER) || (c == ASCII_H_UPPER) ||
-      (c == ASCII_T_LOWER) || (c == ASCII_T_UPPER)) {
-    result = 1;
+  /* Check state */
+  if ((!m_token_init) || (!m_token_par) ||
+      (m_token_chunkCur < m_token_chunkCount)) {
+    abort();
   }
   
-  return result;
-}
-
-/*
- * Determine whether the given character is atomic, meaning it stands by
- * itself.
- * 
- * Parameters:
- * 
- *   c - the character to check
- * 
- * Return:
- * 
- *   non-zero if yes, zero if not
- */
-static int token_isAtomic(int c) {
+  /* Cut the chunks */
+  m_token_chunkCount = 0;
+  m_token_chunkCur = 0;
+  pos = m_token_bufPos;
+  for(i = 0; i < m_token_threads; i++) {
+    pc = &(m_token_chunk[i]);
+    
+    pc->start = pos;
+    pc->end = token_cut(pos + TOKEN_CHUNKSIZE);
+    pc->last = 0;
+    if ((pc->end >= m_token_bufLen) && m_token_done) {
+      pc->last = 1;
+    }
+    
+    pos = pc->end;
+    m_token_chunkCount++;
+    
+    if (pc->last) {
+      break;
+    }
+  }
+  m_token_bufPos = pos;
   
-  int result = 0;
+  /* Start worker threads for all but the first chunk */
+  for(i = 1; i < m_token_chunkCount; i++) {
+    started[i] = 0;
+    if (pthread_create(&(tid[i]), NULL, &token_worker,
+          &(m_token_chunk[i])) == 0) {
+      started[i] = 1;
+    }
+  }
   
-  if ((c == ASCII_LPAREN)  || (c == ASCII_RPAREN)  ||
-      (c == ASCII_R_UPPER) || (c == ASCII_R_LOWER) ||
-      (c == ASCII_LSQUARE) || (c == ASCII_RSQUARE) ||
-      (c == ASCII_SLASH)   || (c == ASCII_DOLLAR)  ||
-      (c == ASCII_ATSIGN)  || (c == ASCII_LCURLY)  ||
-      (c == ASCII_COLON)   || (c == ASCII_RCURLY)  ||
-      (c == ASCII_EQUALS)  || (c == ASCII_TILDE)   ||
-      (c == ASCII_HYPHEN)) {
-    result = 1;
+  /* Lex the first chunk here, and any that did not get a thread */
+  token_lexChunk(&(m_token_chunk[0]));
+  for(i = 1; i < m_token_chunkCount; i++) {
+    if (!started[i]) {
+      token_lexChunk(&(m_token_chunk[i]));
+    }
   }
   
-  return result;
+  /* Wait for the workers */
+  for(i = 1; i < m_token_chunkCount; i++) {
+    if (started[i]) {
+      if (pthread_join(tid[i], NULL) != 0) {
+        abort();
+      }
+    }
+  }
 }
 
 /*
- * Determine whether the given character is the beginning of a pitch
- * definition string.
- * 
- * Parameters:
- * 
- *   c - the character to check
+ * Hand out the next token in parallel mode.
  * 
- * Return:
+ * Parallel mode must be on or a fault occurs.
  * 
- *   non-zero if yes, zero if not
- */
-static int token_isPitchString(int c) {
-  
-  int result = 0;
-  
-  if (((c >= ASCII_A_UPPER) && (c <= ASCII_G_UPPER)) ||
-      ((c >= ASCII_A_LOWER) && (c <= ASCII_G_LOWER))) {
-    result = 1;
-  }
-  
-  return result;
-}
-
-/*
- * Determine whether the given character is the beginning of a rhythm
- * definition string.
+ * Records are handed out chunk by chunk in input order, lexing another
+ * round when needed.  An error in a chunk is handed out after the
+ * records before it, which is the same point at which serial lexing
+ * would have stopped.
  * 
  * Parameters:
  * 
- *   c - the character to check
+ *   ptk - the token structure to fill in
  * 
  * Return:
  * 
- *   non-zero if yes, zero if not
+ *   non-zero if successful, zero if error
  */
-static int token_isRhythmString(int c) {
+static int token_parNext(TOKEN *ptk) {
   
-  int result = 0;
+  TOKEN_CHUNK *pc = NULL;
+  TOKEN_REC *pr = NULL;
+  int found = 0;
   
-  if ((c >= ASCII_ZERO) && (c <= ASCII_NINE)) {
-    result = 1;
+  /* Check state */
+  if ((!m_token_init) || (!m_token_par)) {
+    abort();
   }
   
-  return result;
-}
-
-/*
- * Determine whether the given character is an operator that takes a
- * parameter ended with a semicolon.
- * 
- * Parameters:
- * 
- *   c - the character to check
- * 
- * Return:
- * 
- *   non-zero if yes, zero if not
- */
-static int token_isParamOp(int c) {
+  /* Check parameter */
+  if (ptk == NULL) {
+    abort();
+  }
   
-  int result = 0;
+  /* Find the next record, unless input has already ended */
+  while ((!m_token_parEnd) && (!found)) {
+    
+    /* Lex another round if the current one is used up */
+    if (m_token_chunkCur >= m_token_chunkCount) {
+      token_round();
+    }
+    pc = &(m_token_chunk[m_token_chunkCur]);
+    
+    if (pc->recPos < pc->recCount) {
+      /* Hand out the next record */
+      pr = &((pc->pRec)[pc->recPos]);
+      (pc->recPos)++;
+      
+      ptk->status = ERR_OK;
+      ptk->len = pr->len;
+      ptk->offset = pr->offset;
+      ptk->vstatus = pr->vstatus;
+      ptk->value = pr->value;
+      (ptk->str)[0] = (char) 0;
+      
+      /* The EOF token ends input */
+      if (pr->len < 1) {
+        memcpy(&m_token_parLast, ptk, sizeof(TOKEN));
+        m_token_parEnd = 1;
+      }
+      found = 1;
+      
+    } else if (pc->err != ERR_OK) {
+      /* Error ends input */
+      m_token_parLast.status = pc->err;
+      m_token_parLast.len = 0;
+      m_token_parLast.offset = pc->errOffs;
+      m_token_parLast.vstatus = ERR_OK;
+      m_token_parLast.value = 0;
+      (m_token_parLast.str)[0] = (char) 0;
+      m_token_parEnd = 1;
+      
+    } else {
+      /* Move on to the next chunk */
+      m_token_chunkCur++;
+    }
+  }
   
-  if ((c == ASCII_BSLASH) || (c == ASCII_CARET) ||
-      (c == ASCII_AMP)    || (c == ASCII_PLUS) ||
-      (c == ASCII_GRACC)) {
-    result = 1;
+  /* Once input has ended, keep handing out the final token */
+  if (!found) {
+    memcpy(ptk, &m_token_parLast, sizeof(TOKEN));
   }
   
-  return result;
+  /* Return status */
+  return (ptk->status == ERR_OK);
 }
 
+#endif
+
 /*
- * Determine whether the given character is an operator that takes a
- * single key character parameter.
+ * Read the next token, either by lexing it or, in parallel mode, from
+ * the chunk records.
  * 
  * Parameters:
  * 
- *   c - the character to check
+ *   ptk - the token structure to fill in
  * 
  * Return:
  * 
- *   non-zero if yes, zero if not
+ *   non-zero if successful, zero if error
  */
-static int token_isKeyOp(int c) {
+static int token_next(TOKEN *ptk) {
   
-  int result = 0;
+  int status = 0;
+  
+  m_token_started = 1;
   
-  if ((c == ASCII_STAR) || (c == ASCII_EXCLAIM)) {
-    result = 1;
+#ifdef TOKEN_THREADS
+  if (m_token_par) {
+    status = token_parNext(ptk);
+  } else {
+    status = token_lex(ptk);
   }
+#else
+  status = token_lex(ptk);
+#endif
   
-  return result;
+  return status;
 }
 
 /*
@@ -567,11 +2254,84 @@ void token_init(FILE *pIn) {
   
   /* Initialize variables */
   m_token_init = 1;
+  m_token_started = 0;
   m_token_first = 1;
   m_token_prev = -1;
-  m_token_line = 1;
   m_token_pushback = -1;
-  m_token_pIn = pIn;
+  m_token_bufLen = 0;
+  m_token_bufPos = 0;
+  m_token_bufOffs = 0;
+  m_token_done = 0;
+  m_token_endErr = ERR_OK;
+  m_token_nlCount = 0;
+  m_token_lastOffs = 0;
+  m_token_lastLines = 0;
+  
+  /* Map the input if possible, else read it into the block buffer
+   * through the source module */
+  if (token_map(pIn)) {
+    m_token_mapped = 1;
+  } else {
+    m_token_mapped = 0;
+    m_token_pBuf = m_token_block;
+    source_open(pIn);
+  }
+  
+#ifdef TOKEN_THREADS
+  /* Lex large mapped input in parallel if there is more than one
+   * processor */
+  m_token_par = 0;
+  if (m_token_mapped && (m_token_rawLen >= TOKEN_PARMIN) &&
+      (m_token_rawLen < INT32_MAX)) {
+    m_token_threads = token_threads();
+    if (m_token_threads > 1) {
+      m_token_par = 1;
+      m_token_chunkCount = 0;
+      m_token_chunkCur = 0;
+      m_token_parEnd = 0;
+    }
+  }
+#endif
+}
+
+/*
+ * token_seek function.
+ */
+void token_seek(int64_t offs) {
+  
+  /* Check state */
+  if ((!m_token_init) || m_token_started) {
+    abort();
+  }
+  
+  /* Check parameter */
+  if (offs < 0) {
+    abort();
+  }
+  
+  /* Filter input up to the offset, so that it is indexed for line
+   * lookups, and then position the buffer there or at the end of
+   * filtered input if that comes first */
+  if (m_token_mapped) {
+    while ((m_token_bufLen < offs) && (!m_token_done)) {
+      token_fill();
+    }
+    if (offs > m_token_bufLen) {
+      offs = m_token_bufLen;
+    }
+    m_token_bufPos = offs;
+    
+  } else {
+    while ((m_token_bufOffs + m_token_bufLen < offs) &&
+            (!m_token_done)) {
+      m_token_bufPos = m_token_bufLen;
+      token_fill();
+    }
+    if (offs > m_token_bufOffs + m_token_bufLen) {
+      offs = m_token_bufOffs + m_token_bufLen;
+    }
+    m_token_bufPos = offs - m_token_bufOffs;
+  }
 }
 
 /*
@@ -579,11 +2339,6 @@ void token_init(FILE *pIn) {
  */
 int token_read(TOKEN *ptk) {
   
-  int status = 1;
-  int errnum = ERR_OK;
-  int c = 0;
-  int count = 0;
-  
   /* Check state */
   if (!m_token_init) {
     abort();
@@ -594,201 +2349,116 @@ int token_read(TOKEN *ptk) {
     abort();
   }
   
-  /* Reset token structure */
-  memset(ptk, 0, sizeof(TOKEN));
-  ptk->status = ERR_OK;
+  /* Read the token */
+  return token_next(ptk);
+}
+
+/*
+ * token_readBatch function.
+ */
+int32_t token_readBatch(TOKEN *pa, int32_t max) {
   
-  /* Read from input until we get non-whitespace, or End Of File, or an
-   * error */
-  for(c = token_readByteFinal(&errnum);
-      (c > 0) && (token_isWhitespace(c));
-      c = token_readByteFinal(&errnum));
+  int32_t count = 0;
+  int retval = 0;
   
-  if (c < 0) {
-    status = 0;
+  /* Check state */
+  if (!m_token_init) {
+    abort();
   }
   
-  /* Set the line number */
-  if (status) {
-    ptk->line = m_token_line;
+  /* Check parameters */
+  if ((pa == NULL) || (max < 1)) {
+    abort();
   }
   
-  /* If not EOF, put character in start of token buffer, update count,
-   * and read any extra token characters */
-  if (status && (c > 0)) {
-    
-    /* Put character in buffer and update count */
-    (ptk->str)[0] = (char) c;
+  /* Read tokens until the array is full, stopping early after an error
+   * or the EOF token */
+  while (count < max) {
+    retval = token_next(&(pa[count]));
     count++;
-    
-    /* We only need to read more characters if not atomic */
-    if (!token_isAtomic(c)) {
-      
-      /* Determine non-atomic type of token */
-      if (token_isPitchString(c)) {
-        /* Non-atomic pitch token, so first see if accidentals to add */
-        for(c = token_readByteFinal(&errnum);
-            token_isAccidental(c);
-            c = token_readByteFinal(&errnum)) {
-          
-          /* Add accidental, watching for buffer overflow */
-          if (count < TOKEN_MAXCHAR - 1) {
-            /* No overflow, so add character */
-            (ptk->str)[count] = (char) c;
-            count++;
-            
-          } else {
-            /* Buffer overflow */
-            status = 0;
-            errnum = ERR_LONGTOKEN;
-          }
-          
-          /* Leave loop if error */
-          if (!status) {
-            break;
-          }
-        }
-        
-        /* If we stopped on read error, clear status */
-        if (status && (c < 0)) {
-          status = 0;
-        }
-        
-        /* Push back character we stopped on */
-        if (status) {
-          token_pushback(c);
-        }
-        
-        /* Add any suffixes */
-        if (status) {
-          for(c = token_readByteFinal(&errnum);
-              token_isSuffix(c);
-              c = token_readByteFinal(&errnum)) {
-          
-            /* Add suffix, watching for buffer overflow */
-            if (count < TOKEN_MAXCHAR - 1) {
-              /* No overflow, so add character */
-              (ptk->str)[count] = (char) c;
-              count++;
-            
-            } else {
-              /* Buffer overflow */
-              status = 0;
-              errnum = ERR_LONGTOKEN;
-            }
-          
-            /* Leave loop if error */
-            if (!status) {
-              break;
-            }
-          }
-        }
-        
-        /* If we stopped on read error, clear status */
-        if (status && (c < 0)) {
-          status = 0;
-        }
-        
-        /* Push back character we stopped on */
-        if (status) {
-          token_pushback(c);
-        }
-        
-      } else if (token_isRhythmString(c)) {
-        /* Non-atomic rhythm token, so see if suffix character to add */
-        c = token_readByteFinal(&errnum);
-        if (c < 0) {
-          /* Read error */
-          status = 0;
-        
-        } else if (token_isSuffix(c)) {
-          /* Suffix character, so add it */
-          (ptk->str)[1] = (char) c;
-          count++;
-          
-        } else {
-          /* Not a suffix character, so push it back */
-          token_pushback(c);
-        }
-        
-      } else if (token_isParamOp(c)) {
-        /* Param operation, so we need extra characters until
-         * semicolon */
-        for(c = token_readByteFinal(&errnum);
-            (token_isPrinting(c)) && (c != ASCII_SEMICOL);
-            c = token_readByteFinal(&errnum)) {
-          
-          /* Add character, watching for buffer overflow */
-          if (count < TOKEN_MAXCHAR - 1) {
-            /* No overflow, so add character */
-            (ptk->str)[count] = (char) c;
-            count++;
-            
-          } else {
-            /* Buffer overflow */
-            status = 0;
-            errnum = ERR_LONGTOKEN;
-          }
-          
-          /* Leave loop if error */
-          if (!status) {
-            break;
-          }
-        }
-        
-        /* If we stopped on read error, clear status */
-        if (status && (c < 0)) {
-          status = 0;
-        }
-        
-        /* If we stopped on anything other than semicolon, error */
-        if (status && (c != ASCII_SEMICOL)) {
-          status = 0;
-          errnum = ERR_PARAMTK;
-        }
-        
-        /* Add semicolon, watching for overflow */
-        if (status) {
-          if (count < TOKEN_MAXCHAR - 1) {
-            (ptk->str)[count] = (char) ASCII_SEMICOL;
-            count++;
-          } else {
-            status = 0;
-            errnum = ERR_LONGTOKEN;
-          }
-        }
-        
-      } else if (token_isKeyOp(c)) {
-        /* Key operation, so we need one more printing char */
-        c = token_readByteFinal(&errnum);
-        if (c < 0) {
-          status = 0;
-        } else if (!token_isPrinting(c)) {
-          status = 0;
-          errnum = ERR_KEYTOKEN;
-        }
-        
-        /* Add the extra printing character */
-        if (status) {
-          (ptk->str)[1] = (char) c;
-          count++;
-        }
-        
-      } else {
-        /* Unrecognized character */
-        errnum = ERR_BADCHAR;
-        status = 0;
-      }
+    if ((!retval) || (pa[count - 1].len < 1)) {
+      break;
     }
   }
   
-  /* If we got an error, set structure appropriately */
-  if (!status) {
-    memset(ptk, 0, sizeof(TOKEN));
-    ptk->status = errnum;
-    ptk->line = m_token_line;
+  /* Return number of tokens */
+  return count;
+}
+
+/*
+ * token_line function.
+ */
+int32_t token_line(const TOKEN *ptk) {
+  
+  int64_t line = 0;
+  
+  /* Check state */
+  if (!m_token_init) {
+    abort();
   }
   
-  /* Return status */
-  return status;
+  /* Check parameter */
+  if (ptk == NULL) {
+    abort();
+  }
+  
+  /* Look up the line, limiting it to the range of the result */
+  line = token_lineAt(ptk->offset);
+  if (line > INT32_MAX) {
+    line = INT32_MAX;
+  }
+  
+  /* Return line number */
+  return (int32_t) line;
+}
+
+/*
+ * token_lineOf function.
+ */
+int32_t token_lineOf(int64_t offs) {
+  
+  int64_t line = 0;
+  
+  /* Check state */
+  if (!m_token_init) {
+    abort();
+  }
+  
+  /* Look up the line, limiting it to the range of the result */
+  line = token_lineAt(offs);
+  if (line > INT32_MAX) {
+    line = INT32_MAX;
+  }
+  
+  /* Return line number */
+  return (int32_t) line;
+}
+
+/*
+ * token_text function.
+ */
+const char *token_text(const TOKEN *ptk) {
+  
+  const char *pt = NULL;
+  
+  /* Check state */
+  if (!m_token_init) {
+    abort();
+  }
+  
+  /* Check parameter */
+  if (ptk == NULL) {
+    abort();
+  }
+  
+  /* Mapped tokens are views into the mapping; everything else is in
+   * the copy within the structure */
+  if (m_token_mapped && (ptk->len > 0)) {
+    pt = (const char *) (m_token_pBuf + ptk->offset);
+  } else {
+    pt = ptk->str;
+  }
+  
+  /* Return text pointer */
+  return pt;
 }
@@ -5,6 +5,35 @@
  * token.h
  * 
  * Tokenizer module of the Noir compiler.
+ * 
+ * If the input file is a regular file and the platform supports it,
+ * the input is memory-mapped and tokens are returned as views into the
+ * mapping without copying their characters.  Otherwise, input is read
+ * in blocks and token characters are copied into the token structure.
+ * Use token_text() to get at the characters of a token either way.
+ * 
+ * Tokens record byte offsets rather than line numbers.  token_line()
+ * works out the line number of a token when it is needed for an error
+ * message.  Block-read input keeps a compact index of where its line
+ * breaks are for this purpose.
+ * 
+ * Large memory-mapped input is lexed in parallel on POSIX threads, one
+ * chunk of input per processor at a time.  Chunks are cut just after
+ * an LF, where no token or comment can be in progress, and the tokens
+ * are handed out in input order with the same line numbers and errors
+ * as serial lexing.
+ * 
+ * Input compressed with gzip or zstd is never mapped.  It is read in
+ * blocks through the source module, which decompresses it, and the
+ * filtering of BOMs and line breaks then applies to the decompressed
+ * bytes.  Requires the source module.
+ * 
+ * Each token is also decoded as it is lexed, so that the pitch,
+ * duration, or parameter it stands for is ready in the token structure
+ * without another pass over its characters.
+ * 
+ * Define TOKEN_NO_MMAP when compiling token.c to disable memory
+ * mapping, or TOKEN_NO_THREADS to disable parallel lexing.
  */
 
 #include "noirdef.h"
@@ -29,20 +58,70 @@ typedef struct {
   int status;
   
   /*
-   * The line number in the input file that this token was read from.
+   * If status is ERR_OK, the number of characters in the token.
+   * 
+   * The End Of File (EOF) is recorded as an empty token with a length
+   * of zero.
+   * 
+   * Zero if an error occurs.
+   */
+  int32_t len;
+  
+  /*
+   * If status is ERR_OK, the byte offset of the first character of the
+   * token within the filtered input.  For the EOF token, this is the
+   * length of the filtered input.
+   * 
+   * If status indicates an error, the byte offset just past the last
+   * byte that was read before the error was detected.
+   * 
+   * Filtered input has the UTF-8 BOM removed and all line breaks
+   * converted to a single LF, so this is not necessarily the same as
+   * the offset within the input file.
    * 
-   * If status indicates an error, this is the line number of the error.
+   * Use token_line() to get the line number of the token or error.
    */
-  int32_t line;
+  int64_t offset;
   
   /*
-   * If status is ERR_OK, this contains the nul-terminated token that
-   * was read from the file.
+   * If status is ERR_OK, the result of decoding the token.
+   * 
+   * Tokens are decoded while they are lexed, in the same pass over the
+   * input, so that their characters never have to be parsed again.
+   * vstatus is ERR_OK if the token decoded successfully, in which case
+   * value is:
+   * 
+   *   pitch - the pitch in semitones relative to middle C
+   * 
+   *   duration - the duration in quanta, or zero for a grace note
+   * 
+   *   parameter operation - the integer parameter
+   * 
+   *   key operation - the articulation number
+   * 
+   *   anything else - zero
+   * 
+   * Otherwise, vstatus is the error code to report when the token is
+   * interpreted, which is ERR_BADPITCH or ERR_PITCHR for a pitch,
+   * ERR_BADDUR for a duration, and ERR_BADOP for an operation, and
+   * value is zero.
    * 
-   * The End Of File (EOF) is recorded as an empty token (first
-   * character is nul).
+   * If status indicates an error, vstatus is ERR_OK and value is zero.
    * 
-   * The contents of this buffer are undefined if an error occurs.
+   * The include operation is lexed as a parameter operation, but its
+   * parameter is a path rather than an integer, so vstatus and value
+   * are meaningless for it.
+   */
+  int vstatus;
+  int32_t value;
+  
+  /*
+   * If status is ERR_OK and the input is not memory-mapped, this
+   * contains a nul-terminated copy of the token that was read from the
+   * file.
+   * 
+   * For memory-mapped input, the token characters are not copied here.
+   * Use token_text() rather than accessing this field directly.
    */
   char str[TOKEN_MAXCHAR];
   
@@ -65,6 +144,27 @@ typedef struct {
  */
 void token_init(FILE *pIn);
 
+/*
+ * Start reading at a given offset.
+ * 
+ * This may only be called after token_init() and before any token has
+ * been read, or a fault occurs.
+ * 
+ * offs is a byte offset within the filtered input, as in the offset
+ * field of the token structure.  Reading starts there in the lexer
+ * start state, as if it were the beginning of input, so offs should be
+ * a place where the lexer would be in its start state anyway, such as
+ * the offset of the first character of a token.  The input before offs
+ * is still read and filtered, so that token offsets and line numbers
+ * stay the same as they would be without seeking.  If the filtered input
+ * ends before offs, reading starts at its end.
+ * 
+ * Parameters:
+ * 
+ *   offs - the filtered input offset to start reading at
+ */
+void token_seek(int64_t offs);
+
 /*
  * Read the next token.
  * 
@@ -87,4 +187,96 @@ void token_init(FILE *pIn);
  */
 int token_read(TOKEN *ptk);
 
+/*
+ * Read a batch of tokens.
+ * 
+ * The module must have been initialized with token_init() before using
+ * this function.
+ * 
+ * pa points to an array of max token structures, and max must be at
+ * least one.  Tokens are read into the array in order, as if by
+ * repeated calls to token_read(), until the array is full.  Reading
+ * stops early after the EOF token or after a token that has an error
+ * status, which is then the last token filled in.
+ * 
+ * Parameters:
+ * 
+ *   pa - the array of token structures to fill in
+ * 
+ *   max - the number of structures in the array
+ * 
+ * Return:
+ * 
+ *   the number of tokens filled in, from one up to max
+ */
+int32_t token_readBatch(TOKEN *pa, int32_t max);
+
+/*
+ * Get the line number of a token.
+ * 
+ * ptk is a token that was filled in by token_read() or
+ * token_readBatch().  The return value is the line number in the input
+ * file that the token was read from or, if status indicates an error,
+ * the line number of the error.
+ * 
+ * Line numbers are not tracked while reading.  Instead, they are
+ * worked out from the token offset by counting line breaks, so this
+ * function is meant for reporting errors rather than for calling on
+ * every token.
+ * 
+ * Parameters:
+ * 
+ *   ptk - the token
+ * 
+ * Return:
+ * 
+ *   the line number
+ */
+int32_t token_line(const TOKEN *ptk);
+
+/*
+ * Get the line number at an offset in the filtered input.
+ * 
+ * offs must be the offset of a token that was filled in by token_read()
+ * or token_readBatch(), so that it is within the input read so far.
+ * The result is the same as token_line() would return for that token,
+ * so this is also meant for reporting errors, after the token itself is
+ * gone.
+ * 
+ * Parameters:
+ * 
+ *   offs - the offset of the token
+ * 
+ * Return:
+ * 
+ *   the line number
+ */
+int32_t token_lineOf(int64_t offs);
+
+/*
+ * Get the characters of a token.
+ * 
+ * ptk is a token that was filled in by token_read() or
+ * token_readBatch().  The token structure may have been copied since
+ * then.
+ * 
+ * The return value points to the ptk->len characters of the token.  It
+ * is NOT necessarily nul-terminated.  For memory-mapped input, the
+ * pointer is a view into the mapping that remains valid for the rest of
+ * the process.  Otherwise, the pointer is to the copy within the token
+ * structure, and it is only valid as long as the structure is.
+ * 
+ * If the token is empty or an error, the pointer is to an empty
+ * nul-terminated string.
+ * 
+ * Parameters:
+ * 
+ *   ptk - the token
+ * 
+ * Return:
+ * 
+ *   pointer to the token characters
+ */
+const char *token_text(const TOKEN *ptk);
+
 #endif